@@ -0,0 +1,51 @@
+#include <QApplication>
+#include <QElapsedTimer>
+#include <QTextStream>
+#include <QTimer>
+
+#include "analysisbench.h"
+#include "board.h"
+#include "mainwindow.h"
+
+int run_analysis_benchmark(go_game_ptr gr, const Engine &engine, int seconds)
+{
+    MainWindow *win = new MainWindow(nullptr, gr, nullptr);
+    win->show();
+    Board *b = win->getBoard();
+
+    b->goto_last_move();
+
+    QElapsedTimer clock;
+    clock.start();
+    b->start_analysis(engine);
+
+    int retval = 0;
+    QTimer::singleShot(seconds * 1000, win, [&]() {
+        const analysis_refresh_stats &stats = b->refresh_stats();
+        double                        secs  = clock.elapsed() / 1000.0;
+        QTextStream                   out(stdout);
+        out << QObject::tr("Analyzed for %1 s with %2").arg(secs, 0, 'f', 1).arg(engine.title) << "\n";
+        if (stats.received == 0)
+        {
+            out << QObject::tr("No analysis updates arrived.") << "\n";
+            retval = 1;
+        }
+        else
+        {
+            double active = secs - stats.first_update / 1000.0;
+            out << QObject::tr("First update: %1 ms").arg(stats.first_update) << "\n";
+            out << QObject::tr("Updates: %1, %2/s").arg(stats.received).arg(stats.received / active, 0, 'f', 1) << "\n";
+            out << QObject::tr("Display refreshes: %1, %2/s").arg(stats.flushes).arg(stats.flushes / active, 0, 'f', 1) << "\n";
+            out << QObject::tr("Updates coalesced: %1, dropped: %2").arg(stats.coalesced).arg(stats.dropped) << "\n";
+        }
+        qApp->quit();
+    });
+    if (b->analyzer_state() != analyzer::disconnected)
+        qApp->exec();
+    else
+        retval = 1;
+
+    b->stop_analysis();
+    delete win;
+    return retval;
+}
@@ -0,0 +1,15 @@
+#ifndef ANALYSISBENCH_H
+#define ANALYSISBENCH_H
+
+#include "gogame.h"
+#include "setting.h"
+
+/* Runs live analysis of the last position of GR's main line with ENGINE in a
+   board window for SECONDS, then prints how many updates arrived per second,
+   how long the first one took, and how the board coalesced them into display
+   refreshes.  Meant to be run with the offscreen platform against mockgtp, to
+   measure the cost of our side of live analysis without a real engine.
+   Returns the exit code for the application.  */
+extern int run_analysis_benchmark(go_game_ptr gr, const Engine &engine, int seconds);
+
+#endif
@@ -0,0 +1,251 @@
+#include <utility>
+
+#include <QDebug>
+#include <QSqlDatabase>
+#include <QSqlError>
+#include <QVariant>
+
+#include "analysiscache.h"
+#include "setting.h"
+
+analysis_cache *g_analysis_cache = nullptr;
+
+/* The eight symmetries of a square board are encoded as: bit 0 mirrors x, bit 1
+   mirrors y, bit 2 swaps the axes after mirroring.  Boards that are not square
+   only have the first four.  */
+static void transform(int sym, int sz_x, int sz_y, int &x, int &y)
+{
+    if (sym & 1)
+        x = sz_x - 1 - x;
+    if (sym & 2)
+        y = sz_y - 1 - y;
+    if (sym & 4)
+        std::swap(x, y);
+}
+
+static void untransform(int sym, int sz_x, int sz_y, int &x, int &y)
+{
+    if (sym & 4)
+        std::swap(x, y);
+    if (sym & 2)
+        y = sz_y - 1 - y;
+    if (sym & 1)
+        x = sz_x - 1 - x;
+}
+
+/* Return the smallest of the board's orientations as a string, and store the
+   symmetry that produces it in SYM.  */
+static QString canonical_position(const go_board &b, int &sym)
+{
+    int        sz_x  = b.size_x();
+    int        sz_y  = b.size_y();
+    int        n_sym = sz_x == sz_y ? 8 : 4;
+    QByteArray best;
+    QByteArray cur(sz_x * sz_y, '.');
+    for (int s = 0; s < n_sym; s++)
+    {
+        for (int x = 0; x < sz_x; x++)
+            for (int y = 0; y < sz_y; y++)
+            {
+                stone_color c = b.stone_at(x, y);
+                if (c == none)
+                    continue;
+                int tx = x, ty = y;
+                transform(s, sz_x, sz_y, tx, ty);
+                cur[ty * sz_x + tx] = c == black ? 'X' : 'O';
+            }
+        if (s == 0 || cur < best)
+        {
+            best = cur;
+            sym  = s;
+        }
+        cur.fill('.');
+    }
+    return QString("%1x%2:").arg(sz_x).arg(sz_y) + QString::fromLatin1(best);
+}
+
+/* Moves are stored like SGF coordinates, two letters each.  */
+static char coord_char(int v)
+{
+    return v < 26 ? 'a' + v : 'A' + v - 26;
+}
+
+static int char_coord(QChar c)
+{
+    char l = c.toLatin1();
+    if (l >= 'a' && l <= 'z')
+        return l - 'a';
+    if (l >= 'A' && l <= 'Z')
+        return l - 'A' + 26;
+    return -1;
+}
+
+analysis_cache::analysis_cache(const QString &filename) : m_connection("analysis_cache")
+{
+    QSqlDatabase db = QSqlDatabase::addDatabase("QSQLITE", m_connection);
+    db.setDatabaseName(filename);
+    if (!db.open())
+    {
+        qDebug() << "Failed to open analysis cache: " << db.lastError().text();
+        return;
+    }
+    QSqlQuery q(db);
+    /* Losing the last few entries in a crash is harmless, waiting for the disk
+       on every position is not.  */
+    q.exec("PRAGMA journal_mode=WAL");
+    q.exec("PRAGMA synchronous=NORMAL");
+    if (!q.exec("CREATE TABLE IF NOT EXISTS analysis (position TEXT NOT NULL, to_move INTEGER NOT NULL, komi REAL NOT NULL, "
+                "engine TEXT NOT NULL, engine_komi REAL NOT NULL, flipped INTEGER NOT NULL, "
+                "visits INTEGER NOT NULL, winrate REAL NOT NULL, score REAL NOT NULL, stddev REAL NOT NULL, have_score INTEGER NOT NULL, "
+                "pvs TEXT NOT NULL, PRIMARY KEY (position, to_move, komi, engine, engine_komi, flipped))"))
+    {
+        qDebug() << "Failed to set up analysis cache: " << q.lastError().text();
+        return;
+    }
+    m_select = QSqlQuery(db);
+    m_select.prepare("SELECT visits, winrate, score, stddev, have_score, pvs FROM analysis WHERE position = ? AND to_move = ? AND komi = ? "
+                     "AND engine = ? AND engine_komi = ? AND flipped = ?");
+    m_store = QSqlQuery(db);
+    m_store.prepare("INSERT INTO analysis VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?) "
+                    "ON CONFLICT (position, to_move, komi, engine, engine_komi, flipped) DO UPDATE SET visits = excluded.visits, "
+                    "winrate = excluded.winrate, score = excluded.score, stddev = excluded.stddev, "
+                    "have_score = excluded.have_score, pvs = excluded.pvs "
+                    "WHERE excluded.visits > analysis.visits");
+    m_ok = true;
+}
+
+analysis_cache::~analysis_cache()
+{
+    m_select = QSqlQuery();
+    m_store  = QSqlQuery();
+    {
+        QSqlDatabase db = QSqlDatabase::database(m_connection, false);
+        db.close();
+    }
+    QSqlDatabase::removeDatabase(m_connection);
+}
+
+int analysis_cache::min_visits()
+{
+    return g_setting->readIntEntry("ANALYSIS_CACHE_VISITS");
+}
+
+/* Bind the key columns, which come first in both queries.  Returns the
+   symmetry used to store the position.  */
+static int bind_key(QSqlQuery &q, const go_board &b, stone_color to_move, double komi, const analyzer_id &id, bool flipped)
+{
+    int sym = 0;
+    q.bindValue(0, canonical_position(b, sym));
+    q.bindValue(1, to_move == white ? 1 : 0);
+    q.bindValue(2, komi);
+    q.bindValue(3, QString::fromStdString(id.engine));
+    /* Matches the way analyzer_id compares: the komi only counts if the engine
+       is set to use a specific one.  */
+    q.bindValue(4, id.komi_set ? id.komi : 0.);
+    q.bindValue(5, flipped ? 1 : 0);
+    return sym;
+}
+
+bool analysis_cache::lookup(const go_board           &b,
+                            stone_color               to_move,
+                            double                    komi,
+                            an_id_t                   id,
+                            bool                      flipped,
+                            int                       min_visits,
+                            eval                     &root,
+                            std::vector<analysis_pv> &pvs,
+                            bool                     &have_score)
+{
+    if (!m_ok || min_visits <= 0 || b.torus_h() || b.torus_v())
+        return false;
+    int sym = bind_key(m_select, b, to_move, komi, analyzer_from_idx(id), flipped);
+    if (!m_select.exec() || !m_select.next())
+        return false;
+    int visits = m_select.value(0).toInt();
+    if (visits < min_visits)
+    {
+        m_select.finish();
+        return false;
+    }
+    root.visits       = visits;
+    root.wr_black     = m_select.value(1).toDouble();
+    root.score_mean   = m_select.value(2).toDouble();
+    root.score_stddev = m_select.value(3).toDouble();
+    root.id           = id;
+    have_score        = m_select.value(4).toBool();
+    QString pv_data   = m_select.value(5).toString();
+    m_select.finish();
+
+    int sz_x = b.size_x();
+    int sz_y = b.size_y();
+    pvs.clear();
+    for (auto &line : pv_data.split("\n"))
+    {
+        QStringList f = line.split(" ");
+        if (f.size() != 5)
+            continue;
+        analysis_pv pv;
+        pv.ev.visits       = f[0].toInt();
+        pv.ev.wr_black     = f[1].toDouble();
+        pv.ev.score_mean   = f[2].toDouble();
+        pv.ev.score_stddev = f[3].toDouble();
+        pv.ev.id           = id;
+        const QString &mv  = f[4];
+        for (int i = 0; i + 1 < mv.length(); i += 2)
+        {
+            int x = char_coord(mv[i]);
+            int y = char_coord(mv[i + 1]);
+            if (x < 0 || y < 0)
+                break;
+            untransform(sym, sz_x, sz_y, x, y);
+            if (x < 0 || y < 0 || x >= sz_x || y >= sz_y)
+                break;
+            pv.moves.emplace_back(x, y);
+        }
+        if (!pv.moves.empty())
+            pvs.push_back(std::move(pv));
+    }
+    return true;
+}
+
+void analysis_cache::store(const go_board                 &b,
+                           stone_color                     to_move,
+                           double                          komi,
+                           bool                            flipped,
+                           const eval                     &root,
+                           const std::vector<analysis_pv> &pvs,
+                           bool                            have_score)
+{
+    if (!m_ok || min_visits() <= 0 || root.visits <= 0 || b.torus_h() || b.torus_v())
+        return;
+    int sym  = bind_key(m_store, b, to_move, komi, root.analyzer(), flipped);
+    int sz_x = b.size_x();
+    int sz_y = b.size_y();
+
+    QString pv_data;
+    for (auto &pv : pvs)
+    {
+        QString moves;
+        for (auto &m : pv.moves)
+        {
+            int x = m.first, y = m.second;
+            transform(sym, sz_x, sz_y, x, y);
+            moves += QChar(coord_char(x));
+            moves += QChar(coord_char(y));
+        }
+        pv_data += QString("%1 %2 %3 %4 %5\n")
+                        .arg(pv.ev.visits)
+                        .arg(pv.ev.wr_black, 0, 'g', 10)
+                        .arg(pv.ev.score_mean, 0, 'g', 10)
+                        .arg(pv.ev.score_stddev, 0, 'g', 10)
+                        .arg(moves);
+    }
+    m_store.bindValue(6, root.visits);
+    m_store.bindValue(7, root.wr_black);
+    m_store.bindValue(8, root.score_mean);
+    m_store.bindValue(9, root.score_stddev);
+    m_store.bindValue(10, have_score ? 1 : 0);
+    m_store.bindValue(11, pv_data);
+    if (!m_store.exec())
+        qDebug() << "Failed to store analysis: " << m_store.lastError().text();
+}
@@ -0,0 +1,63 @@
+#ifndef ANALYSISCACHE_H
+#define ANALYSISCACHE_H
+
+#include <vector>
+
+#include <QSqlQuery>
+#include <QString>
+
+#include "goboard.h"
+#include "goeval.h"
+
+/* Results of earlier analysis runs, kept in an SQLite database so that they
+   survive restarts.  Positions are stored in a canonical orientation, so an
+   opening analyzed in one corner is found again when it is played in another.
+   An entry is keyed by the position, the side to move, the komi of the game
+   and the analyzer (engine, and komi if the engine is configured with one).
+   Flipped analysis, where the engine looks at the position with colors
+   swapped, is kept separately.
+
+   The move history leading to a position is not part of the key, so two
+   positions that differ only in a ko ban share an entry.  */
+class analysis_cache
+{
+    QString   m_connection;
+    bool      m_ok = false;
+    QSqlQuery m_select;
+    QSqlQuery m_store;
+
+public:
+    analysis_cache(const QString &filename);
+    ~analysis_cache();
+
+    /* The number of visits a stored result needs to be used instead of asking
+       an engine, from the settings.  Zero disables the cache.  */
+    static int min_visits();
+
+    /* Look up the analysis of B with TO_MOVE by analyzer ID.  Succeeds only if
+       the stored result has at least MIN_VISITS visits.  The evaluations are
+       returned with ID filled in.  */
+    bool lookup(const go_board           &b,
+                stone_color               to_move,
+                double                    komi,
+                an_id_t                   id,
+                bool                      flipped,
+                int                       min_visits,
+                eval                     &root,
+                std::vector<analysis_pv> &pvs,
+                bool                     &have_score);
+    /* Remember an analysis result.  An existing entry is replaced only if the
+       new one has more visits.  */
+    void store(const go_board                 &b,
+               stone_color                     to_move,
+               double                          komi,
+               bool                            flipped,
+               const eval                     &root,
+               const std::vector<analysis_pv> &pvs,
+               bool                            have_score);
+};
+
+/* Null if the database could not be opened.  */
+extern analysis_cache *g_analysis_cache;
+
+#endif
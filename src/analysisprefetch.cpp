@@ -0,0 +1,174 @@
+#include <algorithm>
+
+#include <QDebug>
+
+#include "analysisprefetch.h"
+#include "analysiscache.h"
+
+analysis_prefetcher::analysis_prefetcher(QWidget *parent, int n_ahead)
+    : GTP_Eval_Controller(parent), m_n_ahead(n_ahead), m_visits(analysis_cache::min_visits())
+{
+}
+
+analysis_prefetcher::~analysis_prefetcher()
+{
+    stop_analyzer();
+}
+
+bool analysis_prefetcher::available()
+{
+    return g_analysis_cache != nullptr && analysis_cache::min_visits() > 0;
+}
+
+void analysis_prefetcher::start(const Engine &engine, int size)
+{
+    start_analyzer(engine, size, 7.5, false);
+}
+
+/* Whether ST already has a good enough result in the cache.  */
+bool analysis_prefetcher::cached(game_state *st)
+{
+    double                   komi = QString::fromStdString(m_game->komi()).toDouble();
+    eval                     root;
+    std::vector<analysis_pv> pvs;
+    bool                     have_score;
+    return g_analysis_cache->lookup(st->get_board(), st->to_move(), komi, m_id_idx, false, m_visits, root, pvs, have_score);
+}
+
+/* Move on to the next position that needs work, or go idle.  Leaving a
+   position stores what the engine found in the cache.  */
+void analysis_prefetcher::next_target()
+{
+    analyzer s = analyzer_state();
+    if (s != analyzer::running && s != analyzer::paused)
+        return;
+    if (!m_paused)
+        while (!m_targets.empty())
+        {
+            game_state *st = m_targets.front();
+            m_targets.pop_front();
+            if (cached(st))
+                continue;
+            m_current    = st;
+            m_pause_eval = false;
+            request_analysis(m_game, st);
+            return;
+        }
+    m_current = nullptr;
+    pause_analyzer(true, m_game, nullptr);
+}
+
+void analysis_prefetcher::set_position(go_game_ptr gr, game_state *st)
+{
+    m_game = gr;
+
+    std::unique_ptr<game_state> root(new game_state(st->get_board(), st->to_move()));
+    std::deque<game_state *>    targets;
+    game_state                 *copy = root.get();
+    for (int i = 0; i < m_n_ahead; i++)
+    {
+        st = st->next_primary_move();
+        if (st == nullptr)
+            break;
+        if (st->was_move_p())
+        {
+            auto am = game_state::add_mode::keep_active;
+            copy    = copy->add_child_move_nochecks(st->get_board(), st->get_move_color(), st->get_move_x(), st->get_move_y(), am);
+        }
+        else if (st->was_pass_p())
+            copy = copy->add_child_pass_nochecks(st->get_board(), game_state::add_mode::keep_active);
+        else
+            break;
+        targets.push_back(copy);
+    }
+
+    /* When stepping through the game, the position being analyzed is usually
+       still wanted, and the work done on it is kept.  */
+    game_state *keep = nullptr;
+    if (m_current != nullptr)
+    {
+        auto same = [this](game_state *t) {
+            return t->to_move() == m_current->to_move() && t->get_board().position_equal_p(m_current->get_board());
+        };
+        auto it = std::find_if(targets.begin(), targets.end(), same);
+        if (it != targets.end())
+        {
+            keep = *it;
+            targets.erase(it);
+        }
+    }
+    m_targets     = std::move(targets);
+    m_root        = std::move(root);
+    m_current     = keep;
+    m_reply_known = false;
+    if (m_current == nullptr)
+        next_target();
+}
+
+void analysis_prefetcher::main_progress(int visits, int x, int y)
+{
+    if (m_reply_known || m_root == nullptr || visits < m_visits)
+        return;
+    m_reply_known = true;
+
+    game_state *main_line = m_root->next_primary_move();
+    game_state *reply     = m_root->add_child_move(x, y, m_root->to_move(), game_state::add_mode::keep_active);
+    /* An invalid move, or the one played in the game.  */
+    if (reply == nullptr || reply == main_line)
+        return;
+    /* The next position in the game is still the most likely to be looked at
+       next.  */
+    if (!m_targets.empty() && m_targets.front() == main_line)
+        m_targets.insert(m_targets.begin() + 1, reply);
+    else
+        m_targets.push_front(reply);
+    if (m_current == nullptr)
+        next_target();
+}
+
+void analysis_prefetcher::set_paused(bool on)
+{
+    if (m_paused == on)
+        return;
+    m_paused = on;
+    if (on && m_current != nullptr)
+        m_targets.push_front(m_current);
+    next_target();
+}
+
+void analysis_prefetcher::eval_received(const QString &, int visits, bool)
+{
+    if (m_current != nullptr && visits >= m_visits)
+        next_target();
+}
+
+void analysis_prefetcher::analyzer_restarted()
+{
+    if (m_current != nullptr)
+        m_targets.push_front(m_current);
+    m_current = nullptr;
+    next_target();
+}
+
+void analysis_prefetcher::gtp_startup_success(GTP_Process *)
+{
+    next_target();
+}
+
+/* Prefetching is only a convenience, so a failing engine is not worth a
+   message box; the board's own engine reports any real problem.  */
+void analysis_prefetcher::gtp_exited(GTP_Process *)
+{
+    qDebug() << "prefetch engine exited";
+    m_current = nullptr;
+    m_targets.clear();
+    clear_eval_data();
+}
+
+void analysis_prefetcher::gtp_failure(GTP_Process *, const QString &err)
+{
+    qDebug() << "prefetch engine failed: " << err;
+    m_current = nullptr;
+    m_targets.clear();
+    clear_eval_data();
+}
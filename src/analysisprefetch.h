@@ -0,0 +1,61 @@
+#ifndef ANALYSISPREFETCH_H
+#define ANALYSISPREFETCH_H
+
+#include <deque>
+#include <memory>
+
+#include "gogame.h"
+#include "qgtp.h"
+#include "setting.h"
+
+/* Analyzes the positions a user reviewing a game is likely to look at next,
+   with an engine process of its own, so that their results are in the
+   analysis cache by the time the board asks for them.  These are the next
+   few moves of the main line, and the reply the board's engine prefers.
+   Each of them is analyzed until it has enough visits to be taken from the
+   cache.
+
+   The positions are copied into a small tree of our own, since the user can
+   change the game record at any time.  Copies have no move history before
+   the shown position, which does not matter for the cache.  */
+class analysis_prefetcher : public GTP_Eval_Controller
+{
+    go_game_ptr                 m_game;
+    std::unique_ptr<game_state> m_root;
+    std::deque<game_state *>    m_targets;
+    /* The position being analyzed.  */
+    game_state *m_current {};
+    /* Set once the preferred reply to the shown position has been added.  */
+    bool m_reply_known = false;
+    int  m_n_ahead;
+    int  m_visits;
+    bool m_paused = false;
+
+    bool cached(game_state *);
+    void next_target();
+
+public:
+    /* N_AHEAD is the number of main line moves to look at.  */
+    analysis_prefetcher(QWidget *parent, int n_ahead);
+    ~analysis_prefetcher();
+
+    /* Whether prefetching is useful: results are only kept in the cache.  */
+    static bool available();
+
+    void start(const Engine &, int size);
+    void set_paused(bool);
+    /* The board now shows ST of GR.  */
+    void set_position(go_game_ptr gr, game_state *st);
+    /* The board's engine has spent VISITS on its best move X/Y in the shown
+       position.  */
+    void main_progress(int visits, int x, int y);
+
+    /* Virtuals from GTP_Controller.  */
+    virtual void eval_received(const QString &, int, bool) override;
+    virtual void analyzer_restarted() override;
+    virtual void gtp_startup_success(GTP_Process *) override;
+    virtual void gtp_exited(GTP_Process *) override;
+    virtual void gtp_failure(GTP_Process *, const QString &) override;
+};
+
+#endif
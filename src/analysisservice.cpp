@@ -0,0 +1,398 @@
+#include <algorithm>
+#include <map>
+
+#include <QApplication>
+#include <QDebug>
+#include <QPointer>
+#include <QWidget>
+
+#include "analysisservice.h"
+
+/* Milliseconds of analysis per turn for the board in the active window, and
+   for the others.  */
+static const int focused_slice    = 6000;
+static const int background_slice = 2000;
+
+/* The running services, by engine and board size.  */
+static std::map<QString, analysis_service *> services;
+
+analysis_service::analysis_service(const QString &key, const Engine &engine, int size)
+    : GTP_Controller(nullptr), m_key(key), m_engine(engine), m_size(size)
+{
+    m_slice.setSingleShot(true);
+    m_restart_timer.setSingleShot(true);
+    connect(&m_slice, &QTimer::timeout, this, [this]() { schedule(true); });
+    connect(&m_restart_timer, &QTimer::timeout, this, [this]() { start_engine(true, false); });
+    connect(qApp, &QApplication::focusChanged, this, [this](QWidget *, QWidget *) {
+        /* Focus moving within a window is no reason to switch.  */
+        QWidget *w = QApplication::activeWindow();
+        if (w == m_active_window)
+            return;
+        m_active_window = w;
+        for (auto &c : m_clients)
+            if (in_active_window(c.ctrl))
+                prefetch_for(c.ctrl);
+        prefer_focus();
+    });
+}
+
+analysis_service::~analysis_service()
+{
+    auto it = services.find(m_key);
+    if (it != services.end() && it->second == this)
+        services.erase(it);
+    if (m_current != nullptr)
+        m_current->m_analyzer = nullptr;
+    if (m_proc != nullptr)
+        release_gtp(m_proc);
+}
+
+analysis_service *analysis_service::join(GTP_Eval_Controller *c, QWidget *window, const Engine &engine, int size)
+{
+    QString           key = engine.path + "\n" + engine.args + "\n" + QString::number(size);
+    analysis_service *s   = nullptr;
+    auto              it  = services.find(key);
+    /* A service whose engine is gone for good stays with its old clients
+       until they leave, but new ones get a fresh engine.  */
+    if (it != services.end() && !it->second->engine_lost())
+        s = it->second;
+    if (s == nullptr)
+    {
+        s             = new analysis_service(key, engine, size);
+        services[key] = s;
+        s->start_engine(false, true);
+    }
+    s->m_clients.push_back({ c, window });
+    if (s->engine_ready())
+        QMetaObject::invokeMethod(
+            s,
+            [s, c]() {
+                auto same = [c](const client &other) { return other.ctrl == c; };
+                if (s->engine_ready() && std::any_of(s->m_clients.begin(), s->m_clients.end(), same))
+                    c->gtp_startup_success(s->m_proc);
+            },
+            Qt::QueuedConnection);
+    return s;
+}
+
+void analysis_service::leave(GTP_Eval_Controller *c)
+{
+    auto it = std::find_if(m_clients.begin(), m_clients.end(), [c](const client &cl) { return cl.ctrl == c; });
+    if (it != m_clients.end())
+        m_clients.erase(it);
+    if (c == m_prefetch_client)
+    {
+        m_prefetch_client = nullptr;
+        if (m_prefetch != nullptr)
+            m_prefetch->set_paused(true);
+    }
+    if (m_clients.empty())
+    {
+        delete this;
+        return;
+    }
+    if (c == m_current)
+    {
+        c->m_analyzer = nullptr;
+        m_current     = nullptr;
+        schedule(false);
+    }
+}
+
+void analysis_service::start_engine(bool replacement, bool show_dialog)
+{
+    m_proc = lease_gtp(m_engine, m_size, 7.5, show_dialog);
+    if (replacement)
+    {
+        m_watchdog.started();
+        m_proc->mark_replacement();
+    }
+    m_proc->set_timeout(g_setting->readIntEntry("ANALYSIS_TIMEOUT"));
+}
+
+bool analysis_service::engine_ready()
+{
+    return m_proc != nullptr && m_proc->started() && !m_proc->stopped();
+}
+
+bool analysis_service::engine_lost()
+{
+    return m_proc == nullptr ? !m_restart_timer.isActive() : m_proc->stopped();
+}
+
+/* Call F for each client.  Clients may leave, and the service may go away,
+   while F runs.  Returns false in the latter case.  */
+bool analysis_service::for_clients(const std::function<void(GTP_Eval_Controller *)> &f)
+{
+    QPointer<analysis_service> self(this);
+    auto                       clients = m_clients;
+    for (auto &c : clients)
+    {
+        if (self.isNull())
+            return false;
+        auto same = [&c](const client &other) { return other.ctrl == c.ctrl; };
+        if (std::any_of(m_clients.begin(), m_clients.end(), same))
+            f(c.ctrl);
+    }
+    return !self.isNull();
+}
+
+analyzer analysis_service::state(GTP_Eval_Controller *c)
+{
+    if (m_proc == nullptr)
+        return m_restart_timer.isActive() ? analyzer::starting : analyzer::disconnected;
+    if (m_proc->stopped())
+        return analyzer::disconnected;
+    if (!m_proc->started())
+        return analyzer::starting;
+    return c->m_pause_eval ? analyzer::paused : analyzer::running;
+}
+
+bool analysis_service::runnable(GTP_Eval_Controller *c)
+{
+    return c->m_request_state != nullptr && !c->m_pause_eval;
+}
+
+bool analysis_service::in_active_window(GTP_Eval_Controller *c)
+{
+    for (auto &cl : m_clients)
+        if (cl.ctrl == c)
+            return cl.window != nullptr && cl.window->window()->isActiveWindow();
+    return false;
+}
+
+/* The client in the active window, if it wants analysis.  */
+GTP_Eval_Controller *analysis_service::focused_client()
+{
+    for (auto &c : m_clients)
+        if (c.window != nullptr && c.window->window()->isActiveWindow())
+            return runnable(c.ctrl) ? c.ctrl : nullptr;
+    return nullptr;
+}
+
+/* Decide whose turn it is.  Unless SLICE_DONE, the current client keeps the
+   engine as long as it wants it.  Otherwise the active window's client goes
+   next if it did not just have its turn, and the others take turns in
+   between.  */
+void analysis_service::schedule(bool slice_done)
+{
+    if (!engine_ready())
+        return;
+    if (!slice_done && m_current != nullptr && runnable(m_current))
+        return;
+
+    GTP_Eval_Controller *focus = focused_client();
+    GTP_Eval_Controller *next  = nullptr;
+    if (focus != nullptr && focus != m_current)
+        next = focus;
+    else
+    {
+        size_t n = m_clients.size();
+        for (size_t i = 0; i < n && next == nullptr; i++)
+        {
+            GTP_Eval_Controller *c = m_clients[(m_next + i) % n].ctrl;
+            if (c != focus && runnable(c))
+            {
+                next   = c;
+                m_next = (m_next + i + 1) % n;
+            }
+        }
+        if (next == nullptr)
+            next = focus;
+    }
+    if (next != m_current)
+        switch_to(next);
+    else if (m_current != nullptr)
+        m_slice.start(m_current == focus ? focused_slice : background_slice);
+}
+
+/* The active window changed, or its client has a new position: it should not
+   have to wait for the others.  */
+void analysis_service::prefer_focus()
+{
+    GTP_Eval_Controller *focus = focused_client();
+    if (focus != nullptr && focus != m_current && engine_ready())
+        switch_to(focus);
+    else
+        schedule(false);
+}
+
+/* Give the engine to NEXT, which continues with the position it wants
+   analyzed.  The previous client keeps showing what it has.  */
+void analysis_service::switch_to(GTP_Eval_Controller *next)
+{
+    if (m_current != nullptr)
+    {
+        m_current->save_to_cache();
+        m_current->m_analyzer       = nullptr;
+        m_current->m_switch_pending = false;
+    }
+    m_current     = next;
+    m_analysis_id = 0;
+    m_switch_id   = 0;
+    if (next == nullptr)
+    {
+        m_slice.stop();
+        m_proc->pause_analysis();
+        return;
+    }
+    m_slice.start(next == focused_client() ? focused_slice : background_slice);
+    next->m_analyzer = m_proc;
+    next->request_analysis(next->m_request_game, next->m_request_state, next->m_last_request_flipped);
+}
+
+void analysis_service::client_changed(GTP_Eval_Controller *c)
+{
+    if (c == focused_client())
+        prefer_focus();
+    else
+        schedule(false);
+}
+
+void analysis_service::sent_analysis(GTP_Eval_Controller *c, int id)
+{
+    if (c == m_current)
+        m_analysis_id = id;
+}
+
+void analysis_service::sent_switch(GTP_Eval_Controller *c, int id)
+{
+    if (c == m_current)
+        m_switch_id = id;
+}
+
+void analysis_service::start_prefetch(int n_ahead)
+{
+    if (m_prefetch != nullptr)
+        return;
+    m_prefetch.reset(new analysis_prefetcher(nullptr, n_ahead));
+    m_prefetch->start(m_engine, m_size);
+    for (auto &c : m_clients)
+        if (in_active_window(c.ctrl))
+            prefetch_for(c.ctrl);
+}
+
+/* Have the prefetcher work for C, starting from the position it wants
+   analyzed.  */
+void analysis_service::prefetch_for(GTP_Eval_Controller *c)
+{
+    if (m_prefetch == nullptr || c == m_prefetch_client || c->m_request_state == nullptr)
+        return;
+    m_prefetch_client = c;
+    m_prefetch->set_position(c->m_request_game, c->m_request_state);
+    m_prefetch->set_paused(c->m_pause_eval);
+}
+
+void analysis_service::set_position(GTP_Eval_Controller *c, go_game_ptr gr, game_state *st)
+{
+    if (m_prefetch == nullptr)
+        return;
+    /* A board in the background does not take the prefetcher away from the
+       one the user is looking at.  */
+    if (c != m_prefetch_client && m_prefetch_client != nullptr && in_active_window(m_prefetch_client) && !in_active_window(c))
+        return;
+    m_prefetch_client = c;
+    m_prefetch->set_position(gr, st);
+    m_prefetch->set_paused(c->m_pause_eval);
+}
+
+void analysis_service::main_progress(GTP_Eval_Controller *c, int visits, int x, int y)
+{
+    if (m_prefetch != nullptr && c == m_prefetch_client)
+        m_prefetch->main_progress(visits, x, y);
+}
+
+void analysis_service::set_paused(GTP_Eval_Controller *c, bool on)
+{
+    if (m_prefetch != nullptr && c == m_prefetch_client)
+        m_prefetch->set_paused(on);
+}
+
+void analysis_service::gtp_startup_success(GTP_Process *p)
+{
+    if (for_clients([p](GTP_Eval_Controller *c) { c->gtp_startup_success(p); }))
+        schedule(false);
+}
+
+void analysis_service::gtp_eval(std::string_view s, bool kata_format)
+{
+    if (m_current != nullptr && m_analysis_id != 0 && m_proc->analysis_id() == m_analysis_id)
+        m_current->gtp_eval(s, kata_format);
+}
+
+void analysis_service::gtp_switch_ready()
+{
+    if (m_current != nullptr && m_switch_id != 0 && m_proc->reply_id() == m_switch_id)
+        m_current->gtp_switch_ready();
+}
+
+/* Like GTP_Eval_Controller::gtp_crashed, but for all clients at once.  */
+bool analysis_service::gtp_crashed(GTP_Process *p, const QString &cause)
+{
+    if (p != m_proc)
+        return false;
+    int delay = m_watchdog.crashed(cause);
+    if (delay < 0)
+        return false;
+    qDebug() << "restarting shared engine in " << delay << " ms after: " << cause;
+
+    if (m_current != nullptr)
+        m_current->m_analyzer = nullptr;
+    m_current = nullptr;
+    m_slice.stop();
+    /* We are called from one of its slots.  */
+    p->deleteLater();
+    m_proc = nullptr;
+    m_restart_timer.start(delay);
+    for_clients([&cause](GTP_Eval_Controller *c) {
+        c->clear_eval_data();
+        c->m_switch_pending = false;
+        c->analyzer_restarting(cause);
+        c->analyzer_state_changed();
+    });
+    return true;
+}
+
+void analysis_service::gtp_restarted(GTP_Process *)
+{
+    if (for_clients([](GTP_Eval_Controller *c) { c->analyzer_restarted(); }))
+        schedule(false);
+}
+
+/* The engine is gone for good.  Every client reports the analyzer as
+   disconnected from now on, but only one of them tells the user, through
+   REPORT: the one in the active window, or else the one that was using the
+   engine.  The others are updated first, since the report may wait for the
+   user.  */
+void analysis_service::report_lost(const std::function<void(GTP_Eval_Controller *)> &report)
+{
+    GTP_Eval_Controller *reporter = m_current;
+    for (auto &c : m_clients)
+        if (in_active_window(c.ctrl))
+            reporter = c.ctrl;
+    if (reporter == nullptr && !m_clients.empty())
+        reporter = m_clients.front().ctrl;
+
+    if (m_current != nullptr)
+        m_current->m_analyzer = nullptr;
+    m_current = nullptr;
+    m_slice.stop();
+    if (!for_clients([reporter](GTP_Eval_Controller *c) {
+            if (c != reporter)
+                c->analyzer_lost();
+        }))
+        return;
+    auto same = [reporter](const client &c) { return c.ctrl == reporter; };
+    if (std::any_of(m_clients.begin(), m_clients.end(), same))
+        report(reporter);
+}
+
+void analysis_service::gtp_exited(GTP_Process *p)
+{
+    report_lost([p](GTP_Eval_Controller *c) { c->gtp_exited(p); });
+}
+
+void analysis_service::gtp_failure(GTP_Process *p, const QString &err)
+{
+    report_lost([p, &err](GTP_Eval_Controller *c) { c->gtp_failure(p, err); });
+}
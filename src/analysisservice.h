@@ -0,0 +1,120 @@
+#ifndef ANALYSISSERVICE_H
+#define ANALYSISSERVICE_H
+
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include <QObject>
+#include <QString>
+#include <QTimer>
+
+#include "analysisprefetch.h"
+#include "qgtp.h"
+#include "setting.h"
+
+/* One engine shared by all the boards that analyze with it, so that the load
+   on the machine does not grow with the number of windows.  The engine works
+   on one board's position at a time, and moves on to the next board that
+   wants analysis when its time slice is up.  The board in the active window
+   gets longer slices, gets the engine back after each of the others had a
+   turn, and takes it over right away when it shows a new position.  Boards
+   that are waiting show what the analysis cache has for their position.
+
+   The service is the controller of the engine process.  Evaluations are
+   passed on to the board whose turn it is, but only if they are for the last
+   analysis request it made: after a switch, the engine may still be writing
+   output for a request made by someone else.
+
+   Analyzing ahead with a second engine, see analysis_prefetcher, is also
+   done once per service rather than once per board.  The prefetcher works
+   for the board in the active window, or failing that for the last board
+   that showed a new position.  */
+class analysis_service : public QObject, public GTP_Controller
+{
+    struct client
+    {
+        GTP_Eval_Controller *ctrl;
+        /* Used to find out whether the client's window is active.  */
+        QWidget *window;
+    };
+
+    QString              m_key;
+    Engine               m_engine;
+    int                  m_size;
+    GTP_Process         *m_proc {};
+    std::vector<client>  m_clients;
+    GTP_Eval_Controller *m_current {};
+    /* Where to continue going round the clients that are not in the active
+       window.  */
+    size_t m_next = 0;
+    /* The last analysis and switch requests made by m_current.  */
+    int m_analysis_id = 0;
+    int m_switch_id   = 0;
+    /* The window that was active when we last looked.  */
+    QWidget *m_active_window {};
+
+    QTimer          m_slice;
+    QTimer          m_restart_timer;
+    engine_watchdog m_watchdog;
+
+    std::unique_ptr<analysis_prefetcher> m_prefetch;
+    /* The client whose positions m_prefetch works on.  */
+    GTP_Eval_Controller *m_prefetch_client {};
+
+    analysis_service(const QString &key, const Engine &, int size);
+    ~analysis_service();
+
+    void                 start_engine(bool replacement, bool show_dialog);
+    bool                 engine_ready();
+    bool                 engine_lost();
+    bool                 for_clients(const std::function<void(GTP_Eval_Controller *)> &);
+    void                 report_lost(const std::function<void(GTP_Eval_Controller *)> &);
+    bool                 runnable(GTP_Eval_Controller *);
+    GTP_Eval_Controller *focused_client();
+    void                 schedule(bool slice_done);
+    void                 prefer_focus();
+    void                 switch_to(GTP_Eval_Controller *);
+    bool                 in_active_window(GTP_Eval_Controller *);
+    void                 prefetch_for(GTP_Eval_Controller *);
+
+public:
+    /* Add C, shown in WINDOW, to the clients of the service for ENGINE on
+       boards of SIZE, which is started if necessary.  C is told through
+       gtp_startup_success once the engine is ready.  */
+    static analysis_service *join(GTP_Eval_Controller *c, QWidget *window, const Engine &, int size);
+    /* Remove C.  The service shuts down with its last client.  */
+    void leave(GTP_Eval_Controller *c);
+
+    analyzer state(GTP_Eval_Controller *c);
+    /* C has a new position to analyze, or was paused.  */
+    void client_changed(GTP_Eval_Controller *c);
+    /* C sent the analysis or switch request with number ID.  */
+    void sent_analysis(GTP_Eval_Controller *c, int id);
+    void sent_switch(GTP_Eval_Controller *c, int id);
+
+    /* Start analyzing N_AHEAD moves ahead, unless we already do.  */
+    void start_prefetch(int n_ahead);
+    /* Like the analysis_prefetcher functions of the same names, for client
+       C.  They are ignored unless the prefetcher works for C, or should work
+       for it from now on.  */
+    void set_position(GTP_Eval_Controller *c, go_game_ptr, game_state *);
+    void main_progress(GTP_Eval_Controller *c, int visits, int x, int y);
+    void set_paused(GTP_Eval_Controller *c, bool on);
+
+    /* Virtuals from GTP_Controller.  */
+    virtual void gtp_played_move(GTP_Process *, int, int) override {}
+    virtual void gtp_played_pass(GTP_Process *) override {}
+    virtual void gtp_played_resign(GTP_Process *) override {}
+    virtual void gtp_report_score(GTP_Process *, const QString &) override {}
+    virtual void gtp_setup_success(GTP_Process *) override {}
+    virtual void gtp_startup_success(GTP_Process *) override;
+    virtual void gtp_exited(GTP_Process *) override;
+    virtual void gtp_failure(GTP_Process *, const QString &) override;
+    virtual void gtp_eval(std::string_view, bool) override;
+    virtual void gtp_switch_ready() override;
+    virtual bool gtp_crashed(GTP_Process *, const QString &) override;
+    virtual void gtp_restarted(GTP_Process *) override;
+};
+
+#endif
@@ -1,14 +1,25 @@
+#include <algorithm>
 #include <fstream>
+#include <limits>
 
+#include <QCryptographicHash>
+#include <QDebug>
+#include <QDirIterator>
+#include <QJsonArray>
+#include <QJsonDocument>
 #include <QMessageBox>
+#include <QStandardPaths>
+#include <QTextStream>
+#include <QThread>
 
 #include "analyzedlg.h"
+#include "analysiscache.h"
 #include "clientwin.h"
 #include "uihelpers.h"
 
 AnalyzeDialog *analyze_dialog;
 
-AnalyzeDialog::AnalyzeDialog(QWidget *parent, const QString &filename) : QMainWindow(parent), GTP_Eval_Controller(parent)
+AnalyzeDialog::AnalyzeDialog(QWidget *parent, const QString &filename) : QMainWindow(parent)
 {
     setupUi(this);
     filenameEdit->setText(filename);
@@ -21,6 +32,7 @@ AnalyzeDialog::AnalyzeDialog(QWidget *parent, const QString &filename) : QMainWi
         m_last_dir = g_setting->readEntry("LAST_DIR");
     secondsEdit->setValidator(&m_seconds_vald);
     maxlinesEdit->setValidator(&m_lines_vald);
+    visitsEdit->setValidator(&m_visits_vald);
 
     const QStyle *style  = g_qGoApp->style();
     int           iconsz = style->pixelMetric(QStyle::PixelMetric::PM_ToolBarIconSize);
@@ -39,6 +51,10 @@ AnalyzeDialog::AnalyzeDialog(QWidget *parent, const QString &filename) : QMainWi
 
     connect(enqueueButton, &QPushButton::clicked, [=](bool) { start_job(); });
     connect(fileselButton, &QPushButton::clicked, [=](bool) { select_file(); });
+    connect(adaptiveCheckBox, &QCheckBox::toggled, [=](bool on) {
+        visitsEdit->setEnabled(on);
+        secondsEdit->setEnabled(!on);
+    });
     connect(openButton, &QPushButton::clicked, [=](bool) { open_in_progress_window(false); });
     connect(openDoneButton, &QPushButton::clicked, [=](bool) { open_in_progress_window(true); });
     connect(trashButton, &QPushButton::clicked, [=](bool) { discard_job(false); });
@@ -53,21 +69,45 @@ AnalyzeDialog::AnalyzeDialog(QWidget *parent, const QString &filename) : QMainWi
     void (QSpinBox::*changed)(int) = &QSpinBox::valueChanged;
     connect(boardsizeSpinBox, changed, [this](int) { update_engines(); });
     void (QComboBox::*cic)(int) = &QComboBox::currentIndexChanged;
-    connect(engineComboBox, cic, [this](int v) { engineStartButton->setEnabled(v != -1 && analyzer_state() == analyzer::disconnected); });
+    connect(engineComboBox, cic, [this](int v) { engineStartButton->setEnabled(v != -1 && pool_state() == analyzer::disconnected); });
     connect(configureButton, &QPushButton::clicked, [=](bool) { client_window->dlgSetPreferences(3); });
     connect(engineStartButton, &QPushButton::clicked, [=](bool) { start_engine(); });
-    connect(engineLogButton, &QPushButton::clicked, [=](bool) { m_analyzer->dialog()->show(); });
+    connect(engineLogButton, &QPushButton::clicked, [=](bool) {
+        for (auto &w : m_workers)
+            if (w->m_analyzer != nullptr)
+                w->m_analyzer->dialog()->show();
+        if (m_kata != nullptr)
+            m_kata->dialog()->show();
+    });
+    engineCountSpinBox->setMaximum(std::max(1, QThread::idealThreadCount()));
+    connect(kataProtocolCheckBox, &QCheckBox::toggled, [this](bool) { update_engine_status(); });
+    m_kata_restart.setSingleShot(true);
+    connect(&m_kata_restart, &QTimer::timeout, [this]() { kata_restart(); });
 
     connect(closeButton, &QPushButton::clicked, [=](bool) { close(); });
 
-    update_engines();
+    /* There is no client window when running headless.  */
+    if (client_window != nullptr)
+        update_engines();
 
-    analyzer_state_changed();
+    update_engine_status();
 }
 
 AnalyzeDialog::~AnalyzeDialog()
 {
-    stop_analyzer();
+    stop_workers();
+}
+
+void AnalyzeDialog::stop_workers()
+{
+    for (auto &w : m_workers)
+        w->stop_analyzer();
+    m_kata_restart.stop();
+    if (m_kata != nullptr)
+    {
+        m_kata->quit();
+        kata_lost();
+    }
 }
 
 void AnalyzeDialog::closeEvent(QCloseEvent *e)
@@ -108,7 +148,13 @@ void AnalyzeDialog::closeEvent(QCloseEvent *e)
             return;
         }
     }
-    stop_analyzer();
+    stop_workers();
+    /* The user chose to discard them, so they must not come back at the next
+       start.  */
+    for (auto j : m_jobs.jobs)
+        journal_remove(j);
+    for (auto j : m_done.jobs)
+        journal_remove(j);
     m_jobs.model.clear();
     m_jobs.jobs.clear();
     m_jobs.map.clear();
@@ -116,37 +162,118 @@ void AnalyzeDialog::closeEvent(QCloseEvent *e)
     e->accept();
 }
 
-void AnalyzeDialog::analyzer_state_changed()
+static QString analyzer_state_name(analyzer s)
 {
-    analyzer s = analyzer_state();
     switch (s)
     {
     case analyzer::disconnected:
-        engineStatusLabel->setText(tr("not running"));
-        break;
+        return QObject::tr("not running");
     case analyzer::starting:
-        engineStatusLabel->setText(tr("starting up"));
-        break;
+        return QObject::tr("starting up");
     case analyzer::paused:
-        engineStatusLabel->setText(tr("idle"));
-        break;
+        return QObject::tr("idle");
     case analyzer::running:
-        engineStatusLabel->setText(tr("working"));
         break;
     }
+    return QObject::tr("working");
+}
+
+/* The state of the pool as a whole: running if any engine is working, and
+   disconnected only if all of them are.  */
+analyzer AnalyzeDialog::pool_state()
+{
+    if (m_kata_restart.isActive())
+        return analyzer::starting;
+    if (m_kata != nullptr)
+    {
+        if (m_kata->stopped())
+            return analyzer::disconnected;
+        if (!m_kata->started())
+            return analyzer::starting;
+        return m_kata->n_pending() > 0 ? analyzer::running : analyzer::paused;
+    }
+    bool any_starting = false;
+    bool any_up       = false;
+    for (auto &w : m_workers)
+    {
+        analyzer s = w->analyzer_state();
+        if (s == analyzer::running && w->m_requester != nullptr)
+            return analyzer::running;
+        any_starting |= s == analyzer::starting;
+        any_up |= s != analyzer::disconnected;
+    }
+    return any_starting ? analyzer::starting : any_up ? analyzer::paused : analyzer::disconnected;
+}
+
+void AnalyzeDialog::update_engine_status()
+{
+    analyzer s = pool_state();
+
+    QString status = analyzer_state_name(s);
+    QString details;
+    int     n_busy = 0;
+    for (auto &w : m_workers)
+    {
+        analyzer ws   = w->analyzer_state();
+        bool     busy = ws == analyzer::running && w->m_requester != nullptr;
+        if (ws == analyzer::running && !busy)
+            ws = analyzer::paused;
+        n_busy += busy;
+        QString line = tr("Engine %1: %2, %3 positions analyzed").arg(w->m_idx + 1).arg(analyzer_state_name(ws)).arg(w->m_n_done);
+        if (busy)
+            line += tr(" (now: %1, move %2)").arg(w->m_requester->m_title).arg(w->m_request->move_number());
+        if (w->m_watchdog.n_restarts() > 0)
+            line += tr(", restarted %1 times, last: %2").arg(w->m_watchdog.n_restarts()).arg(w->m_watchdog.causes().back());
+        details += (details.isEmpty() ? "" : "\n") + line;
+    }
+    if (m_workers.size() > 1 && s != analyzer::disconnected)
+        status = tr("%1 (%2 of %3 engines busy)").arg(status).arg(n_busy).arg(m_workers.size());
+    if (m_kata != nullptr)
+    {
+        details = tr("%1 positions analyzed, %2 pending").arg(m_kata_n_done).arg(m_kata->n_pending());
+        if (s == analyzer::running)
+            status = tr("%1 (%2 positions pending)").arg(status).arg(m_kata->n_pending());
+    }
+    if ((m_kata != nullptr || m_kata_restart.isActive()) && m_kata_watchdog.n_restarts() > 0)
+        details += (details.isEmpty() ? "" : "\n")
+                   + tr("Restarted %1 times, last: %2").arg(m_kata_watchdog.n_restarts()).arg(m_kata_watchdog.causes().back());
+    if (m_n_cached > 0)
+        details += (details.isEmpty() ? "" : "\n") + tr("%1 positions taken from the analysis cache").arg(m_n_cached);
+    if (m_n_shared > 0)
+        details += (details.isEmpty() ? "" : "\n") + tr("%1 positions shared between jobs").arg(m_n_shared);
+    engineStatusLabel->setText(status);
+    engineStatusLabel->setToolTip(details);
+
     engineStartButton->setEnabled(engineComboBox->currentIndex() != -1 && s == analyzer::disconnected);
     engineComboBox->setEnabled(s == analyzer::disconnected);
-    engineLogButton->setEnabled(m_analyzer != nullptr && !m_analyzer->dialog()->isVisible());
+    kataProtocolCheckBox->setEnabled(s == analyzer::disconnected);
+    engineCountSpinBox->setEnabled(s == analyzer::disconnected && !kataProtocolCheckBox->isChecked());
+    bool any_hidden = m_kata != nullptr && !m_kata->dialog()->isVisible();
+    for (auto &w : m_workers)
+        any_hidden |= w->m_analyzer != nullptr && !w->m_analyzer->dialog()->isVisible();
+    engineLogButton->setEnabled(any_hidden);
 
     bool any_jobs = m_jobs.model.rowCount() != 0 || m_done.model.rowCount() != 0;
     boardsizeSpinBox->setEnabled(!any_jobs && s == analyzer::disconnected);
 }
 
-AnalyzeDialog::job::job(AnalyzeDialog *dlg, QString &title, go_game_ptr gr, int n_seconds, int n_lines, engine_komi k, bool comments)
-    : m_dlg(dlg), m_title(title), m_game(gr), m_n_seconds(n_seconds), m_n_lines(n_lines), m_komi_type(k), m_comments(comments)
+AnalyzeDialog::job::job(
+    AnalyzeDialog *dlg, QString &title, go_game_ptr gr, int n_seconds, int n_visits, int n_lines, engine_komi k, bool comments)
+    : m_dlg(dlg),
+      m_title(title),
+      m_game(gr),
+      m_n_seconds(n_seconds),
+      m_n_visits(n_visits),
+      m_n_lines(n_lines),
+      m_komi_type(k),
+      m_comments(comments)
 {
-    std::vector<game_state *>        *q = &m_queue;
-    std::function<bool(game_state *)> f = [this, &q](game_state *st) -> bool {
+    position_map positions;
+    /* The queue is worked on from the back, so the end of the game comes
+       first.  Nothing depends on the order in which results arrive: comments
+       that need the next position's evaluation are written in write_comments
+       once the job is finished.  */
+    m_game->get_root()->walk_tree([this, &positions](game_state *st) -> bool {
         eval ev = st->best_eval();
         if (st->has_figure() && ev.visits > 0)
             return false;
@@ -154,17 +281,22 @@ AnalyzeDialog::job::job(AnalyzeDialog *dlg, QString &title, go_game_ptr gr, int
            to the preceding one.  */
         if (st->was_score_p() || st->was_pass_p())
             return true;
-        q->push_back(st);
+        /* Analyze each position only once, at the occurrence closest to the main
+           line.  */
+        game_state *first = positions.find_or_add(st);
+        if (first != nullptr)
+        {
+            m_transpositions[first].push_back(st);
+            return true;
+        }
+        m_queue.push_back(st);
         return true;
-    };
-    /* This produces the nodes in the reverse order of the game.  We rely on this
-       when calculating win rate changes.  */
-    m_game->get_root()->walk_tree(f);
+    });
+    m_positions = m_queue;
+    for (size_t i = 0; i < m_positions.size(); i++)
+        m_position_idx[m_positions[i]] = i;
     if (k == engine_komi::both)
-    {
-        q = &m_queue_flipped;
-        m_game->get_root()->walk_tree(f);
-    }
+        m_queue_flipped = m_queue;
     m_initial_size = m_queue.size() + m_queue_flipped.size();
 }
 
@@ -174,18 +306,23 @@ AnalyzeDialog::job::~job()
         disconnect(m_connection);
 }
 
-game_state *AnalyzeDialog::job::select_request(bool pop)
+game_state *AnalyzeDialog::job::select_request(bool pop, bool &flipped_queue)
 {
     if (m_queue_flipped.size() > 0 && m_dlg->m_current_komi.isEmpty())
     {
         m_initial_size -= m_queue_flipped.size();
+        for (auto st : m_queue_flipped)
+            m_dlg->drop_shared(st);
         m_queue_flipped.clear();
     }
-    if (m_queue.size() == 0)
+    flipped_queue = m_queue.size() == 0;
+    if (flipped_queue)
     {
-        m_komi_type = engine_komi::do_swap;
+        /* Adaptive jobs can get positions back into the main queue, which
+           must not be flipped unless they were before.  */
         if (m_queue_flipped.size() == 0)
             return nullptr;
+        m_komi_type = engine_komi::do_swap;
         game_state *st = m_queue_flipped.back();
         if (pop)
             m_queue_flipped.pop_back();
@@ -198,6 +335,24 @@ game_state *AnalyzeDialog::job::select_request(bool pop)
     return st;
 }
 
+/* Switch to adaptive analysis, which needs a visit limit.  Positions that
+   are analyzed with both komi settings always get the full budget.  */
+void AnalyzeDialog::job::make_adaptive()
+{
+    if (m_n_visits <= 0 || !m_queue_flipped.empty())
+        return;
+    m_adaptive     = true;
+    m_n_seconds    = 0;
+    m_quick_visits = std::max(1, m_n_visits / 4);
+}
+
+/* Put back a position whose engine went away before finishing it.  */
+void AnalyzeDialog::job::requeue(game_state *st, bool flipped_queue)
+{
+    (flipped_queue ? m_queue_flipped : m_queue).push_back(st);
+    m_in_flight--;
+}
+
 void AnalyzeDialog::job::show_window(bool done)
 {
     if (m_win == nullptr)
@@ -208,6 +363,7 @@ void AnalyzeDialog::job::show_window(bool done)
             m_dlg->update_progress();
             if (m_display == &m_dlg->m_done && !m_game->modified())
             {
+                m_dlg->journal_remove(this);
                 m_dlg->remove_job(*m_display, this);
                 m_dlg->update_progress();
             }
@@ -279,10 +435,25 @@ void AnalyzeDialog::discard_job(bool done)
        Checking for nullptr is ultra-paranoid.  */
     if (j->m_display == nullptr)
         return;
-    if (j == m_requester)
-        m_requester = nullptr;
+    for (auto &w : m_workers)
+        if (w->m_requester == j)
+            w->m_requester = nullptr;
+    for (auto it = m_kata_batches.begin(); it != m_kata_batches.end();)
+    {
+        if (it->second.j != j)
+        {
+            ++it;
+            continue;
+        }
+        m_kata->cancel(it->first);
+        it = m_kata_batches.erase(it);
+    }
+    bool requeued = unshare_job(j);
+    journal_remove(j);
     remove_job(*j->m_display, j);
     update_progress();
+    if (requeued)
+        queue_next();
 }
 
 void AnalyzeDialog::open_in_progress_window(bool done)
@@ -304,41 +475,113 @@ void AnalyzeDialog::select_file()
     filenameEdit->setText(filename);
 }
 
-/* Called only in situations when we know the engine is running.  */
+/* Give work to every engine that is up and has nothing to do, and pause the
+   ones for which there is none.  */
 void AnalyzeDialog::queue_next()
 {
-    if (m_jobs.jobs.size() != 0)
+    if (m_kata != nullptr)
     {
-        QStandardItem *item = m_jobs.model.item(0);
-        int            jidx = item->data(Qt::UserRole + 1).toInt();
-        job           *j    = m_jobs.map[jidx];
-        game_state    *st   = j->select_request(false);
-        if (st != nullptr && st->get_board().size_x() == boardsizeSpinBox->value())
+        kata_submit();
+        update_engine_status();
+        return;
+    }
+    for (auto &w : m_workers)
+    {
+        if (w->m_requester != nullptr)
+            continue;
+        analyzer s = w->analyzer_state();
+        if (s != analyzer::running && s != analyzer::paused)
+            continue;
+        if (!dispatch(w.get()))
+            w->pause_analyzer(true, nullptr, nullptr);
+    }
+    update_engine_status();
+}
+
+/* Whether positions from the main queue of J should be analyzed with colors
+   swapped, to get closer to the komi the engine was set up for.  */
+bool AnalyzeDialog::flip_for(job *j)
+{
+    bool flip = j->m_komi_type == engine_komi::do_swap;
+    if (j->m_komi_type == engine_komi::maybe_swap && !m_current_komi.isEmpty())
+    {
+        bool   ok;
+        double k    = m_current_komi.toFloat(&ok);
+        double gm_k = QString::fromStdString(j->m_game->komi()).toDouble();
+        if (ok && std::abs(k - gm_k) > std::abs(k + gm_k))
+            flip = true;
+    }
+    return flip;
+}
+
+/* Hand the next queued position of any job to W.  Positions are removed from
+   the queue here, so that no two engines get the same one.  */
+bool AnalyzeDialog::dispatch(worker *w)
+{
+    for (;;)
+    {
+        job        *j  = nullptr;
+        game_state *st = nullptr;
+        bool        flipped_queue;
+        for (auto it : m_jobs.jobs)
         {
-            m_seconds_count = 0;
-            m_requester     = j;
-            if (analyzer_state() == analyzer::paused)
-                pause_analyzer(false, j->m_game, st);
-            else
+            st = it->select_request(false, flipped_queue);
+            if (st != nullptr && st->get_board().size_x() == boardsizeSpinBox->value())
             {
-                bool flip = j->m_komi_type == engine_komi::do_swap;
-                if (j->m_komi_type == engine_komi::maybe_swap && !m_current_komi.isEmpty())
-                {
-                    bool   ok;
-                    double k    = m_current_komi.toFloat(&ok);
-                    double gm_k = QString::fromStdString(j->m_game->komi()).toDouble();
-                    if (ok && std::abs(k - gm_k) > std::abs(k + gm_k))
-                        flip = true;
-                }
-                request_analysis(j->m_game, st, flip);
+                j = it;
+                break;
             }
-            return;
         }
+        if (j == nullptr)
+            return false;
+        j->select_request(true, flipped_queue);
+
+        bool flip = flip_for(j);
+        /* This can finish the job and change the job list, so start over.  */
+        if (use_cached(j, st, flipped_queue, flip ? w->m_flipped_id_idx : w->m_id_idx, flip))
+            continue;
+        j->m_in_flight++;
+
+        w->m_seconds_count = 0;
+        w->m_requester     = j;
+        w->m_request       = st;
+        w->m_flipped_queue = flipped_queue;
+
+        /* Not using pause_analyzer to resume, since it does not know about
+           flipping.  */
+        bool was_paused = w->m_pause_eval;
+        w->m_pause_eval = false;
+        w->request_analysis(j->m_game, st, flip);
+        if (was_paused)
+            w->analyzer_state_changed();
+        return true;
     }
-    pause_analyzer(true, nullptr, nullptr);
 }
 
-void AnalyzeDialog::notice_analyzer_id(const analyzer_id &id, bool have_score)
+/* If the analysis cache has a good enough result for ST, which has already
+   been removed from its queue, store it in J and return true.  */
+bool AnalyzeDialog::use_cached(job *j, game_state *st, bool flipped_queue, an_id_t id, bool flip)
+{
+    if (g_analysis_cache == nullptr)
+        return false;
+    double                   komi = QString::fromStdString(j->m_game->komi()).toDouble();
+    eval                     root;
+    std::vector<analysis_pv> pvs;
+    bool                     have_score;
+    /* Adaptive jobs want at least as many visits as the current pass.  */
+    int min_visits = analysis_cache::min_visits();
+    if (min_visits > 0 && j->m_adaptive)
+        min_visits = std::max(min_visits, j->visit_limit());
+    if (!g_analysis_cache->lookup(st->get_board(), st->to_move(), komi, id, flip, min_visits, root, pvs, have_score))
+        return false;
+    m_n_cached++;
+    if (j->m_win != nullptr)
+        j->m_win->update_analyzer_ids(id, have_score);
+    store_analysis(j, st, flipped_queue, root, pvs, have_score);
+    return true;
+}
+
+void AnalyzeDialog::worker::notice_analyzer_id(an_id_t id, bool have_score)
 {
     job *j = m_requester;
     if (j == nullptr)
@@ -347,14 +590,29 @@ void AnalyzeDialog::notice_analyzer_id(const analyzer_id &id, bool have_score)
         j->m_win->update_analyzer_ids(id, have_score);
 }
 
+void AnalyzeDialog::worker::eval_received(const QString &, int, bool have_score)
+{
+    m_dlg->position_done(this, have_score);
+}
+
+void AnalyzeDialog::worker::analyzer_state_changed()
+{
+    m_dlg->update_engine_status();
+}
+
 inline std::string s_tr(const char *s)
 {
     return QObject::tr(s).toStdString();
 }
 
-void AnalyzeDialog::eval_received(const QString &, int, bool have_score)
+/* Called for every update from engine W, which arrive once a second.  Once
+   it has spent the requested time or visits on its position, store the
+   results and move on.  A zero limit means none.  Visits are counted for the
+   whole search, as the engine's own visit limit does, not just for the top
+   candidate.  */
+void AnalyzeDialog::position_done(worker *w, bool have_score)
 {
-    job *j = m_requester;
+    job *j = w->m_requester;
     if (j == nullptr)
     {
         /* This occurs when the currently processed job is manually deleted by the
@@ -362,91 +620,156 @@ void AnalyzeDialog::eval_received(const QString &, int, bool have_score)
         queue_next();
         return;
     }
-    if (++m_seconds_count < j->m_n_seconds)
+    bool enough_visits = j->visit_limit() > 0 && w->root_visits() >= j->visit_limit();
+    if (!enough_visits && (j->m_n_seconds <= 0 || ++w->m_seconds_count < j->m_n_seconds))
         return;
+    w->m_requester = nullptr;
+    w->m_n_done++;
+    j->m_in_flight--;
+
+    std::vector<analysis_pv> pvs;
+    for (size_t i = 0; i < w->n_live_pvs(); i++)
+        pvs.push_back(w->live_pv_at(i));
+    store_analysis(j, w->m_request, w->m_flipped_queue, w->m_eval_state->best_eval(), pvs, have_score);
+
+    queue_next();
+}
+
+/* Store the result for position ST of job J, which came from the flipped
+   queue if FLIPPED_QUEUE.  During the quick pass of an adaptive job, it is
+   only kept until the job decides whether the position needs a deeper
+   look.  */
+void AnalyzeDialog::store_analysis(
+    job *j, game_state *st, bool flipped_queue, const eval &root, const std::vector<analysis_pv> &pvs, bool have_score)
+{
+    journal_result(j, st, flipped_queue, root, pvs, have_score);
     j->m_done++;
     update_progress();
 
-    game_state *st = j->select_request(true);
-    st->update_eval(*m_eval_state);
-    auto variations = m_eval_state->take_children();
-    if (j->m_comments && variations.size() > 0)
+    if (j->m_adaptive && !j->m_refining)
     {
-        game_state *best = variations[0];
-        eval        e    = best->best_eval();
-        if (e.visits > 0)
+        /* The evaluation is stored right away, so that the refining pass can
+           compare neighbouring positions.  */
+        st->update_eval(root);
+        j->m_quick[st] = job::result {root, pvs, have_score};
+    }
+    else
+        write_analysis(j, st, root, pvs, have_score);
+    check_job_done(j);
+    share_result(st, &root, pvs, have_score);
+}
+
+/* Add a comment describing the engine's view of ST, and how the game move
+   compares to it, given the variations PVS.  The next position of the game
+   must have its evaluation already.  */
+static void write_comment(game_state *st, const std::vector<analysis_pv> &pvs, bool have_score)
+{
+    const analysis_pv &best = pvs[0];
+    eval               e    = best.ev;
+    std::string        comm = st->comment();
+    if (comm.length() > 0)
+    {
+        if (comm.back() != '\n')
+            comm.push_back('\n');
+        comm += "----------------\n";
+    }
+    auto cname = st->get_board().coords_name(best.moves[0].first, best.moves[0].second, false);
+    comm += s_tr("Engine top choice: ") + cname.first + cname.second;
+    comm += s_tr(", ") + std::to_string(e.visits) + s_tr(" visits") + s_tr(", winrate B: ") + komi_str(e.wr_black * 100) + "%";
+    if (have_score)
+    {
+        double sval = e.score_mean;
+        if (sval < 0)
+            sval = -sval, comm += s_tr("\nScore: W+");
+        else
+            comm += s_tr("\nScore: B+");
+        comm += komi_str((long)(sval * 100) / 100.);
+        comm += s_tr(" (stddev ") + komi_str((long)(e.score_stddev * 100) / 100.) + s_tr(")");
+    }
+    comm += "\n";
+    game_state *next = st->next_primary_move();
+    if (next && next->was_move_p())
+    {
+        auto nextcname = st->get_board().coords_name(next->get_move_x(), next->get_move_y(), false);
+        comm += s_tr("Game move: ") + nextcname.first + nextcname.second;
+        if (cname != nextcname)
         {
-            std::string comm = st->comment();
-            if (comm.length() > 0)
-            {
-                if (comm.back() != '\n')
-                    comm.push_back('\n');
-                comm += "----------------\n";
-            }
-            auto cname = st->get_board().coords_name(best->get_move_x(), best->get_move_y(), false);
-            comm += s_tr("Engine top choice: ") + cname.first + cname.second;
-            comm += s_tr(", ") + std::to_string(e.visits) + s_tr(" visits") + s_tr(", winrate B: ") + komi_str(e.wr_black * 100) + "%";
-            if (have_score)
-            {
-                double sval = e.score_mean;
-                if (sval < 0)
-                    sval = -sval, comm += s_tr("\nScore: W+");
-                else
-                    comm += s_tr("\nScore: B+");
-                comm += komi_str((long)(sval * 100) / 100.);
-                comm += s_tr(" (stddev ") + komi_str((long)(e.score_stddev * 100) / 100.) + s_tr(")");
-            }
-            comm += "\n";
-            game_state *next = st->next_primary_move();
-            if (next && next->was_move_p())
+            comm += s_tr(", ");
+            auto   next_move = std::make_pair(next->get_move_x(), next->get_move_y());
+            size_t choice    = 0;
+            while (choice < pvs.size() && (pvs[choice].moves.empty() || pvs[choice].moves[0] != next_move))
+                choice++;
+            if (choice < pvs.size())
+                comm += s_tr("choice #") + std::to_string(choice + 1);
+            else
+                comm += "not considered";
+
+            eval e2 = next->eval_from(e.id, true);
+            if (e2.visits > 0)
             {
-                auto nextcname = st->get_board().coords_name(next->get_move_x(), next->get_move_y(), false);
-                comm += s_tr("Game move: ") + nextcname.first + nextcname.second;
-                if (cname != nextcname)
-                {
-                    comm += s_tr(", ");
-                    for (size_t cnt = 1; cnt < variations.size(); cnt++)
-                    {
-                        if (variations[cnt]->get_move_x() == next->get_move_x() && variations[cnt]->get_move_y() == next->get_move_y())
-                        {
-                            comm += s_tr("choice #") + std::to_string(cnt + 1);
-                            goto found;
-                        }
-                    }
-                    comm += "not considered";
-                found:
-
-                    eval e2 = next->eval_from(e.id, true);
-                    if (e2.visits > 0)
-                    {
-                        double      diff    = e2.wr_black - e.wr_black;
-                        std::string diffstr = komi_str(diff * 100);
-                        if (diff > 0)
-                            diffstr = "+" + diffstr;
-                        comm += s_tr(", winrate B: ") + komi_str(e2.wr_black * 100) + "% (" + diffstr + ")";
-                    }
-                }
-                comm += "\n";
+                double      diff    = e2.wr_black - e.wr_black;
+                std::string diffstr = komi_str(diff * 100);
+                if (diff > 0)
+                    diffstr = "+" + diffstr;
+                comm += s_tr(", winrate B: ") + komi_str(e2.wr_black * 100) + "% (" + diffstr + ")";
             }
-            comm += s_tr("Analysis: ") + e.id.engine;
-            if (e.id.komi_set)
-                comm += s_tr(" @") + komi_str(e.id.komi) + s_tr(" komi");
-            comm += "\n";
-            st->set_comment(comm);
         }
+        comm += "\n";
     }
-    int count = 0;
-    for (auto it : variations)
+    const analyzer_id &id = e.analyzer();
+    comm += s_tr("Analysis: ") + id.engine;
+    if (id.komi_set)
+        comm += s_tr(" @") + komi_str(id.komi) + s_tr(" komi");
+    comm += "\n";
+    st->set_comment(comm);
+}
+
+/* Store the evaluation ROOT of position ST in job J, along with the first
+   few variations from PVS, and keep what is needed for a comment if the job
+   asks for them.  */
+void AnalyzeDialog::write_analysis(job *j, game_state *st, const eval &root, const std::vector<analysis_pv> &pvs, bool have_score)
+{
+    st->update_eval(root);
+    auto transp = j->m_transpositions.find(st);
+    if (transp != j->m_transpositions.end())
+        for (auto it : transp->second)
+            it->update_eval(root);
+    if (j->m_comments && pvs.size() > 0 && pvs[0].ev.visits > 0)
+        j->m_comment_data[st].push_back(job::result {root, pvs, have_score});
+    /* Build the variations on a scratch copy of the position, then move them
+       into the game.  */
+    game_state scratch(st->get_board(), st->to_move());
+    size_t     n_lines = std::min<size_t>(pvs.size(), j->m_n_lines);
+    for (size_t i = 0; i < n_lines; i++)
     {
-        eval    ev    = it->best_eval();
-        double  wr    = ev.wr_black;
-        QString cnt   = QString::number(count + 1);
-        QString wrb   = QString::number(wr * 100);
-        QString wrw   = QString::number((1 - wr) * 100);
-        QString vis   = QString::number(ev.visits);
-        QString title = tr("PV ") + cnt + ": " + tr("W Win ") + wrw + "%, " + tr("B Win ") + wrb + "% " + tr("at ") + vis + tr(" visits.");
-        it->set_figure(257, title.toStdString());
+        game_state *node  = &scratch;
+        game_state *first = nullptr;
+        for (auto &m : pvs[i].moves)
+        {
+            node = node->add_child_move(m.first, m.second);
+            if (node == nullptr)
+                break;
+            if (first == nullptr)
+                first = node;
+        }
+        if (first == nullptr)
+            continue;
+
+        const eval &ev    = pvs[i].ev;
+        double      wr    = ev.wr_black;
+        QString     cnt   = QString::number(i + 1);
+        QString     wrb   = QString::number(wr * 100);
+        QString     wrw   = QString::number((1 - wr) * 100);
+        QString     vis   = QString::number(ev.visits);
+        QString     title = tr("PV ") + cnt + ": " + tr("W Win ") + wrw + "%, " + tr("B Win ") + wrb + "% " + tr("at ") + vis + tr(" visits.");
+        first->update_eval(ev);
+        first->set_figure(257, title.toStdString());
+    }
+    auto variations = scratch.take_children();
+    for (auto it : variations)
         st->add_child_tree(it);
+    if (!variations.empty())
+    {
         j->m_game->set_modified();
         if (j->m_win)
         {
@@ -454,24 +777,325 @@ void AnalyzeDialog::eval_received(const QString &, int, bool have_score)
             j->m_win->update_figures();
             j->m_win->update_game_record();
         }
-        count++;
-        if (count >= j->m_n_lines)
-            break;
     }
+}
+
+/* Positions are ranked by how much the evaluation changes from the position
+   before or to the ones after it, in winrate or in points, with one point
+   counting as much as five percent.  Positions where the engine could not
+   decide between its top two candidates rank higher, and positions the user
+   marked up, or made a figure of, are always looked at again.  */
+static double criticality(game_state *st, const eval &e, const std::vector<analysis_pv> &pvs, bool have_score)
+{
+    if (st->has_figure())
+        return std::numeric_limits<double>::infinity();
+    const go_board &b = st->get_board();
+    for (int x = 0; x < b.size_x(); x++)
+        for (int y = 0; y < b.size_y(); y++)
+        {
+            mark m = b.mark_at(x, y);
+            if (m != mark::none && m != mark::move && m != mark::dead && m != mark::seki && m != mark::terr)
+                return std::numeric_limits<double>::infinity();
+        }
 
-    if (j->select_request(false) == nullptr)
+    double crit  = 0;
+    auto   swing = [&](game_state *other) {
+        if (other == nullptr)
+            return;
+        eval o = other->eval_from(e.id, true);
+        if (o.visits == 0)
+            return;
+        double d = std::abs(o.wr_black - e.wr_black);
+        if (have_score)
+            d = std::max(d, std::abs(o.score_mean - e.score_mean) / 20);
+        crit = std::max(crit, d);
+    };
+    swing(st->prev_move());
+    for (auto c : st->children())
+        swing(c);
+    if (pvs.size() > 1 && pvs[1].ev.visits * 2 >= pvs[0].ev.visits)
+        crit += 0.05;
+    return crit;
+}
+
+/* The quick pass over the positions of adaptive job J is done.  Up to an
+   eighth of them, those that change the evaluation by at least five percent,
+   are queued again and share a quarter of the job's total budget, which
+   leaves the whole job at about half the visits of analyzing each position
+   with m_n_visits.  The rest keep the result of the quick pass.  */
+void AnalyzeDialog::refine_job(job *j)
+{
+    j->m_refining = true;
+
+    std::vector<std::pair<double, game_state *>> ranked;
+    for (auto &it : j->m_quick)
+        ranked.emplace_back(criticality(it.first, it.second.root, it.second.pvs, it.second.have_score), it.first);
+    std::sort(ranked.begin(), ranked.end(), [](auto &a, auto &b) { return a.first > b.first; });
+
+    size_t max_refine = std::max<size_t>(1, ranked.size() / 8);
+    size_t n_refine   = 0;
+    while (n_refine < ranked.size() && ranked[n_refine].first >= 0.05
+           && (n_refine < max_refine || ranked[n_refine].first == std::numeric_limits<double>::infinity()))
+        n_refine++;
+
+    if (n_refine > 0)
     {
+        long budget      = (long)ranked.size() * j->m_n_visits / 4;
+        j->m_deep_visits = std::clamp<long>(budget / n_refine, j->m_n_visits, 4 * j->m_n_visits);
+    }
+    /* The queue is worked on from the back, so the most critical positions
+       go last.  */
+    for (size_t i = n_refine; i-- > 0;)
+    {
+        j->m_queue.push_back(ranked[i].second);
+        j->m_quick.erase(ranked[i].second);
+    }
+    j->m_initial_size += n_refine;
+    for (auto &it : j->m_quick)
+        write_analysis(j, it.first, it.second.root, it.second.pvs, it.second.have_score);
+    j->m_quick.clear();
+
+    if (n_refine > 0)
+    {
+        j->m_submitted = false;
+        /* Not called directly, since we may be in the middle of handing out
+           work.  */
+        QMetaObject::invokeMethod(this, &AnalyzeDialog::queue_next, Qt::QueuedConnection);
+    }
+}
+
+/* Write the comments of finished job J, in the order of its positions.  */
+void AnalyzeDialog::write_comments(job *j)
+{
+    if (j->m_comment_data.empty())
+        return;
+    for (auto st : j->m_positions)
+    {
+        auto it = j->m_comment_data.find(st);
+        if (it != j->m_comment_data.end())
+            for (auto &r : it->second)
+                write_comment(st, r.pvs, r.have_score);
+    }
+    j->m_comment_data.clear();
+    j->m_game->set_modified();
+    if (j->m_win)
+        j->m_win->refresh_comment();
+}
+
+void AnalyzeDialog::check_job_done(job *j)
+{
+    if (j->finished() && j->m_adaptive && !j->m_refining && j->m_display == &m_jobs)
+        refine_job(j);
+    if (j->finished() && j->m_display == &m_jobs)
+    {
+        write_comments(j);
         if (j->m_win != nullptr)
             j->m_win->setGameMode(modeNormal);
 
         remove_job(m_jobs, j);
+        if (m_headless)
+        {
+            headless_save(j);
+            QMetaObject::invokeMethod(this, &AnalyzeDialog::headless_check_done, Qt::QueuedConnection);
+            return;
+        }
         insert_job(m_done, doneView, j);
         update_progress();
     }
+}
+
+static std::string kata_rules(const std::string &rules)
+{
+    QString r = QString::fromStdString(rules).toLower();
+    for (auto name : {"japanese", "chinese", "korean", "aga", "new-zealand", "tromp-taylor"})
+        if (r.startsWith(name))
+            return name;
+    if (r.startsWith("nz") || r.startsWith("new zealand"))
+        return "new-zealand";
+    return "chinese";
+}
+
+/* Send every job that has not been submitted yet to the KataGo analysis
+   engine, one batch for each of its queues.  The engine decides how to spread
+   the positions over its search threads.  */
+void AnalyzeDialog::kata_submit()
+{
+    if (m_kata->stopped() || !m_kata->started())
+        return;
+    /* Copy the list, since finishing a job modifies it.  */
+    std::vector<job *> jobs = m_jobs.jobs;
+    for (auto j : jobs)
+    {
+        if (j->m_submitted || j->m_game->get_root()->get_board().size_x() != boardsizeSpinBox->value())
+            continue;
+        j->m_submitted = true;
+        /* Called for its side effect of dropping the flipped queue if it
+           can't be used.  */
+        bool flipped_queue;
+        j->select_request(false, flipped_queue);
+
+        kata_submit_queue(j, false, flip_for(j));
+        kata_submit_queue(j, true, true);
+        /* Jobs with nothing left to analyze.  */
+        check_job_done(j);
+    }
+}
+
+/* Send the positions of one queue of J to the engine, except for those the
+   analysis cache can answer.  */
+void AnalyzeDialog::kata_submit_queue(job *j, bool flipped_queue, bool flip)
+{
+    std::vector<game_state *> &q  = flipped_queue ? j->m_queue_flipped : j->m_queue;
+    an_id_t                    id = m_kata->analyzer_idx(flip);
+    for (size_t i = 0; i < q.size();)
+    {
+        game_state *st = q[i];
+        q.erase(q.begin() + i);
+        if (!use_cached(j, st, flipped_queue, id, flip))
+            q.insert(q.begin() + i++, st);
+    }
+    if (q.empty())
+        return;
+
+    kata_send(j, flipped_queue, flip, q);
+}
+
+/* Send positions from a queue of J to the engine as one batch.  */
+void AnalyzeDialog::kata_send(job *j, bool flipped_queue, bool flip, const std::vector<game_state *> &q)
+{
+    double      komi  = QString::fromStdString(j->m_game->komi()).toDouble();
+    std::string rules = kata_rules(j->m_game->rules());
+    int         tag   = ++m_kata_tag_count;
 
+    m_kata_batches[tag] = kata_batch {j, flipped_queue, flip};
+    m_kata->analyze(tag, q, komi, rules, flip, j->visit_limit(), j->m_n_seconds);
+}
+
+/* Remove ST from the queue of the batch identified by TAG, and return the job
+   it belongs to.  FLIPPED_QUEUE is set to the queue it came from, and FLIP
+   to whether the batch was analyzed flipped.  Returns null if the batch or
+   the position is unknown, e.g. because the job was discarded.  */
+AnalyzeDialog::job *AnalyzeDialog::kata_take_position(int tag, game_state *st, bool &flipped_queue, bool &flip)
+{
+    auto it = m_kata_batches.find(tag);
+    if (it == m_kata_batches.end())
+        return nullptr;
+    job                       *j = it->second.j;
+    std::vector<game_state *> &q = it->second.flipped_queue ? j->m_queue_flipped : j->m_queue;
+    auto                       p = std::find(q.begin(), q.end(), st);
+    if (p == q.end())
+        return nullptr;
+    q.erase(p);
+    flipped_queue = it->second.flipped_queue;
+    flip          = it->second.flip;
+    return j;
+}
+
+void AnalyzeDialog::kata_result(Kata_Analysis_Process          *,
+                                int                             tag,
+                                game_state                     *st,
+                                const eval                     &root,
+                                const std::vector<analysis_pv> &pvs,
+                                bool                            have_score)
+{
+    bool flipped_queue, flip;
+    job *j = kata_take_position(tag, st, flipped_queue, flip);
+    if (j == nullptr)
+        return;
+    m_kata_n_done++;
+    if (g_analysis_cache != nullptr)
+    {
+        double komi = QString::fromStdString(j->m_game->komi()).toDouble();
+        g_analysis_cache->store(st->get_board(), st->to_move(), komi, flip, root, pvs, have_score);
+    }
+    if (j->m_win != nullptr)
+        j->m_win->update_analyzer_ids(root.id, have_score);
+    store_analysis(j, st, flipped_queue, root, pvs, have_score);
+    update_engine_status();
+}
+
+/* The engine could not handle the position; count it as done so that the job
+   can finish.  */
+void AnalyzeDialog::kata_rejected(Kata_Analysis_Process *, int tag, game_state *st)
+{
+    bool flipped_queue, flip;
+    job *j = kata_take_position(tag, st, flipped_queue, flip);
+    if (j == nullptr)
+        return;
+    j->m_done++;
+    update_progress();
+    check_job_done(j);
+    share_result(st, nullptr, {}, false);
+    update_engine_status();
+}
+
+void AnalyzeDialog::kata_startup_success(Kata_Analysis_Process *)
+{
     queue_next();
 }
 
+/* Forget about all submitted batches.  The positions are still in the job
+   queues, so they are sent again if the engine is restarted.  */
+void AnalyzeDialog::kata_lost()
+{
+    m_kata->take_pending();
+    m_kata_batches.clear();
+    for (auto j : m_jobs.jobs)
+        j->m_submitted = false;
+}
+
+void AnalyzeDialog::kata_exited(Kata_Analysis_Process *)
+{
+    kata_lost();
+    if (m_headless)
+        headless_error(QObject::tr("Analysis engine exited unexpectedly."));
+    else
+        QMessageBox::warning(this, PACKAGE, QObject::tr("Analysis engine exited unexpectedly."));
+    update_engine_status();
+}
+
+/* Like GTP_Eval_Controller::gtp_crashed: start the engine again after a
+   delay, unless it keeps crashing.  The pending positions are submitted again
+   once the new one is up.  */
+bool AnalyzeDialog::kata_crashed(Kata_Analysis_Process *p, const QString &cause)
+{
+    if (p != m_kata.get() || m_kata_engine == nullptr)
+        return false;
+    int delay = m_kata_watchdog.crashed(cause);
+    if (delay < 0)
+        return false;
+    qDebug() << "restarting analysis engine in " << delay << " ms after: " << cause;
+
+    kata_lost();
+    /* We are called from one of its slots.  */
+    m_kata.release()->deleteLater();
+    m_kata_restart.start(delay);
+    if (m_headless)
+        QTextStream(stderr) << QObject::tr("Engine is restarting: %1").arg(cause) << "\n";
+    update_engine_status();
+    return true;
+}
+
+void AnalyzeDialog::kata_restart()
+{
+    m_kata_watchdog.started();
+    m_kata.reset(new Kata_Analysis_Process(this, this, *m_kata_engine, m_kata_engine->boardsize.toInt(), false));
+    update_engine_status();
+}
+
+void AnalyzeDialog::kata_failure(Kata_Analysis_Process *, const QString &err)
+{
+    kata_lost();
+    update_engine_status();
+    if (m_headless)
+    {
+        headless_error(err);
+        return;
+    }
+    QMessageBox msg(QString(QObject::tr("Error")), err, QMessageBox::Warning, QMessageBox::Ok | QMessageBox::Default, Qt::NoButton, Qt::NoButton);
+    msg.exec();
+}
+
 void AnalyzeDialog::update_buttons(display &d, QListView *view, QProgressBar *bar, QToolButton *trash, QToolButton *open)
 {
     QItemSelectionModel   *sel       = view->selectionModel();
@@ -517,7 +1141,7 @@ void AnalyzeDialog::update_buttons(display &d, QListView *view, QProgressBar *ba
 void AnalyzeDialog::update_engines()
 {
     /* Keep old entry showing if the engine is running.  */
-    if (!engineComboBox->isEnabled())
+    if (!engineComboBox->isEnabled() || m_headless)
         return;
 
     auto new_list = client_window->analysis_engines(boardsizeSpinBox->value());
@@ -535,46 +1159,546 @@ void AnalyzeDialog::update_progress()
     update_buttons(m_done, doneView, nullptr, openDoneButton, trashDoneButton);
 
     bool any_jobs = m_jobs.model.rowCount() != 0 || m_done.model.rowCount() != 0;
-    boardsizeSpinBox->setEnabled(!any_jobs && analyzer_state() == analyzer::disconnected);
+    boardsizeSpinBox->setEnabled(!any_jobs && pool_state() == analyzer::disconnected);
 
     /* Garbage collect.  */
     if (!any_jobs)
         m_all_jobs.clear();
 }
 
-void AnalyzeDialog::gtp_startup_success(GTP_Process *)
+void AnalyzeDialog::worker::gtp_startup_success(GTP_Process *)
 {
-    analyzer_state_changed();
+    m_dlg->queue_next();
+}
+
+/* Engine W has stopped working.  Return its position to the queue so that one
+   of the others can pick it up.  */
+void AnalyzeDialog::engine_lost(worker *w)
+{
+    w->clear_eval_data();
+    if (w->m_requester != nullptr)
+    {
+        w->m_requester->requeue(w->m_request, w->m_flipped_queue);
+        w->m_requester = nullptr;
+    }
     queue_next();
 }
 
-void AnalyzeDialog::gtp_failure(GTP_Process *, const QString &err)
+void AnalyzeDialog::worker::gtp_failure(GTP_Process *, const QString &err)
 {
-    clear_eval_data();
+    m_dlg->engine_lost(this);
+    if (m_dlg->m_headless)
+    {
+        m_dlg->headless_error(err);
+        return;
+    }
     QMessageBox msg(QString(QObject::tr("Error")), err, QMessageBox::Warning, QMessageBox::Ok | QMessageBox::Default, Qt::NoButton, Qt::NoButton);
     msg.exec();
 }
 
-void AnalyzeDialog::gtp_exited(GTP_Process *)
+void AnalyzeDialog::worker::analyzer_restarting(const QString &cause)
 {
-    clear_eval_data();
-    QMessageBox::warning(this, PACKAGE, QObject::tr("GTP process exited unexpectedly."));
-    analyzer_state_changed();
+    if (m_dlg->m_headless)
+        QTextStream(stderr) << QObject::tr("Engine %1 is restarting: %2").arg(m_idx + 1).arg(cause) << "\n";
+}
+
+/* Start over on the interrupted position, unless its job was discarded in
+   the meantime.  */
+void AnalyzeDialog::worker::analyzer_restarted()
+{
+    m_seconds_count = 0;
+    if (m_requester != nullptr)
+        GTP_Eval_Controller::analyzer_restarted();
+    else
+        m_dlg->queue_next();
+}
+
+void AnalyzeDialog::worker::gtp_exited(GTP_Process *)
+{
+    m_dlg->engine_lost(this);
+    if (m_dlg->m_headless)
+        m_dlg->headless_error(QObject::tr("GTP process exited unexpectedly."));
+    else
+        QMessageBox::warning(m_dlg, PACKAGE, QObject::tr("GTP process exited unexpectedly."));
+    m_dlg->update_engine_status();
 }
 
 void AnalyzeDialog::start_engine()
 {
-    if (analyzer_state() != analyzer::disconnected)
+    if (pool_state() != analyzer::disconnected)
         return;
     int idx = engineComboBox->currentIndex();
     if (idx < 0 || idx >= m_engines.count())
         return;
+    start_engine(m_engines.at(idx));
+}
 
+void AnalyzeDialog::start_engine(const Engine &e)
+{
     boardsizeSpinBox->setEnabled(false);
 
-    const Engine &e = m_engines.at(idx);
-    m_current_komi  = e.komi;
-    start_analyzer(e, e.boardsize.toInt(), 7.5, false);
+    m_current_komi = e.komi;
+
+    m_workers.clear();
+    if (m_kata != nullptr)
+        kata_lost();
+    m_kata.reset();
+    m_kata_restart.stop();
+    if (kataProtocolCheckBox->isChecked())
+    {
+        m_kata_engine.reset(new Engine(e));
+        m_kata_watchdog.reset();
+        m_kata.reset(new Kata_Analysis_Process(this, this, e, e.boardsize.toInt(), false));
+        update_engine_status();
+        return;
+    }
+
+    /* Each engine gets its own process; how many threads each of them uses is
+       up to the engine's configuration.  */
+    int n = engineCountSpinBox->value();
+    for (int i = 0; i < n; i++)
+    {
+        m_workers.emplace_back(new worker(this, i));
+        m_workers.back()->start_analyzer(e, e.boardsize.toInt(), 7.5, false);
+    }
+    update_engine_status();
+}
+
+static uint64_t share_hash(const game_state *st, bool flipped_queue)
+{
+    uint64_t h = st->get_board().position_hash() ^ ((uint64_t)st->to_move() * 0x5851f42d4c957f2dull);
+    return flipped_queue ? ~h : h;
+}
+
+/* Whether ST from J, queued in the flipped queue if FLIPPED_QUEUE, would be
+   analyzed exactly like OTHER, a position led by another job: same position,
+   komi, rules and limits.  */
+bool AnalyzeDialog::share_match(job *j, game_state *st, bool flipped_queue, game_state *other)
+{
+    const shared_position &sp = m_shared.at(other);
+    job                   *oj = sp.leader;
+    return (sp.flipped_queue == flipped_queue && oj->m_komi_type == j->m_komi_type && oj->m_n_seconds == j->m_n_seconds
+            && oj->m_n_visits == j->m_n_visits && oj->m_game->komi() == j->m_game->komi() && oj->m_game->rules() == j->m_game->rules()
+            && other->to_move() == st->to_move() && other->get_board().position_equal_p(st->get_board()));
+}
+
+/* Look for the queued positions of the new job J in the queues of other jobs.
+   Those already queued elsewhere are taken out of J's queues to wait for the
+   result; the others are made available to later jobs.  Adaptive jobs
+   treat positions differently depending on their neighbours, so they are
+   left out.  */
+void AnalyzeDialog::share_positions(job *j)
+{
+    if (j->m_adaptive)
+        return;
+    for (bool flipped_queue : {false, true})
+    {
+        std::vector<game_state *> &q = flipped_queue ? j->m_queue_flipped : j->m_queue;
+        std::vector<game_state *>  kept;
+        for (auto st : q)
+        {
+            uint64_t    h     = share_hash(st, flipped_queue);
+            auto        range = m_shared_index.equal_range(h);
+            game_state *found = nullptr;
+            for (auto it = range.first; it != range.second && found == nullptr; ++it)
+                if (share_match(j, st, flipped_queue, it->second))
+                    found = it->second;
+            if (found != nullptr)
+            {
+                m_shared.at(found).waiters.emplace_back(j, st);
+                j->m_waiting++;
+                continue;
+            }
+            m_shared.emplace(st, shared_position {h, j, flipped_queue, {}});
+            m_shared_index.emplace(h, st);
+            kept.push_back(st);
+        }
+        q = std::move(kept);
+    }
+}
+
+void AnalyzeDialog::unindex_shared(uint64_t hash, game_state *st)
+{
+    auto range = m_shared_index.equal_range(hash);
+    for (auto it = range.first; it != range.second; ++it)
+        if (it->second == st)
+        {
+            m_shared_index.erase(it);
+            return;
+        }
+}
+
+/* Position ST has been analyzed for the job that led it; store the result in
+   the jobs waiting for it.  A null ROOT means the engine rejected the
+   position.  */
+void AnalyzeDialog::share_result(game_state *st, const eval *root, const std::vector<analysis_pv> &pvs, bool have_score)
+{
+    auto it = m_shared.find(st);
+    if (it == m_shared.end())
+        return;
+    auto waiters       = std::move(it->second.waiters);
+    bool flipped_queue = it->second.flipped_queue;
+    unindex_shared(it->second.hash, st);
+    m_shared.erase(it);
+
+    for (auto &w : waiters)
+    {
+        job *j = w.first;
+        j->m_waiting--;
+        m_n_shared++;
+        if (root != nullptr)
+        {
+            if (j->m_win != nullptr)
+                j->m_win->update_analyzer_ids(root->id, have_score);
+            store_analysis(j, w.second, flipped_queue, *root, pvs, have_score);
+        }
+        else
+        {
+            j->m_done++;
+            update_progress();
+            check_job_done(j);
+        }
+    }
+}
+
+/* The leading job has dropped ST without analyzing it, and so do the jobs
+   waiting for it.  Since this happens while work is being handed out, the
+   check whether that finished them is delayed.  */
+void AnalyzeDialog::drop_shared(game_state *st)
+{
+    auto it = m_shared.find(st);
+    if (it == m_shared.end())
+        return;
+    for (auto &w : it->second.waiters)
+    {
+        w.first->m_waiting--;
+        w.first->m_initial_size--;
+    }
+    unindex_shared(it->second.hash, st);
+    m_shared.erase(it);
+    QMetaObject::invokeMethod(
+        this,
+        [this]() {
+            std::vector<job *> jobs = m_jobs.jobs;
+            for (auto j : jobs)
+                check_job_done(j);
+            update_progress();
+        },
+        Qt::QueuedConnection);
+}
+
+/* Called before discarding J.  Positions J was waiting for are forgotten, and
+   those other jobs were waiting for are handed to the first of them, which
+   gets the position back into its queue.  Returns true if that happened.  */
+bool AnalyzeDialog::unshare_job(job *j)
+{
+    bool requeued = false;
+    for (auto it = m_shared.begin(); it != m_shared.end();)
+    {
+        shared_position &sp = it->second;
+        sp.waiters.erase(std::remove_if(sp.waiters.begin(), sp.waiters.end(), [j](auto &w) { return w.first == j; }), sp.waiters.end());
+        if (sp.leader != j)
+        {
+            ++it;
+            continue;
+        }
+        unindex_shared(sp.hash, it->first);
+        if (!sp.waiters.empty())
+        {
+            job            *nj = sp.waiters.front().first;
+            game_state     *st = sp.waiters.front().second;
+            shared_position moved {sp.hash, nj, sp.flipped_queue, {}};
+            moved.waiters.assign(sp.waiters.begin() + 1, sp.waiters.end());
+            nj->m_waiting--;
+            (sp.flipped_queue ? nj->m_queue_flipped : nj->m_queue).push_back(st);
+            /* A job whose queues were already sent to the engine needs this
+               position sent separately.  */
+            if (m_kata != nullptr && nj->m_submitted)
+                kata_send(nj, sp.flipped_queue, sp.flipped_queue || flip_for(nj), {st});
+            m_shared_index.emplace(moved.hash, st);
+            m_shared.emplace(st, std::move(moved));
+            requeued = true;
+        }
+        it = m_shared.erase(it);
+    }
+    return requeued;
+}
+
+/* Create a job for FILE, whose contents are GR, and queue it.  If the same
+   job was interrupted earlier, it continues where it stopped.  */
+AnalyzeDialog::job *AnalyzeDialog::create_job(const QString &file,
+                                              go_game_ptr    gr,
+                                              int            n_seconds,
+                                              int            n_visits,
+                                              int            n_lines,
+                                              engine_komi    k,
+                                              bool           comments,
+                                              bool           adaptive,
+                                              const QString &output)
+{
+    QString title = file;
+    m_all_jobs.emplace_front(this, title, gr, n_seconds, n_visits, n_lines, k, comments);
+    job *j      = &m_all_jobs.front();
+    j->m_output = output;
+    if (adaptive)
+        j->make_adaptive();
+    insert_job(m_jobs, jobView, j);
+
+    QJsonObject def {{"file", QFileInfo(file).absoluteFilePath()},
+                     {"seconds", n_seconds},
+                     {"visits", n_visits},
+                     {"lines", n_lines},
+                     {"komi", (int)k},
+                     {"comments", comments},
+                     {"adaptive", adaptive},
+                     {"output", output}};
+    journal_open(j, def);
+    if (j->m_display == &m_jobs)
+        share_positions(j);
+    return j;
+}
+
+QString AnalyzeDialog::journal_dir()
+{
+    QString data_dir = QStandardPaths::writableLocation(QStandardPaths::AppDataLocation);
+    if (data_dir.isEmpty())
+        return QString();
+    return data_dir + "/analysis_jobs";
+}
+
+static QByteArray file_hash(const QString &filename)
+{
+    QFile f(filename);
+    if (!f.open(QIODevice::ReadOnly))
+        return QByteArray();
+    QCryptographicHash h(QCryptographicHash::Sha1);
+    h.addData(&f);
+    return h.result().toHex();
+}
+
+/* Find the journal for J, which is named after its definition DEF.  If it
+   exists and was written for the same file contents, replay it; otherwise
+   start a new one.  */
+void AnalyzeDialog::journal_open(job *j, const QJsonObject &def)
+{
+    QString dir = journal_dir();
+    if (dir.isEmpty() || !QDir().mkpath(dir))
+        return;
+
+    QByteArray def_bytes = QJsonDocument(def).toJson(QJsonDocument::Compact);
+    QString    base      = QDir(dir).filePath(QCryptographicHash::hash(def_bytes, QCryptographicHash::Sha1).toHex().left(16));
+    QString    path      = base + ".journal";
+    /* The same file can be queued more than once.  */
+    for (int n = 2;; n++)
+    {
+        bool in_use = false;
+        for (auto &other : m_all_jobs)
+            in_use |= &other != j && other.m_journal == path;
+        if (!in_use)
+            break;
+        path = base + QString("-%1.journal").arg(n);
+    }
+    j->m_journal = path;
+
+    QByteArray source = file_hash(def["file"].toString());
+    QFile      f(path);
+    if (f.open(QIODevice::ReadOnly))
+    {
+        QJsonObject head = QJsonDocument::fromJson(f.readLine()).object();
+        if (head["def"].toObject() == def && head["source"].toString().toLatin1() == source)
+        {
+            journal_replay(j, f);
+            return;
+        }
+        f.close();
+    }
+    QJsonObject head {{"def", def}, {"source", QString::fromLatin1(source)}};
+    if (!f.open(QIODevice::WriteOnly | QIODevice::Truncate))
+    {
+        j->m_journal.clear();
+        return;
+    }
+    f.write(QJsonDocument(head).toJson(QJsonDocument::Compact) + "\n");
+}
+
+static QJsonArray eval_to_json(const eval &e)
+{
+    return QJsonArray {e.visits, e.wr_black, e.score_mean, e.score_stddev};
+}
+
+static eval eval_from_json(const QJsonArray &a, an_id_t id)
+{
+    eval e;
+    e.visits       = a[0].toInt();
+    e.wr_black     = a[1].toDouble();
+    e.score_mean   = a[2].toDouble();
+    e.score_stddev = a[3].toDouble();
+    e.id           = id;
+    return e;
+}
+
+/* Store the results recorded in the journal F of J as if they had just come
+   from the engine.  A line cut short by a crash is removed.  */
+void AnalyzeDialog::journal_replay(job *j, QFile &f)
+{
+    qint64 good_end = f.pos();
+    bool   torn     = false;
+    j->m_replaying  = true;
+    while (!f.atEnd() && j->m_display == &m_jobs)
+    {
+        QByteArray  line = f.readLine();
+        QJsonObject e    = QJsonDocument::fromJson(line).object();
+        if (e.isEmpty())
+        {
+            torn = true;
+            break;
+        }
+        good_end = f.pos();
+
+        int n = e["n"].toInt(-1);
+        if (n < 0 || (size_t)n >= j->m_positions.size())
+            continue;
+        game_state *st            = j->m_positions[n];
+        bool        flipped_queue = e["f"].toBool();
+
+        analyzer_id id;
+        id.engine = e["engine"].toString().toStdString();
+        if (e.contains("engine_komi"))
+        {
+            id.komi     = e["engine_komi"].toDouble();
+            id.komi_set = true;
+        }
+        an_id_t                  idx  = intern_analyzer_id(id);
+        eval                     root = eval_from_json(e["eval"].toArray(), idx);
+        std::vector<analysis_pv> pvs;
+        for (auto v : e["pvs"].toArray())
+        {
+            QJsonObject p = v.toObject();
+            analysis_pv pv;
+            pv.ev          = eval_from_json(p["eval"].toArray(), idx);
+            QJsonArray mvs = p["moves"].toArray();
+            for (int i = 0; i + 1 < mvs.size(); i += 2)
+                pv.moves.emplace_back(mvs[i].toInt(), mvs[i + 1].toInt());
+            pvs.push_back(std::move(pv));
+        }
+
+        std::vector<game_state *> &q = flipped_queue ? j->m_queue_flipped : j->m_queue;
+        auto                       p = std::find(q.begin(), q.end(), st);
+        if (p != q.end())
+            q.erase(p);
+        store_analysis(j, st, flipped_queue, root, pvs, e["have_score"].toBool());
+    }
+    j->m_replaying = false;
+    f.close();
+    if (torn && !j->m_journal.isEmpty())
+        f.resize(good_end);
+}
+
+/* Append a result to the journal of J.  The file is closed after each one,
+   so that little is lost if the machine goes down.  */
+void AnalyzeDialog::journal_result(
+    job *j, game_state *st, bool flipped_queue, const eval &root, const std::vector<analysis_pv> &pvs, bool have_score)
+{
+    if (j->m_replaying || j->m_journal.isEmpty())
+        return;
+    auto idx = j->m_position_idx.find(st);
+    if (idx == j->m_position_idx.end())
+        return;
+
+    const analyzer_id &id = root.analyzer();
+    QJsonObject        e {{"n", idx->second},
+                   {"eval", eval_to_json(root)},
+                   {"engine", QString::fromStdString(id.engine)},
+                   {"have_score", have_score}};
+    if (flipped_queue)
+        e["f"] = true;
+    if (id.komi_set)
+        e["engine_komi"] = id.komi;
+    QJsonArray pv_data;
+    for (auto &pv : pvs)
+    {
+        QJsonArray moves;
+        for (auto &m : pv.moves)
+        {
+            moves.append(m.first);
+            moves.append(m.second);
+        }
+        pv_data.append(QJsonObject {{"eval", eval_to_json(pv.ev)}, {"moves", moves}});
+    }
+    e["pvs"] = pv_data;
+
+    QFile f(j->m_journal);
+    if (f.open(QIODevice::WriteOnly | QIODevice::Append))
+        f.write(QJsonDocument(e).toJson(QJsonDocument::Compact) + "\n");
+}
+
+/* The job is gone, or its result has been saved.  */
+void AnalyzeDialog::journal_remove(job *j)
+{
+    if (j->m_journal.isEmpty())
+        return;
+    QFile::remove(j->m_journal);
+    j->m_journal.clear();
+}
+
+int AnalyzeDialog::restore_jobs()
+{
+    QString dir = journal_dir();
+    if (dir.isEmpty())
+        return 0;
+    int n = 0;
+    for (auto &name : QDir(dir).entryList({"*.journal"}, QDir::Files, QDir::Name))
+    {
+        QString path   = QDir(dir).filePath(name);
+        bool    in_use = false;
+        for (auto &other : m_all_jobs)
+            in_use |= other.m_journal == path;
+        if (in_use)
+            continue;
+
+        QFile f(path);
+        if (!f.open(QIODevice::ReadOnly))
+            continue;
+        QJsonObject def  = QJsonDocument::fromJson(f.readLine()).object()["def"].toObject();
+        QString     file = def["file"].toString();
+        f.close();
+        /* Jobs from the command line are resumed by running it again.  */
+        if (!def["output"].toString().isEmpty())
+            continue;
+        go_game_ptr gr = file.isEmpty() || !QFile::exists(file) ? nullptr : record_from_file(file, nullptr);
+        if (gr == nullptr)
+        {
+            /* Nothing left to resume.  */
+            QFile::remove(path);
+            continue;
+        }
+        const go_board &b = gr->get_root()->get_board();
+        if (b.size_x() != b.size_y())
+        {
+            QFile::remove(path);
+            continue;
+        }
+        /* Jobs for other board sizes wait until an engine for their size is
+           started.  */
+        if (n == 0 && pool_state() == analyzer::disconnected)
+            boardsizeSpinBox->setValue(b.size_x());
+        create_job(file,
+                   gr,
+                   def["seconds"].toInt(),
+                   def["visits"].toInt(),
+                   def["lines"].toInt(),
+                   (engine_komi)def["komi"].toInt(),
+                   def["comments"].toBool(),
+                   def["adaptive"].toBool(),
+                   def["output"].toString());
+        n++;
+    }
+    if (n > 0)
+    {
+        update_progress();
+        queue_next();
+    }
+    return n;
 }
 
 void AnalyzeDialog::start_job()
@@ -603,13 +1727,162 @@ void AnalyzeDialog::start_job()
     int komi_val = komiComboBox->currentIndex();
 
     engine_komi k = komi_val == 2 ? engine_komi::both : komi_val == 1 ? engine_komi::maybe_swap : engine_komi::dflt;
-    m_all_jobs.emplace_front(this, f, gr, secondsEdit->text().toInt(), maxlinesEdit->text().toInt(), k, commentsCheckBox->isChecked());
-    job *j = &m_all_jobs.front();
-    insert_job(m_jobs, jobView, j);
+    bool adaptive = adaptiveCheckBox->isChecked();
+    int  visits   = adaptive ? visitsEdit->text().toInt() : 0;
+    create_job(f, gr, secondsEdit->text().toInt(), visits, maxlinesEdit->text().toInt(), k, commentsCheckBox->isChecked(), adaptive, QString());
 
     update_progress();
-    if (analyzer_state() == analyzer::paused)
+    queue_next();
+}
+
+/* Print an engine problem.  Once no engine is left, there is no point in
+   going on.  The check is delayed since the failing engine may still be
+   shutting down.  */
+void AnalyzeDialog::headless_error(const QString &err)
+{
+    QTextStream(stderr) << err << "\n";
+    m_headless_failures++;
+    QMetaObject::invokeMethod(
+        this,
+        [this]() {
+            if (pool_state() == analyzer::disconnected)
+            {
+                QTextStream(stderr) << tr("No analysis engine left, giving up.") << "\n";
+                QCoreApplication::exit(1);
+            }
+        },
+        Qt::QueuedConnection);
+}
+
+void AnalyzeDialog::headless_save(job *j)
+{
+    QFileInfo fi(j->m_output);
+    QDir().mkpath(fi.absolutePath());
+    QFile      of(j->m_output);
+    QByteArray bytes = QByteArray::fromStdString(j->m_game->to_sgf());
+    if (!of.open(QIODevice::WriteOnly) || of.write(bytes) != bytes.length())
     {
-        queue_next();
+        QTextStream(stderr) << tr("Failed to save %1.").arg(j->m_output) << "\n";
+        m_headless_failures++;
+        return;
     }
+    of.close();
+    j->m_game->set_modified(false);
+    journal_remove(j);
+    QTextStream(stdout) << tr("%1: %2 positions analyzed, saved to %3").arg(j->m_title).arg(j->m_done).arg(j->m_output) << "\n";
+}
+
+void AnalyzeDialog::headless_check_done()
+{
+    if (!m_jobs.jobs.empty())
+        return;
+    stop_workers();
+    QCoreApplication::exit(m_headless_failures > 0 ? 1 : 0);
+}
+
+/* Analyze the SGF files in INPUTS, which may also name directories to be
+   searched for them, without showing any windows.  Returns false if there is
+   nothing to do; otherwise the application exits when all jobs are done.  */
+bool AnalyzeDialog::run_headless(const QStringList &inputs, const headless_options &opts)
+{
+    m_headless = true;
+    QTextStream err(stderr);
+
+    const Engine *engine = nullptr;
+    for (auto &e : g_setting->m_engines)
+        if (e.analysis && e.title == opts.engine)
+        {
+            engine = &e;
+            break;
+        }
+    if (engine == nullptr)
+    {
+        err << tr("No analysis engine named \"%1\" is configured.  Available engines:").arg(opts.engine) << "\n";
+        for (auto &e : g_setting->m_engines)
+            if (e.analysis)
+                err << "  " << e.title << " (" << e.boardsize << "x" << e.boardsize << ")\n";
+        return false;
+    }
+    int size = engine->boardsize.toInt();
+    boardsizeSpinBox->setValue(size);
+
+    /* Pairs of input and output file names.  Directories are searched
+       recursively, and their structure is kept below the output directory.  */
+    std::vector<std::pair<QString, QString>> files;
+    auto output_for = [&opts](const QString &in, const QString &rel) -> QString {
+        if (!opts.output.isEmpty())
+            return QDir(opts.output).filePath(rel);
+        QFileInfo fi(in);
+        return fi.dir().filePath(fi.completeBaseName() + "-analyzed.sgf");
+    };
+    for (auto &in : inputs)
+    {
+        QFileInfo fi(in);
+        if (fi.isDir())
+        {
+            QDir         base(in);
+            QStringList  found;
+            QDirIterator it(in, {"*.sgf", "*.SGF"}, QDir::Files, QDirIterator::Subdirectories);
+            while (it.hasNext())
+            {
+                QString f = it.next();
+                /* Our own output from an earlier run.  */
+                if (opts.output.isEmpty() && f.endsWith("-analyzed.sgf"))
+                    continue;
+                found << f;
+            }
+            found.sort();
+            for (auto &f : found)
+                files.emplace_back(f, output_for(f, base.relativeFilePath(f)));
+        }
+        else if (fi.exists())
+            files.emplace_back(in, output_for(in, fi.fileName()));
+        else
+        {
+            err << tr("File not found: %1").arg(in) << "\n";
+            m_headless_failures++;
+        }
+    }
+
+    int seconds = opts.seconds;
+    if (seconds <= 0 && opts.visits <= 0)
+        seconds = secondsEdit->text().toInt();
+    int lines  = opts.lines > 0 ? opts.lines : maxlinesEdit->text().toInt();
+    int n_jobs = 0;
+    for (auto &f : files)
+    {
+        go_game_ptr gr = record_from_file(f.first, nullptr);
+        if (gr == nullptr)
+        {
+            err << tr("Could not load %1.").arg(f.first) << "\n";
+            m_headless_failures++;
+            continue;
+        }
+        const go_board &b = gr->get_root()->get_board();
+        if (b.size_x() != size || b.size_y() != size)
+        {
+            err << tr("Skipping %1: the engine is configured for %2x%2.").arg(f.first).arg(size) << "\n";
+            continue;
+        }
+        /* This resumes the job if it was interrupted in an earlier run,
+           which may also finish it.  */
+        create_job(f.first, gr, seconds, opts.visits, lines, engine_komi::maybe_swap, true, opts.adaptive, f.second);
+        n_jobs++;
+    }
+    if (n_jobs == 0)
+    {
+        err << tr("Nothing to analyze.") << "\n";
+        return false;
+    }
+
+    kataProtocolCheckBox->setChecked(opts.kata);
+    engineCountSpinBox->setValue(opts.processes);
+    start_engine(*engine);
+
+    /* Jobs whose positions all have evaluations already.  */
+    std::vector<job *> jobs = m_jobs.jobs;
+    for (auto j : jobs)
+        check_job_done(j);
+    QMetaObject::invokeMethod(this, &AnalyzeDialog::headless_check_done, Qt::QueuedConnection);
+    return true;
 }
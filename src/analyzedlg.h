@@ -7,11 +7,17 @@
 
 #include <forward_list>
 #include <map>
+#include <memory>
+#include <unordered_map>
 #include <vector>
 
+#include <QFile>
+#include <QJsonObject>
+
 #include "defines.h"
 #include "goboard.h"
 #include "gogame.h"
+#include "kataanalysis.h"
 #include "qgtp.h"
 #include "setting.h"
 #include "ui_analyze_gui.h"
@@ -21,7 +27,7 @@ class MainWindow;
 class AnalyzeDialog
     : public QMainWindow
     , public Ui::AnalyzeDialog
-    , public GTP_Eval_Controller
+    , public Kata_Analysis_Controller
 {
     Q_OBJECT
 
@@ -62,35 +68,211 @@ class AnalyzeDialog
            around so we can delete it on close.  */
         QMetaObject::Connection m_connection;
         int                     m_n_seconds;
+        int                     m_n_visits;
         int                     m_n_lines;
         engine_komi             m_komi_type;
         bool                    m_comments;
+        /* Where to save the result when running headless.  */
+        QString m_output;
+        /* The file that records the job and its results as they come in, so
+           that it can be resumed after quitting or a crash.  Positions are
+           identified by their index in m_positions, which lists them in the
+           order of the tree walk, as initially queued.  */
+        QString                     m_journal;
+        std::vector<game_state *>   m_positions;
+        std::map<game_state *, int> m_position_idx;
+        bool                        m_replaying = false;
 
         std::vector<game_state *> m_queue;
         std::vector<game_state *> m_queue_flipped;
         size_t                    m_initial_size;
         size_t                    m_done = 0;
+        /* Positions handed to an engine which have not finished yet.  */
+        size_t m_in_flight = 0;
+        /* Positions left to another job which has them queued too.  */
+        size_t m_waiting = 0;
+        /* True once the queues have been sent to the KataGo analysis engine.
+           The positions stay queued until their results arrive.  */
+        bool m_submitted = false;
+
+        struct result
+        {
+            eval                     root;
+            std::vector<analysis_pv> pvs;
+            bool                     have_score;
+        };
+        /* The results for positions that get a comment.  Comments compare a
+           position with the next one in the game, so they are only written
+           once the job is finished and all evaluations are known.  A position
+           analyzed with both komi settings has two results.  */
+        std::map<game_state *, std::vector<result>> m_comment_data;
+
+        /* Adaptive analysis spends m_n_visits per position on average, but
+           not evenly: a quick pass over all positions comes first, and the
+           rest of the budget goes to the critical ones in a second pass.
+           Results of the quick pass are kept in m_quick until it is known
+           which positions get another look.  */
+        bool                           m_adaptive     = false;
+        bool                           m_refining     = false;
+        int                            m_quick_visits = 0;
+        int                            m_deep_visits  = 0;
+        std::map<game_state *, result> m_quick;
+
+        /* Transpositions of queued positions.  These are not analyzed
+           separately, they receive a copy of the evaluation instead.  */
+        std::map<game_state *, std::vector<game_state *>> m_transpositions;
 
         display *m_display;
         int      m_idx;
 
-        job(AnalyzeDialog *dlg, QString &title, go_game_ptr gr, int n_seconds, int n_lines, engine_komi, bool comments);
+        job(AnalyzeDialog *dlg, QString &title, go_game_ptr gr, int n_seconds, int n_visits, int n_lines, engine_komi, bool comments);
         ~job();
-        game_state *select_request(bool pop);
+        game_state *select_request(bool pop, bool &flipped_queue);
+        void        requeue(game_state *, bool flipped_queue);
         void        show_window(bool done);
+        void        make_adaptive();
+        int         visit_limit()
+        {
+            return !m_adaptive ? m_n_visits : m_refining ? m_deep_visits : m_quick_visits;
+        }
+        bool finished()
+        {
+            return m_queue.empty() && m_queue_flipped.empty() && m_in_flight == 0 && m_waiting == 0;
+        }
+    };
+
+    /* One engine process of the pool.  Each of them works on a position of its
+       own, taken from the shared job queue, and reports back to the dialog.  */
+    class worker : public GTP_Eval_Controller
+    {
+        friend class AnalyzeDialog;
+
+        AnalyzeDialog *m_dlg;
+        int            m_idx;
+
+        /* The position being analyzed, and the job it belongs to.  The job is
+           null if the engine is idle, or if the job was discarded.  */
+        job        *m_requester {};
+        game_state *m_request {};
+        bool        m_flipped_queue = false;
+        int         m_seconds_count = 0;
+        size_t      m_n_done        = 0;
+
+    public:
+        worker(AnalyzeDialog *dlg, int idx) : GTP_Eval_Controller(dlg), m_dlg(dlg), m_idx(idx) {}
+
+        /* Virtuals from Gtp_Controller.  */
+        virtual void eval_received(const QString &, int, bool) override;
+        virtual void analyzer_state_changed() override;
+        virtual void notice_analyzer_id(an_id_t, bool) override;
+        virtual void gtp_startup_success(GTP_Process *) override;
+        virtual void gtp_exited(GTP_Process *) override;
+        virtual void gtp_failure(GTP_Process *, const QString &) override;
+        virtual void analyzer_restarting(const QString &) override;
+        virtual void analyzer_restarted() override;
     };
+    std::vector<std::unique_ptr<worker>> m_workers;
+
+    /* Used instead of the workers if the engine speaks the KataGo analysis
+       protocol.  Each queue of a job is submitted as a batch, identified by a
+       tag.  */
+    std::unique_ptr<Kata_Analysis_Process> m_kata;
+    struct kata_batch
+    {
+        job *j;
+        bool flipped_queue;
+        bool flip;
+    };
+    std::map<int, kata_batch> m_kata_batches;
+    int                       m_kata_tag_count = 0;
+    size_t                    m_kata_n_done    = 0;
+    /* What the engine was started with, to start it again if it crashes.  */
+    std::unique_ptr<Engine> m_kata_engine;
+    engine_watchdog         m_kata_watchdog;
+    QTimer                  m_kata_restart;
+    /* Positions answered from the analysis cache.  */
+    size_t m_n_cached = 0;
+
+    /* Jobs made from games of the same event often share their opening
+       positions.  Each of those is analyzed only once, by the job that queued
+       it first, and the others wait for the result, which is then stored in
+       each of them.  Entries are keyed by the leading job's node, and found
+       through a hash of the position in m_shared_index.  */
+    struct shared_position
+    {
+        uint64_t                                    hash;
+        job                                        *leader;
+        bool                                        flipped_queue;
+        std::vector<std::pair<job *, game_state *>> waiters;
+    };
+    std::map<game_state *, shared_position>         m_shared;
+    std::unordered_multimap<uint64_t, game_state *> m_shared_index;
+    /* Positions analyzed once on behalf of several jobs.  */
+    size_t m_n_shared = 0;
 
-    job          *m_requester;
-    int           m_seconds_count;
     QIntValidator m_seconds_vald {1, 86400};
     QIntValidator m_lines_vald {1, 100};
+    QIntValidator m_visits_vald {1, 1000000};
 
     QString m_last_dir;
 
-    void queue_next();
+    /* Set when running from the command line without windows.  Errors are
+       printed instead of shown in message boxes, finished jobs are saved and
+       the application exits once all are done.  */
+    bool m_headless          = false;
+    int  m_headless_failures = 0;
+
+    void     queue_next();
+    bool     flip_for(job *);
+    bool     dispatch(worker *);
+    bool     use_cached(job *, game_state *, bool flipped_queue, an_id_t, bool flip);
+    void     position_done(worker *, bool have_score);
+    void     store_analysis(job *, game_state *, bool flipped_queue, const eval &, const std::vector<analysis_pv> &, bool have_score);
+    void     write_analysis(job *, game_state *, const eval &, const std::vector<analysis_pv> &, bool have_score);
+    void     refine_job(job *);
+    void     check_job_done(job *);
+    void     write_comments(job *);
+    void     kata_submit();
+    void     kata_submit_queue(job *, bool flipped_queue, bool flip);
+    void     kata_send(job *, bool flipped_queue, bool flip, const std::vector<game_state *> &);
+    job     *kata_take_position(int tag, game_state *, bool &flipped_queue, bool &flip);
+    void     kata_lost();
+    void     kata_restart();
+    void     engine_lost(worker *);
+    void     stop_workers();
+    analyzer pool_state();
+    void     update_engine_status();
+
+    bool share_match(job *, game_state *, bool flipped_queue, game_state *other);
+    void share_positions(job *);
+    void share_result(game_state *, const eval *, const std::vector<analysis_pv> &, bool have_score);
+    void drop_shared(game_state *);
+    bool unshare_job(job *);
+    void unindex_shared(uint64_t hash, game_state *);
+
+    job *create_job(const QString &file,
+                    go_game_ptr    gr,
+                    int            n_seconds,
+                    int            n_visits,
+                    int            n_lines,
+                    engine_komi    k,
+                    bool           comments,
+                    bool           adaptive,
+                    const QString &output);
+
+    static QString journal_dir();
+    void           journal_open(job *, const QJsonObject &def);
+    void           journal_replay(job *, QFile &);
+    void           journal_result(job *, game_state *, bool flipped_queue, const eval &, const std::vector<analysis_pv> &, bool have_score);
+    void           journal_remove(job *);
+
+    void headless_error(const QString &);
+    void headless_save(job *);
+    void headless_check_done();
 
     void select_file();
     void start_engine();
+    void start_engine(const Engine &);
     void start_job();
 
     /* Maintaining the job queue listviews and assorted data structures.  */
@@ -103,13 +285,16 @@ class AnalyzeDialog
     void open_in_progress_window(bool done);
     void discard_job(bool done);
 
-    /* Virtuals from Gtp_Controller.  */
-    virtual void eval_received(const QString &, int, bool) override;
-    virtual void analyzer_state_changed() override;
-    virtual void notice_analyzer_id(const analyzer_id &, bool) override;
-
     virtual void closeEvent(QCloseEvent *) override;
 
+    /* Virtuals from Kata_Analysis_Controller.  */
+    virtual void kata_result(Kata_Analysis_Process *, int, game_state *, const eval &, const std::vector<analysis_pv> &, bool) override;
+    virtual void kata_rejected(Kata_Analysis_Process *, int, game_state *) override;
+    virtual void kata_startup_success(Kata_Analysis_Process *) override;
+    virtual void kata_exited(Kata_Analysis_Process *) override;
+    virtual void kata_failure(Kata_Analysis_Process *, const QString &) override;
+    virtual bool kata_crashed(Kata_Analysis_Process *, const QString &) override;
+
 public:
     AnalyzeDialog(QWidget *parent, const QString &filename);
     ~AnalyzeDialog();
@@ -117,10 +302,22 @@ public:
     /* Used internally, and also called when the settings change.  */
     void update_engines();
 
-    /* Virtuals from Gtp_Controller.  */
-    virtual void gtp_startup_success(GTP_Process *) override;
-    virtual void gtp_exited(GTP_Process *) override;
-    virtual void gtp_failure(GTP_Process *, const QString &) override;
+    struct headless_options
+    {
+        QString engine;
+        int     seconds   = 0;
+        int     visits    = 0;
+        int     lines     = 0;
+        int     processes = 1;
+        bool    kata      = false;
+        bool    adaptive  = false;
+        /* Empty to save results next to the input files.  */
+        QString output;
+    };
+    bool run_headless(const QStringList &inputs, const headless_options &);
+    /* Queue the jobs that were left unfinished when the program last quit.
+       Returns the number of jobs.  */
+    int restore_jobs();
 };
 
 extern AnalyzeDialog *analyze_dialog;
@@ -252,6 +252,20 @@ public:
     /* Check for intersections, but shift other left (or right, if negative).  */
     bool intersect_p(const bit_array &other, int shift) const;
 
+    /* A hash of the contents, suitable for detecting equal bit sets quickly.
+       Equality must still be verified with operator==.  */
+    uint64_t hash() const
+    {
+        uint64_t h = m_n_bits;
+        for (int i = 0; i < m_n_elts; i++)
+        {
+            h ^= m_bits[i];
+            h *= 0x9e3779b97f4a7c15ull;
+            h ^= h >> 29;
+        }
+        return h;
+    }
+
     unsigned popcnt() const
     {
         unsigned cnt = 0;
@@ -16,9 +16,14 @@
 #include <QPainter>
 #include <QPixmap>
 #include <QResizeEvent>
+#include <QScreen>
+#include <QTextStream>
 #include <QWheelEvent>
+#include <QWindow>
 
 #include "board.h"
+#include "analysisprefetch.h"
+#include "analysisservice.h"
 #include "clientwin.h"
 #include "config.h"
 #include "imagehandler.h"
@@ -88,6 +93,9 @@ Board::Board(QWidget *parent) : BoardView(parent), GTP_Eval_Controller(parent)
     curX = curY = -1;
 
     navIntersectionStatus = false;
+
+    m_refresh_timer.setSingleShot(true);
+    connect(&m_refresh_timer, &QTimer::timeout, this, [this]() { flush_refresh(); });
 }
 
 Board::~Board()
@@ -1194,25 +1202,57 @@ bool Board::have_analysis()
     return false;
 }
 
-game_state *Board::analysis_at(int x, int y, int &num, double &primary)
+/* Find the analysis variation starting at X/Y, either from the live engine or
+   stored in the game.  Returns false if there is none; otherwise its evaluation
+   is stored in EV and its rank in NUM.  PRIMARY receives the winrate of the top
+   choice.  Looking at a live variation's moves requires creating nodes for it,
+   so that is only done if NODE is nonnull.  */
+bool Board::analysis_at(int x, int y, int &num, double &primary, eval &ev, game_state **node)
 {
-    game_state *eval_root = m_eval_state != nullptr ? m_eval_state : m_displayed;
-    auto       &c         = eval_root->children();
-    num                   = 0;
-    primary               = 0;
+    num     = 0;
+    primary = 0;
+    if (m_eval_state != nullptr)
+    {
+        size_t n = n_live_pvs();
+        for (size_t i = 0; i < n; i++)
+        {
+            const live_pv &pv = live_pv_at(i);
+            if (pv.ev.visits == 0 || pv.moves.empty())
+                continue;
+            if (num == 0)
+                primary = pv.ev.wr_black;
+            if (pv.moves[0].first == x && pv.moves[0].second == y)
+            {
+                ev = pv.ev;
+                if (node == nullptr)
+                    return true;
+                *node = live_pv_node(i);
+                return *node != nullptr;
+            }
+            num++;
+        }
+        return false;
+    }
+
+    auto &c = m_displayed->children();
     for (auto it : c)
     {
-        eval ev = m_eval_state != nullptr ? it->best_eval() : it->eval_from(m_an_id, true);
-        if (it->has_figure() && ev.visits > 0 && it->was_move_p())
+        eval it_ev = it->eval_from(m_an_id, true);
+        if (it->has_figure() && it_ev.visits > 0 && it->was_move_p())
         {
             if (num == 0)
-                primary = ev.wr_black;
+                primary = it_ev.wr_black;
             if (it->get_move_x() == x && it->get_move_y() == y)
-                return it;
+            {
+                ev = it->best_eval();
+                if (node != nullptr)
+                    *node = it;
+                return true;
+            }
             num++;
         }
     }
-    return nullptr;
+    return false;
 }
 
 /* Examine the current cursor position, and extract a PV line into board B if
@@ -1223,8 +1263,9 @@ int Board::extract_analysis(go_board &b)
 
     int         idx;
     double      primary;
-    game_state *pv = analysis_at(curX, curY, idx, primary);
-    if (pv == nullptr)
+    eval        ev;
+    game_state *pv = nullptr;
+    if (!analysis_at(curX, curY, idx, primary, ev, &pv))
     {
         m_board_win->set_2nd_eval(nullptr, 0, none, 0);
         return 0;
@@ -1234,7 +1275,6 @@ int Board::extract_analysis(go_board &b)
         int         x       = pv->get_move_x();
         int         y       = pv->get_move_y();
         stone_color to_move = m_displayed->to_move();
-        eval        ev      = pv->best_eval();
         double      wr      = ev.wr_black;
         int         visits  = ev.visits;
         if (to_move == white)
@@ -1265,10 +1305,10 @@ Board::ram_result Board::render_analysis_marks(
     int  winrate_for      = g_setting->values.analysis_winrate;
     bool hideother        = g_setting->values.analysis_hideother;
 
-    int         pv_idx;
-    double      primary;
-    game_state *pv = analysis_at(x, y, pv_idx, primary);
-    if (pv == nullptr || v > 0 || (max_number > 0 && hideother))
+    int    pv_idx;
+    double primary;
+    eval   ev;
+    if (!analysis_at(x, y, pv_idx, primary, ev) || v > 0 || (max_number > 0 && hideother))
     {
         if (child_mark)
         {
@@ -1281,7 +1321,6 @@ Board::ram_result Board::render_analysis_marks(
     stone_color wr_swap_col = winrate_for == 0 ? white : winrate_for == 1 ? black : none;
 
     stone_color to_move = m_displayed->to_move();
-    eval        ev      = pv->best_eval();
     double      wr      = ev.wr_black;
     double      wrdiff  = wr - primary;
     if (to_move == white)
@@ -1562,7 +1601,7 @@ void Board::observed_changed()
     BoardView::set_displayed(m_state);
 }
 
-void Board::set_analyzer_id(analyzer_id id)
+void Board::set_analyzer_id(an_id_t id)
 {
     bool changed = m_an_id != id;
     m_an_id      = id;
@@ -1994,7 +2033,8 @@ void Board::mousePressEvent(QMouseEvent *e)
     }
     if (m_eval_state != nullptr && ((e->modifiers() == Qt::ShiftModifier && e->button() == Qt::LeftButton) || e->button() == Qt::MiddleButton))
     {
-        game_state *evchild = m_eval_state->find_child_move(x, y);
+        int         pv_idx  = find_live_pv(x, y);
+        game_state *evchild = pv_idx < 0 ? nullptr : live_pv_node(pv_idx);
         if (evchild != nullptr)
         {
             eval        ev      = evchild->best_eval();
@@ -2396,6 +2436,10 @@ void Board::navIntersection()
 void Board::setup_analyzer_position()
 {
     request_analysis(m_game, m_displayed);
+    if (m_prefetch != nullptr)
+        m_prefetch->set_position(m_game, m_displayed);
+    else if (service() != nullptr)
+        service()->set_position(this, m_game, m_displayed);
 }
 
 void Board::gtp_startup_success(GTP_Process *)
@@ -2404,27 +2448,117 @@ void Board::gtp_startup_success(GTP_Process *)
     setup_analyzer_position();
 }
 
-void Board::gtp_failure(GTP_Process *, const QString &err)
+void Board::analyzer_restarting(const QString &)
+{
+    m_board_win->update_analysis(analyzer::starting);
+}
+
+/* Continue with whatever we show now, which may have changed while the
+   engine was restarting.  */
+void Board::analyzer_restarted()
+{
+    m_board_win->update_analysis(analyzer_state());
+    if (!m_pause_eval)
+        setup_analyzer_position();
+}
+
+void Board::analyzer_lost()
 {
     clear_eval_data();
+    m_prefetch.reset();
     m_board_win->update_analysis(analyzer::disconnected);
+}
+
+void Board::gtp_failure(GTP_Process *, const QString &err)
+{
+    analyzer_lost();
+    if (g_headless)
+    {
+        QTextStream(stderr) << err << "\n";
+        return;
+    }
     QMessageBox msg(QString(QObject::tr("Error")), err, QMessageBox::Warning, QMessageBox::Ok | QMessageBox::Default, Qt::NoButton, Qt::NoButton);
     msg.exec();
 }
 
 void Board::gtp_exited(GTP_Process *)
 {
-    clear_eval_data();
-    m_board_win->update_analysis(analyzer::disconnected);
-    QMessageBox::warning(this, PACKAGE, QObject::tr("GTP process exited unexpectedly."));
+    analyzer_lost();
+    if (g_headless)
+        QTextStream(stderr) << QObject::tr("GTP process exited unexpectedly.") << "\n";
+    else
+        QMessageBox::warning(this, PACKAGE, QObject::tr("GTP process exited unexpectedly."));
+}
+
+/* Milliseconds between repaints for live analysis.  */
+int Board::refresh_interval()
+{
+    int rate = g_setting->readIntEntry("ANALYSIS_REFRESH");
+    if (rate <= 0)
+    {
+        QWindow *win    = window()->windowHandle();
+        QScreen *screen = win != nullptr ? win->screen() : QGuiApplication::primaryScreen();
+        rate            = screen != nullptr ? screen->refreshRate() : 60;
+    }
+    return std::max(1, 1000 / std::max(rate, 1));
 }
 
 void Board::eval_received(const QString &move, int visits, bool have_score)
 {
-    m_board_win->update_analyzer_ids(m_id, have_score);
+    /* Storing the evaluation is cheap, and the data should be current in case
+       anything looks at it before the next repaint.  */
     m_displayed->update_eval(*m_eval_state);
-    m_board_win->set_eval(move, m_primary_eval, m_displayed->to_move(), visits);
-    sync_appearance();
+    if (n_live_pvs() > 0)
+    {
+        const live_pv &best = live_pv_at(0);
+        if (m_prefetch != nullptr)
+            m_prefetch->main_progress(best.ev.visits, best.moves[0].first, best.moves[0].second);
+        else if (service() != nullptr)
+            service()->main_progress(this, best.ev.visits, best.moves[0].first, best.moves[0].second);
+    }
+
+    if (m_refresh_stats.received++ == 0 && m_analysis_started.isValid())
+        m_refresh_stats.first_update = m_analysis_started.elapsed();
+    if (m_refresh_dirty != 0)
+        m_refresh_stats.coalesced++;
+    m_pending_eval.position     = m_displayed;
+    m_pending_eval.move         = move;
+    m_pending_eval.primary_eval = m_primary_eval;
+    m_pending_eval.visits       = visits;
+    m_pending_eval.have_score   = have_score;
+    m_refresh_dirty             = refresh_board | refresh_evalbar | refresh_graph;
+
+    if (m_refresh_timer.isActive())
+        return;
+    int interval = refresh_interval();
+    if (!m_last_refresh.isValid() || m_last_refresh.elapsed() >= interval)
+        flush_refresh();
+    else
+        m_refresh_timer.start(interval - m_last_refresh.elapsed());
+}
+
+void Board::flush_refresh()
+{
+    int dirty       = m_refresh_dirty;
+    m_refresh_dirty = 0;
+    if (dirty == 0)
+        return;
+    /* Navigating or pausing has already redrawn everything, and the update
+       belongs to a position we no longer show.  */
+    if (m_pending_eval.position != m_displayed || m_eval_state == nullptr || m_pause_eval)
+    {
+        m_refresh_stats.dropped++;
+        return;
+    }
+    m_last_refresh.start();
+    m_refresh_stats.flushes++;
+
+    if (dirty & refresh_graph)
+        m_board_win->update_analyzer_ids(m_id_idx, m_pending_eval.have_score);
+    if (dirty & refresh_evalbar)
+        m_board_win->set_eval(m_pending_eval.move, m_pending_eval.primary_eval, m_displayed->to_move(), m_pending_eval.visits);
+    if (dirty & refresh_board)
+        sync_appearance();
 }
 
 void Board::start_analysis(const Engine &e)
@@ -2435,13 +2569,33 @@ void Board::start_analysis(const Engine &e)
         return;
     }
 
-    start_analyzer(e, m_dims.width(), 7.5);
+    m_refresh_stats = analysis_refresh_stats();
+    m_analysis_started.start();
+    if (g_setting->readBoolEntry("ANALYSIS_SHARED"))
+        start_shared_analyzer(e, m_dims.width(), 7.5, this);
+    else
+        start_analyzer(e, m_dims.width(), 7.5);
     m_board_win->update_analysis(analyzer::starting);
+
+    /* Boards sharing an engine also share the prefetcher.  */
+    int n_ahead = g_setting->readIntEntry("ANALYSIS_PREFETCH");
+    m_prefetch.reset();
+    if (n_ahead > 0 && analysis_prefetcher::available())
+    {
+        if (service() != nullptr)
+            service()->start_prefetch(n_ahead);
+        else
+        {
+            m_prefetch.reset(new analysis_prefetcher(this, n_ahead));
+            m_prefetch->start(e, m_dims.width());
+        }
+    }
 }
 
 void Board::stop_analysis()
 {
     stop_analyzer();
+    m_prefetch.reset();
     m_board_win->update_analysis(analyzer::disconnected);
 }
 
@@ -2449,6 +2603,10 @@ void Board::pause_analysis(bool on)
 {
     if (pause_analyzer(on, m_game, m_displayed))
         m_board_win->update_analysis(analyzer_state());
+    if (m_prefetch != nullptr)
+        m_prefetch->set_paused(on);
+    else if (service() != nullptr)
+        service()->set_paused(this, on);
 }
 
 FigureView::FigureView(QWidget *parent) : BoardView(parent)
@@ -6,15 +6,18 @@
 #define BOARD_H
 
 #include <map>
+#include <memory>
 #include <vector>
 
 #include <QDateTime>
+#include <QElapsedTimer>
 #include <QEvent>
 #include <QGraphicsPixmapItem>
 #include <QGraphicsView>
 #include <QMouseEvent>
 #include <QPainter>
 #include <QResizeEvent>
+#include <QTimer>
 #include <QWheelEvent>
 
 #include "defines.h"
@@ -33,6 +36,20 @@ class svg_builder;
 class QFontInfo;
 struct Engine;
 
+/* Counters for the coalescing of live analysis updates, see Board::eval_received.  */
+struct analysis_refresh_stats
+{
+    unsigned long received = 0;
+    /* Updates that were replaced by a newer one before they were shown.  */
+    unsigned long coalesced = 0;
+    /* Updates that were thrown away because the user moved to a different
+       position or paused the analysis before they were shown.  */
+    unsigned long dropped = 0;
+    unsigned long flushes = 0;
+    /* Milliseconds from starting the analysis to the first update, or -1.  */
+    qint64 first_update = -1;
+};
+
 /* We split the Board view into two classes: a BoardView, dealing only with
    display, and Board, which also interacts with the board window. The split is
    not 100% clean, as BoardView contains a few members that are modified only by
@@ -226,6 +243,8 @@ protected:
 #endif
 };
 
+class analysis_prefetcher;
+
 class Board
     : public BoardView
     , public navigable_observer
@@ -257,7 +276,37 @@ class Board
 
     /* Given to us by the main window, indicates the analyzer selected in the eval
        graph list view.  */
-    analyzer_id m_an_id;
+    an_id_t m_an_id {};
+
+    /* The engine can send updates much faster than it is useful to repaint.
+       eval_received only records the latest one and marks what needs to be
+       redrawn; flush_refresh does the work, at most once per display frame or
+       at the rate set in the preferences.  */
+    enum refresh_flags
+    {
+        refresh_board   = 1,
+        refresh_evalbar = 2,
+        refresh_graph   = 4
+    };
+    int           m_refresh_dirty = 0;
+    QTimer        m_refresh_timer;
+    QElapsedTimer m_last_refresh;
+    QElapsedTimer m_analysis_started;
+    struct
+    {
+        game_state *position;
+        QString     move;
+        double      primary_eval;
+        int         visits;
+        bool        have_score;
+    } m_pending_eval {};
+    analysis_refresh_stats m_refresh_stats;
+
+    /* Works ahead of the user with a second engine, if enabled.  */
+    std::unique_ptr<analysis_prefetcher> m_prefetch;
+
+    int  refresh_interval();
+    void flush_refresh();
 
     bool show_cursor_p();
     void update_shift(int x, int y);
@@ -272,7 +321,7 @@ public:
     virtual void reset_game(go_game_ptr) override;
     virtual void set_displayed(game_state *) override;
 
-    void set_analyzer_id(analyzer_id id);
+    void set_analyzer_id(an_id_t id);
     void setModified(bool m = true);
     void external_move(game_state *st)
     {
@@ -300,6 +349,10 @@ public:
     void start_analysis(const Engine &);
     void stop_analysis();
     void pause_analysis(bool);
+    const analysis_refresh_stats &refresh_stats() const
+    {
+        return m_refresh_stats;
+    }
 
     bool player_to_move_p()
     {
@@ -329,6 +382,9 @@ public:
     virtual void gtp_startup_success(GTP_Process *) override;
     virtual void gtp_exited(GTP_Process *) override;
     virtual void gtp_failure(GTP_Process *, const QString &) override;
+    virtual void analyzer_restarting(const QString &) override;
+    virtual void analyzer_restarted() override;
+    virtual void analyzer_lost() override;
     void set_local_stone_sound(bool b)
     {
         local_stone_sound = b;
@@ -341,7 +397,7 @@ protected:
     virtual void leaveEvent(QEvent *) override;
 
     virtual bool        have_analysis() override;
-    game_state         *analysis_at(int x, int y, int &, double &);
+    bool                analysis_at(int x, int y, int &, double &, eval &, game_state ** = nullptr);
     virtual stone_color cursor_color(int x, int y, stone_color to_move) override;
     virtual ram_result  render_analysis_marks(
          svg_builder &, double svg_factor, double cx, double cy, const QFontInfo &, int x, int y, bool child_mark, int v, int max_number) override;
@@ -0,0 +1,491 @@
+#include <algorithm>
+#include <cmath>
+
+#include <QCoreApplication>
+#include <QDir>
+#include <QFile>
+#include <QTextStream>
+
+#include "enginematch.h"
+
+/* One game at a time, played between the two engine processes the slot owns.
+   The processes are kept for the next game unless it is for a different
+   pair of engines.  */
+class engine_match::game_slot : public GTP_Controller
+{
+    engine_match *m_match;
+    int           m_pair = -1;
+    GTP_Process  *m_first {};
+    GTP_Process  *m_second {};
+    assignment    m_game {};
+    bool          m_game_started = false;
+
+    go_game_ptr m_record;
+    game_state *m_pos {};
+    int         m_n_moves     = 0;
+    int         m_starting_up = 0;
+    int         m_setting_up  = 0;
+
+    /* The results reported by the two engines' final_score.  */
+    stone_color m_winner_1, m_winner_2;
+    QString     m_score_1, m_score_2;
+
+    GTP_Process *engine_for(stone_color col)
+    {
+        return (col == black) == m_game.first_black ? m_first : m_second;
+    }
+    GTP_Process *other(GTP_Process *p)
+    {
+        return p == m_first ? m_second : m_first;
+    }
+    bool ours(GTP_Process *p)
+    {
+        return p != nullptr && (p == m_first || p == m_second);
+    }
+
+    void start_engines(int pair);
+    void stop_engines(bool now);
+    void start_game();
+    void request_next_move();
+    void move_done(stone_color col);
+    void enter_scoring();
+    void end_game(const QString &result, stone_color winner, bool disagreement);
+    void fail(const QString &err);
+
+public:
+    game_slot(engine_match *m) : GTP_Controller(nullptr), m_match(m) {}
+    ~game_slot()
+    {
+        stop_engines(true);
+    }
+    bool idle()
+    {
+        return m_first == nullptr;
+    }
+    void next_game();
+
+    /* Virtuals from Gtp_Controller.  */
+    virtual void gtp_played_move(GTP_Process *p, int x, int y) override;
+    virtual void gtp_played_resign(GTP_Process *p) override;
+    virtual void gtp_played_pass(GTP_Process *p) override;
+    virtual void gtp_startup_success(GTP_Process *p) override;
+    virtual void gtp_setup_success(GTP_Process *p) override;
+    virtual void gtp_exited(GTP_Process *p) override;
+    virtual void gtp_failure(GTP_Process *p, const QString &) override;
+    virtual void gtp_report_score(GTP_Process *p, const QString &) override;
+};
+
+void engine_match::game_slot::start_engines(int pair)
+{
+    stop_engines(false);
+    m_pair = pair;
+
+    auto  &engines = m_match->m_opts.pairs[pair];
+    int    size    = m_match->m_book->boardsize();
+    double komi    = QString::fromStdString(m_match->m_book->komi()).toDouble();
+    m_starting_up  = 2;
+    m_first        = create_gtp(engines.first, size, komi, false);
+    m_second       = create_gtp(engines.second, size, komi, false);
+}
+
+/* Called from the engines' callbacks, which is why the processes are normally
+   not deleted right away.  */
+void engine_match::game_slot::stop_engines(bool now)
+{
+    for (auto p : {m_first, m_second})
+    {
+        if (p == nullptr)
+            continue;
+        p->quit();
+        if (now)
+            delete p;
+        else
+            p->deleteLater();
+    }
+    m_first = m_second = nullptr;
+}
+
+void engine_match::game_slot::next_game()
+{
+    m_game_started = false;
+    assignment a;
+    if (!m_match->next_assignment(m_pair, a))
+    {
+        stop_engines(false);
+        m_pair = -1;
+        m_match->slot_idle();
+        return;
+    }
+    m_game = a;
+    if (m_first == nullptr || a.pair != m_pair)
+        start_engines(a.pair);
+    else
+        start_game();
+}
+
+/* Copy the line leading to the opening into a new game record, and set up
+   both engines with it.  */
+void engine_match::game_slot::start_game()
+{
+    m_game_started = true;
+
+    std::vector<game_state *> path;
+    for (game_state *st = m_match->m_openings[m_game.opening]; st != nullptr; st = st->prev_move())
+        path.push_back(st);
+
+    auto       &engines = m_match->m_opts.pairs[m_pair];
+    game_info   info    = *m_match->m_book;
+    const auto &b_name  = m_game.first_black ? engines.first.title : engines.second.title;
+    const auto &w_name  = m_game.first_black ? engines.second.title : engines.first.title;
+    info.set_name_black(b_name.toStdString());
+    info.set_name_white(w_name.toStdString());
+    info.set_round(std::to_string(m_game.game));
+    info.set_result("");
+
+    game_state *root = path.back();
+    m_record         = std::make_shared<game_record>(go_board(root->get_board(), mark::none), root->to_move(), info);
+    game_state *st   = m_record->get_root();
+    for (auto it = path.rbegin() + 1; it != path.rend(); ++it)
+    {
+        game_state     *src = *it;
+        const go_board &b   = src->get_board();
+        if (src->was_move_p())
+            st = st->add_child_move(go_board(b, mark::none), src->get_move_color(), src->get_move_x(), src->get_move_y());
+        else if (src->was_pass_p())
+            st = st->add_child_pass(go_board(b, mark::none));
+        else
+            st = st->add_child_edit(go_board(b, mark::none), src->to_move());
+    }
+    m_pos        = st;
+    m_n_moves    = 0;
+    m_setting_up = 2;
+    m_first->setup_initial_position(m_pos);
+    m_second->setup_initial_position(m_pos);
+}
+
+void engine_match::game_slot::request_next_move()
+{
+    stone_color col = m_pos->to_move();
+    engine_for(col)->request_move(col);
+}
+
+void engine_match::game_slot::gtp_startup_success(GTP_Process *p)
+{
+    if (!ours(p) || --m_starting_up > 0)
+        return;
+    start_game();
+}
+
+void engine_match::game_slot::gtp_setup_success(GTP_Process *p)
+{
+    if (!ours(p) || --m_setting_up > 0)
+        return;
+    request_next_move();
+}
+
+void engine_match::game_slot::move_done(stone_color col)
+{
+    int max = m_match->m_opts.max_moves;
+    if (max > 0 && ++m_n_moves >= max)
+    {
+        enter_scoring();
+        return;
+    }
+    stone_color next = col == black ? white : black;
+    engine_for(next)->request_move(next);
+}
+
+void engine_match::game_slot::gtp_played_move(GTP_Process *p, int x, int y)
+{
+    if (!ours(p))
+        return;
+    stone_color col    = m_pos->to_move();
+    game_state *st_new = m_pos->add_child_move(x, y);
+    if (st_new == nullptr)
+    {
+        /* An illegal move forfeits the game.  */
+        m_pos->set_comment(QObject::tr("Invalid move by %1.").arg(col == black ? "Black" : "White").toStdString());
+        end_game(col == black ? "W+F" : "B+F", col == black ? white : black, false);
+        return;
+    }
+    m_pos = st_new;
+    other(p)->played_move(col, x, y);
+    move_done(col);
+}
+
+void engine_match::game_slot::gtp_played_pass(GTP_Process *p)
+{
+    if (!ours(p))
+        return;
+    game_state *st  = m_pos;
+    stone_color col = st->to_move();
+    m_pos           = st->add_child_pass();
+    other(p)->played_move_pass(col);
+    if (st->was_pass_p())
+        enter_scoring();
+    else
+        move_done(col);
+}
+
+void engine_match::game_slot::gtp_played_resign(GTP_Process *p)
+{
+    if (!ours(p))
+        return;
+    stone_color col = engine_for(black) == p ? black : white;
+    end_game(col == black ? "W+R" : "B+R", col == black ? white : black, false);
+}
+
+void engine_match::game_slot::enter_scoring()
+{
+    m_winner_1 = m_winner_2 = unknown;
+    m_score_1.clear();
+    m_score_2.clear();
+    m_first->request_score();
+}
+
+static stone_color score_winner(const QString &s)
+{
+    if (s.isEmpty())
+        return unknown;
+    return s[0] == 'B' ? black : s[0] == 'W' ? white : s[0] == '0' ? none : unknown;
+}
+
+/* Both engines are asked for the score.  If they disagree about the winner,
+   the game has no result.  */
+void engine_match::game_slot::gtp_report_score(GTP_Process *p, const QString &s)
+{
+    if (!ours(p))
+        return;
+    if (p == m_first)
+    {
+        m_score_1  = s;
+        m_winner_1 = score_winner(s);
+        m_second->request_score();
+        return;
+    }
+    m_score_2  = s;
+    m_winner_2 = score_winner(s);
+
+    auto &engines = m_match->m_opts.pairs[m_pair];
+    if (m_winner_1 != unknown && m_winner_2 != unknown && m_winner_1 != m_winner_2)
+    {
+        QString report = QObject::tr("Reported score by %1: %2\nReported score by %3: %4\n")
+                             .arg(engines.first.title)
+                             .arg(m_score_1)
+                             .arg(engines.second.title)
+                             .arg(m_score_2);
+        m_pos->set_comment(report.toStdString());
+        end_game("?", unknown, true);
+        return;
+    }
+    if (m_winner_1 != unknown)
+        end_game(m_winner_1 == none ? "0" : m_score_1, m_winner_1, false);
+    else
+        end_game(m_winner_2 == none ? "0" : m_winner_2 == unknown ? "?" : m_score_2, m_winner_2, false);
+}
+
+void engine_match::game_slot::end_game(const QString &result, stone_color winner, bool disagreement)
+{
+    m_record->set_result(result.toStdString());
+    m_match->game_finished(m_game, m_record, winner, disagreement);
+    m_record = nullptr;
+    next_game();
+}
+
+/* An engine failed.  The game is lost, but the slot goes on with fresh
+   processes unless they never got as far as starting a game.  */
+void engine_match::game_slot::fail(const QString &err)
+{
+    bool started = m_game_started;
+    m_match->game_failed(m_game, err);
+    m_record = nullptr;
+    stop_engines(false);
+    m_pair = -1;
+    if (started)
+        next_game();
+    else
+        m_match->slot_idle();
+}
+
+void engine_match::game_slot::gtp_failure(GTP_Process *p, const QString &err)
+{
+    if (ours(p))
+        fail(err);
+}
+
+void engine_match::game_slot::gtp_exited(GTP_Process *p)
+{
+    if (ours(p))
+        fail(QObject::tr("GTP process exited unexpectedly."));
+}
+
+engine_match::engine_match(go_game_ptr book, const options &opts) : m_opts(opts), m_book(book)
+{
+    m_book->get_root()->walk_leaves([this](game_state *st) -> bool {
+        m_openings.push_back(st);
+        return true;
+    });
+
+    /* Each opening is played twice in a row, with colors swapped, so that
+       neither engine profits from getting the better side more often.  */
+    size_t n_pairs = m_opts.pairs.size();
+    m_pending.resize(n_pairs);
+    m_stats.resize(n_pairs);
+    for (int g = 0; g < m_opts.games; g++)
+        for (size_t p = 0; p < n_pairs; p++)
+            m_pending[p].push_back({++m_n_games, (int)p, (int)((g / 2) % m_openings.size()), g % 2 == 0});
+}
+
+engine_match::~engine_match()
+{
+}
+
+/* Hand out the next game, preferably one for PREFERRED_PAIR so that the
+   engines can be reused.  Otherwise, pick the pair with the most games left.  */
+bool engine_match::next_assignment(int preferred_pair, assignment &a)
+{
+    int pair = -1;
+    if (preferred_pair >= 0 && !m_pending[preferred_pair].empty())
+        pair = preferred_pair;
+    else
+        for (size_t p = 0; p < m_pending.size(); p++)
+            if (!m_pending[p].empty() && (pair == -1 || m_pending[p].size() > m_pending[pair].size()))
+                pair = p;
+    if (pair == -1)
+        return false;
+    a = m_pending[pair].front();
+    m_pending[pair].pop_front();
+    return true;
+}
+
+void engine_match::game_finished(const assignment &a, go_game_ptr gr, stone_color winner, bool disagreement)
+{
+    pair_stats &s           = m_stats[a.pair];
+    stone_color first_color = a.first_black ? black : white;
+    if (disagreement)
+    {
+        s.disagreements++;
+        s.no_result++;
+    }
+    else if (winner == none)
+        s.jigo++;
+    else if (winner == unknown)
+        s.no_result++;
+    else
+    {
+        if (winner == first_color)
+            s.wins_first++;
+        else
+            s.wins_second++;
+        if (winner == black)
+            s.black_wins++;
+        else
+            s.white_wins++;
+    }
+
+    QString filename = QDir(m_opts.output).filePath(QString("game-%1.sgf").arg(a.game, 4, 10, QChar('0')));
+    QFile   of(filename);
+    QByteArray bytes = QByteArray::fromStdString(gr->to_sgf());
+    if (!of.open(QIODevice::WriteOnly) || of.write(bytes) != bytes.length())
+    {
+        QTextStream(stderr) << QObject::tr("Failed to save %1.").arg(filename) << "\n";
+        m_failures++;
+    }
+    QTextStream(stdout) << QObject::tr("Game %1: %2 (B) vs. %3 (W): %4")
+                               .arg(a.game)
+                               .arg(QString::fromStdString(gr->name_black()))
+                               .arg(QString::fromStdString(gr->name_white()))
+                               .arg(QString::fromStdString(gr->result()))
+                        << "\n";
+}
+
+void engine_match::game_failed(const assignment &a, const QString &err)
+{
+    m_stats[a.pair].no_result++;
+    m_failures++;
+    QTextStream(stderr) << QObject::tr("Game %1: %2").arg(a.game).arg(err) << "\n";
+}
+
+/* Called when a slot has run out of games.  The last one to do so ends the
+   match; the exit is delayed so that the slot's engines can be cleaned up.  */
+void engine_match::slot_idle()
+{
+    for (auto &s : m_slots)
+        if (!s->idle())
+            return;
+    QMetaObject::invokeMethod(
+        QCoreApplication::instance(),
+        [this]() {
+            print_summary();
+            QCoreApplication::exit(m_failures > 0 ? 1 : 0);
+        },
+        Qt::QueuedConnection);
+}
+
+void engine_match::print_summary()
+{
+    QTextStream out(stdout);
+    for (size_t p = 0; p < m_stats.size(); p++)
+    {
+        const pair_stats &s      = m_stats[p];
+        const QString    &first  = m_opts.pairs[p].first.title;
+        const QString    &second = m_opts.pairs[p].second.title;
+        int               n      = s.wins_first + s.wins_second + s.jigo;
+        out << "\n" << QObject::tr("%1 vs. %2: %3 games with a result").arg(first).arg(second).arg(n) << "\n";
+        out << "  " << QObject::tr("Wins for %1/%2: %3/%4").arg(first).arg(second).arg(s.wins_first).arg(s.wins_second);
+        if (s.jigo > 0)
+            out << QObject::tr(" Jigo: %1").arg(s.jigo);
+        if (s.no_result > 0)
+            out << QObject::tr(" No result: %1").arg(s.no_result);
+        if (s.disagreements > 0)
+            out << QObject::tr(" Disagreements: %1").arg(s.disagreements);
+        out << "\n";
+        out << "  " << QObject::tr("Wins for Black/White: %1/%2").arg(s.black_wins).arg(s.white_wins) << "\n";
+        if (n == 0)
+            continue;
+
+        /* The Elo difference that predicts the observed score, with a 95%
+           confidence interval from the normal approximation.  */
+        double score = (s.wins_first + s.jigo / 2.) / n;
+        if (score <= 0 || score >= 1)
+        {
+            out << "  " << QObject::tr("Elo difference for %1: %2").arg(first).arg(score <= 0 ? "-inf" : "+inf") << "\n";
+            continue;
+        }
+        double elo    = -400 * std::log10(1 / score - 1);
+        double se     = std::sqrt(score * (1 - score) / n);
+        double margin = 1.96 * se * 400 / (std::log(10.) * score * (1 - score));
+        out << "  "
+            << QObject::tr("Elo difference for %1: %2 +/- %3").arg(first).arg(elo, 0, 'f', 1).arg(margin, 0, 'f', 1)
+            << "\n";
+    }
+}
+
+bool engine_match::start()
+{
+    QTextStream err(stderr);
+    if (m_opts.pairs.empty())
+    {
+        err << QObject::tr("No engines to play the match.") << "\n";
+        return false;
+    }
+    if (m_n_games == 0)
+    {
+        err << QObject::tr("No games to play.") << "\n";
+        return false;
+    }
+    if (!QDir().mkpath(m_opts.output))
+    {
+        err << QObject::tr("Could not create %1.").arg(m_opts.output) << "\n";
+        return false;
+    }
+
+    int n_slots = std::max(1, std::min(m_opts.concurrency, m_n_games));
+    QTextStream(stdout) << QObject::tr("Playing %1 games from %2 openings, %3 at a time.").arg(m_n_games).arg(m_openings.size()).arg(n_slots)
+                        << "\n";
+    for (int i = 0; i < n_slots; i++)
+        m_slots.emplace_back(new game_slot(this));
+    for (auto &s : m_slots)
+        s->next_game();
+    return true;
+}
@@ -0,0 +1,84 @@
+#ifndef ENGINEMATCH_H
+#define ENGINEMATCH_H
+
+#include <deque>
+#include <memory>
+#include <vector>
+
+#include <QString>
+
+#include "gogame.h"
+#include "qgtp.h"
+#include "setting.h"
+
+/* Plays matches between pairs of engines without any windows, several games
+   at a time.  Each game starts from one of the openings of a book, which is
+   an SGF file whose leaves are the starting positions; every opening is
+   played twice per pair of engines, once with either engine taking Black.
+   Finished games are decided by the engines' final_score, or by resignation,
+   and are saved as SGF files.  Once all games are done, win counts and the
+   Elo difference for each pair are printed and the application exits.  */
+class engine_match
+{
+public:
+    struct options
+    {
+        std::vector<std::pair<Engine, Engine>> pairs;
+        /* The number of games for each pair.  */
+        int games       = 2;
+        int concurrency = 1;
+        /* Games still going after this many moves are scored as they
+           are.  Zero means no limit.  */
+        int     max_moves = 0;
+        QString output;
+    };
+
+private:
+    class game_slot;
+    friend class game_slot;
+
+    struct assignment
+    {
+        int  game;
+        int  pair;
+        int  opening;
+        bool first_black;
+    };
+
+    struct pair_stats
+    {
+        int wins_first  = 0;
+        int wins_second = 0;
+        int jigo        = 0;
+        /* Games lost to errors, or where the engines disagreed on the winner.  */
+        int no_result     = 0;
+        int disagreements = 0;
+        int black_wins    = 0;
+        int white_wins    = 0;
+    };
+
+    options                                 m_opts;
+    go_game_ptr                             m_book;
+    std::vector<game_state *>               m_openings;
+    std::vector<std::deque<assignment>>     m_pending;
+    std::vector<pair_stats>                 m_stats;
+    std::vector<std::unique_ptr<game_slot>> m_slots;
+    int                                     m_n_games  = 0;
+    int                                     m_failures = 0;
+
+    bool next_assignment(int preferred_pair, assignment &);
+    void game_finished(const assignment &, go_game_ptr, stone_color winner, bool disagreement);
+    void game_failed(const assignment &, const QString &err);
+    void slot_idle();
+    void print_summary();
+
+public:
+    engine_match(go_game_ptr book, const options &);
+    ~engine_match();
+
+    /* Start playing.  Returns false if there is nothing to do; otherwise the
+       application exits when all games are finished.  */
+    bool start();
+};
+
+#endif
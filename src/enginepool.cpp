@@ -0,0 +1,194 @@
+#include <algorithm>
+
+#include <QDebug>
+#include <QFile>
+
+#include "enginepool.h"
+#include "setting.h"
+
+engine_pool *g_engine_pool = nullptr;
+
+/* Milliseconds an engine may stay idle before it is shut down.  */
+static const int max_idle_time = 10 * 60 * 1000;
+
+/* The resident memory of P in megabytes, or 0 if we can't tell.  */
+static long engine_memory(GTP_Process *p)
+{
+#ifdef Q_OS_LINUX
+    QFile f(QString("/proc/%1/status").arg(p->processId()));
+    if (!f.open(QIODevice::ReadOnly))
+        return 0;
+    for (;;)
+    {
+        QByteArray line = f.readLine();
+        if (line.isEmpty())
+            break;
+        if (line.startsWith("VmRSS:"))
+            return line.mid(6).trimmed().split(' ').first().toLong() / 1024;
+    }
+#else
+    (void)p;
+#endif
+    return 0;
+}
+
+void engine_pool::idle_controller::gtp_exited(GTP_Process *p)
+{
+    m_pool->forget(p);
+    p->deleteLater();
+}
+
+void engine_pool::idle_controller::gtp_failure(GTP_Process *p, const QString &err)
+{
+    qDebug() << "idle engine failed: " << err;
+    m_pool->forget(p);
+    p->deleteLater();
+}
+
+engine_pool::engine_pool() : m_idle_ctrl(this)
+{
+    connect(&m_expiry, &QTimer::timeout, this, &engine_pool::expire);
+    m_expiry.start(60 * 1000);
+}
+
+engine_pool::~engine_pool()
+{
+    std::vector<idle_engine> idle;
+    std::swap(idle, m_idle);
+    for (auto &e : idle)
+    {
+        e.proc->quit();
+        delete e.proc;
+    }
+}
+
+/* Engines with the same key are interchangeable.  */
+QString engine_pool::engine_key(const Engine &e)
+{
+    return e.path + "\n" + e.args;
+}
+
+GTP_Process *engine_pool::spawn(GTP_Controller *c, const Engine &engine, int size, double komi, bool show_dialog)
+{
+    /* No parent window: the engine outlives the window that asked for it.  */
+    GTP_Process *p = new GTP_Process(nullptr, c, engine, size, komi, show_dialog);
+    m_all[p]       = engine_key(engine);
+    connect(p, &QObject::destroyed, this, [this, p]() { forget(p); });
+    return p;
+}
+
+void engine_pool::forget(GTP_Process *p)
+{
+    m_all.erase(p);
+    auto it = std::find_if(m_idle.begin(), m_idle.end(), [p](const idle_engine &e) { return e.proc == p; });
+    if (it != m_idle.end())
+        m_idle.erase(it);
+}
+
+void engine_pool::evict(size_t idx)
+{
+    GTP_Process *p = m_idle[idx].proc;
+    qDebug() << "shutting down idle engine " << m_all[p];
+    m_idle.erase(m_idle.begin() + idx);
+    m_all.erase(p);
+    p->quit();
+    p->deleteLater();
+}
+
+/* Shut down idle engines, oldest first, until there is room for ROOM more
+   processes within the limits.  */
+void engine_pool::trim(int room)
+{
+    size_t max_procs = std::max(1, g_setting->readIntEntry("ENGINE_POOL_SIZE"));
+    while (!m_idle.empty() && m_all.size() + room > max_procs)
+        evict(0);
+
+    long max_memory = g_setting->readIntEntry("ENGINE_POOL_MEMORY");
+    if (max_memory <= 0 || m_idle.empty())
+        return;
+    long total = 0;
+    for (auto &it : m_all)
+        total += engine_memory(it.first);
+    /* A new engine will need about as much as the ones we have.  */
+    if (room > 0 && !m_all.empty())
+        total += room * total / (long)m_all.size();
+    while (!m_idle.empty() && total > max_memory)
+    {
+        total -= engine_memory(m_idle.front().proc);
+        evict(0);
+    }
+}
+
+void engine_pool::expire()
+{
+    while (!m_idle.empty() && m_idle.front().since.elapsed() > max_idle_time)
+        evict(0);
+}
+
+/* Hand an engine to C: a waiting one if there is one for ENGINE, otherwise
+   a newly started one.  Engines that are still starting can be taken over
+   only if they were started for the same board size.  */
+GTP_Process *engine_pool::lease(GTP_Controller *c, const Engine &engine, int size, double komi, bool show_dialog)
+{
+    QString      key = engine_key(engine);
+    GTP_Process *p   = nullptr;
+    for (auto it = m_idle.begin(); it != m_idle.end(); ++it)
+    {
+        GTP_Process *cand = it->proc;
+        if (it->key != key || cand->stopped())
+            continue;
+        if (cand->idle() || (!cand->started() && cand->board_size() == size))
+        {
+            p = cand;
+            m_idle.erase(it);
+            break;
+        }
+    }
+    if (p != nullptr)
+        p->attach(c, size, komi, show_dialog);
+    else
+    {
+        trim(1);
+        p = spawn(c, engine, size, komi, show_dialog);
+    }
+
+    /* Get the next one ready if the user wants that, unless that means
+       shutting something down.  */
+    if (!g_setting->readBoolEntry("ENGINE_POOL_SPARE"))
+        return p;
+    bool   have_spare = std::any_of(m_idle.begin(), m_idle.end(), [&key](const idle_engine &e) { return e.key == key; });
+    size_t max_procs  = std::max(1, g_setting->readIntEntry("ENGINE_POOL_SIZE"));
+    long   max_memory = g_setting->readIntEntry("ENGINE_POOL_MEMORY");
+    if (!have_spare && m_all.size() < max_procs)
+    {
+        long total = 0;
+        if (max_memory > 0)
+            for (auto &it : m_all)
+                total += engine_memory(it.first);
+        if (max_memory <= 0 || total + total / (long)m_all.size() <= max_memory)
+        {
+            GTP_Process *spare = spawn(&m_idle_ctrl, engine, size, 7.5, false);
+            m_idle.push_back({ spare, key, QElapsedTimer() });
+            m_idle.back().since.start();
+        }
+    }
+    return p;
+}
+
+/* Take back P from the controller that leased it.  */
+void engine_pool::release(GTP_Process *p)
+{
+    auto it = m_all.find(p);
+    if (it == m_all.end() || p->stopped())
+    {
+        if (!p->stopped())
+            p->quit();
+        /* We may be called from one of its slots.  */
+        p->deleteLater();
+        return;
+    }
+    p->detach(&m_idle_ctrl);
+    m_idle.push_back({ p, it->second, QElapsedTimer() });
+    m_idle.back().since.start();
+    trim(0);
+}
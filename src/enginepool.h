@@ -0,0 +1,79 @@
+#ifndef ENGINEPOOL_H
+#define ENGINEPOOL_H
+
+#include <map>
+#include <vector>
+
+#include <QElapsedTimer>
+#include <QObject>
+#include <QString>
+#include <QTimer>
+
+#include "qgtp.h"
+
+/* Keeps analysis engines running between uses, so that starting analysis in
+   another window does not have to wait for the engine to load its network
+   again.  Controllers lease engines through GTP_Controller::lease_gtp and
+   return them with release_gtp; a returned engine stays idle in the pool
+   until someone asks for the same engine again.  Optionally
+   (ENGINE_POOL_SPARE), a spare one is started in the background after an
+   engine is leased if there is room for it, so the next window also finds
+   one waiting; this is off by default, as it doubles the memory used for
+   the network as soon as analysis is started.
+
+   The pool is limited by the number of engine processes, and optionally by
+   the memory they use.  Only idle engines are ever shut down to stay within
+   the limits; a lease is never refused.  */
+class engine_pool : public QObject
+{
+    /* Owns the engines that are not leased to anyone.  */
+    class idle_controller : public GTP_Controller
+    {
+        engine_pool *m_pool;
+
+    public:
+        idle_controller(engine_pool *pool) : GTP_Controller(nullptr), m_pool(pool) {}
+
+        /* Virtuals from GTP_Controller.  */
+        virtual void gtp_played_move(GTP_Process *, int, int) override {}
+        virtual void gtp_played_pass(GTP_Process *) override {}
+        virtual void gtp_played_resign(GTP_Process *) override {}
+        virtual void gtp_report_score(GTP_Process *, const QString &) override {}
+        virtual void gtp_startup_success(GTP_Process *) override {}
+        virtual void gtp_setup_success(GTP_Process *) override {}
+        virtual void gtp_exited(GTP_Process *) override;
+        virtual void gtp_failure(GTP_Process *, const QString &) override;
+    };
+
+    struct idle_engine
+    {
+        GTP_Process  *proc;
+        QString       key;
+        QElapsedTimer since;
+    };
+
+    idle_controller m_idle_ctrl;
+    /* Every process we started, leased or not, with the key of its engine.  */
+    std::map<GTP_Process *, QString> m_all;
+    /* Oldest first.  */
+    std::vector<idle_engine> m_idle;
+    QTimer                   m_expiry;
+
+    static QString engine_key(const Engine &);
+    GTP_Process   *spawn(GTP_Controller *, const Engine &, int size, double komi, bool show_dialog);
+    void           forget(GTP_Process *);
+    void           evict(size_t idx);
+    void           trim(int room);
+    void           expire();
+
+public:
+    engine_pool();
+    ~engine_pool();
+
+    GTP_Process *lease(GTP_Controller *, const Engine &, int size, double komi, bool show_dialog);
+    void         release(GTP_Process *);
+};
+
+extern engine_pool *g_engine_pool;
+
+#endif
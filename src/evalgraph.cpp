@@ -27,10 +27,22 @@ EvalGraph::EvalGraph(QWidget *parent) : QGraphicsView(parent)
     gradient.setColorAt(0, Qt::white);
     gradient.setColorAt(1, Qt::black);
     gradient.setCoordinateMode(QGradient::StretchToDeviceMode);
-    m_brush              = new QBrush(gradient);
-    QGraphicsRectItem *r = m_scene->addRect(0, 0, GRADIENT_WIDTH, h, Qt::NoPen, *m_brush);
-    r->setZValue(-2);
-    m_scene->addLine(0, h / 2, w, h / 2);
+    m_brush    = new QBrush(gradient);
+    m_gradient = m_scene->addRect(0, 0, GRADIENT_WIDTH, h, Qt::NoPen, *m_brush);
+    m_gradient->setZValue(-2);
+    m_midline = m_scene->addLine(0, h / 2, w, h / 2);
+    m_midline->setZValue(2);
+
+    /* These are created once and only have their geometry changed by update.  */
+    m_type = m_scene->addText(QString());
+    m_type->setZValue(4);
+    m_sel = m_scene->addRect(0, 0, 0, 0, Qt::NoPen, QBrush(Qt::gray));
+    m_sel->setZValue(2);
+    m_sd_item = m_scene->addPath(QPainterPath(), Qt::NoPen);
+    m_sd_item->setZValue(1);
+    m_chg_b = m_scene->addPath(QPainterPath(), Qt::NoPen, QBrush(Qt::black));
+    m_chg_w = m_scene->addPath(QPainterPath(), Qt::NoPen, QBrush(Qt::white));
+
     setAlignment(Qt::AlignTop | Qt::AlignLeft);
 
     setToolTip(tr("The evaluation graph.\nDisplays evaluation data found in the "
@@ -44,16 +56,12 @@ void EvalGraph::mousePressEvent(QMouseEvent *e)
     if (m_game == nullptr || e->buttons() != Qt::LeftButton)
         return;
 
-    game_state *st  = m_game->get_root();
-    int         pos = e->x() - GRADIENT_WIDTH;
+    int pos = e->x() - GRADIENT_WIDTH;
     if (pos < 0)
         return;
 
     pos /= m_step;
-    for (int i = 0; st && i < pos; i++)
-    {
-        st = st->next_primary_move();
-    }
+    game_state *st = m_game->main_line().at(pos);
     if (st && m_active != st)
         m_win->set_game_position(st);
 }
@@ -130,114 +138,259 @@ void EvalGraph::export_file(bool)
         QMessageBox::warning(this, PACKAGE, tr("Failed to save image!"));
 }
 
-void EvalGraph::update(go_game_ptr gr, game_state *active, int sel_idx)
+/* Bring the cached series up to date with the main line of GR.  Returns false,
+   after doing only a few comparisons, if no evaluation or tree structure changed
+   anywhere since the last call.  */
+bool EvalGraph::refresh_series(go_game_ptr gr)
 {
-    int w = width();
-    int h = height();
-
-    m_scene->clear();
-    QGraphicsRectItem *gradr = m_scene->addRect(0, 0, GRADIENT_WIDTH, h, Qt::NoPen, *m_brush);
-    gradr->setZValue(-2);
-    QGraphicsLineItem *line = m_scene->addLine(0, h / 2, w, h / 2);
-    line->setZValue(2);
-
-    if (gr == nullptr)
-        return;
-
-    w -= GRADIENT_WIDTH;
+    const auto &entries     = m_model->entries();
+    bool        ids_changed = gr != m_cached_game || entries.size() != m_series.size();
+    for (size_t i = 0; !ids_changed && i < entries.size(); i++)
+        ids_changed = entries[i].first != m_series[i].id;
 
-    game_state *r = gr->get_root();
-
-    m_game   = gr;
-    m_active = active;
-    m_id_idx = sel_idx;
+    if (!ids_changed && m_struct_gen == gr->get_root()->structure_generation() && m_eval_gen == gr->get_root()->eval_generation())
+        return false;
 
-    size_t count        = 0;
-    int    active_point = -1;
-    for (game_state *st = r; st != nullptr; st = st->next_primary_move())
+    if (ids_changed)
     {
-        if (active == st)
-            active_point = count;
-        count++;
+        for (auto &s : m_series)
+            delete s.item;
+        m_series.clear();
+        for (auto &e : entries)
+        {
+            m_series.emplace_back();
+            m_series.back().id = e.first;
+        }
+        m_nodes.clear();
+        m_stamps.clear();
+        m_cached_game = gr;
+    }
+    m_struct_gen = gr->get_root()->structure_generation();
+    m_eval_gen   = gr->get_root()->eval_generation();
+
+    const std::vector<game_state *> &main_line = gr->main_line().nodes();
+    size_t                           count     = main_line.size();
+    bool                             changed   = ids_changed || count != m_nodes.size();
+    m_nodes.resize(count, nullptr);
+    m_stamps.resize(count, 0);
+    for (auto &s : m_series)
+        s.points.resize(count);
+
+    for (size_t x = 0; x < count; x++)
+    {
+        game_state *st = main_line[x];
+        if (st == m_nodes[x] && st->eval_stamp() == m_stamps[x])
+            continue;
+        m_nodes[x]  = st;
+        m_stamps[x] = st->eval_stamp();
+        changed     = true;
+        for (auto &s : m_series)
+            s.points[x].valid = st->find_eval(s.id, s.points[x].ev);
     }
+    return changed;
+}
+
+void EvalGraph::rebuild_paths(int w, int h, int sel_idx)
+{
+    m_paths_valid = true;
+    m_path_w      = w;
+    m_path_h      = h;
+    m_path_sel    = sel_idx;
+    m_path_scores = m_show_scores;
 
-    m_step = (double)w / count;
+    w -= GRADIENT_WIDTH;
 
-    QGraphicsTextItem *type  = m_scene->addText(m_show_scores ? tr("Score") : tr("Win rate"));
-    QRectF             trect = type->boundingRect();
-    type->setPos(w - trect.width(), h - trect.height());
-    type->setZValue(4);
-    for (int idnr = 0; idnr < m_model->rowCount(); idnr++)
+    size_t count = m_nodes.size();
+    m_step       = (double)w / count;
+
+    /* With more moves than pixels, every pixel column shows the range of values
+       of the moves falling into it, which keeps the number of path elements
+       proportional to the width rather than to the length of the game.  */
+    bool   downsample = m_step < 1;
+    double col_w      = downsample ? 1 : m_step;
+    auto   column     = [&](size_t x) -> int { return downsample ? (int)(x * m_step) : (int)x; };
+    auto   column_x   = [&](int c) -> double { return GRADIENT_WIDTH + (downsample ? c : c * m_step); };
+
+    m_type->setPlainText(m_show_scores ? tr("Score") : tr("Win rate"));
+    QRectF trect = m_type->boundingRect();
+    m_type->setPos(w - trect.width(), h - trect.height());
+
+    QPainterPath sd_path, chg_path[2];
+    sd_path.setFillRule(Qt::WindingFill);
+    QBrush sdbrush;
+    for (size_t idnr = 0; idnr < m_series.size(); idnr++)
     {
-        if (m_show_scores && idnr != sel_idx)
+        series &s = m_series[idnr];
+        if (s.item == nullptr)
+        {
+            s.item = m_scene->addPath(QPainterPath());
+            s.item->setZValue(3);
+        }
+        if (m_show_scores && (int)idnr != sel_idx)
+        {
+            s.item->hide();
             continue;
-        auto         e  = m_model->entries()[idnr];
-        auto         id = e.first;
-        QPainterPath path;
-        bool         on_path = false;
-        game_state  *st      = r;
-        double       prev    = 0;
+        }
+        s.item->show();
 
         QPen pen;
         pen.setWidth(2);
         QVariant v = m_model->data(m_model->index(idnr, 0), Qt::DecorationRole);
         pen.setColor(v.value<QColor>());
-        QBrush sdbrush(v.value<QColor>().lighter());
-        for (int x = 0; st != nullptr; x++, st = st->next_primary_move())
+        s.item->setPen(pen);
+        if ((int)idnr == sel_idx)
+            sdbrush = QBrush(v.value<QColor>().lighter());
+
+        QPainterPath path;
+        bool         open      = false;
+        bool         have_prev = false;
+        double       prev      = 0;
+
+        /* Accumulated values for the current column.  */
+        int    col   = -1;
+        double first = 0, last = 0, lo = 0, hi = 0;
+        double sd_lo = 0, sd_hi = 0;
+        bool   have_sd = false;
+        double chg_lo[2] = {}, chg_hi[2] = {};
+
+        auto flush = [&]() -> void {
+            if (col < 0)
+                return;
+            double px = column_x(col);
+            if (open)
+                path.lineTo(px, first);
+            else
+                path.moveTo(px, first);
+            if (lo < hi)
+            {
+                path.lineTo(px, lo);
+                path.lineTo(px, hi);
+            }
+            if (path.currentPosition().y() != last)
+                path.lineTo(px, last);
+            if (have_sd)
+                sd_path.addRect(px, sd_lo, col_w, sd_hi - sd_lo);
+            for (int c = 0; c < 2; c++)
+            {
+                if (chg_hi[c] > 0)
+                    chg_path[c].addRect(px, h / 2, col_w, h * chg_hi[c]);
+                if (chg_lo[c] < 0)
+                    chg_path[c].addRect(px, h / 2 + h * chg_lo[c], col_w, -h * chg_lo[c]);
+            }
+            open = true;
+            col  = -1;
+        };
+
+        for (size_t x = 0; x < count; x++)
         {
-            eval ev;
-            if (!st->find_eval(id, ev))
+            const series::point &p = s.points[x];
+            if (!p.valid || (m_show_scores && p.ev.score_stddev == 0))
             {
-                on_path = false;
+                flush();
+                open      = false;
+                have_prev = false;
                 continue;
             }
-            double val;
+            const eval &ev = p.ev;
+            double      val;
+            double      vminb = 0, vmaxb = 0;
             if (m_show_scores)
             {
-                if (ev.score_stddev == 0)
-                {
-                    on_path = false;
-                    continue;
-                }
-                val                      = (ev.score_mean + 15.) / 30;
-                double vmin              = val - ev.score_stddev / 30.;
-                double vmax              = val + ev.score_stddev / 30.;
-                val                      = std::min(1.0, std::max(val, 0.0));
-                double             vminb = std::min(1.0, std::max(vmin, 0.0));
-                double             vmaxb = std::min(1.0, std::max(vmax, 0.0));
-                QGraphicsRectItem *sdrect;
-                sdrect = m_scene->addRect(GRADIENT_WIDTH + x * m_step, (h - 2) * vminb, m_step, (h - 2) * (vmaxb - vminb), Qt::NoPen, sdbrush);
-                sdrect->setZValue(1);
+                val         = (ev.score_mean + 15.) / 30;
+                double vmin = val - ev.score_stddev / 30.;
+                double vmax = val + ev.score_stddev / 30.;
+                val         = std::min(1.0, std::max(val, 0.0));
+                vminb       = std::min(1.0, std::max(vmin, 0.0));
+                vmaxb       = std::min(1.0, std::max(vmax, 0.0));
             }
             else
                 val = ev.wr_black;
 
-            if (on_path)
+            double y = (h - 2) * val;
+            int    c = column(x);
+            if (c != col)
             {
-                path.lineTo(GRADIENT_WIDTH + x * m_step, (h - 2) * val);
-                double chg = val - prev;
-                if (!m_show_scores && chg != 0 && st->was_move_p() && idnr == sel_idx)
-                {
-                    QBrush br(st->get_move_color() == black ? Qt::black : Qt::white);
-                    /* One idea was to offset this by half the width of a step, so as to
-                       make the change appear between moves, but I found that confusing.
-                     */
-                    m_scene->addRect(GRADIENT_WIDTH + x * m_step, h / 2, m_step, h * chg, Qt::NoPen, br);
-                }
+                flush();
+                col     = c;
+                first   = lo = hi = y;
+                have_sd = false;
+                for (int i = 0; i < 2; i++)
+                    chg_lo[i] = chg_hi[i] = 0;
             }
-            else
-                path.moveTo(GRADIENT_WIDTH + x * m_step, (h - 2) * val);
-            prev    = val;
-            on_path = true;
+            lo   = std::min(lo, y);
+            hi   = std::max(hi, y);
+            last = y;
+            if (m_show_scores)
+            {
+                sd_lo   = have_sd ? std::min(sd_lo, (h - 2) * vminb) : (h - 2) * vminb;
+                sd_hi   = have_sd ? std::max(sd_hi, (h - 2) * vmaxb) : (h - 2) * vmaxb;
+                have_sd = true;
+            }
+
+            game_state *st  = m_nodes[x];
+            double      chg = val - prev;
+            if (have_prev && !m_show_scores && chg != 0 && st->was_move_p() && (int)idnr == sel_idx)
+            {
+                /* One idea was to offset this by half the width of a step, so as to
+                   make the change appear between moves, but I found that confusing.
+                 */
+                int ci     = st->get_move_color() == black ? 0 : 1;
+                chg_lo[ci] = std::min(chg_lo[ci], chg);
+                chg_hi[ci] = std::max(chg_hi[ci], chg);
+            }
+            prev      = val;
+            have_prev = true;
         }
+        flush();
+        s.item->setPath(path);
+    }
+    m_sd_item->setBrush(sdbrush);
+    m_sd_item->setPath(sd_path);
+    m_sd_item->setVisible(m_show_scores);
+    m_chg_b->setPath(chg_path[0]);
+    m_chg_w->setPath(chg_path[1]);
+}
 
-        QGraphicsPathItem *p = m_scene->addPath(path, pen);
-        p->setZValue(3);
+void EvalGraph::update(go_game_ptr gr, game_state *active, int sel_idx)
+{
+    int w = width();
+    int h = height();
+
+    if (w != m_path_w || h != m_path_h)
+    {
+        m_gradient->setRect(0, 0, GRADIENT_WIDTH, h);
+        m_midline->setLine(0, h / 2, w, h / 2);
     }
-    QGraphicsRectItem *sel = m_scene->addRect(GRADIENT_WIDTH + (int)(active_point * m_step), 0, round(m_step), h, Qt::NoPen, QBrush(Qt::gray));
-    sel->setZValue(2);
 
-    m_scene->update();
+    if (gr == nullptr)
+    {
+        for (auto &s : m_series)
+            delete s.item;
+        m_series.clear();
+        m_cached_game = nullptr;
+        m_paths_valid = false;
+        m_type->hide();
+        m_sel->hide();
+        m_sd_item->hide();
+        m_chg_b->setPath(QPainterPath());
+        m_chg_w->setPath(QPainterPath());
+        return;
+    }
+
+    m_game   = gr;
+    m_active = active;
+    m_id_idx = sel_idx;
+
+    /* Analysis updates arrive several times a second, and most position changes
+       don't alter any evaluations, so only redo work when something changed.  */
+    bool data_changed = refresh_series(gr);
+    if (data_changed || !m_paths_valid || w != m_path_w || h != m_path_h || sel_idx != m_path_sel || m_show_scores != m_path_scores)
+        rebuild_paths(w, h, sel_idx);
+    m_type->show();
+
+    int active_point = active == nullptr ? -1 : gr->main_line().find(active);
+    m_sel->setRect(GRADIENT_WIDTH + (int)(active_point * m_step), 0, std::max(1.0, round(m_step)), h);
+    m_sel->setVisible(active_point >= 0);
 }
 
 void EvalGraph::changeEvent(QEvent *e)
@@ -6,6 +6,7 @@
 #define EVALGRAPH_H
 
 #include <memory>
+#include <vector>
 
 #include <QGraphicsView>
 
@@ -34,6 +35,39 @@ class EvalGraph : public QGraphicsView
     double          m_step;
     bool            m_show_scores = false;
 
+    /* The evaluations found along the main line for one analyzer.  These are
+       kept between updates and refreshed only for nodes whose evals changed.  */
+    struct series
+    {
+        struct point
+        {
+            bool valid = false;
+            eval ev;
+        };
+        an_id_t            id;
+        std::vector<point> points;
+        QGraphicsPathItem *item {};
+    };
+    std::vector<series>        m_series;
+    std::vector<game_state *>  m_nodes;
+    std::vector<unsigned long> m_stamps;
+    go_game_ptr                m_cached_game {};
+    unsigned long              m_struct_gen = 0, m_eval_gen = 0;
+
+    /* The parameters the current paths were built with.  */
+    bool m_paths_valid = false;
+    int  m_path_w = 0, m_path_h = 0, m_path_sel = 0;
+    bool m_path_scores = false;
+
+    QGraphicsRectItem *m_gradient;
+    QGraphicsLineItem *m_midline;
+    QGraphicsTextItem *m_type;
+    QGraphicsRectItem *m_sel;
+    QGraphicsPathItem *m_sd_item, *m_chg_b, *m_chg_w;
+
+    bool refresh_series(go_game_ptr gr);
+    void rebuild_paths(int w, int h, int sel_idx);
+
 protected:
     virtual void mouseMoveEvent(QMouseEvent *e) override;
     virtual void mousePressEvent(QMouseEvent *e) override;
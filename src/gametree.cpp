@@ -2,9 +2,10 @@
  * gametree.cpp
  */
 
-#include <QGraphicsSceneContextMenuEvent>
-#include <QGraphicsSceneMouseEvent>
+#include <cmath>
+
 #include <QHelpEvent>
+#include <QMouseEvent>
 #include <QScrollBar>
 #include <QToolTip>
 
@@ -34,65 +35,6 @@ static QByteArray box_svg = "<?xml version=\"1.0\" encoding=\"UTF-8\" ?>"
                             "     d=\"M 35.2,14 44.8,11 124.8,36 115.2,35 Z\" />"
                             "</svg>";
 
-class ClickablePixmap : public QGraphicsPixmapItem
-{
-    GameTree *m_view;
-    int       m_x, m_y, m_size;
-
-public:
-    ClickablePixmap(GameTree *view, QGraphicsScene *scene, int x, int y, int size, const QPixmap &pm)
-        : QGraphicsPixmapItem(pm), m_view(view), m_x(x), m_y(y), m_size(size)
-    {
-        setZValue(10);
-        /* Supposedly faster, and makes it easier to click on edit nodes.  */
-        setShapeMode(QGraphicsPixmapItem::BoundingRectShape);
-        scene->addItem(this);
-        setAcceptHoverEvents(true);
-    }
-
-protected:
-    virtual void mousePressEvent(QGraphicsSceneMouseEvent *e) override;
-    virtual void hoverEnterEvent(QGraphicsSceneHoverEvent *e) override;
-    virtual void hoverLeaveEvent(QGraphicsSceneHoverEvent *e) override;
-    virtual void contextMenuEvent(QGraphicsSceneContextMenuEvent *e) override;
-};
-
-void ClickablePixmap::contextMenuEvent(QGraphicsSceneContextMenuEvent *e)
-{
-    QPointF pos = e->pos();
-    int     x   = m_x + pos.x() / m_size;
-    int     y   = m_y;
-    m_view->show_menu(x, y, e->screenPos());
-}
-
-void ClickablePixmap::mousePressEvent(QGraphicsSceneMouseEvent *e)
-{
-    QPointF pos = e->pos();
-    int     x   = m_x + pos.x() / m_size;
-    int     y   = m_y;
-    if (e->button() == Qt::LeftButton)
-    {
-        if (e->modifiers() == Qt::ShiftModifier)
-            m_view->toggle_collapse(x, y, false);
-        else if (e->modifiers() == Qt::ControlModifier)
-            m_view->toggle_collapse(x, y, true);
-        else
-            m_view->item_clicked(x, y);
-    }
-    else if (e->button() == Qt::MiddleButton)
-        m_view->toggle_collapse(x, y, false);
-}
-
-void ClickablePixmap::hoverEnterEvent(QGraphicsSceneHoverEvent *)
-{
-    m_view->setDragMode(QGraphicsView::NoDrag);
-}
-
-void ClickablePixmap::hoverLeaveEvent(QGraphicsSceneHoverEvent *)
-{
-    m_view->setDragMode(QGraphicsView::ScrollHandDrag);
-}
-
 GameTree::GameTree(QWidget *parent)
     : QGraphicsView(parent), m_scene(new QGraphicsScene(0, 0, 30, 30, this)), m_header_scene(new QGraphicsScene(0, 0, 30, 30, this))
 {
@@ -274,6 +216,138 @@ void GameTree::show_menu(int x, int y, const QPoint &pos)
     menu.exec(pos);
 }
 
+game_state *GameTree::node_at(const QPoint &pos, int &x, int &y)
+{
+    if (m_game == nullptr)
+        return nullptr;
+    QPointF point = mapToScene(pos);
+    if (point.x() < 0 || point.y() < 0)
+        return nullptr;
+    x = point.x() / m_size;
+    y = point.y() / m_size;
+    return m_game->get_root()->locate_by_vis_coords(x, y, 0, 0);
+}
+
+void GameTree::mousePressEvent(QMouseEvent *e)
+{
+    int         x, y;
+    game_state *st = node_at(e->pos(), x, y);
+    if (st == nullptr)
+    {
+        QGraphicsView::mousePressEvent(e);
+        return;
+    }
+    if (e->button() == Qt::LeftButton)
+    {
+        if (e->modifiers() == Qt::ShiftModifier)
+            toggle_collapse(x, y, false);
+        else if (e->modifiers() == Qt::ControlModifier)
+            toggle_collapse(x, y, true);
+        else
+            item_clicked(x, y);
+    }
+    else if (e->button() == Qt::MiddleButton)
+        toggle_collapse(x, y, false);
+    e->accept();
+}
+
+void GameTree::mouseMoveEvent(QMouseEvent *e)
+{
+    /* Show the hand cursor only over empty areas, which is where dragging starts.  */
+    if (e->buttons() == Qt::NoButton)
+    {
+        int x, y;
+        setDragMode(node_at(e->pos(), x, y) != nullptr ? QGraphicsView::NoDrag : QGraphicsView::ScrollHandDrag);
+    }
+    QGraphicsView::mouseMoveEvent(e);
+}
+
+/* Draw the part of the tree that intersects RECT: either the connecting lines, or the
+   nodes themselves, which must appear above the active path.  */
+void GameTree::paint_cells(QPainter *painter, const QRectF &rect, bool nodes)
+{
+    if (m_game == nullptr)
+        return;
+
+    int x0 = std::max(0, (int)floor(rect.left() / m_size));
+    int y0 = std::max(0, (int)floor(rect.top() / m_size));
+    int x1 = ceil(rect.right() / m_size) + 1;
+    int y1 = ceil(rect.bottom() / m_size) + 1;
+
+    QPen line_pen;
+    line_pen.setWidth(2);
+    QPen dotted_pen = line_pen;
+    dotted_pen.setStyle(Qt::DotLine);
+    QPen diag_pen(Qt::blue);
+    diag_pen.setWidth(2);
+
+    auto node = [&](game_state *st, int x, int y, bool hidden_figs) -> void {
+        if (!nodes)
+            return;
+        const QPixmap *src = &m_pm_box;
+        bool           fig = st->has_figure();
+        stone_color    col = st->get_move_color();
+        if (!st->vis_collapsed())
+        {
+            if (col == none)
+                src = &m_pm_e;
+            else if (col == white)
+                src = fig ? &m_pm_wfig : &m_pm_w;
+            else if (col == black)
+                src = fig ? &m_pm_bfig : &m_pm_b;
+        }
+        painter->drawPixmap(x * m_size + 1, y * m_size + 1, *src);
+        if (hidden_figs)
+        {
+            painter->setPen(diag_pen);
+            painter->setBrush(Qt::NoBrush);
+            painter->drawRect(x * m_size + m_size / 2 + 2, y * m_size + 2, m_size / 2 - 4, m_size / 2 - 4);
+        }
+    };
+    auto line = [&](int lx0, int ly0, int lx1, int ly1, bool dotted) -> void {
+        if (nodes)
+            return;
+        painter->setPen(dotted ? dotted_pen : line_pen);
+        painter->drawLine(QLineF(lx0, ly0, lx1, ly1));
+    };
+    m_game->get_root()->render_visualization(0, 0, x0, y0, x1, y1, m_size, node, line);
+}
+
+void GameTree::drawBackground(QPainter *painter, const QRectF &rect)
+{
+    QGraphicsView::drawBackground(painter, rect);
+    if (m_sel_found)
+        painter->fillRect(QRectF(m_sel_x * m_size, m_sel_y * m_size, m_size, m_size), Qt::red);
+    paint_cells(painter, rect, false);
+}
+
+void GameTree::drawForeground(QPainter *painter, const QRectF &rect)
+{
+    paint_cells(painter, rect, true);
+    QGraphicsView::drawForeground(painter, rect);
+}
+
+void GameTree::update_header()
+{
+    int w = m_vis_w;
+    m_header_scene->clear();
+    m_header_scene->setSceneRect(0, 0, m_size * w, m_header_scene->height());
+    m_header_view->setSceneRect(0, 0, m_size * w, m_header_scene->height());
+    for (int i = 0; i < w; i++)
+    {
+        auto  *item   = m_header_scene->addSimpleText(QString::number(i), m_header_font);
+        QRectF bounds = item->boundingRect();
+        bounds.moveCenter({(i + 0.5) * m_size, m_header_view->height() / 2.});
+        item->setPos(bounds.x(), 0);
+        if (i % 2)
+        {
+            auto *ritem = m_header_scene->addRect(i * m_size, 0, m_size, m_header_scene->height(), QPen(Qt::NoPen), QBrush(Qt::white));
+            ritem->setZValue(-1);
+        }
+    }
+    m_header_view->verticalScrollBar()->setSliderPosition(0);
+}
+
 void GameTree::update(go_game_ptr gr, game_state *active, bool force)
 {
     game_state *r              = gr->get_root();
@@ -288,7 +362,14 @@ void GameTree::update(go_game_ptr gr, game_state *active, bool force)
     }
     if (active_changed)
         do_autocollapse();
-    changed |= r->update_visualization(g_setting->values.gametree_diaghide) || force;
+    int  first_row = 0, end_row = 0;
+    bool layout_changed = r->update_visualization(g_setting->values.gametree_diaghide, first_row, end_row);
+    if (changed || force)
+    {
+        first_row = 0;
+        end_row   = std::max(m_vis_h, r->visualization().height());
+    }
+    changed |= layout_changed || force;
     if (!changed && !active_changed)
         return;
     m_game = gr;
@@ -299,91 +380,18 @@ void GameTree::update(go_game_ptr gr, game_state *active, bool force)
         int                h     = vroot.height();
 
         m_scene->setSceneRect(0, 0, m_size * w, m_size * h);
-
-        m_scene->clear();
-        m_sel      = nullptr;
-        m_path     = nullptr;
-        m_path_end = nullptr;
+        /* Only the rows whose contents changed need to be repainted, and of
+           those only the part that is on screen is actually drawn.  */
+        int old_w = m_vis_w;
+        m_vis_w   = w;
+        m_vis_h   = h;
+        if (end_row > first_row)
+            m_scene->update(0, first_row * m_size, m_size * std::max(w, old_w), (end_row - first_row) * m_size);
 
         setDragMode(QGraphicsView::ScrollHandDrag);
 
-        visual_tree::bit_rect stones_w(w, h);
-        visual_tree::bit_rect stones_b(w, h);
-        visual_tree::bit_rect edits(w, h);
-        visual_tree::bit_rect collapsed(w, h);
-        visual_tree::bit_rect figures(w, h);
-        visual_tree::bit_rect hidden_figs(w, h);
-
-        r->extract_visualization(0, 0, stones_w, stones_b, edits, collapsed, figures, hidden_figs);
-        visual_tree::bit_rect all_items = stones_w;
-        all_items.ior(stones_b, 0, 0);
-        all_items.ior(edits, 0, 0);
-        all_items.ior(collapsed, 0, 0);
-
-        QPen diag_pen(Qt::blue);
-        diag_pen.setWidth(2);
-        for (int y = 0; y < h; y++)
-            for (int x0 = 0; x0 < w;)
-            {
-                int len = 1;
-                if (all_items.test_bit(x0, y))
-                {
-                    while (x0 + len < w && all_items.test_bit(x0 + len, y))
-                        len++;
-                    QPixmap combined(m_size * len, m_size);
-                    combined.fill(QColor(0, 0, 0, 0));
-                    QPainter painter;
-                    painter.begin(&combined);
-                    painter.setPen(Qt::NoPen);
-                    for (int i = 0; i < len; i++)
-                    {
-                        QPixmap *src = &m_pm_box;
-                        bool     fig = figures.test_bit(x0 + i, y);
-                        if (edits.test_bit(x0 + i, y))
-                            src = &m_pm_e;
-                        else if (stones_w.test_bit(x0 + i, y))
-                            src = fig ? &m_pm_wfig : &m_pm_w;
-                        else if (stones_b.test_bit(x0 + i, y))
-                            src = fig ? &m_pm_bfig : &m_pm_b;
-                        painter.drawPixmap(i * m_size + 1, 1, *src);
-                        if (hidden_figs.test_bit(x0 + i, y))
-                        {
-                            painter.setPen(diag_pen);
-                            painter.drawRect(i * m_size + m_size / 2 + 2, 2, m_size / 2 - 4, m_size / 2 - 4);
-                            painter.setPen(Qt::NoPen);
-                        }
-                    }
-                    painter.end();
-                    QGraphicsPixmapItem *pm = new ClickablePixmap(this, m_scene, x0, y, m_size, combined);
-                    pm->setPos(x0 * m_size, y * m_size);
-                }
-                x0 += len;
-            }
-        auto line = [&](int x0, int y0, int x1, int y1, bool dotted) -> void {
-            QPen pen;
-            pen.setWidth(2);
-            if (dotted)
-                pen.setStyle(Qt::DotLine);
-            QLineF line(x0, y0, x1, y1);
-            m_scene->addLine(line, pen);
-        };
-        r->render_visualization(m_size / 2, m_size / 2, m_size, line, true);
-        m_header_scene->clear();
-        m_header_scene->setSceneRect(0, 0, m_size * w, m_header_scene->height());
-        m_header_view->setSceneRect(0, 0, m_size * w, m_header_scene->height());
-        for (int i = 0; i < w; i++)
-        {
-            auto  *item   = m_header_scene->addSimpleText(QString::number(i), m_header_font);
-            QRectF bounds = item->boundingRect();
-            bounds.moveCenter({(i + 0.5) * m_size, m_header_view->height() / 2.});
-            item->setPos(bounds.x(), 0);
-            if (i % 2)
-            {
-                auto *ritem = m_header_scene->addRect(i * m_size, 0, m_size, m_header_scene->height(), QPen(Qt::NoPen), QBrush(Qt::white));
-                ritem->setZValue(-1);
-            }
-        }
-        m_header_view->verticalScrollBar()->setSliderPosition(0);
+        if (w != old_w || force)
+            update_header();
     }
 
     QPen pen;
@@ -414,22 +422,18 @@ void GameTree::update(go_game_ptr gr, game_state *active, bool force)
 
     int  acx = 0, acy = 0;
     bool found = r->locate_visual(0, 0, active, acx, acy);
-
-    /* Ideally we'd keep the m_sel object around and just move it.  The problem is
-       that when scrolling, Qt leaves behind ghost copies at the old location as
-       graphical garbage.  */
-    delete m_sel;
-    m_sel = m_scene->addRect(0, 0, m_size, m_size, Qt::NoPen, QBrush(Qt::red));
-    m_sel->setZValue(-1);
+    if (m_sel_found)
+        m_scene->update(m_sel_x * m_size, m_sel_y * m_size, m_size, m_size);
+    m_sel_found = found;
+    m_sel_x     = acx;
+    m_sel_y     = acy;
     if (found)
     {
-        m_sel->setPos(acx * m_size, acy * m_size);
+        QRectF sel(acx * m_size, acy * m_size, m_size, m_size);
+        m_scene->update(sel);
         if (active_changed)
-            ensureVisible(m_sel, m_size / 2, m_size / 2);
+            ensureVisible(sel, m_size / 2, m_size / 2);
     }
-    else
-        m_sel->hide();
-    m_scene->update();
 }
 
 bool GameTree::event(QEvent *e)
@@ -479,10 +483,10 @@ void GameTree::do_autocollapse()
 
 void GameTree::contextMenuEvent(QContextMenuEvent *e)
 {
-    /* The dragMode test is shorthand for "are we hovering over an item?"  */
-    if (dragMode() != QGraphicsView::ScrollHandDrag)
+    int x, y;
+    if (node_at(e->pos(), x, y) != nullptr)
     {
-        QGraphicsView::contextMenuEvent(e);
+        show_menu(x, y, e->globalPos());
         return;
     }
     QMenu   menu;
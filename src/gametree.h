@@ -41,7 +41,6 @@ class GameTree : public QGraphicsView
     game_state        *m_active {};
     QGraphicsScene    *m_scene;
     QGraphicsScene    *m_header_scene;
-    QGraphicsRectItem *m_sel {};
     QGraphicsPathItem *m_path {};
     QGraphicsLineItem *m_path_end {};
     QPixmap            m_pm_w, m_pm_b, m_pm_wfig, m_pm_bfig;
@@ -50,14 +49,28 @@ class GameTree : public QGraphicsView
     QStandardItemModel m_headers;
     bool               m_autocollapse = false;
 
-    void do_autocollapse();
-    void resize_header();
+    /* Nodes are not scene items; only the part of the tree that intersects the
+       exposed area is painted, in drawBackground and drawForeground.  These
+       cache the dimensions of the visualization and the active node's cell.  */
+    int  m_vis_w = 0, m_vis_h = 0;
+    int  m_sel_x = 0, m_sel_y = 0;
+    bool m_sel_found = false;
+
+    void        do_autocollapse();
+    void        resize_header();
+    void        update_header();
+    game_state *node_at(const QPoint &pos, int &x, int &y);
+    void        paint_cells(QPainter *painter, const QRectF &rect, bool nodes);
 
 protected:
     virtual void contextMenuEvent(QContextMenuEvent *e) override;
     virtual void resizeEvent(QResizeEvent *) override;
     virtual void changeEvent(QEvent *) override;
     virtual bool event(QEvent *e) override;
+    virtual void mousePressEvent(QMouseEvent *e) override;
+    virtual void mouseMoveEvent(QMouseEvent *e) override;
+    virtual void drawBackground(QPainter *painter, const QRectF &rect) override;
+    virtual void drawForeground(QPainter *painter, const QRectF &rect) override;
 
 public:
     GameTree(QWidget *parent);
@@ -1119,7 +1119,7 @@ void go_board::verify_invariants()
 #endif
 }
 
-#ifdef TEST
+#if defined TEST && !defined BENCH
 #    include <stdlib.h>
 
 int main()
@@ -414,6 +414,13 @@ public:
             return false;
         return true;
     }
+    /* A hash of the stones on the board, consistent with position_equal_p.  */
+    uint64_t position_hash() const
+    {
+        uint64_t hb = m_stones_b->hash();
+        uint64_t hw = m_stones_w->hash();
+        return hb ^ (hw << 1 | hw >> 63) ^ ((uint64_t)m_sz_x << 48 | (uint64_t)m_sz_y << 32);
+    }
     bool position_empty_p() const
     {
         return m_stones_b->popcnt() == 0 && m_stones_w->popcnt() == 0;
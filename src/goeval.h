@@ -1,6 +1,12 @@
 #ifndef GOEVAL_H
 #define GOEVAL_H
 
+#include <cstdint>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
 struct analyzer_id
 {
     std::string engine;
@@ -17,14 +23,40 @@ struct analyzer_id
     }
 };
 
+/* Evaluations do not carry an analyzer_id around; instead they hold an index
+   into a table of interned ids.  There are only ever a handful of distinct
+   engine/komi combinations, so the table is never pruned.  It is shared by all
+   game records, since PV subtrees and copied nodes move freely between them.
+   Index 0 is always the default-constructed (anonymous) analyzer_id.  */
+typedef uint16_t an_id_t;
+
+extern an_id_t            intern_analyzer_id(const analyzer_id &);
+extern const analyzer_id &analyzer_from_idx(an_id_t);
+
 struct eval
 {
     int visits = 0;
+    /* Index into the analyzer table, see above.  */
+    an_id_t id = 0;
     /* The score is stored from Black's perspective, as is the winrate.  */
-    double      score_mean   = 0;
-    double      score_stddev = 0;
-    double      wr_black     = 0.5;
-    analyzer_id id;
+    double score_mean   = 0;
+    double score_stddev = 0;
+    double wr_black     = 0.5;
+
+    const analyzer_id &analyzer() const
+    {
+        return analyzer_from_idx(id);
+    }
+};
+
+static_assert(std::is_trivially_copyable<eval>::value, "eval must remain a plain fixed-size record");
+
+/* A variation reported by an analysis engine: its moves, and the evaluation of
+   the first one.  */
+struct analysis_pv
+{
+    std::vector<std::pair<int, int>> moves;
+    eval                             ev;
 };
 
 #endif
@@ -1,6 +1,24 @@
 #include "gogame.h"
 #include "goboard.h"
-#include "svgbuilder.h"
+
+static std::vector<analyzer_id> analyzer_table(1);
+
+an_id_t intern_analyzer_id(const analyzer_id &id)
+{
+    size_t n = analyzer_table.size();
+    for (size_t i = 0; i < n; i++)
+        if (analyzer_table[i] == id)
+            return i;
+    if (n > UINT16_MAX)
+        throw std::length_error("too many distinct analyzers");
+    analyzer_table.push_back(id);
+    return n;
+}
+
+const analyzer_id &analyzer_from_idx(an_id_t idx)
+{
+    return analyzer_table[idx];
+}
 
 bool game_state::valid_move_p(int x, int y, stone_color col)
 {
@@ -30,47 +48,91 @@ const go_board game_state::child_moves(const game_state *excluding, bool exclude
     return b;
 }
 
-visual_tree::visual_tree(visual_tree &main_var, int max_child_width) : m_rep(1 + max_child_width, main_var.height())
+visual_tree::visual_tree(visual_tree &main_var, int max_child_width)
+    : m_top(1 + max_child_width, INT_MAX), m_bottom(1 + max_child_width, -1), m_h(main_var.height())
 {
-    m_rep.ior(main_var.m_rep, 1, 0);
+    std::copy(main_var.m_top.begin(), main_var.m_top.end(), m_top.begin() + 1);
+    std::copy(main_var.m_bottom.begin(), main_var.m_bottom.end(), m_bottom.begin() + 1);
     main_var.m_off_y = 0;
-    m_rep.set_bit(0, 0);
+    m_top[0]         = 0;
+    m_bottom[0]      = 0;
 }
 
 void visual_tree::add_variation(visual_tree &other)
 {
-    m_rep.set_max_width(other.width() + 1);
+    size_t w = other.width() + 1;
+    if (m_top.size() < w)
+    {
+        m_top.resize(w, INT_MAX);
+        m_bottom.resize(w, -1);
+    }
 
-    /* Find the highest offset that does not cause overlap.  */
-    int i = height();
-    while (i-- > 0)
-        if (m_rep.test_overlap(other.m_rep, 1, i))
-            break;
+    /* Find the highest offset that does not cause overlap.  Sliding the variation
+       up from below, it first collides where our bottom contour comes closest to
+       its top contour.  */
+    int off = 0;
+    for (size_t x = 1; x < w; x++)
+        if (m_bottom[x] >= 0 && other.m_bottom[x - 1] >= 0)
+            off = std::max(off, m_bottom[x] - other.m_top[x - 1] + 1);
 
-    other.m_off_y = i + 1;
-    m_rep.set_max_height(std::max(height(), other.m_off_y + other.height()));
-    m_rep.ior(other.m_rep, 1, other.m_off_y);
+    other.m_off_y = off;
+    m_h           = std::max(m_h, off + other.m_h);
+    for (size_t x = 1; x < w; x++)
+        if (other.m_bottom[x - 1] >= 0)
+        {
+            m_top[x]    = std::min(m_top[x], other.m_top[x - 1] + off);
+            m_bottom[x] = std::max(m_bottom[x], other.m_bottom[x - 1] + off);
+        }
 
     /* Show conflicts for the connecting lines as well.  */
-    for (int y = 1; y < other.m_off_y; y++)
-        m_rep.set_bit(0, y);
+    m_bottom[0] = std::max(m_bottom[0], off - 1);
 }
 
 bool game_state::update_visualization(bool hide_figures)
 {
-    bool changes   = false;
-    int  max_width = 1;
+    int first_row, end_row;
+    return update_visualization(hide_figures, first_row, end_row);
+}
+
+bool game_state::update_visualization(bool hide_figures, int &first_row, int &end_row)
+{
+    bool self_ok = m_visual_ok && m_visual_hide_figs == hide_figures;
+    if (self_ok && m_visual_subtree_ok)
+        return false;
+
+    /* Where each child was placed before, and which of its rows changed.
+       Only tracked if our own structure is unchanged; otherwise everything is
+       considered changed, and a collapsed node does not show its children.  */
+    struct placement
+    {
+        int  off, height;
+        bool shown;
+        int  first_changed, end_changed;
+    };
+    std::vector<placement> old_places;
+    bool                   track = self_ok && !m_visual_collapse;
+    if (track)
+        old_places.reserve(m_children.size());
+
+    bool changes    = !self_ok;
+    int  max_width  = 1;
+    int  old_height = m_visualized.height();
     for (auto &it : m_children)
     {
-        changes |= it->update_visualization(hide_figures);
+        placement p {it->m_visualized.y_offset(), it->m_visualized.height(), it->m_visual_shown, 0, 0};
+        changes |= it->update_visualization(hide_figures, p.first_changed, p.end_changed);
         bool show = it == m_children[0] || !it->has_figure() || !hide_figures;
         changes |= show != it->m_visual_shown;
         it->m_visual_shown = show;
         if (it->m_visual_shown)
             max_width = std::max(max_width, it->m_visualized.width());
+        if (track)
+            old_places.push_back(p);
     }
+    m_visual_subtree_ok = true;
+    m_visual_hide_figs  = hide_figures;
 
-    if (!changes && m_visual_ok)
+    if (!changes)
         return false;
     if (m_children.size() == 0 || m_visual_collapse)
     {
@@ -87,110 +149,87 @@ bool game_state::update_visualization(bool hide_figures)
         }
     }
     m_visual_ok = true;
-    return true;
-}
-
-/* CX and CY are the cumulative offsets from the root node, and should count in pixels.
-   They give the center of the node; modulo that they are multiples of SIZE.
-   FIRST is true if this is the first node in a subtree.  It means we should draw a straight
-   line to the end.  */
-void game_state::render_visualization(int cx, int cy, int size, const draw_line &line_fn, bool first)
-{
-    size_t n_children = m_children.size();
-
-    if (m_visual_collapse && n_children > 0)
-    {
-        line_fn(cx, cy, cx + size, cy, true);
-        return;
-    }
 
-    if (n_children > 0 && !m_visual_collapse)
+    int all_rows = std::max(old_height, m_visualized.height());
+    first_row    = self_ok ? INT_MAX : 0;
+    end_row      = self_ok ? 0 : all_rows;
+    for (size_t i = 0; i < old_places.size(); i++)
     {
-        if (first)
+        const placement &p   = old_places[i];
+        game_state      *c   = m_children[i];
+        int              off = c->m_visualized.y_offset();
+        int              h   = c->m_visualized.height();
+        if (p.shown != c->m_visual_shown)
         {
-            game_state *p     = this;
-            int         count = 0;
-            while (p && !p->m_visual_collapse && p->m_children.size() > 0)
-            {
-                count++;
-                p = p->m_children[0];
-            }
-            line_fn(cx, cy, cx + size * count, cy, false);
+            /* Affects the hidden-figure marker on our own row as well.  */
+            first_row = 0;
+            end_row   = all_rows;
+            break;
         }
-        size_t last_idx = m_children.size();
-        while (last_idx-- > 0 && !m_children[last_idx]->m_visual_shown)
-            /* nothing */;
-
-        game_state *last = m_children[last_idx];
-        int         yoff = last->m_visualized.y_offset() - 1;
-        if (last_idx > 0 && yoff > 0)
+        if (!p.shown)
+            continue;
+        if (off != p.off || h != p.height)
         {
-            line_fn(cx, cy + size * 0.45, cx, cy + size * yoff, false);
+            first_row = std::min(first_row, std::min(off, p.off));
+            end_row   = std::max(end_row, std::max(off + h, p.off + p.height));
         }
-        for (auto it : m_children)
+        else if (p.end_changed > p.first_changed)
         {
-            if (!it->m_visual_shown)
-                continue;
-            int y0 = it->m_visualized.y_offset() * size;
-            int y1 = y0;
-            if (y0 > 0)
-            {
-                y0 -= size;
-                line_fn(cx, cy + y0, cx + size, cy + y1, false);
-            }
+            first_row = std::min(first_row, off + p.first_changed);
+            end_row   = std::max(end_row, off + p.end_changed);
         }
     }
-
-    for (auto &it : m_children)
-    {
-        if (!it->m_visual_shown)
-            continue;
-        int yoff = it->m_visualized.y_offset();
-        it->render_visualization(cx + size, cy + size * yoff, size, line_fn, it != m_children[0]);
-    }
+    if (first_row >= end_row)
+        first_row = end_row = 0;
+    return true;
 }
 
-void game_state::extract_visualization(int                    x,
-                                       int                    y,
-                                       visual_tree::bit_rect &stones_w,
-                                       visual_tree::bit_rect &stones_b,
-                                       visual_tree::bit_rect &edits,
-                                       visual_tree::bit_rect &collapsed,
-                                       visual_tree::bit_rect &figures,
-                                       visual_tree::bit_rect &hidden_figs)
+/* X and Y give this node's cell in the visualization.  Only nodes whose subtree's box
+   intersects the cells [X0, X1) x [Y0, Y1) are visited, so the cost is proportional to
+   the visible area rather than the size of the tree.  NODE_FN is called for each visited
+   node, with a flag indicating whether it has children hidden as figures.  LINE_FN draws
+   the connecting lines going out from each visited node, in pixels, using SIZE as the
+   size of a cell.  */
+void game_state::render_visualization(int x, int y, int x0, int y0, int x1, int y1, int size, const add_node &node_fn, const draw_line &line_fn)
 {
-    size_t n_children = m_children.size();
+    if (x >= x1 || y >= y1 || x + m_visualized.width() <= x0 || y + m_visualized.height() <= y0)
+        return;
 
-    if (m_visual_collapse && n_children > 0)
-    {
-        collapsed.set_bit(x, y);
+    size_t n_children  = m_children.size();
+    bool   hidden_figs = false;
+    for (auto it : m_children)
+        if (!it->m_visual_shown)
+            hidden_figs = true;
+    node_fn(this, x, y, hidden_figs && !m_visual_collapse);
+
+    if (n_children == 0)
         return;
-    }
-    switch (m_move_color)
-    {
-    case none:
-        edits.set_bit(x, y);
-        break;
-    case white:
-        stones_w.set_bit(x, y);
-        break;
-    case black:
-        stones_b.set_bit(x, y);
-        break;
-    }
-    if (has_figure())
-        figures.set_bit(x, y);
-    for (auto &it : m_children)
+
+    int cx = x * size + size / 2;
+    int cy = y * size + size / 2;
+    if (m_visual_collapse)
     {
-        if (it != m_children[0] && !it->m_visual_shown)
-            hidden_figs.set_bit(x, y);
+        line_fn(cx, cy, cx + size, cy, true);
+        return;
     }
-    for (auto &it : m_children)
+    line_fn(cx, cy, cx + size, cy, false);
+
+    size_t last_idx = n_children;
+    while (last_idx-- > 0 && !m_children[last_idx]->m_visual_shown)
+        /* nothing */;
+
+    int yoff = m_children[last_idx]->m_visualized.y_offset() - 1;
+    if (last_idx > 0 && yoff > 0)
+        line_fn(cx, cy + size * 0.45, cx, cy + size * yoff, false);
+
+    for (auto it : m_children)
     {
         if (!it->m_visual_shown)
             continue;
-        int yoff = it->m_visualized.y_offset();
-        it->extract_visualization(x + 1, y + yoff, stones_w, stones_b, edits, collapsed, figures, hidden_figs);
+        int child_y = y + it->m_visualized.y_offset();
+        if (child_y > y)
+            line_fn(cx, cy + (child_y - y - 1) * size, cx + size, cy + (child_y - y) * size, false);
+        it->render_visualization(x + 1, child_y, x0, y0, x1, y1, size, node_fn, line_fn);
     }
 }
 
@@ -248,7 +287,7 @@ game_state *game_state::locate_by_vis_coords(int x, int y, int off_x, int off_y)
 {
     if (off_x == x && off_y == y)
         return this;
-    if (x < off_x || y < off_y)
+    if (x < off_x || y < off_y || m_visual_collapse)
         return nullptr;
     if (x >= off_x + m_visualized.width() || y >= off_y + m_visualized.height())
         return nullptr;
@@ -343,11 +382,15 @@ void game_state::update_eval(const eval &ev)
         if (ev.id == ours.id)
         {
             if (ev.visits > ours.visits)
-                ours = ev;
+            {
+                ours         = ev;
+                m_eval_stamp = ++tree_root()->m_eval_generation;
+            }
             return;
         }
     }
     m_evals.push_back(ev);
+    m_eval_stamp = ++tree_root()->m_eval_generation;
 }
 
 void game_state::update_eval(const game_state &other)
@@ -361,13 +404,13 @@ eval game_state::best_eval()
     eval best;
     for (auto &it : m_evals)
     {
-        if ((it.id.komi_set && !best.id.komi_set) || it.visits > best.visits)
+        if ((it.analyzer().komi_set && !best.analyzer().komi_set) || it.visits > best.visits)
             best = it;
     }
     return best;
 }
 
-eval game_state::eval_from(const analyzer_id &id, bool require)
+eval game_state::eval_from(an_id_t id, bool require)
 {
     for (auto &it : m_evals)
     {
@@ -377,25 +420,53 @@ eval game_state::eval_from(const analyzer_id &id, bool require)
     return require ? eval() : best_eval();
 }
 
-void game_state::walk_tree(std::function<bool(game_state *)> &func)
+game_state *position_map::find_or_add(game_state *st)
 {
-    /* This function is slightly convoluted, in order to both
-       traverse the main branch first, and avoid recursion while
-       doing so.  */
-    game_state *last = this;
-    while (last != nullptr)
+    const go_board &b     = st->get_board();
+    uint64_t        h     = b.position_hash() ^ ((uint64_t)st->to_move() * 0x5851f42d4c957f2dull);
+    auto            range = m_map.equal_range(h);
+    for (auto it = range.first; it != range.second; ++it)
     {
-        if (!func(last))
-            break;
-        last = last->next_primary_move();
+        game_state *other = it->second;
+        if (other->to_move() == st->to_move() && other->get_board().position_equal_p(b))
+            return other;
     }
-    game_state *st = this;
-    while (st != last)
+    m_map.emplace(h, st);
+    return nullptr;
+}
+
+transposition_list find_transpositions(game_state *root)
+{
+    position_map                             positions;
+    std::unordered_map<game_state *, size_t> groups;
+    transposition_list                       result;
+
+    root->walk_tree([&](game_state *st) -> bool {
+        game_state *first = positions.find_or_add(st);
+        if (first == nullptr)
+            return true;
+        auto it = groups.find(first);
+        if (it == groups.end())
+        {
+            groups.emplace(first, result.size());
+            result.push_back({first, st});
+        }
+        else
+            result[it->second].push_back(st);
+        return true;
+    });
+    return result;
+}
+
+void share_transposition_evals(const transposition_list &groups)
+{
+    for (auto &g : groups)
     {
-        for (auto &it : st->m_children)
-            if (it != st->m_children[0])
-                it->walk_tree(func);
-        st = st->next_primary_move();
+        game_state *first = g[0];
+        for (size_t i = 1; i < g.size(); i++)
+            first->update_eval(*g[i]);
+        for (size_t i = 1; i < g.size(); i++)
+            g[i]->update_eval(*first);
     }
 }
 
@@ -614,11 +685,9 @@ bool navigable_observer::find_move(int x, int y)
 
 bool navigable_observer::goto_nth_move(int n)
 {
-    game_state *st = m_game->get_root();
-    while (st->move_number() < n && st->n_children() > 0)
-    {
-        st = st->next_move(true);
-    }
+    main_line_index &idx = m_game->main_line();
+    game_state      *st  = idx.at(std::min<size_t>(std::max(n, 0), idx.size() - 1));
+    st->make_active();
     move_state(st);
     return st != nullptr;
 }
@@ -627,6 +696,11 @@ bool navigable_observer::goto_nth_move_in_var(int n)
 {
     game_state *st = m_state;
 
+    /* Moving backwards from a node on the main line stays on the main line, so
+       use the index rather than walking.  */
+    if (m_game != nullptr && n >= 0 && n < st->move_number() && m_game->main_line().find(st) >= 0)
+        st = m_game->main_line().at(n);
+
     while (st->move_number() != n)
     {
         game_state *next = st->move_number() < n ? st->next_move() : st->prev_move();
@@ -692,3 +766,86 @@ bool navigable_observer::goto_next_branch()
         move_state(st);
     return st != nullptr;
 }
+
+#ifdef BENCH
+/* Benchmark for the tree traversals.  Build with
+     g++ -O2 -std=c++17 -DTEST -DBENCH gogame.cc goboard.cc
+   plus -I options for the QtCore headers, or with Qt 6 the Core5Compat ones:
+   this is not standalone, since sgf.h includes <QTextCodec>.  No Qt library
+   is linked.  Optionally pass the number of nodes on the command line.  */
+#    include <chrono>
+#    include <cstdio>
+
+template<class F>
+static void time_walk(const char *name, F &&walk)
+{
+    auto   t0  = std::chrono::steady_clock::now();
+    size_t cnt = walk();
+    auto   t1  = std::chrono::steady_clock::now();
+    printf("%-28s %9zu nodes %8.2f ms\n", name, cnt, std::chrono::duration<double, std::milli>(t1 - t0).count());
+}
+
+int main(int argc, char **argv)
+{
+    size_t n_nodes = argc > 1 ? atol(argv[1]) : 1000000;
+
+    /* Build a tree shaped vaguely like a heavily annotated game: long lines,
+       with an occasional variation branching off somewhere earlier.  Small
+       boards keep the memory footprint reasonable.  */
+    game_state               *root = new game_state(5);
+    std::vector<game_state *> nodes {root};
+    game_state               *cur = root;
+    srand(1);
+    while (nodes.size() < n_nodes)
+    {
+        if (rand() % 100 == 0)
+            cur = nodes[rand() % nodes.size()];
+        cur = cur->add_child_pass_nochecks(cur->get_board(), game_state::add_mode::keep_active);
+        nodes.push_back(cur);
+    }
+
+    time_walk("walk_tree", [root]() {
+        size_t cnt = 0;
+        root->walk_tree([&cnt](game_state *) {
+            cnt++;
+            return true;
+        });
+        return cnt;
+    });
+    time_walk("walk_tree (std::function)", [root]() {
+        size_t                            cnt = 0;
+        std::function<bool(game_state *)> f   = [&cnt](game_state *) {
+            cnt++;
+            return true;
+        };
+        root->walk_tree(f);
+        return cnt;
+    });
+    time_walk("walk_preorder", [root]() {
+        size_t cnt = 0;
+        root->walk_preorder([&cnt](game_state *) {
+            cnt++;
+            return true;
+        });
+        return cnt;
+    });
+    time_walk("walk_leaves", [root]() {
+        size_t cnt = 0;
+        root->walk_leaves([&cnt](game_state *) {
+            cnt++;
+            return true;
+        });
+        return cnt;
+    });
+    time_walk("walk_main_line", [root]() {
+        size_t cnt = 0;
+        root->walk_main_line([&cnt](game_state *) {
+            cnt++;
+            return true;
+        });
+        return cnt;
+    });
+    delete root;
+    return 0;
+}
+#endif
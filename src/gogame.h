@@ -1,7 +1,9 @@
 #ifndef GOGAME_H
 #define GOGAME_H
 
+#include <climits>
 #include <functional>
+#include <unordered_map>
 
 #include "goboard.h"
 #include "goeval.h"
@@ -20,84 +22,32 @@ inline std::string komi_str(double k)
 
 class visual_tree
 {
-public:
-    struct bit_rect
-    {
-        std::vector<bit_array> m_rep;
-        int                    m_w, m_h;
-        bit_rect(int w, int h) : m_w(w), m_h(h)
-        {
-            for (int i = 0; i < h; i++)
-                m_rep.emplace_back(m_w);
-        }
-        void set_bit(int x, int y)
-        {
-            m_rep[y].set_bit(x);
-        }
-        bool test_bit(int x, int y)
-        {
-            return m_rep[y].test_bit(x);
-        }
-        void ior(const bit_rect &other, int xoff, int yoff)
-        {
-            for (int i = 0; i < other.m_h; i++)
-                m_rep[yoff + i].ior(other.m_rep[i], xoff);
-        }
-        bool test_overlap(const bit_rect &other, int xoff, int yoff)
-        {
-            for (int y = yoff; y < m_h && y - yoff < other.m_h; y++)
-                if (m_rep[y].intersect_p(other.m_rep[y - yoff], xoff))
-                    return true;
-            return false;
-        }
-        void set_max_width(int x)
-        {
-            if (x <= m_w)
-                return;
-            m_w = x;
-            for (auto &vec : m_rep)
-                vec.grow(m_w);
-        }
-        void set_max_height(int h)
-        {
-            while (m_h < h)
-            {
-                m_rep.emplace_back(m_w);
-                m_h++;
-            }
-        }
-    };
-
 private:
-    bit_rect m_rep;
+    /* For each column, the first and last row occupied by a node or by a
+       connecting line.  Packing variations against these contours gives the
+       same placement as testing full bitmaps for overlap, at a fraction of the
+       cost.  Empty columns hold INT_MAX and -1.  */
+    std::vector<int> m_top, m_bottom;
+    int              m_h = 1;
     /* The offset from the parent's box.  */
     int m_off_y = 0;
 
 public:
-    visual_tree(bool collapsed = false) : m_rep(collapsed ? 2 : 1, 1)
-    {
-        m_rep.set_bit(0, 0);
-        if (m_rep.m_w == 2)
-            m_rep.set_bit(1, 0);
-    }
+    visual_tree(bool collapsed = false) : m_top(collapsed ? 2 : 1, 0), m_bottom(collapsed ? 2 : 1, 0) {}
     visual_tree(visual_tree &main_var, int max_child_width);
     void add_variation(visual_tree &other);
     int  width() const
     {
-        return m_rep.m_w;
+        return m_top.size();
     }
     int height() const
     {
-        return m_rep.m_h;
+        return m_h;
     }
     int y_offset() const
     {
         return m_off_y;
     }
-    const bit_rect &representation()
-    {
-        return m_rep;
-    }
 };
 
 class game_state
@@ -135,9 +85,14 @@ private:
     /* Default initialized to a one-node tree, which is up-to-date when
      * initialized without children.  */
     visual_tree m_visualized;
-    /* The visualization is up-to-date iff both this variable is true, and none of
-       the children require updates.  */
+    /* The visualization is up-to-date iff this variable is true, none of the
+       children require updates, and it was computed with the current figure
+       hiding setting.  */
     bool m_visual_ok = true;
+    /* False if some descendant has m_visual_ok cleared.  If a node has this set,
+       all of its ancestors do as well, so clean subtrees need not be visited.  */
+    bool m_visual_subtree_ok = true;
+    bool m_visual_hide_figs  = false;
     /* True if we should not be showing child nodes.  Always false if no children
      * exist.  */
     bool m_visual_collapse = false;
@@ -152,9 +107,21 @@ private:
     std::vector<eval> m_evals;
     eval              m_live_eval;
 
+    /* The eval generation of the tree when m_evals last changed.  */
+    unsigned long m_eval_stamp = 0;
+
     /* Support for SGF VW.  */
     bit_array *m_visible {};
 
+    /* Only used in the root node: incremented whenever nodes are added to or
+       removed from this game tree.  Used to invalidate cached information about
+       tree structure, such as main_line_index, without disturbing the caches
+       of other games.  */
+    unsigned long m_structure_generation = 0;
+    /* Likewise, incremented whenever an evaluation is stored in a node of this
+       tree.  */
+    unsigned long m_eval_generation = 0;
+
     game_state(const go_board &b, int move, int sgf_move, game_state *parent, stone_color to_move)
         : m_board(b), m_move_number(move), m_sgf_movenum(sgf_move), m_parent(parent), m_to_move(to_move)
     {
@@ -260,7 +227,7 @@ public:
                      other.m_move_color,
                      other.m_unrecognized_props,
                      other.m_visualized,
-                     other.m_visual_ok,
+                     other.m_visual_ok && other.m_visual_subtree_ok,
                      other.m_visible)
     {
         for (auto c : other.m_children)
@@ -300,7 +267,8 @@ public:
             if (i == parent->m_active && i > 0)
                 parent->m_active--;
 
-            parent->m_visual_ok = false;
+            parent->invalidate_visual();
+            parent->structure_changed();
             if (parent->m_children.size() == 0)
                 parent->m_visual_collapse = false;
 #if 0
@@ -434,6 +402,19 @@ public:
             m_stonesleft_b = tm;
     }
 
+    unsigned long structure_generation()
+    {
+        return tree_root()->m_structure_generation;
+    }
+    unsigned long eval_generation()
+    {
+        return tree_root()->m_eval_generation;
+    }
+    unsigned long eval_stamp() const
+    {
+        return m_eval_stamp;
+    }
+
     void remove_observer(const observer *o) const
     {
         for (auto it = m_observers.begin(); it != m_observers.end(); ++it)
@@ -489,8 +470,28 @@ public:
     };
 
 private:
+    /* Mark our own layout as out of date, and let the ancestors know they have
+       a descendant that needs to be visited.  */
+    void invalidate_visual()
+    {
+        m_visual_ok = false;
+        for (game_state *p = m_parent; p != nullptr && p->m_visual_subtree_ok; p = p->m_parent)
+            p->m_visual_subtree_ok = false;
+    }
+    game_state *tree_root()
+    {
+        game_state *r = this;
+        while (r->m_parent != nullptr)
+            r = r->m_parent;
+        return r;
+    }
+    void structure_changed()
+    {
+        tree_root()->m_structure_generation++;
+    }
     game_state *insert_child(game_state *tmp, add_mode am)
     {
+        structure_changed();
         if (am == add_mode::set_main)
         {
             m_children.insert(std::begin(m_children), tmp);
@@ -506,7 +507,7 @@ private:
 public:
     game_state *add_child_edit_nochecks(const go_board &new_board, stone_color to_move, bool scored, add_mode am)
     {
-        m_visual_ok      = false;
+        invalidate_visual();
         int         code = scored ? -3 : -2;
         game_state *tmp  = new game_state(new_board, m_move_number + 1, m_sgf_movenum + 1, this, to_move, code, code, none);
         return insert_child(tmp, am);
@@ -522,8 +523,8 @@ public:
     game_state *add_child_move_nochecks(const go_board &new_board, stone_color to_move, int x, int y, add_mode am)
     {
         stone_color next_to_move = to_move == black ? white : black;
-        m_visual_ok              = false;
-        game_state *tmp          = new game_state(new_board, m_move_number + 1, m_sgf_movenum + 1, this, next_to_move, x, y, to_move);
+        invalidate_visual();
+        game_state *tmp = new game_state(new_board, m_move_number + 1, m_sgf_movenum + 1, this, next_to_move, x, y, to_move);
         return insert_child(tmp, am);
     }
 
@@ -560,7 +561,7 @@ public:
     }
     game_state *add_child_pass_nochecks(const go_board &new_board, add_mode am)
     {
-        m_visual_ok       = false;
+        invalidate_visual();
         game_state *tmp   = new game_state(new_board, m_move_number + 1, m_sgf_movenum + 1, this, m_to_move == black ? white : black);
         tmp->m_move_color = m_to_move;
         return insert_child(tmp, am);
@@ -580,7 +581,12 @@ public:
     {
         m_children.push_back(other);
         other->m_parent = this;
-        m_visual_ok     = false;
+        invalidate_visual();
+        structure_changed();
+        /* Keep the eval stamps of the new nodes below the counter they are now
+           compared with.  */
+        game_state *r        = tree_root();
+        r->m_eval_generation = std::max(r->m_eval_generation, other->m_eval_generation);
     }
     bool valid_move_p(int x, int y, stone_color);
     void toggle_group_alive(int x, int y)
@@ -684,8 +690,9 @@ public:
     {
         std::vector<game_state *> tmp;
         std::swap(tmp, m_children);
-        m_active    = 0;
-        m_visual_ok = false;
+        m_active = 0;
+        invalidate_visual();
+        structure_changed();
         for (auto it : tmp)
             it->m_parent = nullptr;
         return tmp;
@@ -735,13 +742,14 @@ public:
     void update_eval(const eval &);
     void update_eval(const game_state &other);
     eval best_eval();
-    eval eval_from(const analyzer_id &id, bool require);
-    void collect_analyzers(std::function<void(const analyzer_id &, bool)> &callback)
+    eval eval_from(an_id_t id, bool require);
+    template<class F>
+    void collect_analyzers(F &&callback) const
     {
         for (auto &it : m_evals)
             callback(it.id, it.score_stddev != 0);
     }
-    void set_eval_data(int visits, double winrate_black, analyzer_id id)
+    void set_eval_data(int visits, double winrate_black, an_id_t id)
     {
         eval ev;
         ev.visits   = visits;
@@ -749,7 +757,7 @@ public:
         ev.id       = id;
         update_eval(ev);
     }
-    void set_eval_data(int visits, double winrate_black, double scorem, double scored, analyzer_id id)
+    void set_eval_data(int visits, double winrate_black, double scorem, double scored, an_id_t id)
     {
         eval ev;
         ev.visits       = visits;
@@ -759,7 +767,7 @@ public:
         ev.score_stddev = scored;
         update_eval(ev);
     }
-    bool find_eval(const analyzer_id &id, eval &ev)
+    bool find_eval(an_id_t id, eval &ev)
     {
         for (auto &e : m_evals)
             if (e.id == id)
@@ -796,7 +804,7 @@ public:
     void set_figure(int flags, const std::string &title)
     {
         if (!m_figure.present)
-            m_visual_ok = false;
+            invalidate_visual();
         m_figure.present = true;
         m_figure.flags   = flags;
         m_figure.title   = title;
@@ -804,7 +812,7 @@ public:
     void clear_figure()
     {
         if (m_figure.present)
-            m_visual_ok = false;
+            invalidate_visual();
         m_figure.present = false;
     }
     const bit_array *visible() const
@@ -828,23 +836,19 @@ public:
         delete m_visible;
         m_visible = v;
     }
-    /* Return true if a change was made.  */
-    bool                                                  update_visualization(bool hide_figures);
-    typedef std::function<void(int, int, int, int, bool)> draw_line;
-    typedef std::function<void(int, int)>                 add_point;
-    void                                                  extract_visualization(int                    x,
-                                                                                int                    y,
-                                                                                visual_tree::bit_rect &stones_w,
-                                                                                visual_tree::bit_rect &stones_b,
-                                                                                visual_tree::bit_rect &edits,
-                                                                                visual_tree::bit_rect &collapsed,
-                                                                                visual_tree::bit_rect &figures,
-                                                                                visual_tree::bit_rect &hidden_figs);
-    void                                                  render_visualization(int, int, int, const draw_line &, bool first);
-    void                                                  render_active_trace(int, int, int, const add_point &, const draw_line &);
-    bool                                                  locate_visual(int, int, const game_state *active, int &, int &);
-    game_state                                           *locate_by_vis_coords(int x, int y, int off_x, int off_y);
-    const visual_tree                                    &visualization()
+    /* Return true if a change was made.  The second form also returns the range of
+       rows, relative to this node, whose contents may have changed.  */
+    bool                                                     update_visualization(bool hide_figures);
+    bool                                                     update_visualization(bool hide_figures, int &first_row, int &end_row);
+    typedef std::function<void(int, int, int, int, bool)>    draw_line;
+    typedef std::function<void(int, int)>                    add_point;
+    typedef std::function<void(game_state *, int, int, bool)> add_node;
+    void                                                     render_visualization(int x, int y, int x0, int y0, int x1, int y1, int size,
+                                                                                  const add_node &, const draw_line &);
+    void                                                     render_active_trace(int, int, int, const add_point &, const draw_line &);
+    bool                                                     locate_visual(int, int, const game_state *active, int &, int &);
+    game_state                                              *locate_by_vis_coords(int x, int y, int off_x, int off_y);
+    const visual_tree                                       &visualization()
     {
         return m_visualized;
     }
@@ -854,7 +858,7 @@ public:
             return;
 
         m_visual_collapse = !m_visual_collapse;
-        m_visual_ok       = false;
+        invalidate_visual();
     }
     bool vis_collapsed()
     {
@@ -868,9 +872,151 @@ public:
        the case.  */
     bool vis_expand_one();
 
-    void walk_tree(std::function<bool(game_state *)> &);
+    /* Tree traversals.  These are templates so that the visitor is inlined;
+       they do not recurse, so arbitrarily deep trees are fine.
+
+       walk_tree visits the main branch first, then the variations branching
+       off it, from the top down, each in the same order.  If the visitor
+       returns false for a node, that node's descendants along the line are
+       skipped, but traversal continues with the variations before it.  */
+    template<class F>
+    void walk_tree(F &&func)
+    {
+        std::vector<game_state *> lines {this};
+        std::vector<game_state *> branches;
+        while (!lines.empty())
+        {
+            game_state *start = lines.back();
+            lines.pop_back();
+
+            game_state *last = start;
+            while (last != nullptr)
+            {
+                if (!func(last))
+                    break;
+                last = last->next_primary_move();
+            }
+            branches.clear();
+            for (game_state *st = start; st != last; st = st->next_primary_move())
+                for (size_t i = 1; i < st->m_children.size(); i++)
+                    branches.push_back(st->m_children[i]);
+            lines.insert(lines.end(), branches.rbegin(), branches.rend());
+        }
+    }
+    /* Plain depth-first pre-order traversal, children in order.  The whole walk
+       stops as soon as the visitor returns false, in which case we return
+       false.  */
+    template<class F>
+    bool walk_preorder(F &&func)
+    {
+        std::vector<game_state *> stack {this};
+        while (!stack.empty())
+        {
+            game_state *st = stack.back();
+            stack.pop_back();
+            if (!func(st))
+                return false;
+            stack.insert(stack.end(), st->m_children.rbegin(), st->m_children.rend());
+        }
+        return true;
+    }
+    /* Visit this node and its primary successors, stopping early if the visitor
+       returns false.  */
+    template<class F>
+    bool walk_main_line(F &&func)
+    {
+        for (game_state *st = this; st != nullptr; st = st->next_primary_move())
+            if (!func(st))
+                return false;
+        return true;
+    }
+    /* Visit the leaves of the subtree in pre-order, stopping early if the visitor
+       returns false.  */
+    template<class F>
+    bool walk_leaves(F &&func)
+    {
+        return walk_preorder([&func](game_state *st) -> bool { return st->m_children.size() > 0 || func(st); });
+    }
+};
+
+/* A cache of the nodes along the main line of a game tree, i.e. the root and
+   its successive first children, so that the node for a given move number can
+   be found without walking the tree.  It is rebuilt lazily whenever the
+   structure of a game tree has changed since it was last used.  */
+class main_line_index
+{
+    game_state               *m_root;
+    std::vector<game_state *> m_nodes;
+    unsigned long             m_generation = 0;
+    bool                      m_valid      = false;
+
+    void refresh()
+    {
+        if (m_valid && m_generation == m_root->structure_generation())
+            return;
+        m_nodes.clear();
+        for (game_state *st = m_root; st != nullptr; st = st->next_primary_move())
+            m_nodes.push_back(st);
+        m_generation = m_root->structure_generation();
+        m_valid      = true;
+    }
+
+public:
+    main_line_index(game_state *root) : m_root(root) {}
+    /* Don't copy the cache along with the game record; the copy has a
+       different root.  */
+    main_line_index(const main_line_index &) = delete;
+    main_line_index &operator=(const main_line_index &) = delete;
+
+    size_t size()
+    {
+        refresh();
+        return m_nodes.size();
+    }
+    /* Return the Nth node along the main line, or nullptr if it isn't that
+       long.  */
+    game_state *at(size_t n)
+    {
+        refresh();
+        return n < m_nodes.size() ? m_nodes[n] : nullptr;
+    }
+    /* Return the position of ST along the main line, or -1 if it is not on it.  */
+    int find(const game_state *st)
+    {
+        refresh();
+        int n = st->move_number() - m_root->move_number();
+        if (n < 0 || (size_t)n >= m_nodes.size() || m_nodes[n] != st)
+            return -1;
+        return n;
+    }
+    const std::vector<game_state *> &nodes()
+    {
+        refresh();
+        return m_nodes;
+    }
 };
 
+/* Used to detect transpositions: nodes with the same position and the same
+   player to move.  */
+class position_map
+{
+    std::unordered_multimap<uint64_t, game_state *> m_map;
+
+public:
+    /* Return a previously added node which is a transposition of ST, or add ST
+       and return nullptr if there is none.  */
+    game_state *find_or_add(game_state *st);
+};
+
+/* Find transpositions within the tree rooted at ROOT: groups of nodes which
+   have the same position and the same player to move.  Each group has at least
+   two members, listed in walk_tree order, so the first one is the node closest
+   to the main line.  */
+typedef std::vector<std::vector<game_state *>> transposition_list;
+extern transposition_list find_transpositions(game_state *root);
+/* Make all nodes within each group share their evaluations.  */
+extern void share_transposition_evals(const transposition_list &);
+
 class sgf;
 class game_record;
 
@@ -1125,6 +1271,7 @@ class game_record : public game_info
     game_state         m_root;
     bool               m_modified = false;
     sgf_errors         m_errors;
+    main_line_index    m_main_line {&m_root};
 
 public:
     game_record(int size, const game_info &info) : game_info(info), m_root(size) {}
@@ -1135,6 +1282,10 @@ public:
     {
         return &m_root;
     }
+    main_line_index &main_line()
+    {
+        return m_main_line;
+    }
     bool replace_root(const go_board &b, stone_color to_move)
     {
         if (m_root.n_children() > 0)
@@ -0,0 +1,358 @@
+#include "gtpinfo.h"
+
+static inline bool is_space(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+static inline bool is_digit(char c)
+{
+    return c >= '0' && c <= '9';
+}
+
+static bool number_token(std::string_view tok)
+{
+    char c = tok[0];
+    return is_digit(c) || c == '-' || c == '+' || c == '.';
+}
+
+static bool vertex_token(std::string_view tok)
+{
+    if (tok == "pass")
+        return true;
+    if (tok.size() < 2 || !((tok[0] >= 'A' && tok[0] <= 'Z') || (tok[0] >= 'a' && tok[0] <= 'z')))
+        return false;
+    for (size_t i = 1; i < tok.size(); i++)
+        if (!is_digit(tok[i]))
+            return false;
+    return true;
+}
+
+bool gtp_info_parser::next_token(std::string_view &list, std::string_view &tok)
+{
+    size_t len = list.size();
+    size_t i   = 0;
+    while (i < len && is_space(list[i]))
+        i++;
+    if (i == len)
+    {
+        list = std::string_view();
+        return false;
+    }
+    size_t start = i;
+    while (i < len && !is_space(list[i]))
+        i++;
+    tok  = list.substr(start, i - start);
+    list = list.substr(i);
+    return true;
+}
+
+bool gtp_info_parser::parse_int(std::string_view s, int &val)
+{
+    size_t i   = 0;
+    bool   neg = false;
+    if (i < s.size() && (s[i] == '-' || s[i] == '+'))
+        neg = s[i++] == '-';
+    if (i == s.size())
+        return false;
+    int v = 0;
+    for (; i < s.size(); i++)
+    {
+        if (!is_digit(s[i]))
+            return false;
+        v = v * 10 + (s[i] - '0');
+    }
+    val = neg ? -v : v;
+    return true;
+}
+
+/* We can't use strtod, as it depends on the locale, and Qt sets that from the
+   environment.  This is accurate enough for anything an engine prints.  */
+bool gtp_info_parser::parse_double(std::string_view s, double &val)
+{
+    size_t i = 0, len = s.size();
+    bool   neg = false;
+    if (i < len && (s[i] == '-' || s[i] == '+'))
+        neg = s[i++] == '-';
+
+    double mant   = 0;
+    int    exp    = 0;
+    bool   digits = false;
+    for (; i < len && is_digit(s[i]); i++, digits = true)
+        mant = mant * 10 + (s[i] - '0');
+    if (i < len && s[i] == '.')
+        for (i++; i < len && is_digit(s[i]); i++, digits = true)
+        {
+            mant = mant * 10 + (s[i] - '0');
+            exp--;
+        }
+    if (!digits)
+        return false;
+    if (i < len && (s[i] == 'e' || s[i] == 'E'))
+    {
+        int e;
+        if (!parse_int(s.substr(i + 1), e))
+            return false;
+        exp += e;
+        i = len;
+    }
+    if (i != len)
+        return false;
+
+    static const double pow10[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16};
+    while (exp < -16)
+    {
+        mant /= 1e16;
+        exp += 16;
+    }
+    while (exp > 16)
+    {
+        mant *= 1e16;
+        exp -= 16;
+    }
+    mant = exp < 0 ? mant / pow10[-exp] : mant * pow10[exp];
+    val  = neg ? -mant : mant;
+    return true;
+}
+
+bool gtp_info_parser::parse_vertex(std::string_view s, int size_x, int size_y, int &x, int &y)
+{
+    int row;
+    if (s.size() < 2 || !parse_int(s.substr(1), row) || s[1] == '-' || s[1] == '+')
+        return false;
+    int i = s[0] - 'A';
+    if (i > 7)
+        i--;
+    int j = size_y - row;
+    if (i < 0 || i >= size_x || j < 0 || j >= size_y)
+        return false;
+    x = i;
+    y = j;
+    return true;
+}
+
+size_t gtp_info_parser::parse_values(std::string_view list, double *out, size_t max)
+{
+    std::string_view tok;
+    size_t           n = 0;
+    while (n < max && next_token(list, tok) && parse_double(tok, out[n]))
+        n++;
+    return n;
+}
+
+bool gtp_info_parser::take_token(std::string_view &tok)
+{
+    while (m_p < m_end && is_space(*m_p))
+        m_p++;
+    if (m_p == m_end)
+        return false;
+    const char *start = m_p;
+    while (m_p < m_end && !is_space(*m_p))
+        m_p++;
+    tok = std::string_view(start, m_p - start);
+    return true;
+}
+
+/* Consume the longest run of tokens for which PRED is true, and return it as one
+   view.  Leaves the position before the first token that doesn't match.  */
+std::string_view gtp_info_parser::take_run(bool (*pred)(std::string_view))
+{
+    const char *start = nullptr;
+    const char *end   = m_p;
+    for (;;)
+    {
+        const char      *save = m_p;
+        std::string_view tok;
+        if (!take_token(tok) || !pred(tok))
+        {
+            m_p = save;
+            break;
+        }
+        if (start == nullptr)
+            start = tok.data();
+        end = m_p;
+    }
+    return start == nullptr ? std::string_view() : std::string_view(start, end - start);
+}
+
+/* Parse the value(s) for field KEY.  MV is null for fields outside of a candidate
+   move.  Fields we don't know about are skipped along with any numbers following
+   them, which covers things like pvVisits and movesOwnership.  */
+void gtp_info_parser::take_field(std::string_view key, gtp_info_move *mv)
+{
+    if (key == "pv")
+    {
+        std::string_view pv = take_run(vertex_token);
+        if (mv != nullptr)
+            mv->pv = pv;
+        return;
+    }
+    std::string_view vals = take_run(number_token);
+    if (key == "ownership")
+        m_ownership = vals;
+    else if (key == "policy")
+        m_policy = vals;
+    if (mv == nullptr || vals.empty())
+        return;
+
+    std::string_view first;
+    next_token(vals, first);
+    if (key == "visits")
+        parse_int(first, mv->visits);
+    else if (key == "winrate")
+    {
+        if (parse_double(first, mv->winrate) && !m_kata)
+            mv->winrate /= 10000.;
+    }
+    else if (key == "prior")
+    {
+        if (parse_double(first, mv->prior) && !m_kata)
+            mv->prior /= 10000.;
+    }
+    else if (key == "scoreMean")
+        parse_double(first, mv->score_mean);
+    else if (key == "scoreStdev")
+        parse_double(first, mv->score_stddev);
+}
+
+bool gtp_info_parser::next(gtp_info_move &mv)
+{
+    std::string_view tok;
+    while (take_token(tok))
+    {
+        if (tok != "info")
+        {
+            take_field(tok, nullptr);
+            continue;
+        }
+
+        mv = gtp_info_move();
+
+        bool have_move    = false;
+        bool have_visits  = false;
+        bool have_winrate = false;
+        bool have_pv      = false;
+        bool have_mean    = false;
+        bool have_stddev  = false;
+        for (;;)
+        {
+            const char *save = m_p;
+            if (!take_token(tok))
+                break;
+            if (tok == "info")
+            {
+                m_p = save;
+                break;
+            }
+            if (tok == "move")
+            {
+                have_move = take_token(mv.move);
+                continue;
+            }
+            have_visits |= tok == "visits";
+            have_winrate |= tok == "winrate";
+            have_pv |= tok == "pv";
+            have_mean |= tok == "scoreMean";
+            have_stddev |= tok == "scoreStdev";
+            take_field(tok, &mv);
+        }
+        if (have_move && have_visits && have_winrate && have_pv)
+        {
+            mv.have_score = have_mean && have_stddev;
+            return true;
+        }
+    }
+    return false;
+}
+
+#ifdef BENCH
+/* Throughput benchmark.  Build with
+     g++ -O2 -std=c++17 -DBENCH gtpinfo.cc
+   and pass a file of recorded engine output, e.g. saved from the engine log
+   window with kata-analyze running.  Lines not starting with "info move" are
+   ignored.  Without a file, a synthetic 19x19 KataGo update with 50 candidates
+   is used.  */
+#    include <chrono>
+#    include <cstdio>
+#    include <fstream>
+#    include <string>
+#    include <vector>
+
+int main(int argc, char **argv)
+{
+    std::vector<std::string> lines;
+    bool                     kata = true;
+    if (argc > 1)
+    {
+        std::ifstream in(argv[1]);
+        std::string   l;
+        while (std::getline(in, l))
+            if (l.compare(0, 10, "info move ") == 0)
+                lines.push_back(l);
+        /* Leela Zero reports integer winrates.  */
+        kata = lines.empty() || lines[0].find("scoreMean") != std::string::npos;
+    }
+    if (lines.empty())
+    {
+        std::string l;
+        for (int i = 0; i < 50; i++)
+        {
+            char buf[200];
+            snprintf(buf,
+                     sizeof buf,
+                     "info move %c%d visits %d utility -0.0123 winrate 0.%06d scoreMean %d.25 scoreStdev 11.5 scoreLead 1.5 "
+                     "scoreSelfplay 1.7 prior 0.0%d lcb 0.48 utilityLcb -0.1 order %d pv",
+                     'A' + i % 8,
+                     1 + i % 19,
+                     5000 / (i + 1),
+                     483000 + i * 17,
+                     i % 7,
+                     i,
+                     i);
+            l += (i == 0 ? "" : " ") + std::string(buf);
+            for (int k = 0; k < 12; k++)
+                l += std::string(" ") + (char)('A' + (i + k) % 8) + std::to_string(1 + (i * 3 + k) % 19);
+        }
+        l += " ownership";
+        for (int i = 0; i < 361; i++)
+            l += i % 2 ? " -0.387412" : " 0.912345";
+        lines.push_back(l);
+    }
+
+    size_t total_bytes = 0;
+    for (auto &l : lines)
+        total_bytes += l.size();
+    int rounds = std::max<size_t>(1, 20000000 / total_bytes);
+
+    size_t cands    = 0;
+    size_t pv_len   = 0;
+    double checksum = 0;
+    auto   t0       = std::chrono::steady_clock::now();
+    for (int r = 0; r < rounds; r++)
+        for (auto &l : lines)
+        {
+            gtp_info_parser p(l, kata);
+            gtp_info_move   mv;
+            while (p.next(mv))
+            {
+                cands++;
+                checksum += mv.winrate + mv.visits;
+                std::string_view pv = mv.pv, tok;
+                int              x, y;
+                while (gtp_info_parser::next_token(pv, tok) && gtp_info_parser::parse_vertex(tok, 19, 19, x, y))
+                    pv_len++;
+            }
+            double own[361];
+            checksum += gtp_info_parser::parse_values(p.ownership(), own, 361);
+        }
+    auto   t1 = std::chrono::steady_clock::now();
+    double ms = std::chrono::duration<double, std::milli>(t1 - t0).count();
+    printf("%zu lines, %zu candidates, %zu pv moves in %.2f ms\n", rounds * lines.size(), cands, pv_len, ms);
+    printf("%.1f MB/s, %.0f lines/s, %.0f candidates/s (checksum %g)\n",
+           total_bytes * rounds / ms / 1000,
+           rounds * lines.size() / ms * 1000,
+           cands / ms * 1000,
+           checksum);
+    return 0;
+}
+#endif
@@ -0,0 +1,76 @@
+#ifndef GTPINFO_H
+#define GTPINFO_H
+
+#include <cstddef>
+#include <string_view>
+
+/* One candidate move from an "info move ..." line, as printed by the lz-analyze
+   and kata-analyze GTP extensions.  The string views point into the line that
+   was parsed, so they are only valid as long as that is.  */
+struct gtp_info_move
+{
+    std::string_view move;
+    int              visits = 0;
+    /* For the side to move, as a fraction.  Leela Zero reports it in units of
+       0.01%, this is converted by the parser.  */
+    double winrate      = 0;
+    bool   have_score   = false;
+    double score_mean   = 0;
+    double score_stddev = 0;
+    /* The policy prior for the move, or -1 if the engine did not send one.  */
+    double prior = -1;
+    /* The principal variation as a space separated list of vertices.  Use
+       gtp_info_parser::next_token to step through it.  */
+    std::string_view pv;
+};
+
+/* Tokenizes analysis output directly on the bytes received from the engine.
+   It never allocates, which matters since a fast engine sends many lines per
+   second with dozens of candidates each, and they are all parsed on the GUI
+   thread.  */
+class gtp_info_parser
+{
+    const char *m_p;
+    const char *m_end;
+    bool        m_kata;
+
+    std::string_view m_ownership;
+    std::string_view m_policy;
+
+    bool             take_token(std::string_view &);
+    std::string_view take_run(bool (*)(std::string_view));
+    void             take_field(std::string_view key, gtp_info_move *);
+
+public:
+    gtp_info_parser(std::string_view line, bool kata_format) : m_p(line.data()), m_end(line.data() + line.size()), m_kata(kata_format) {}
+
+    /* Store the next complete candidate in MV.  Candidates lacking any of the
+       move, visits, winrate or pv fields are skipped.  Returns false at the
+       end of the line.  */
+    bool next(gtp_info_move &mv);
+
+    /* Lists of numbers for the whole position, empty unless the engine sent
+       them.  KataGo prints these after the last candidate, so they are only
+       known once next has returned false.  */
+    std::string_view ownership() const
+    {
+        return m_ownership;
+    }
+    std::string_view policy() const
+    {
+        return m_policy;
+    }
+
+    /* Remove the first whitespace separated token from LIST and store it in TOK.  */
+    static bool   next_token(std::string_view &list, std::string_view &tok);
+    static bool   parse_int(std::string_view, int &);
+    static bool   parse_double(std::string_view, double &);
+    /* Convert a GTP vertex like "Q16" to board coordinates.  Returns false for
+       passes and anything that is not on the board.  */
+    static bool   parse_vertex(std::string_view, int size_x, int size_y, int &x, int &y);
+    /* Parse up to MAX numbers from LIST, such as ownership or policy, into OUT.
+       Returns the number of values stored.  */
+    static size_t parse_values(std::string_view list, double *out, size_t max);
+};
+
+#endif
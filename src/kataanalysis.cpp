@@ -0,0 +1,427 @@
+#include <algorithm>
+#include <set>
+
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonValue>
+
+#include "gogame.h"
+#include "gtpinfo.h"
+#include "kataanalysis.h"
+
+Kata_Analysis_Process::Kata_Analysis_Process(QWidget *parent, Kata_Analysis_Controller *c, const Engine &engine, int size, bool show_dialog)
+    : m_controller(c), m_dlg(parent, TextView::type::gtp), m_size(size)
+{
+    analyzer_id id   = engine_analyzer_id(engine, 7.5);
+    m_id_idx         = intern_analyzer_id(id);
+    id.komi          = -id.komi;
+    m_flipped_id_idx = intern_analyzer_id(id);
+
+    if (show_dialog)
+    {
+        m_dlg.show();
+        m_dlg.activateWindow();
+    }
+    connect(m_dlg.buttonAbort, &QPushButton::clicked, this, &Kata_Analysis_Process::slot_abort_request);
+
+    connect(this, &QProcess::started, this, &Kata_Analysis_Process::slot_started);
+    connect(this, &QProcess::errorOccurred, this, &Kata_Analysis_Process::slot_error);
+    void (QProcess::*fini)(int, QProcess::ExitStatus) = &QProcess::finished;
+    connect(this, fini, this, &Kata_Analysis_Process::slot_finished);
+    connect(this, &QProcess::readyReadStandardError, this, &Kata_Analysis_Process::slot_receive_stderr);
+    connect(this, &QProcess::readyReadStandardOutput, this, &Kata_Analysis_Process::slot_receive_stdout);
+
+    QStringList arguments;
+    if (!engine.args.isEmpty())
+        arguments = engine.args.split(QRegularExpression("\\s+"));
+    QFileInfo fi(engine.path);
+    QString   wd = fi.dir().absolutePath();
+    setWorkingDirectory(wd);
+    m_dlg.textEdit->setTextColor(Qt::red);
+    m_dlg.append("Working directory: " + wd);
+    m_dlg.textEdit->setTextColor(Qt::black);
+    start(engine.path, arguments);
+}
+
+Kata_Analysis_Process::~Kata_Analysis_Process()
+{
+    m_stopped = true;
+    disconnect(this, &QProcess::readyReadStandardOutput, nullptr, nullptr);
+    disconnect(this, &QProcess::readyReadStandardError, nullptr, nullptr);
+    disconnect(this, &QProcess::errorOccurred, nullptr, nullptr);
+    void (QProcess::*fini)(int, QProcess::ExitStatus) = &QProcess::finished;
+    disconnect(this, fini, nullptr, nullptr);
+}
+
+void Kata_Analysis_Process::append_text(const QString &txt, const QColor &col)
+{
+    /* See GTP_Process::append_text.  */
+    if (m_dlg_lines == 200)
+        m_dlg.delete_cursor_line();
+    else
+        m_dlg_lines++;
+    m_dlg.textEdit->setTextColor(col);
+    m_dlg.append(txt);
+}
+
+/* The analysis engine has no handshake; it reads queries as soon as it is
+   running, even if it is still loading the network.  */
+void Kata_Analysis_Process::slot_started()
+{
+    m_started = true;
+    m_dlg.textEdit->setTextColor(Qt::darkGray);
+    m_dlg.append("[...]\n");
+    m_dlg.textEdit->setTextColor(Qt::black);
+    m_dlg.hide();
+    m_dlg.remember_cursor();
+    m_controller->kata_startup_success(this);
+}
+
+/* Tell the controller we are gone, once.  Unless the user stopped us, it
+   may start a replacement if we had started.  */
+void Kata_Analysis_Process::report_exit(const QString &cause, bool crash)
+{
+    /* A crash produces both an error and the finished signal.  */
+    if (m_exit_reported)
+        return;
+    bool replace    = crash && m_started && !m_stopped;
+    m_exit_reported = true;
+    m_stopped       = true;
+    m_dlg.hide();
+    if (replace && m_controller->kata_crashed(this, cause))
+        return;
+    m_controller->kata_exited(this);
+}
+
+void Kata_Analysis_Process::slot_error(QProcess::ProcessError)
+{
+    report_exit(errorString(), true);
+}
+
+void Kata_Analysis_Process::slot_finished(int exitcode, QProcess::ExitStatus status)
+{
+    if (status == QProcess::CrashExit)
+        report_exit(tr("Engine crashed"), true);
+    else
+        report_exit(tr("Engine exited with code %1").arg(exitcode), true);
+}
+
+void Kata_Analysis_Process::slot_abort_request(bool)
+{
+    quit();
+    report_exit(QString(), false);
+}
+
+void Kata_Analysis_Process::quit()
+{
+    void (QProcess::*fini)(int, QProcess::ExitStatus) = &QProcess::finished;
+    disconnect(this, fini, nullptr, nullptr);
+    disconnect(this, &QProcess::readyReadStandardOutput, nullptr, nullptr);
+    disconnect(this, &QProcess::readyReadStandardError, nullptr, nullptr);
+    if (!m_stopped && state() == QProcess::Running)
+    {
+        send_query(QJsonObject {{"id", "quit"}, {"action", "terminate_all"}});
+        /* The engine exits once its input is closed and it has nothing left
+           to do.  */
+        closeWriteChannel();
+    }
+    m_stopped = true;
+}
+
+void Kata_Analysis_Process::slot_receive_stderr()
+{
+    m_stderr_buffer += readAllStandardError();
+    if (m_stopped)
+    {
+        m_stderr_buffer.clear();
+        return;
+    }
+    for (;;)
+    {
+        int idx = m_stderr_buffer.indexOf("\n");
+        if (idx < 0)
+            return;
+
+        append_text(m_stderr_buffer.left(idx).trimmed(), Qt::black);
+        m_stderr_buffer = m_stderr_buffer.mid(idx + 1);
+    }
+}
+
+void Kata_Analysis_Process::slot_receive_stdout()
+{
+    m_buffer += readAllStandardOutput();
+    if (m_stopped)
+    {
+        m_buffer.clear();
+        return;
+    }
+    int pos = 0;
+    for (;;)
+    {
+        int idx = m_buffer.indexOf('\n', pos);
+        if (idx < 0)
+            break;
+        QByteArray line = m_buffer.mid(pos, idx - pos).trimmed();
+        pos             = idx + 1;
+        if (!line.isEmpty())
+            receive_response(line);
+        /* The controller may have shut us down.  */
+        if (m_stopped)
+        {
+            m_buffer.clear();
+            return;
+        }
+    }
+    m_buffer.remove(0, pos);
+}
+
+void Kata_Analysis_Process::send_query(const QJsonObject &obj)
+{
+    QByteArray req = QJsonDocument(obj).toJson(QJsonDocument::Compact);
+    /* Queries for long games are large; the log only needs to show what was
+       asked for.  */
+    append_text(QString::fromUtf8(req.left(300)) + (req.length() > 300 ? " ..." : ""), Qt::blue);
+    req += '\n';
+    write(req);
+}
+
+static QString vertex_name(int x, int y, int size)
+{
+    if (x >= 8)
+        x++;
+    return QChar('A' + x) + QString::number(size - y);
+}
+
+static QString color_name(stone_color c, bool flip)
+{
+    if (flip)
+        c = flip_color(c);
+    return c == black ? "B" : "W";
+}
+
+/* A position can be sent to the engine as a list of moves starting at the
+   closest ancestor that is either the root or an edited position.  */
+static game_state *line_start(game_state *st)
+{
+    while (!st->root_node_p() && (st->was_move_p() || st->was_pass_p()))
+        st = st->prev_move();
+    return st;
+}
+
+/* Follow the primary continuation of ST for as long as it consists of moves.
+   All positions between line_start and this node can share a query.  */
+static game_state *line_end(game_state *st)
+{
+    for (;;)
+    {
+        game_state *next = st->next_primary_move();
+        if (next == nullptr || !(next->was_move_p() || next->was_pass_p()))
+            return st;
+        st = next;
+    }
+}
+
+void Kata_Analysis_Process::analyze(int                              tag,
+                                    const std::vector<game_state *> &positions,
+                                    double                           komi,
+                                    const std::string               &rules,
+                                    bool                             flip,
+                                    int                              max_visits,
+                                    double                           max_seconds)
+{
+    std::map<std::pair<game_state *, game_state *>, std::set<game_state *>> lines;
+    for (auto st : positions)
+        lines[std::make_pair(line_start(st), line_end(st))].insert(st);
+
+    for (auto &it : lines)
+    {
+        game_state                   *start  = it.first.first;
+        const std::set<game_state *> &wanted = it.second;
+        std::vector<game_state *>     path;
+        for (game_state *st = it.first.second; st != start; st = st->prev_move())
+            path.push_back(st);
+        path.push_back(start);
+        std::reverse(path.begin(), path.end());
+
+        QString id = "q" + QString::number(++m_query_count);
+        query  &q  = m_queries[id];
+        q.tag      = tag;
+        q.flip     = flip;
+
+        QJsonArray moves;
+        QJsonArray turns;
+        for (size_t t = 0; t < path.size(); t++)
+        {
+            game_state *st = path[t];
+            if (t > 0)
+            {
+                QString v = st->was_pass_p() ? "pass" : vertex_name(st->get_move_x(), st->get_move_y(), m_size);
+                moves.append(QJsonArray {color_name(st->get_move_color(), flip), v});
+            }
+            if (wanted.count(st) > 0)
+            {
+                q.turns[t] = st;
+                turns.append((int)t);
+            }
+        }
+        m_n_pending += q.turns.size();
+
+        const go_board &b = start->get_board();
+        QJsonArray      stones;
+        for (int x = 0; x < b.size_x(); x++)
+            for (int y = 0; y < b.size_y(); y++)
+            {
+                stone_color c = b.stone_at(x, y);
+                if (c != none)
+                    stones.append(QJsonArray {color_name(c, flip), vertex_name(x, y, m_size)});
+            }
+
+        QJsonObject obj;
+        obj["id"]            = id;
+        obj["initialStones"] = stones;
+        obj["initialPlayer"] = color_name(start->to_move(), flip);
+        obj["moves"]         = moves;
+        obj["rules"]         = QString::fromStdString(rules);
+        obj["komi"]          = komi;
+        obj["boardXSize"]    = b.size_x();
+        obj["boardYSize"]    = b.size_y();
+        obj["analyzeTurns"]  = turns;
+        if (max_visits > 0)
+            obj["maxVisits"] = max_visits;
+        if (max_seconds > 0)
+            obj["overrideSettings"] = QJsonObject {{"maxTime", max_seconds}};
+        send_query(obj);
+    }
+}
+
+void Kata_Analysis_Process::cancel(int tag)
+{
+    for (auto it = m_queries.begin(); it != m_queries.end();)
+    {
+        if (it->second.tag != tag)
+        {
+            ++it;
+            continue;
+        }
+        m_n_pending -= it->second.turns.size();
+        if (!m_stopped)
+            send_query(QJsonObject {{"id", "cancel-" + it->first}, {"action", "terminate"}, {"terminateId", it->first}});
+        it = m_queries.erase(it);
+    }
+}
+
+std::vector<std::pair<int, game_state *>> Kata_Analysis_Process::take_pending()
+{
+    std::vector<std::pair<int, game_state *>> result;
+    for (auto &q : m_queries)
+        for (auto &t : q.second.turns)
+            result.emplace_back(q.second.tag, t.second);
+    m_queries.clear();
+    m_n_pending = 0;
+    return result;
+}
+
+/* Convert one move or root evaluation.  The engine's Black is our White if the
+   position was flipped.  */
+static void parse_eval(const QJsonObject &obj, bool flip, an_id_t id, eval &ev, bool &have_score)
+{
+    double wr   = obj["winrate"].toDouble(0.5);
+    ev.visits   = obj["visits"].toInt();
+    ev.wr_black = flip ? 1 - wr : wr;
+    ev.id       = id;
+    have_score  = obj.contains("scoreLead");
+    if (have_score)
+    {
+        double sc       = obj["scoreLead"].toDouble();
+        ev.score_mean   = flip ? -sc : sc;
+        ev.score_stddev = obj["scoreStdev"].toDouble();
+    }
+}
+
+bool Kata_Analysis_Process::parse_result(const QJsonObject        &obj,
+                                         const query              &q,
+                                         int                       size,
+                                         eval                     &root,
+                                         std::vector<analysis_pv> &pvs,
+                                         bool                     &have_score)
+{
+    if (!obj["rootInfo"].isObject())
+        return false;
+    an_id_t id = q.flip ? m_flipped_id_idx : m_id_idx;
+    parse_eval(obj["rootInfo"].toObject(), q.flip, id, root, have_score);
+
+    bool             prune = g_setting->readBoolEntry("ANALYSIS_PRUNE");
+    const QJsonArray infos = obj["moveInfos"].toArray();
+    for (auto v : infos)
+    {
+        QJsonObject info = v.toObject();
+        analysis_pv pv;
+        bool        pv_score;
+        parse_eval(info, q.flip, id, pv.ev, pv_score);
+        for (auto m : info["pv"].toArray())
+        {
+            std::string vtx = m.toString().toStdString();
+            int         x, y;
+            if (!gtp_info_parser::parse_vertex(vtx, size, size, x, y))
+                break;
+            pv.moves.emplace_back(x, y);
+        }
+        if (pv.moves.empty() || (prune && pv.moves.size() < 2 && pv.ev.visits < 2))
+            continue;
+        pvs.push_back(std::move(pv));
+    }
+    return true;
+}
+
+void Kata_Analysis_Process::receive_response(const QByteArray &line)
+{
+    QJsonDocument doc = QJsonDocument::fromJson(line);
+    if (!doc.isObject())
+    {
+        append_text(QString::fromUtf8(line), Qt::red);
+        return;
+    }
+    QJsonObject obj = doc.object();
+    QString     id  = obj["id"].toString();
+    auto        it  = m_queries.find(id);
+    if (obj.contains("error") || obj.contains("warning"))
+    {
+        append_text(QString::fromUtf8(line), Qt::red);
+        /* An error means the query was rejected as a whole.  */
+        if (!obj.contains("error") || it == m_queries.end())
+            return;
+        query q = std::move(it->second);
+        m_queries.erase(it);
+        m_n_pending -= q.turns.size();
+        for (auto &t : q.turns)
+            m_controller->kata_rejected(this, q.tag, t.second);
+        return;
+    }
+    /* Responses to queries that were cancelled can still arrive.  */
+    if (it == m_queries.end() || obj["isDuringSearch"].toBool())
+        return;
+    int  turn = obj["turnNumber"].toInt(-1);
+    auto t    = it->second.turns.find(turn);
+    if (t == it->second.turns.end())
+        return;
+
+    game_state *st  = t->second;
+    int         tag = it->second.tag;
+
+    eval                     root;
+    std::vector<analysis_pv> pvs;
+    bool                     have_score = false;
+    bool                     ok         = parse_result(obj, it->second, m_size, root, pvs, have_score);
+    if (m_dlg.isVisible())
+        append_text(QString("%1 turn %2: %3 visits").arg(id).arg(turn).arg(root.visits), Qt::red);
+
+    it->second.turns.erase(t);
+    if (it->second.turns.empty())
+        m_queries.erase(it);
+    m_n_pending--;
+
+    if (ok)
+        m_controller->kata_result(this, tag, st, root, pvs, have_score);
+    else
+        m_controller->kata_rejected(this, tag, st);
+}
@@ -0,0 +1,150 @@
+#ifndef KATAANALYSIS_H
+#define KATAANALYSIS_H
+
+#include <map>
+#include <vector>
+
+#include <QJsonObject>
+#include <QProcess>
+
+#include "goeval.h"
+#include "qgtp.h"
+#include "setting.h"
+#include "textview.h"
+
+class game_state;
+class Kata_Analysis_Process;
+
+class Kata_Analysis_Controller
+{
+public:
+    /* Called for every analyzed position.  TAG is the value that was passed to
+       Kata_Analysis_Process::analyze.  The evaluations are already converted
+       to the colors of the original position if it was flipped.  */
+    virtual void kata_result(Kata_Analysis_Process          *,
+                             int                             tag,
+                             game_state                     *,
+                             const eval                     &,
+                             const std::vector<analysis_pv> &,
+                             bool                            have_score) = 0;
+
+    /* The engine rejected the query for a position; it will not produce a
+       result for it.  */
+    virtual void kata_rejected(Kata_Analysis_Process *, int tag, game_state *) = 0;
+
+    virtual void kata_startup_success(Kata_Analysis_Process *)           = 0;
+    virtual void kata_exited(Kata_Analysis_Process *)                    = 0;
+    virtual void kata_failure(Kata_Analysis_Process *, const QString &) = 0;
+    /* The engine died, and CAUSE says how.  Returns true if the controller
+       starts a new engine in its place, in which case kata_exited is not
+       called.  */
+    virtual bool kata_crashed(Kata_Analysis_Process *, const QString &)
+    {
+        return false;
+    }
+};
+
+/* Talks to KataGo's analysis engine ("katago analysis"), which reads queries as
+   JSON objects, one per line, and answers each analyzed position with a JSON
+   object.  Unlike GTP, the engine is not told about positions one by one: all
+   positions on a line of play are sent together as one query, listing the
+   turns to analyze, and the engine works on many of them in parallel.
+   Responses can arrive in any order and are matched to positions by their id
+   and turn number.
+
+   Winrates and scores are expected from Black's perspective, which is the
+   default setting of reportAnalysisWinratesAs for the analysis engine.  */
+class Kata_Analysis_Process : public QProcess
+{
+    Q_OBJECT
+
+    Kata_Analysis_Controller *m_controller;
+    TextView                  m_dlg;
+    int                       m_dlg_lines = 0;
+
+    QByteArray m_buffer;
+    QString    m_stderr_buffer;
+
+    int  m_size;
+    bool m_started = false;
+    bool m_stopped = false;
+    /* Set once the controller has been told that we exited.  */
+    bool m_exit_reported = false;
+
+    an_id_t m_id_idx;
+    an_id_t m_flipped_id_idx;
+
+    struct query
+    {
+        int  tag;
+        bool flip;
+        /* The positions still waiting for a response, by turn number.  */
+        std::map<int, game_state *> turns;
+    };
+    std::map<QString, query> m_queries;
+    int                      m_query_count = 0;
+    size_t                   m_n_pending   = 0;
+
+    void append_text(const QString &, const QColor &col);
+    void report_exit(const QString &cause, bool crash);
+    void send_query(const QJsonObject &);
+    void receive_response(const QByteArray &);
+    bool parse_result(const QJsonObject &, const query &, int size, eval &, std::vector<analysis_pv> &, bool &have_score);
+
+public slots:
+    void slot_started();
+    void slot_finished(int exitcode, QProcess::ExitStatus status);
+    void slot_error(QProcess::ProcessError);
+    void slot_receive_stdout();
+    void slot_receive_stderr();
+    void slot_abort_request(bool);
+
+public:
+    Kata_Analysis_Process(QWidget *parent, Kata_Analysis_Controller *c, const Engine &engine, int size, bool show_dialog = true);
+    ~Kata_Analysis_Process();
+
+    bool started()
+    {
+        return m_started;
+    }
+    bool stopped()
+    {
+        return m_stopped;
+    }
+    /* The interned analyzer_id used for results, with or without flipping.  */
+    an_id_t analyzer_idx(bool flip)
+    {
+        return flip ? m_flipped_id_idx : m_id_idx;
+    }
+    /* The number of positions submitted but not yet answered.  */
+    size_t n_pending()
+    {
+        return m_n_pending;
+    }
+
+    /* Submit POSITIONS for analysis.  Positions lying on the same line of play
+       are combined into a single query.  A nonzero MAX_VISITS or MAX_SECONDS
+       overrides the engine's configured limits.  */
+    void analyze(int                              tag,
+                 const std::vector<game_state *> &positions,
+                 double                           komi,
+                 const std::string               &rules,
+                 bool                             flip,
+                 int                              max_visits,
+                 double                           max_seconds);
+    /* Forget about all queries submitted with TAG, and ask the engine to stop
+       working on them.  */
+    void cancel(int tag);
+    /* Forget about everything; return the positions that did not get a result,
+       with their tags.  Used when the engine has died.  */
+    std::vector<std::pair<int, game_state *>> take_pending();
+
+    void quit();
+
+    QDialog *dialog()
+    {
+        return &m_dlg;
+    }
+};
+
+#endif
@@ -5,6 +5,7 @@
  *  (C) by Peter Strempel, Johannes Mesa, Emmanuel Beranger 2001-2003
  *
  */
+#include <cstring>
 #include <tuple>
 
 #include <QApplication>
@@ -12,14 +13,19 @@
 #include <QDir>
 #include <QFileDialog>
 #include <QMessageBox>
+#include <QStandardPaths>
 #include <QTextCodec>
 #include <QTranslator>
 
+#include "analysisbench.h"
+#include "analysiscache.h"
 #include "analyzedlg.h"
 #include "archivehandlerfactory.h"
 #include "clientwin.h"
 #include "config.h"
 #include "dbdialog.h"
+#include "enginematch.h"
+#include "enginepool.h"
 #include "miscdialogs.h"
 #include "msg_handler.h"
 #include "setting.h"
@@ -33,6 +39,8 @@ QApplication *g_qGoApp = nullptr;
 
 Setting *g_setting = nullptr;
 
+bool g_headless = false;
+
 DBDialog *g_dbDialog = nullptr;
 
 Debug_Dialog *debug_dialog = nullptr;
@@ -87,6 +95,16 @@ go_game_ptr new_variant_game_dialog(QWidget *parent)
     return gr;
 }
 
+/* Problems with SGF files are shown in message boxes, or printed when there
+   are no windows.  */
+static void sgf_warning(const QString &msg)
+{
+    if (g_headless)
+        QTextStream(stderr) << msg << "\n";
+    else
+        QMessageBox::warning(0, PACKAGE, msg);
+}
+
 static void warn_errors(go_game_ptr gr)
 {
     if (g_setting->readBoolEntry("SUPPRESS_SGF_PARSER_ERROR_WARNING"))
@@ -94,53 +112,41 @@ static void warn_errors(go_game_ptr gr)
     const sgf_errors &errs = gr->errors();
     if (errs.invalid_structure)
     {
-        QMessageBox::warning(0,
-                             PACKAGE,
-                             QObject::tr("The file did not quite have the correct structure of an "
-                                         "SGF file, but could otherwise be understood."));
+        sgf_warning(QObject::tr("The file did not quite have the correct structure of an "
+                                "SGF file, but could otherwise be understood."));
     }
     if (errs.played_on_stone)
     {
-        QMessageBox::warning(0,
-                             PACKAGE,
-                             QObject::tr("The SGF file contained an invalid move that was played on top of "
-                                         "another stone. Variations have been truncated at that point."));
+        sgf_warning(QObject::tr("The SGF file contained an invalid move that was played on top of "
+                                "another stone. Variations have been truncated at that point."));
     }
     if (errs.charset_error)
     {
-        QMessageBox::warning(0,
-                             PACKAGE,
-                             QObject::tr("One or more comments have been dropped since they "
-                                         "contained invalid characters."));
+        sgf_warning(QObject::tr("One or more comments have been dropped since they "
+                                "contained invalid characters."));
     }
     if (errs.empty_komi)
     {
-        QMessageBox::warning(0, PACKAGE, QObject::tr("The SGF contained an empty value for komi. Assuming zero."));
+        sgf_warning(QObject::tr("The SGF contained an empty value for komi. Assuming zero."));
     }
     if (errs.empty_handicap)
     {
-        QMessageBox::warning(0,
-                             PACKAGE,
-                             QObject::tr("The SGF contained an empty value for the "
-                                         "handicap. Assuming zero."));
+        sgf_warning(QObject::tr("The SGF contained an empty value for the "
+                                "handicap. Assuming zero."));
     }
     if (errs.invalid_val)
     {
-        QMessageBox::warning(0,
-                             PACKAGE,
-                             QObject::tr("The SGF contained an invalid value in a property related to "
-                                         "display.  Things like move numbers might not show up correctly."));
+        sgf_warning(QObject::tr("The SGF contained an invalid value in a property related to "
+                                "display.  Things like move numbers might not show up correctly."));
     }
     if (errs.malformed_eval)
     {
-        QMessageBox::warning(0, PACKAGE, QObject::tr("The SGF contained evaluation data that could not be understood."));
+        sgf_warning(QObject::tr("The SGF contained evaluation data that could not be understood."));
     }
     if (errs.move_outside_board)
     {
-        QMessageBox::warning(0,
-                             PACKAGE,
-                             QObject::tr("The SGF contained moves outside of the board area.  They "
-                                         "were converted to passes."));
+        sgf_warning(QObject::tr("The SGF contained moves outside of the board area.  They "
+                                "were converted to passes."));
     }
 }
 
@@ -159,17 +165,17 @@ go_game_ptr record_from_stream(QIODevice &isgf, QTextCodec *codec)
     catch (invalid_boardsize &)
     {
         if (!g_setting->readBoolEntry("SUPPRESS_SGF_PARSER_ERROR_WARNING"))
-            QMessageBox::warning(0, PACKAGE, QObject::tr("Unsupported board size in SGF file."));
+            sgf_warning(QObject::tr("Unsupported board size in SGF file."));
     }
     catch (broken_sgf &)
     {
         if (!g_setting->readBoolEntry("SUPPRESS_SGF_PARSER_ERROR_WARNING"))
-            QMessageBox::warning(0, PACKAGE, QObject::tr("Errors found in SGF file."));
+            sgf_warning(QObject::tr("Errors found in SGF file."));
     }
     catch (...)
     {
         if (!g_setting->readBoolEntry("SUPPRESS_SGF_PARSER_ERROR_WARNING"))
-            QMessageBox::warning(0, PACKAGE, QObject::tr("Error while trying to load SGF file."));
+            sgf_warning(QObject::tr("Error while trying to load SGF file."));
     }
     return nullptr;
 }
@@ -680,11 +686,102 @@ void installTranslator(const QString& preferLang, const QString& preferDir, QTra
     }
 }
 
+static const Engine *find_engine(const QString &title)
+{
+    for (auto &e : g_setting->m_engines)
+        if (e.title == title)
+            return &e;
+    return nullptr;
+}
+
+/* Play the engine matches requested on the command line.  Each entry of
+   PAIRS names two engines separated by a comma.  */
+static int run_match(const QString &book_file, const QStringList &pairs, engine_match::options &opts)
+{
+    QTextStream err(stderr);
+    for (auto &p : pairs)
+    {
+        QStringList names = p.split(',');
+        if (names.size() != 2)
+        {
+            err << QObject::tr("Expected two engine names separated by a comma: %1").arg(p) << "\n";
+            return 1;
+        }
+        const Engine *first  = find_engine(names[0].trimmed());
+        const Engine *second = find_engine(names[1].trimmed());
+        if (first == nullptr || second == nullptr)
+        {
+            err << QObject::tr("Unknown engine in %1.  Available engines:").arg(p) << "\n";
+            for (auto &e : g_setting->m_engines)
+                err << "  " << e.title << "\n";
+            return 1;
+        }
+        opts.pairs.emplace_back(*first, *second);
+    }
+
+    go_game_ptr book = record_from_file(book_file, nullptr);
+    if (book == nullptr)
+    {
+        err << QObject::tr("Could not load %1.").arg(book_file) << "\n";
+        return 1;
+    }
+    if (opts.output.isEmpty())
+    {
+        QFileInfo fi(book_file);
+        opts.output = fi.dir().filePath(fi.completeBaseName() + "-match");
+    }
+
+    engine_match match(book, opts);
+    if (!match.start())
+        return 1;
+    return g_qGoApp->exec();
+}
+
+/* Set up the live analysis benchmark requested on the command line.  The
+   engine is either one of the configured ones, by NAME, or COMMAND, a
+   program followed by its arguments.  */
+static int run_benchmark(const QStringList &files, const QString &name, const QString &command, int seconds)
+{
+    QTextStream err(stderr);
+    go_game_ptr gr;
+    if (files.isEmpty())
+        gr = std::make_shared<game_record>(go_board(19), black, game_info("White", "Black"));
+    else if ((gr = record_from_file(files.first(), nullptr)) == nullptr)
+    {
+        err << QObject::tr("Could not load %1.").arg(files.first()) << "\n";
+        return 1;
+    }
+
+    if (!command.isEmpty())
+    {
+        QString program = command.section(' ', 0, 0, QString::SectionSkipEmpty);
+        QString args    = command.section(' ', 1, -1, QString::SectionSkipEmpty);
+        Engine  e("benchmark", program, args, "7.5", true, QString::number(gr->boardsize()));
+        return run_analysis_benchmark(gr, e, seconds > 0 ? seconds : 10);
+    }
+    const Engine *found = find_engine(name);
+    if (found == nullptr || !found->analysis)
+    {
+        err << QObject::tr("No analysis engine named \"%1\" is configured.  Available engines:").arg(name) << "\n";
+        for (auto &e : g_setting->m_engines)
+            if (e.analysis)
+                err << "  " << e.title << "\n";
+        return 1;
+    }
+    return run_analysis_benchmark(gr, *found, seconds > 0 ? seconds : 10);
+}
+
 int main(int argc, char **argv)
 {
 #if QT_VERSION < QT_VERSION_CHECK(6, 0, 0)
     QApplication::setAttribute(Qt::AA_EnableHighDpiScaling);
 #endif
+    /* Batch jobs and benchmarks may run on machines without a display.  This
+       must be decided before the application object exists, so look at the
+       arguments ourselves.  */
+    for (int i = 1; i < argc; i++)
+        if ((strcmp(argv[i], "--headless") == 0 || strcmp(argv[i], "--benchmark-analysis") == 0) && qEnvironmentVariableIsEmpty("QT_QPA_PLATFORM"))
+            qputenv("QT_QPA_PLATFORM", "offscreen");
 
     QApplication myapp(argc, argv);
     g_qGoApp = &myapp;
@@ -697,6 +794,35 @@ int main(int argc, char **argv)
     QCommandLineOption clo_debug {{"d", "debug"}, QObject::tr("Display debug messages in a window")};
     QCommandLineOption clo_debug_file {{"D", "debug-file"}, QObject::tr("Send debug messages to <file>."), QObject::tr("file")};
     QCommandLineOption clo_encoding {{"e", "encoding "}, QObject::tr("Specify text <encoding> of SGF files passed by command line."), "encoding"};
+    QCommandLineOption clo_headless {"headless",
+                                     QObject::tr("Analyze the files and directories given with --analyze or as arguments, or play "
+                                                 "engine matches with --match, without opening any windows, then exit.")};
+    QCommandLineOption clo_engine {"engine", QObject::tr("Use the analysis engine called <name> when running headless."), QObject::tr("name")};
+    QCommandLineOption clo_seconds {"seconds", QObject::tr("Analyze each position for <n> seconds when running headless."), "n"};
+    QCommandLineOption clo_visits {"visits", QObject::tr("Analyze each position until <n> visits when running headless."), "n"};
+    QCommandLineOption clo_lines {"lines", QObject::tr("Store at most <n> variations per position when running headless."), "n"};
+    QCommandLineOption clo_processes {"processes", QObject::tr("Start <n> engine processes when running headless."), "n"};
+    QCommandLineOption clo_kata {"kata-protocol", QObject::tr("Use the KataGo analysis protocol when running headless.")};
+    QCommandLineOption clo_adaptive {"adaptive",
+                                     QObject::tr("With --visits, spend more visits on critical positions and fewer on the rest when "
+                                                 "running headless.")};
+    QCommandLineOption clo_output {"output",
+                                   QObject::tr("Save analyzed files or match games to <dir> when running headless, instead of next to "
+                                               "the original."),
+                                   QObject::tr("dir")};
+    QCommandLineOption clo_match {
+        "match", QObject::tr("With --headless, play engine matches starting from the openings in <book>, an SGF file."), QObject::tr("book")};
+    QCommandLineOption clo_pair {
+        "pair", QObject::tr("Add a pair of engines, given by name, to the match.  May be given more than once."), QObject::tr("first,second")};
+    QCommandLineOption clo_games {"games", QObject::tr("Play <n> games for each pair of engines in a match."), "n"};
+    QCommandLineOption clo_concurrency {"concurrency", QObject::tr("Play <n> match games at the same time."), "n"};
+    QCommandLineOption clo_max_moves {"max-moves", QObject::tr("Score match games after <n> moves."), "n"};
+    QCommandLineOption clo_benchmark {"benchmark-analysis",
+                                      QObject::tr("Run live analysis with --engine or --engine-command on the last position of <file>, "
+                                                  "or an empty board, in an offscreen window for --seconds, then print statistics "
+                                                  "and exit.")};
+    QCommandLineOption clo_engine_command {
+        "engine-command", QObject::tr("With --benchmark-analysis, run <command> as the engine instead of a configured one."), QObject::tr("command")};
 
     cmdp.addOption(clo_client);
     cmdp.addOption(clo_board);
@@ -706,6 +832,22 @@ int main(int argc, char **argv)
     cmdp.addOption(clo_debug_file);
 #endif
     cmdp.addOption(clo_encoding);
+    cmdp.addOption(clo_headless);
+    cmdp.addOption(clo_engine);
+    cmdp.addOption(clo_seconds);
+    cmdp.addOption(clo_visits);
+    cmdp.addOption(clo_lines);
+    cmdp.addOption(clo_processes);
+    cmdp.addOption(clo_kata);
+    cmdp.addOption(clo_adaptive);
+    cmdp.addOption(clo_output);
+    cmdp.addOption(clo_match);
+    cmdp.addOption(clo_pair);
+    cmdp.addOption(clo_games);
+    cmdp.addOption(clo_concurrency);
+    cmdp.addOption(clo_max_moves);
+    cmdp.addOption(clo_benchmark);
+    cmdp.addOption(clo_engine_command);
     cmdp.addHelpOption();
     cmdp.addPositionalArgument("file", QObject::tr("Load <file> and display it in a board window."));
 
@@ -733,6 +875,10 @@ int main(int argc, char **argv)
     g_setting = new Setting();
     g_setting->loadSettings();
 
+    QString data_dir = QStandardPaths::writableLocation(QStandardPaths::AppDataLocation);
+    if (!data_dir.isEmpty() && QDir().mkpath(data_dir))
+        g_analysis_cache = new analysis_cache(data_dir + "/analysis_cache.sqlite");
+
     // Load translation
     QString     lang = g_setting->getLanguage();
     qDebug() << "Checking for language settings..." << lang;
@@ -742,9 +888,73 @@ int main(int argc, char **argv)
     QTranslator qtTranslator;
     installTranslator(lang, tr_dir, translator, qtTranslator);
 
+    if (cmdp.isSet(clo_headless) && cmdp.isSet(clo_match))
+    {
+        g_headless = true;
+        engine_match::options opts;
+        opts.games       = cmdp.isSet(clo_games) ? cmdp.value(clo_games).toInt() : 2;
+        opts.concurrency = std::max(1, cmdp.value(clo_concurrency).toInt());
+        opts.max_moves   = cmdp.value(clo_max_moves).toInt();
+        opts.output      = cmdp.value(clo_output);
+
+        int retval = run_match(cmdp.value(clo_match), cmdp.values(clo_pair), opts);
+        delete g_analysis_cache;
+        g_analysis_cache = nullptr;
+        delete g_setting;
+        return retval;
+    }
+    if (cmdp.isSet(clo_headless))
+    {
+        g_headless = true;
+        AnalyzeDialog::headless_options opts;
+        opts.engine    = cmdp.value(clo_engine);
+        opts.seconds   = cmdp.value(clo_seconds).toInt();
+        opts.visits    = cmdp.value(clo_visits).toInt();
+        opts.lines     = cmdp.value(clo_lines).toInt();
+        opts.processes = std::max(1, cmdp.value(clo_processes).toInt());
+        opts.kata      = cmdp.isSet(clo_kata);
+        opts.adaptive  = cmdp.isSet(clo_adaptive);
+        opts.output    = cmdp.value(clo_output);
+
+        analyze_dialog = new AnalyzeDialog(nullptr, QString());
+        int retval     = 1;
+        if (analyze_dialog->run_headless(cmdp.values(clo_analysis) + args, opts))
+            retval = myapp.exec();
+
+        delete analyze_dialog;
+        delete g_analysis_cache;
+        g_analysis_cache = nullptr;
+        delete g_setting;
+        return retval;
+    }
+
+    g_engine_pool = new engine_pool;
     client_window = new ClientWindow(0);
     client_window->setWindowTitle(PACKAGE1 + QString(" ") + VERSION);
 
+    if (cmdp.isSet(clo_benchmark))
+    {
+        g_headless = true;
+        /* Measure a single private engine, without the analysis cache: cached
+           visits would stop updates from being counted, and the benchmark
+           engine's results must not end up in the user's cache.  The settings
+           are restored afterwards in case anything saves them.  */
+        delete g_analysis_cache;
+        g_analysis_cache = nullptr;
+        bool shared   = g_setting->readBoolEntry("ANALYSIS_SHARED");
+        int  prefetch = g_setting->readIntEntry("ANALYSIS_PREFETCH");
+        g_setting->writeBoolEntry("ANALYSIS_SHARED", false);
+        g_setting->writeIntEntry("ANALYSIS_PREFETCH", 0);
+        int retval = run_benchmark(args, cmdp.value(clo_engine), cmdp.value(clo_engine_command), cmdp.value(clo_seconds).toInt());
+        g_setting->writeBoolEntry("ANALYSIS_SHARED", shared);
+        g_setting->writeIntEntry("ANALYSIS_PREFETCH", prefetch);
+        delete client_window;
+        delete g_engine_pool;
+        g_engine_pool = nullptr;
+        delete g_setting;
+        return retval;
+    }
+
 #ifdef OWN_DEBUG_MODE
     // restore size and pos
     if (client_window->getViewSize().width() > 0)
@@ -803,6 +1013,9 @@ int main(int argc, char **argv)
     else
         analyze_dialog = new AnalyzeDialog(nullptr, QString());
     analyze_dialog->setVisible(cmdp.isSet(clo_analysis));
+    /* Batch jobs interrupted by the last exit continue.  */
+    if (analyze_dialog->restore_jobs() > 0)
+        analyze_dialog->setVisible(true);
 
     if (g_setting->getNewVersionWarning())
         help_new_version();
@@ -819,9 +1032,13 @@ int main(int argc, char **argv)
 
     delete client_window;
     delete analyze_dialog;
+    delete g_engine_pool;
+    g_engine_pool = nullptr;
 #ifdef OWN_DEBUG_MODE
     delete debug_dialog;
 #endif
+    delete g_analysis_cache;
+    g_analysis_cache = nullptr;
     delete g_setting;
 
     return retval;
@@ -63,7 +63,7 @@ void an_id_model::populate_list(go_game_ptr game)
 {
     beginResetModel();
     m_entries.clear();
-    std::function<void(const analyzer_id &, bool)> f2 = [this](const analyzer_id &id, bool score) -> void {
+    auto f2 = [this](an_id_t id, bool score) -> void {
         bool found = false;
         for (auto &e : m_entries)
             if (e.first == id)
@@ -75,17 +75,16 @@ void an_id_model::populate_list(go_game_ptr game)
         if (!found)
             m_entries.emplace_back(id, score);
     };
-    std::function<bool(game_state *)> f = [this, &f2](game_state *st) -> bool {
+    game_state *r = game->get_root();
+    r->walk_tree([&f2](game_state *st) -> bool {
         st->collect_analyzers(f2);
         return true;
-    };
-    game_state *r = game->get_root();
-    r->walk_tree(f);
+    });
     endResetModel();
 }
 
 /* This is called to notify us that an evaluation from NEW_ID came in.  */
-void an_id_model::notice_analyzer_id(const analyzer_id &new_id, bool have_score)
+void an_id_model::notice_analyzer_id(an_id_t new_id, bool have_score)
 {
     bool found = false;
     for (auto &e : m_entries)
@@ -119,7 +118,7 @@ QVariant an_id_model::data(const QModelIndex &index, int role) const
     if (role != Qt::DisplayRole)
         return QVariant();
 
-    const analyzer_id &id = m_entries[row].first;
+    const analyzer_id &id = analyzer_from_idx(m_entries[row].first);
     if (!id.komi_set)
         return QString::fromStdString(id.engine);
     return QString::fromStdString(id.engine) + " @ " + QString::number(id.komi);
@@ -641,6 +640,7 @@ void MainWindow::initActions()
     });
     connect(anDisconnect, &QAction::triggered, this, [=]() { gfx_board->stop_analysis(); });
     connect(anBatch, &QAction::triggered, [](bool) { show_batch_analysis(); });
+    connect(anTranspositions, &QAction::triggered, this, &MainWindow::slotShareTranspositions);
     connect(anPlay, &QAction::triggered, this, &MainWindow::slotPlayFromHere);
 
     /* Help menu.  */
@@ -1169,6 +1169,28 @@ void MainWindow::slotPlayFromHere(bool)
     new MainWindow_GTP(0, gr, st, screen_key(this), engine, !computer_white, computer_white);
 }
 
+/* Give every position which occurs more than once in the game tree the
+   evaluations of all its transpositions, so that analysis done in one
+   variation shows up in the others.  */
+void MainWindow::slotShareTranspositions(bool)
+{
+    transposition_list groups = find_transpositions(m_game->get_root());
+    size_t             nodes  = 0;
+    for (auto &g : groups)
+        nodes += g.size();
+    if (!groups.empty())
+    {
+        share_transposition_evals(groups);
+        m_game->set_modified();
+        update_game_tree();
+    }
+    QMessageBox::information(this, tr("Transpositions"),
+                             groups.empty() ? tr("No position occurs more than once in this game.")
+                                            : tr("Found %1 positions which occur more than once, in %2 nodes.  Their evaluations are now shared.")
+                                                  .arg(groups.size())
+                                                  .arg(nodes));
+}
+
 void MainWindow::slotDiagChosen(int idx)
 {
     game_state *st = m_figures.at(idx);
@@ -2634,12 +2656,13 @@ MainWindow_GTP::MainWindow_GTP(
     for (int i = 0; i < n_games; i++)
         if (book)
         {
-            std::function<bool(game_state *)> f = [this](game_state *st) -> bool {
+            /* Games are played from the openings in walk_tree order: the
+               end of the main line first, then those of the variations.  */
+            gr->get_root()->walk_tree([this](game_state *st) -> bool {
                 if (st->n_children() == 0)
                     m_start_positions.push_back(st);
                 return true;
-            };
-            gr->get_root()->walk_tree(f);
+            });
         }
         else
             m_start_positions.push_back(primary);
@@ -3113,7 +3136,7 @@ void MainWindow::setTimes(
 
 /* Called whenever a new evaluation comes in from NEW_ID.  We update the
  * evaluation graph.  */
-void MainWindow::update_analyzer_ids(const analyzer_id &new_id, bool have_score)
+void MainWindow::update_analyzer_ids(an_id_t new_id, bool have_score)
 {
     int old_cnt = m_an_id_model.rowCount();
     m_an_id_model.notice_analyzer_id(new_id, have_score);
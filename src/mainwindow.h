@@ -34,7 +34,7 @@ class QListWidgetItem;
    komi.  The evaluation graph shows one line per id.  */
 class an_id_model : public QAbstractItemModel
 {
-    typedef std::pair<analyzer_id, bool> entry;
+    typedef std::pair<an_id_t, bool> entry;
     std::vector<entry>                   m_entries;
 
 public:
@@ -45,7 +45,7 @@ public:
     {
         return m_entries;
     }
-    void notice_analyzer_id(const analyzer_id &, bool);
+    void notice_analyzer_id(an_id_t, bool);
 
     virtual QVariant data(const QModelIndex &index, int role = Qt::DisplayRole) const override;
     QModelIndex      index(int row, int col, const QModelIndex &parent = QModelIndex()) const override;
@@ -146,7 +146,7 @@ public:
     void update_analysis(analyzer);
     void update_game_tree();
     void update_figures();
-    void update_analyzer_ids(const analyzer_id &, bool);
+    void update_analyzer_ids(an_id_t, bool);
 
     void coords_changed(const QString &, const QString &);
 
@@ -237,6 +237,7 @@ public slots:
     void slotEditClearSelect(bool);
 
     void slotPlayFromHere(bool);
+    void slotShareTranspositions(bool);
 
     void slotDiagEdit(bool);
     void slotDiagASCII(bool);
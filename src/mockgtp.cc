@@ -0,0 +1,900 @@
+/* A stand-in GTP engine, for exercising the engine code (analysis, batch
+   analysis and engine games) without a real engine and its network.  It
+   implements the subset of GTP we use and produces analysis output at a fixed
+   rate, either made up from the position or replayed from a file of recorded
+   engine output, so that throughput and latency can be measured on a machine
+   without a GPU.
+
+   Build with
+     g++ -O2 -std=c++17 -pthread mockgtp.cc -o mockgtp
+   or the mockgtp target in CMake, and configure it as an engine.  The
+   analysis-benchmark target runs live analysis against it in an offscreen
+   board window, see run_analysis_benchmark.  Options:
+     --rate N          analysis updates per second (default: the interval the
+                       client asks for)
+     --candidates N    candidate moves per update (default 10)
+     --pv N            length of the variations (default 8)
+     --replay FILE     cycle through the "info move" lines in FILE instead of
+                       making them up, e.g. saved from the engine log window
+     --delay MS        wait before answering each command
+     --genmove-ms MS   time spent "thinking" on genmove
+     --seed N          for the pseudo-random moves and evaluations
+     --no-kata         don't offer kata-analyze, to look like Leela Zero
+     --crash-after N   abort when the Nth command arrives
+     --hang-after N    stop reading and writing when the Nth command arrives,
+                       to test the engine watchdog
+     --analysis        speak KataGo's JSON analysis protocol instead of GTP,
+                       for the --kata-protocol batch analysis backend.  Each
+                       turn listed in a query's analyzeTurns is answered with
+                       one result, at --rate results per second (default 20),
+                       queries first come first served.  The terminate and
+                       terminate_all actions drop what is left of a query.
+                       Commands for --crash-after and --hang-after are query
+                       lines in this mode.
+
+   The board model only knows which points are occupied; captures are not
+   played out.  That is enough for our clients, which never rely on the
+   engine's idea of legality.  */
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using clock_type = std::chrono::steady_clock;
+
+struct options
+{
+    double                   rate        = 0;
+    int                      candidates  = 10;
+    int                      pv_len      = 8;
+    int                      delay_ms    = 0;
+    int                      genmove_ms  = 0;
+    unsigned                 seed        = 1;
+    bool                     kata        = true;
+    int                      crash_after = 0;
+    int                      hang_after  = 0;
+    bool                     analysis    = false;
+    std::vector<std::string> replay;
+};
+
+static std::string vertex_name(int x, int y, int size)
+{
+    if (x < 0)
+        return "pass";
+    char c = 'A' + x + (x >= 8);
+    return c + std::to_string(size - y);
+}
+
+/* Commands are read on a separate thread, so that the main loop can wait for
+   either the next command or the time to print the next analysis update.  */
+class input_queue
+{
+    std::mutex              m_mutex;
+    std::condition_variable m_cond;
+    std::deque<std::string> m_lines;
+    bool                    m_eof = false;
+
+public:
+    void run()
+    {
+        std::string l;
+        while (std::getline(std::cin, l))
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_lines.push_back(l);
+            m_cond.notify_one();
+        }
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_eof = true;
+        m_cond.notify_one();
+    }
+    /* Wait until DEADLINE for a line.  Returns false on timeout or at the end
+       of the input, which EOF distinguishes.  */
+    bool wait(clock_type::time_point deadline, std::string &line, bool &eof)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_cond.wait_until(lock, deadline, [this] { return !m_lines.empty() || m_eof; });
+        eof = m_lines.empty() && m_eof;
+        if (m_lines.empty())
+            return false;
+        line = m_lines.front();
+        m_lines.pop_front();
+        return true;
+    }
+};
+
+class mock_engine
+{
+    const options &m_opts;
+    std::mt19937   m_rng;
+
+    int    m_size = 19;
+    double m_komi = 7.5;
+    /* 0 for empty, 1 black, 2 white.  */
+    std::vector<int> m_board;
+    struct move
+    {
+        int col;
+        int x, y;
+    };
+    std::vector<move> m_moves;
+
+    /* Set while an analysis command is running.  Its response is ended by a
+       blank line when the next command arrives.  */
+    bool                   m_analyzing  = false;
+    bool                   m_kata_fmt   = false;
+    int                    m_an_visits  = 0;
+    size_t                 m_replay_pos = 0;
+    clock_type::duration   m_interval;
+    clock_type::time_point m_next_update;
+
+    std::string vertex(int x, int y) const
+    {
+        return vertex_name(x, y, m_size);
+    }
+    bool parse_vertex(const std::string &s, int &x, int &y) const
+    {
+        if (s == "pass" || s == "PASS")
+        {
+            x = y = -1;
+            return true;
+        }
+        if (s.size() < 2)
+            return false;
+        int c = toupper((unsigned char)s[0]);
+        if (c < 'A' || c > 'Z' || c == 'I')
+            return false;
+        x       = c - 'A' - (c > 'I');
+        int row = atoi(s.c_str() + 1);
+        y       = m_size - row;
+        return x < m_size && row >= 1 && row <= m_size;
+    }
+    static bool parse_color(const std::string &s, int &col)
+    {
+        if (s == "b" || s == "B" || s == "black" || s == "Black")
+            col = 1;
+        else if (s == "w" || s == "W" || s == "white" || s == "White")
+            col = 2;
+        else
+            return false;
+        return true;
+    }
+    std::vector<int> empty_points()
+    {
+        std::vector<int> pts;
+        for (int i = 0; i < m_size * m_size; i++)
+            if (m_board[i] == 0)
+                pts.push_back(i);
+        return pts;
+    }
+
+    void clear()
+    {
+        m_board.assign(m_size * m_size, 0);
+        m_moves.clear();
+    }
+
+    void play(int col, int x, int y)
+    {
+        if (x >= 0)
+            m_board[y * m_size + x] = col;
+        m_moves.push_back({col, x, y});
+    }
+
+    std::string genmove(int col)
+    {
+        if (m_opts.genmove_ms > 0)
+            std::this_thread::sleep_for(std::chrono::milliseconds(m_opts.genmove_ms));
+        std::vector<int> pts = empty_points();
+        if (pts.empty())
+        {
+            play(col, -1, -1);
+            return "pass";
+        }
+        int p = pts[m_rng() % pts.size()];
+        play(col, p % m_size, p / m_size);
+        return vertex(p % m_size, p / m_size);
+    }
+
+    std::string final_score()
+    {
+        double score = -m_komi;
+        for (int v : m_board)
+            score += v == 1 ? 1 : v == 2 ? -1 : 0;
+        if (score == 0)
+            return "0";
+        std::ostringstream s;
+        s << (score > 0 ? "B+" : "W+") << std::abs(score);
+        return s.str();
+    }
+
+    /* Make up an update: candidates on random empty points with visits
+       growing over time, winrates wandering around 50%.  */
+    std::string synthetic_update()
+    {
+        std::vector<int> pts = empty_points();
+        std::shuffle(pts.begin(), pts.end(), m_rng);
+        int n = std::min<int>(m_opts.candidates, pts.size());
+        m_an_visits += 50 + m_rng() % 50;
+        std::uniform_real_distribution<double> wr_dist(0.35, 0.65);
+        std::uniform_real_distribution<double> score_dist(-10, 10);
+        std::ostringstream                     out;
+        int                                    visits = m_an_visits;
+        for (int i = 0; i < n; i++)
+        {
+            double wr = wr_dist(m_rng);
+            if (i > 0)
+                out << " ";
+            out << "info move " << vertex(pts[i] % m_size, pts[i] / m_size) << " visits " << visits;
+            if (m_kata_fmt)
+                out << " utility 0.0 winrate " << wr << " scoreMean " << score_dist(m_rng) << " scoreStdev 12.5 scoreLead 0.5"
+                    << " prior " << 1.0 / (i + 2) << " lcb " << wr - 0.01;
+            else
+                out << " winrate " << (int)(wr * 10000) << " prior " << 10000 / (i + 2) << " lcb " << (int)(wr * 9900);
+            out << " order " << i << " pv " << vertex(pts[i] % m_size, pts[i] / m_size);
+            for (int k = 1; k < m_opts.pv_len && (size_t)(n + k) < pts.size(); k++)
+            {
+                int p = pts[n + (i * 7 + k) % (pts.size() - n)];
+                out << " " << vertex(p % m_size, p / m_size);
+            }
+            visits = visits * 2 / 3;
+        }
+        return out.str();
+    }
+
+public:
+    mock_engine(const options &o) : m_opts(o), m_rng(o.seed)
+    {
+        clear();
+    }
+
+    bool analyzing() const
+    {
+        return m_analyzing;
+    }
+    clock_type::time_point next_update() const
+    {
+        return m_next_update;
+    }
+
+    void emit_update()
+    {
+        if (!m_opts.replay.empty())
+        {
+            std::cout << m_opts.replay[m_replay_pos] << "\n";
+            m_replay_pos = (m_replay_pos + 1) % m_opts.replay.size();
+        }
+        else
+            std::cout << synthetic_update() << "\n";
+        std::cout.flush();
+        m_next_update += m_interval;
+        /* Don't try to catch up if we were held up.  */
+        if (m_next_update < clock_type::now())
+            m_next_update = clock_type::now() + m_interval;
+    }
+
+    /* Process one command line.  Returns false for quit.  */
+    bool command(const std::string &line)
+    {
+        if (m_analyzing)
+        {
+            /* A blank line ends the analysis response.  */
+            std::cout << "\n";
+            m_analyzing = false;
+        }
+        std::istringstream       in(line);
+        std::vector<std::string> args;
+        std::string              w;
+        while (in >> w)
+            args.push_back(w);
+        if (args.empty())
+            return true;
+        std::string id;
+        if (isdigit((unsigned char)args[0][0]))
+        {
+            id = args[0];
+            args.erase(args.begin());
+            if (args.empty())
+                return true;
+        }
+        if (m_opts.delay_ms > 0)
+            std::this_thread::sleep_for(std::chrono::milliseconds(m_opts.delay_ms));
+
+        std::string cmd = args[0];
+        auto        ok  = [&](const std::string &r) { std::cout << "=" << id << (r.empty() ? "" : " ") << r << "\n\n"; };
+        auto        err = [&](const std::string &r) { std::cout << "?" << id << " " << r << "\n\n"; };
+
+        static const char *const commands[]
+            = {"protocol_version", "name", "version", "known_command", "list_commands", "quit", "boardsize", "clear_board", "komi", "play",
+               "genmove", "undo", "final_score", "lz-analyze", "kata-analyze"};
+        auto known = [&](const std::string &c) {
+            if (c == "kata-analyze" && !m_opts.kata)
+                return false;
+            for (auto k : commands)
+                if (c == k)
+                    return true;
+            return false;
+        };
+
+        int col, x, y;
+        if (cmd == "protocol_version")
+            ok("2");
+        else if (cmd == "name")
+            ok("mockgtp");
+        else if (cmd == "version")
+            ok("1.0");
+        else if (cmd == "known_command")
+            ok(args.size() > 1 && known(args[1]) ? "true" : "false");
+        else if (cmd == "list_commands")
+        {
+            std::string all;
+            for (auto k : commands)
+                if (known(k))
+                    all += (all.empty() ? "" : "\n") + std::string(k);
+            ok(all);
+        }
+        else if (cmd == "quit")
+        {
+            ok("");
+            std::cout.flush();
+            return false;
+        }
+        else if (cmd == "boardsize")
+        {
+            int sz = args.size() > 1 ? atoi(args[1].c_str()) : 0;
+            if (sz < 2 || sz > 25)
+                err("unacceptable size");
+            else
+            {
+                m_size = sz;
+                clear();
+                ok("");
+            }
+        }
+        else if (cmd == "clear_board")
+        {
+            clear();
+            ok("");
+        }
+        else if (cmd == "komi")
+        {
+            if (args.size() > 1)
+                m_komi = atof(args[1].c_str());
+            ok("");
+        }
+        else if (cmd == "play")
+        {
+            if (args.size() < 3 || !parse_color(args[1], col) || !parse_vertex(args[2], x, y))
+                err("syntax error");
+            else if (x >= 0 && m_board[y * m_size + x] != 0)
+                err("illegal move");
+            else
+            {
+                play(col, x, y);
+                ok("");
+            }
+        }
+        else if (cmd == "genmove")
+        {
+            if (args.size() < 2 || !parse_color(args[1], col))
+                err("syntax error");
+            else
+                ok(genmove(col));
+        }
+        else if (cmd == "undo")
+        {
+            if (m_moves.empty())
+                err("cannot undo");
+            else
+            {
+                move &m = m_moves.back();
+                if (m.x >= 0)
+                    m_board[m.y * m_size + m.x] = 0;
+                m_moves.pop_back();
+                ok("");
+            }
+        }
+        else if (cmd == "final_score")
+            ok(final_score());
+        else if (known(cmd) && (cmd == "lz-analyze" || cmd == "kata-analyze"))
+        {
+            /* [color] [interval], where the interval is in centiseconds.  */
+            int    centisecs = 100;
+            size_t a         = 1;
+            if (a < args.size() && parse_color(args[a], col))
+                a++;
+            if (a < args.size() && args[a] == "interval")
+                a++;
+            if (a < args.size())
+                centisecs = std::max(1, atoi(args[a].c_str()));
+            double per_sec = m_opts.rate > 0 ? m_opts.rate : 100.0 / centisecs;
+            m_interval     = std::chrono::duration_cast<clock_type::duration>(std::chrono::duration<double>(1 / per_sec));
+            m_kata_fmt     = cmd == "kata-analyze";
+            m_an_visits    = 0;
+            m_analyzing    = true;
+            m_next_update  = clock_type::now() + m_interval;
+            std::cout << "=" << id << "\n";
+        }
+        else
+            err("unknown command");
+        std::cout.flush();
+        return true;
+    }
+};
+
+/* Just enough JSON for the analysis protocol: values are found by key in the
+   top level object of a query and kept as text until they are needed.  */
+static size_t skip_space(const std::string &s, size_t pos)
+{
+    while (pos < s.size() && isspace((unsigned char)s[pos]))
+        pos++;
+    return pos;
+}
+
+/* The position after the value that starts at POS.  */
+static size_t skip_value(const std::string &s, size_t pos)
+{
+    int  depth     = 0;
+    bool in_string = false;
+    for (; pos < s.size(); pos++)
+    {
+        char c = s[pos];
+        if (in_string)
+        {
+            if (c == '\\')
+                pos++;
+            else if (c == '"')
+            {
+                in_string = false;
+                if (depth == 0)
+                    return pos + 1;
+            }
+        }
+        else if (c == '"')
+            in_string = true;
+        else if (c == '[' || c == '{')
+            depth++;
+        else if (c == ']' || c == '}')
+        {
+            if (depth == 0)
+                return pos;
+            if (--depth == 0)
+                return pos + 1;
+        }
+        else if (depth == 0 && (c == ',' || isspace((unsigned char)c)))
+            return pos;
+    }
+    return pos;
+}
+
+/* The members of the object or elements of the array in TEXT, as text.  For
+   objects, keys and values alternate.  */
+static std::vector<std::string> json_elements(const std::string &text)
+{
+    std::vector<std::string> result;
+    size_t                   pos = skip_space(text, 0);
+    if (pos >= text.size() || (text[pos] != '[' && text[pos] != '{'))
+        return result;
+    pos++;
+    for (;;)
+    {
+        pos = skip_space(text, pos);
+        if (pos >= text.size() || text[pos] == ']' || text[pos] == '}')
+            return result;
+        size_t end = skip_value(text, pos);
+        if (end == pos)
+            return result;
+        result.push_back(text.substr(pos, end - pos));
+        pos = skip_space(text, end);
+        if (pos < text.size() && (text[pos] == ',' || text[pos] == ':'))
+            pos++;
+    }
+}
+
+static std::string json_string(const std::string &text)
+{
+    if (text.size() < 2 || text.front() != '"')
+        return text;
+    std::string result;
+    for (size_t i = 1; i + 1 < text.size(); i++)
+    {
+        if (text[i] == '\\')
+            i++;
+        result += text[i];
+    }
+    return result;
+}
+
+/* The value of KEY in OBJ, or an empty string.  */
+static std::string json_field(const std::string &obj, const std::string &key)
+{
+    std::vector<std::string> members = json_elements(obj);
+    for (size_t i = 0; i + 1 < members.size(); i += 2)
+        if (json_string(members[i]) == key)
+            return members[i + 1];
+    return std::string();
+}
+
+static std::string json_quote(const std::string &s)
+{
+    std::string result = "\"";
+    for (char c : s)
+    {
+        if (c == '"' || c == '\\')
+            result += '\\';
+        result += c;
+    }
+    return result + "\"";
+}
+
+/* Answers queries of KataGo's analysis engine.  Results are made up like
+   those of mock_engine's synthetic updates, for the position of each turn.  */
+class mock_analysis_engine
+{
+    const options &m_opts;
+    std::mt19937   m_rng;
+
+    struct turn
+    {
+        std::string      id;
+        int              number;
+        int              size;
+        int              to_move;
+        int              visits;
+        std::vector<int> board;
+    };
+    std::deque<turn> m_pending;
+
+    clock_type::duration   m_interval;
+    clock_type::time_point m_next_update;
+
+    void reply(const std::string &text)
+    {
+        std::cout << text << "\n";
+        std::cout.flush();
+    }
+    void error(const std::string &id, const std::string &msg, const std::string &field = std::string())
+    {
+        std::string r = "{\"error\":" + json_quote(msg);
+        if (!id.empty())
+            r += ",\"id\":" + json_quote(id);
+        if (!field.empty())
+            r += ",\"field\":" + json_quote(field);
+        reply(r + "}");
+    }
+    static int color(const std::string &s)
+    {
+        return s == "B" || s == "b" ? 1 : s == "W" || s == "w" ? 2 : 0;
+    }
+    static bool parse_vertex(const std::string &s, int size, int &x, int &y)
+    {
+        if (s == "pass" || s == "PASS")
+        {
+            x = y = -1;
+            return true;
+        }
+        if (s.size() < 2)
+            return false;
+        int c = toupper((unsigned char)s[0]);
+        if (c < 'A' || c > 'Z' || c == 'I')
+            return false;
+        x       = c - 'A' - (c > 'I');
+        int row = atoi(s.c_str() + 1);
+        y       = size - row;
+        return x < size && row >= 1 && row <= size;
+    }
+    /* Put the [color, vertex] pairs of LIST on BOARD.  Returns false and
+       reports the error if one of them makes no sense.  */
+    bool place(const std::string &id, const std::string &field, const std::vector<std::string> &list, int size,
+               std::vector<int> &board, int &to_move)
+    {
+        for (auto &m : list)
+        {
+            std::vector<std::string> pair = json_elements(m);
+            int                      x, y;
+            int                      col = pair.size() == 2 ? color(json_string(pair[0])) : 0;
+            if (col == 0 || !parse_vertex(json_string(pair[1]), size, x, y))
+            {
+                error(id, "could not parse " + m, field);
+                return false;
+            }
+            if (x >= 0)
+                board[y * size + x] = col;
+            to_move = 3 - col;
+        }
+        return true;
+    }
+
+    void terminate(const std::string &id, const std::string &action, const std::string &target)
+    {
+        std::string turns;
+        for (auto it = m_pending.begin(); it != m_pending.end();)
+        {
+            if (!target.empty() && it->id != target)
+            {
+                ++it;
+                continue;
+            }
+            turns += (turns.empty() ? "" : ",") + std::to_string(it->number);
+            it = m_pending.erase(it);
+        }
+        std::string r = "{\"action\":" + json_quote(action) + ",\"id\":" + json_quote(id);
+        if (!target.empty())
+            r += ",\"terminateId\":" + json_quote(target);
+        reply(r + ",\"turnNumbers\":[" + turns + "]}");
+    }
+
+public:
+    mock_analysis_engine(const options &o) : m_opts(o), m_rng(o.seed)
+    {
+        double per_sec = m_opts.rate > 0 ? m_opts.rate : 20;
+        m_interval     = std::chrono::duration_cast<clock_type::duration>(std::chrono::duration<double>(1 / per_sec));
+    }
+
+    bool analyzing() const
+    {
+        return !m_pending.empty();
+    }
+    clock_type::time_point next_update() const
+    {
+        return m_next_update;
+    }
+
+    /* Process one query line.  Returns false for quit, which the analysis
+       protocol does not have.  */
+    bool command(const std::string &line)
+    {
+        if (skip_space(line, 0) == line.size())
+            return true;
+        if (m_opts.delay_ms > 0)
+            std::this_thread::sleep_for(std::chrono::milliseconds(m_opts.delay_ms));
+        std::string id = json_string(json_field(line, "id"));
+        if (json_elements(line).empty())
+        {
+            error(id, "could not parse query");
+            return true;
+        }
+        if (id.empty())
+        {
+            error(id, "'id' field was not specified", "id");
+            return true;
+        }
+        std::string action = json_string(json_field(line, "action"));
+        if (action == "terminate")
+        {
+            std::string target = json_string(json_field(line, "terminateId"));
+            if (target.empty())
+                error(id, "'terminateId' field was not specified", "terminateId");
+            else
+                terminate(id, action, target);
+            return true;
+        }
+        if (action == "terminate_all")
+        {
+            terminate(id, action, std::string());
+            return true;
+        }
+        if (action == "query_version")
+        {
+            reply("{\"action\":\"query_version\",\"id\":" + json_quote(id) + ",\"version\":\"1.0-mockgtp\"}");
+            return true;
+        }
+        if (!action.empty())
+        {
+            error(id, "unknown action " + action, "action");
+            return true;
+        }
+
+        int size  = atoi(json_field(line, "boardXSize").c_str());
+        int ysize = atoi(json_field(line, "boardYSize").c_str());
+        if (size < 2 || size > 25 || ysize != size)
+        {
+            error(id, "unsupported board size", "boardXSize");
+            return true;
+        }
+        std::vector<int> board(size * size, 0);
+        int              to_move = color(json_string(json_field(line, "initialPlayer")));
+        if (!place(id, "initialStones", json_elements(json_field(line, "initialStones")), size, board, to_move))
+            return true;
+        if (to_move == 0)
+            to_move = 1;
+
+        std::vector<std::string> moves = json_elements(json_field(line, "moves"));
+        std::vector<int>         turns;
+        std::string              turns_text = json_field(line, "analyzeTurns");
+        if (turns_text.empty())
+            turns.push_back(moves.size());
+        for (auto &t : json_elements(turns_text))
+        {
+            int n = atoi(t.c_str());
+            if (n < 0 || (size_t)n > moves.size())
+            {
+                error(id, "invalid turn number " + t, "analyzeTurns");
+                return true;
+            }
+            turns.push_back(n);
+        }
+        std::sort(turns.begin(), turns.end());
+
+        /* Play through the moves, remembering the positions to analyze.  The
+           query is rejected as a whole if any move is bad.  */
+        int               max_visits = atoi(json_field(line, "maxVisits").c_str());
+        size_t            next       = 0;
+        std::vector<turn> wanted;
+        for (size_t t = 0; t <= moves.size(); t++)
+        {
+            while (next < turns.size() && (size_t)turns[next] == t)
+            {
+                int visits = max_visits > 0 ? max_visits : 100 + m_rng() % 900;
+                wanted.push_back({id, turns[next++], size, to_move, visits, board});
+            }
+            if (t < moves.size() && !place(id, "moves", {moves[t]}, size, board, to_move))
+                return true;
+        }
+        if (m_pending.empty())
+            m_next_update = clock_type::now() + m_interval;
+        for (auto &t : wanted)
+            m_pending.push_back(std::move(t));
+        return true;
+    }
+
+    void emit_update()
+    {
+        turn t = std::move(m_pending.front());
+        m_pending.pop_front();
+
+        std::vector<int> pts;
+        for (int i = 0; i < t.size * t.size; i++)
+            if (t.board[i] == 0)
+                pts.push_back(i);
+        std::shuffle(pts.begin(), pts.end(), m_rng);
+        int n = std::min<int>(m_opts.candidates, pts.size());
+
+        std::uniform_real_distribution<double> wr_dist(0.35, 0.65);
+        std::uniform_real_distribution<double> score_dist(-10, 10);
+        std::ostringstream                     infos;
+        double                                 root_wr    = wr_dist(m_rng);
+        double                                 root_score = score_dist(m_rng);
+        int                                    visits     = t.visits / 2;
+        for (int i = 0; i < n; i++)
+        {
+            double      wr = wr_dist(m_rng);
+            std::string mv = vertex_name(pts[i] % t.size, pts[i] / t.size, t.size);
+            infos << (i > 0 ? "," : "") << "{\"move\":\"" << mv << "\",\"order\":" << i << ",\"prior\":" << 1.0 / (i + 2)
+                  << ",\"scoreLead\":" << score_dist(m_rng) << ",\"scoreMean\":0.0,\"scoreStdev\":12.5,\"visits\":" << std::max(1, visits)
+                  << ",\"winrate\":" << wr << ",\"lcb\":" << wr - 0.01 << ",\"pv\":[\"" << mv << "\"";
+            for (int k = 1; k < m_opts.pv_len && (size_t)(n + k) < pts.size(); k++)
+            {
+                int p = pts[n + (i * 7 + k) % (pts.size() - n)];
+                infos << ",\"" << vertex_name(p % t.size, p / t.size, t.size) << "\"";
+            }
+            infos << "]}";
+            visits = visits * 2 / 3;
+        }
+        std::ostringstream out;
+        out << "{\"id\":" << json_quote(t.id) << ",\"isDuringSearch\":false,\"turnNumber\":" << t.number << ",\"moveInfos\":["
+            << infos.str() << "],\"rootInfo\":{\"currentPlayer\":\"" << (t.to_move == 2 ? "W" : "B") << "\",\"scoreLead\":" << root_score
+            << ",\"scoreStdev\":12.5,\"visits\":" << t.visits << ",\"winrate\":" << root_wr << "}}";
+        reply(out.str());
+
+        m_next_update += m_interval;
+        if (m_next_update < clock_type::now())
+            m_next_update = clock_type::now() + m_interval;
+    }
+};
+
+/* Read commands and produce analysis output until the input ends or ENGINE
+   is told to quit.  */
+template<class E>
+static int run(E &engine, const options &opts)
+{
+    input_queue input;
+    std::thread reader(&input_queue::run, &input);
+    reader.detach();
+
+    int  n_commands = 0;
+    bool eof        = false;
+    for (;;)
+    {
+        auto        deadline = engine.analyzing() ? engine.next_update() : clock_type::now() + std::chrono::hours(1);
+        std::string line;
+        if (eof)
+        {
+            /* Like the real analysis engine, finish what was asked for before
+               exiting at the end of the input.  */
+            if (!engine.analyzing())
+                break;
+            std::this_thread::sleep_until(deadline);
+        }
+        else if (input.wait(deadline, line, eof))
+        {
+            n_commands++;
+            if (n_commands == opts.crash_after)
+                abort();
+            if (n_commands == opts.hang_after)
+                for (;;)
+                    std::this_thread::sleep_for(std::chrono::hours(1));
+            if (!engine.command(line))
+                break;
+            continue;
+        }
+        else if (eof && !opts.analysis)
+            break;
+        if (engine.analyzing() && clock_type::now() >= engine.next_update())
+            engine.emit_update();
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    options opts;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string a    = argv[i];
+        bool        more = i + 1 < argc;
+        if (a == "--rate" && more)
+            opts.rate = atof(argv[++i]);
+        else if (a == "--candidates" && more)
+            opts.candidates = std::max(1, atoi(argv[++i]));
+        else if (a == "--pv" && more)
+            opts.pv_len = std::max(1, atoi(argv[++i]));
+        else if (a == "--delay" && more)
+            opts.delay_ms = atoi(argv[++i]);
+        else if (a == "--genmove-ms" && more)
+            opts.genmove_ms = atoi(argv[++i]);
+        else if (a == "--seed" && more)
+            opts.seed = atoi(argv[++i]);
+        else if (a == "--no-kata")
+            opts.kata = false;
+        else if (a == "--crash-after" && more)
+            opts.crash_after = atoi(argv[++i]);
+        else if (a == "--hang-after" && more)
+            opts.hang_after = atoi(argv[++i]);
+        else if (a == "--analysis")
+            opts.analysis = true;
+        else if (a == "--replay" && more)
+        {
+            std::ifstream f(argv[++i]);
+            std::string   l;
+            while (std::getline(f, l))
+                if (l.compare(0, 10, "info move ") == 0)
+                    opts.replay.push_back(l);
+            if (opts.replay.empty())
+            {
+                fprintf(stderr, "mockgtp: no analysis lines in %s\n", argv[i]);
+                return 1;
+            }
+        }
+        else
+        {
+            fprintf(stderr, "mockgtp: unknown option %s\n", a.c_str());
+            return 1;
+        }
+    }
+
+    if (opts.analysis && !opts.replay.empty())
+    {
+        fprintf(stderr, "mockgtp: --replay only works with GTP\n");
+        return 1;
+    }
+    if (opts.analysis)
+    {
+        mock_analysis_engine engine(opts);
+        return run(engine, opts);
+    }
+    mock_engine engine(opts);
+    return run(engine, opts);
+}
@@ -184,6 +184,12 @@ PreferencesDialog::PreferencesDialog(QWidget *parent)
     LineEdit_port->setValidator(new QIntValidator(0, 9999, this));
     anMaxMovesEdit->setValidator(new QIntValidator(0, 999, this));
     anDepthEdit->setValidator(new QIntValidator(0, 999, this));
+    anRefreshEdit->setValidator(new QIntValidator(0, 999, this));
+    anCacheEdit->setValidator(new QIntValidator(0, 9999999, this));
+    anTimeoutEdit->setValidator(new QIntValidator(0, 99999, this));
+    anPrefetchEdit->setValidator(new QIntValidator(0, 99, this));
+    poolSizeEdit->setValidator(new QIntValidator(1, 99, this));
+    poolMemoryEdit->setValidator(new QIntValidator(0, 9999999, this));
     slideXEdit->setValidator(new QIntValidator(100, 9999, this));
     slideYEdit->setValidator(new QIntValidator(100, 9999, this));
 
@@ -524,10 +530,18 @@ void PreferencesDialog::init_from_settings()
     anChildMovesCheckBox->setChecked(g_setting->readBoolEntry("ANALYSIS_CHILDREN"));
     anPruneCheckBox->setChecked(g_setting->readBoolEntry("ANALYSIS_PRUNE"));
     anHideCheckBox->setChecked(g_setting->readBoolEntry("ANALYSIS_HIDEOTHER"));
+    anSharedCheckBox->setChecked(g_setting->readBoolEntry("ANALYSIS_SHARED"));
     anVarComboBox->setCurrentIndex(g_setting->readIntEntry("ANALYSIS_VARTYPE"));
     winrateComboBox->setCurrentIndex(g_setting->readIntEntry("ANALYSIS_WINRATE"));
     anDepthEdit->setText(QString::number(g_setting->readIntEntry("ANALYSIS_DEPTH")));
     anMaxMovesEdit->setText(QString::number(g_setting->readIntEntry("ANALYSIS_MAXMOVES")));
+    anRefreshEdit->setText(QString::number(g_setting->readIntEntry("ANALYSIS_REFRESH")));
+    anCacheEdit->setText(QString::number(g_setting->readIntEntry("ANALYSIS_CACHE_VISITS")));
+    anTimeoutEdit->setText(QString::number(g_setting->readIntEntry("ANALYSIS_TIMEOUT")));
+    anPrefetchEdit->setText(QString::number(g_setting->readIntEntry("ANALYSIS_PREFETCH")));
+    poolSizeEdit->setText(QString::number(g_setting->readIntEntry("ENGINE_POOL_SIZE")));
+    poolMemoryEdit->setText(QString::number(g_setting->readIntEntry("ENGINE_POOL_MEMORY")));
+    poolSpareCheckBox->setChecked(g_setting->readBoolEntry("ENGINE_POOL_SPARE"));
 
     // Go Server tab
     boardSizeSpin->setValue(g_setting->readIntEntry("DEFAULT_SIZE"));
@@ -839,11 +853,19 @@ void PreferencesDialog::slot_apply()
     g_setting->writeBoolEntry("ANALYSIS_CHILDREN", anChildMovesCheckBox->isChecked());
     g_setting->writeBoolEntry("ANALYSIS_PRUNE", anPruneCheckBox->isChecked());
     g_setting->writeBoolEntry("ANALYSIS_HIDEOTHER", anHideCheckBox->isChecked());
+    g_setting->writeBoolEntry("ANALYSIS_SHARED", anSharedCheckBox->isChecked());
     g_setting->writeIntEntry("ANALYSIS_VARTYPE", anVarComboBox->currentIndex());
     g_setting->writeIntEntry("ANALYSIS_WINRATE", winrateComboBox->currentIndex());
 
     g_setting->writeIntEntry("ANALYSIS_DEPTH", anDepthEdit->text().toInt());
     g_setting->writeIntEntry("ANALYSIS_MAXMOVES", anMaxMovesEdit->text().toInt());
+    g_setting->writeIntEntry("ANALYSIS_REFRESH", anRefreshEdit->text().toInt());
+    g_setting->writeIntEntry("ANALYSIS_CACHE_VISITS", anCacheEdit->text().toInt());
+    g_setting->writeIntEntry("ANALYSIS_TIMEOUT", anTimeoutEdit->text().toInt());
+    g_setting->writeIntEntry("ANALYSIS_PREFETCH", anPrefetchEdit->text().toInt());
+    g_setting->writeIntEntry("ENGINE_POOL_SIZE", poolSizeEdit->text().toInt());
+    g_setting->writeIntEntry("ENGINE_POOL_MEMORY", poolMemoryEdit->text().toInt());
+    g_setting->writeBoolEntry("ENGINE_POOL_SPARE", poolSpareCheckBox->isChecked());
 
     g_setting->writeIntEntry("GAMETREE_SIZE", gameTreeSizeSlider->value());
     g_setting->writeIntEntry("BOARD_DIAGMODE", diagShowComboBox->currentIndex());
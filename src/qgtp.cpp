@@ -1,34 +1,102 @@
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+
+#include <QDir>
 #include <QProcess>
 
 #include "qgtp.h"
+#include "analysiscache.h"
+#include "analysisservice.h"
+#include "enginepool.h"
+#include "gtpinfo.h"
 #include "gogame.h"
 #include "qgo.h"
 #include "setting.h"
 
-GTP_Process *GTP_Controller::create_gtp(const Engine &engine, int size, double komi, bool show_dialog)
+analyzer_id engine_analyzer_id(const Engine &engine, double komi)
 {
-    m_id.engine   = engine.title.toStdString();
+    analyzer_id id;
+    id.engine     = engine.title.toStdString();
     QString ekstr = engine.komi;
     bool    ok;
     double  ekomi = ekstr.toFloat(&ok);
-    m_id.komi_set = !ekstr.isEmpty() && ok;
-    if (m_id.komi_set)
+    id.komi_set   = !ekstr.isEmpty() && ok;
+    if (id.komi_set)
     {
-        m_id.komi = ekomi;
+        id.komi = ekomi;
     }
     else
-        m_id.komi = komi;
+        id.komi = komi;
+    return id;
+}
+
+void engine_watchdog::reset()
+{
+    m_n_quick    = 0;
+    m_n_restarts = 0;
+    m_causes.clear();
+    m_since_start.start();
+}
 
+int engine_watchdog::crashed(const QString &cause)
+{
+    m_causes.append(cause);
+    if (m_causes.size() > 10)
+        m_causes.removeFirst();
+    if (!m_since_start.isValid() || m_since_start.elapsed() >= stable_time)
+        m_n_quick = 0;
+    if (m_n_quick == max_quick_crashes)
+        return -1;
+    int delay = 1000 << m_n_quick;
+    m_n_quick++;
+    m_n_restarts++;
+    return delay;
+}
+
+void GTP_Controller::set_analyzer_id(const Engine &engine, double komi)
+{
+    m_id                = engine_analyzer_id(engine, komi);
+    m_id_idx            = intern_analyzer_id(m_id);
+    analyzer_id flipped = m_id;
+    flipped.komi        = -flipped.komi;
+    m_flipped_id_idx    = intern_analyzer_id(flipped);
+}
+
+GTP_Process *GTP_Controller::create_gtp(const Engine &engine, int size, double komi, bool show_dialog)
+{
+    set_analyzer_id(engine, komi);
     GTP_Process *g = new GTP_Process(m_parent, this, engine, size, komi, show_dialog);
     return g;
 }
 
+GTP_Process *GTP_Controller::lease_gtp(const Engine &engine, int size, double komi, bool show_dialog)
+{
+    if (g_engine_pool == nullptr)
+        return create_gtp(engine, size, komi, show_dialog);
+    set_analyzer_id(engine, komi);
+    return g_engine_pool->lease(this, engine, size, komi, show_dialog);
+}
+
+void GTP_Controller::release_gtp(GTP_Process *p)
+{
+    if (g_engine_pool != nullptr)
+    {
+        g_engine_pool->release(p);
+        return;
+    }
+    if (!p->stopped())
+        p->quit();
+    delete p;
+}
+
 GTP_Process::GTP_Process(QWidget *parent, GTP_Controller *c, const Engine &engine, int size, float komi, bool show_dialog)
-    : m_dlg(parent, TextView::type::gtp), m_controller(c), m_size(size), m_komi(komi)
+    : m_dlg(parent, TextView::type::gtp), m_controller(c), m_size(size), m_komi(komi), m_sync_start(size)
 {
     const QString &prog = engine.path;
     const QString &args = engine.args;
     req_cnt             = 1;
+    m_clock.start();
 
     if (show_dialog)
     {
@@ -44,6 +112,7 @@ GTP_Process::GTP_Process(QWidget *parent, GTP_Controller *c, const Engine &engin
     connect(this, fini, this, &GTP_Process::slot_finished);
     connect(this, &QProcess::readyReadStandardError, this, &GTP_Process::slot_startup_messages);
     connect(this, &QProcess::readyReadStandardOutput, this, &GTP_Process::slot_receive_stdout);
+    connect(&m_watchdog, &QTimer::timeout, this, &GTP_Process::check_alive);
 
     QStringList arguments;
     if (!args.isEmpty())
@@ -57,22 +126,75 @@ GTP_Process::GTP_Process(QWidget *parent, GTP_Controller *c, const Engine &engin
     start(prog, arguments);
 }
 
+/* The startup commands don't depend on each other's results, so they all go
+   out at once and the engine works through them while we wait.  If the
+   protocol version is wrong, we quit and the remaining answers are ignored.  */
 void GTP_Process::slot_started()
 {
-    send_request("protocol_version", &GTP_Process::startup_part2);
+    send_request("protocol_version", &GTP_Process::startup_protocol);
+    send_request(QString("boardsize ") + QString::number(m_size));
+    send_request("clear_board");
+    char komi[20];
+    sprintf(komi, "komi %.2f", m_komi);
+    send_request(komi);
+    send_request("known_command lz-analyze", &GTP_Process::startup_lz_analyze);
+    send_request("known_command kata-analyze", &GTP_Process::startup_kata_analyze);
+    send_request("known_command set_position", &GTP_Process::startup_set_position);
+    send_request("known_command loadsgf", &GTP_Process::startup_loadsgf);
 }
 
 void GTP_Process::slot_error(QProcess::ProcessError)
 {
-    m_stopped = true;
-    m_receivers.clear();
+    report_crash(errorString());
+}
+
+/* Tell the controller we are gone.  It may start a replacement if we got far
+   enough to be useful, or were a replacement ourselves.  */
+void GTP_Process::report_crash(const QString &cause)
+{
+    /* A crash produces both an error and the finished signal.  */
+    if (m_crash_reported)
+        return;
+    m_crash_reported = true;
+    m_stopped        = true;
+    m_watchdog.stop();
+    m_requests.clear();
+    m_unsent.clear();
+    m_in_flight = 0;
     m_dlg.hide();
+    if ((m_started || m_replacement) && m_controller->gtp_crashed(this, cause))
+        return;
     m_controller->gtp_exited(this);
 }
 
+void GTP_Process::set_timeout(int seconds)
+{
+    m_timeout = seconds;
+    if (seconds > 0)
+        m_watchdog.start(1000);
+    else
+        m_watchdog.stop();
+}
+
+void GTP_Process::check_alive()
+{
+    if (!m_started || m_stopped || (m_in_flight == 0 && !m_analyzing))
+        return;
+    if (m_clock.nsecsElapsed() - m_last_activity < m_timeout * 1000000000ll)
+        return;
+    append_text(tr("No response for %1 seconds, stopping the engine").arg(m_timeout), Qt::darkRed);
+    void (QProcess::*fini)(int, QProcess::ExitStatus) = &QProcess::finished;
+    disconnect(this, fini, nullptr, nullptr);
+    disconnect(this, &QProcess::errorOccurred, nullptr, nullptr);
+    kill();
+    report_crash(tr("No response for %1 seconds").arg(m_timeout));
+}
+
 void GTP_Process::slot_abort_request(bool)
 {
-    m_receivers.clear();
+    m_requests.clear();
+    m_unsent.clear();
+    m_in_flight = 0;
     quit();
     m_dlg.hide();
     m_controller->gtp_exited(this);
@@ -98,46 +220,37 @@ void GTP_Process::slot_startup_messages()
     }
 }
 
-void GTP_Process::startup_part2(const QString &response)
+void GTP_Process::startup_protocol(const QString &response)
 {
     if (response != "2")
     {
         m_controller->gtp_failure(this, tr("GTP engine reported unsupported protocol version"));
         quit();
-        return;
     }
-    send_request(QString("boardsize ") + QString::number(m_size), &GTP_Process::startup_part3);
-}
-
-void GTP_Process::startup_part3(const QString &)
-{
-    send_request("clear_board", &GTP_Process::startup_part4);
 }
 
-void GTP_Process::startup_part4(const QString &)
+void GTP_Process::startup_lz_analyze(const QString &response)
 {
-    char komi[20];
-    sprintf(komi, "komi %.2f", m_komi);
-    send_request(komi, &GTP_Process::startup_part5);
+    if (response == "true")
+        m_analyze_lz = true;
 }
 
-void GTP_Process::startup_part5(const QString &)
+void GTP_Process::startup_kata_analyze(const QString &response)
 {
-    send_request("known_command lz-analyze", &GTP_Process::startup_part6);
+    if (response == "true")
+        m_analyze_kata = true;
 }
 
-void GTP_Process::startup_part6(const QString &response)
+void GTP_Process::startup_set_position(const QString &response)
 {
     if (response == "true")
-        m_analyze_lz = true;
-
-    send_request("known_command kata-analyze", &GTP_Process::startup_part7);
+        m_set_position = true;
 }
 
-void GTP_Process::startup_part7(const QString &response)
+void GTP_Process::startup_loadsgf(const QString &response)
 {
     if (response == "true")
-        m_analyze_kata = true;
+        m_loadsgf = true;
 
     /* Set this before calling startup success, as the callee may want to examine
      * it.  */
@@ -147,7 +260,66 @@ void GTP_Process::startup_part7(const QString &response)
     m_dlg.textEdit->setTextColor(Qt::black);
     m_dlg.hide();
     m_dlg.remember_cursor();
-    m_controller->gtp_startup_success(this);
+    report_started();
+}
+
+void GTP_Process::report_started()
+{
+    m_last_activity = m_clock.nsecsElapsed();
+    if (m_replacement)
+        m_controller->gtp_restarted(this);
+    else
+        m_controller->gtp_startup_success(this);
+}
+
+/* Take over a running engine for controller C.  Nothing of what the previous
+   controller did carries over: the board is cleared and resized, and C is
+   told that we have started once the engine has caught up with that.  An
+   engine that is still starting, which must have the right board size, only
+   needs the new komi.  */
+void GTP_Process::attach(GTP_Controller *c, int size, double km, bool show_dialog)
+{
+    m_controller  = c;
+    m_replacement = false;
+    if (show_dialog)
+    {
+        m_dlg.show();
+        m_dlg.activateWindow();
+    }
+    if (!m_started)
+    {
+        if (state() == QProcess::Starting)
+            m_komi = km;
+        else
+            komi(km);
+        return;
+    }
+    m_started = false;
+    if (size != m_size)
+    {
+        m_size = size;
+        send_request(QString("boardsize ") + QString::number(size));
+    }
+    m_sync_start = go_board(size);
+    clear_board();
+    komi(km);
+    send_request("known_command known_command", &GTP_Process::attach_done);
+}
+
+void GTP_Process::attach_done(const QString &)
+{
+    m_started = true;
+    report_started();
+}
+
+/* Hand the engine to C, which keeps it idle until the next attach.  */
+void GTP_Process::detach(GTP_Controller *c)
+{
+    m_controller = c;
+    set_timeout(0);
+    m_dlg.hide();
+    if (m_analyzing)
+        pause_analysis();
 }
 
 void GTP_Process::append_text(const QString &txt, const QColor &col)
@@ -172,6 +344,7 @@ void GTP_Process::receive_move(const QString &move)
     }
     else if (move.toLower() == "pass")
     {
+        m_sync_moves.push_back({m_genmove_col, -1, -1});
         m_controller->gtp_played_pass(this);
     }
     else
@@ -182,30 +355,44 @@ void GTP_Process::receive_move(const QString &move)
         if (i > 7)
             i--;
         int j = move.mid(1).toInt();
+        m_sync_moves.push_back({m_genmove_col, i, m_size - j});
         m_controller->gtp_played_move(this, i, m_size - j);
     }
 }
 
-void GTP_Process::played_move(stone_color col, int x, int y)
+void GTP_Process::send_play(const sync_move &m)
 {
-    if (m_last_move != nullptr)
-        m_last_move = m_last_move->add_child_move(x, y, col);
+    QString req = m.col == black ? "play black " : "play white ";
+    if (m.x < 0)
+    {
+        send_request(req + "pass");
+        return;
+    }
+    int x = m.x;
     if (x >= 8)
         x++;
-    char req[20];
-    sprintf(req, "%c%d", 'A' + x, m_size - y);
-    if (col == black)
-        send_request("play black " + QString(req));
-    else
-        send_request("play white " + QString(req));
+    send_request(req + QChar('A' + x) + QString::number(m_size - m.y));
+}
+
+void GTP_Process::played_move(stone_color col, int x, int y)
+{
+    m_sync_moves.push_back({col, x, y});
+    send_play(m_sync_moves.back());
 }
 
 void GTP_Process::played_move_pass(stone_color col)
 {
-    if (col == black)
-        send_request("play black pass");
-    else
-        send_request("play white pass");
+    m_sync_moves.push_back({col, -1, -1});
+    send_play(m_sync_moves.back());
+}
+
+void GTP_Process::clear_board()
+{
+    m_sync_start = go_board(m_sync_start, none);
+    m_sync_flip  = false;
+    m_sync_valid = true;
+    m_sync_moves.clear();
+    send_request("clear_board");
 }
 
 void GTP_Process::komi(double km)
@@ -221,6 +408,7 @@ void GTP_Process::komi(double km)
 
 void GTP_Process::request_move(stone_color col)
 {
+    m_genmove_col = col;
     if (col == black)
         send_request("genmove black", &GTP_Process::receive_move);
     else
@@ -250,12 +438,10 @@ void GTP_Process::score_callback_2(const QString &s)
 void GTP_Process::undo_move()
 {
     send_request("undo");
-    game_state *st = m_last_move;
-    if (st != nullptr)
-    {
-        m_last_move = st->prev_move();
-        delete st;
-    }
+    if (m_sync_moves.empty())
+        m_sync_valid = false;
+    else
+        m_sync_moves.pop_back();
 }
 
 static stone_color maybe_flip(stone_color col, bool flip)
@@ -265,72 +451,165 @@ static stone_color maybe_flip(stone_color col, bool flip)
     return flip_color(col);
 }
 
-void GTP_Process::dup_move(game_state *from, bool flip)
+/* Write a position with setup stones from B and MOVES after them to a
+   temporary SGF file, and have the engine load it.  Returns false if that
+   can't be done.  */
+bool GTP_Process::send_loadsgf(const go_board &b, bool flip, const std::vector<sync_move> &moves, double km)
 {
-    stone_color c = maybe_flip(from->get_move_color(), flip);
-    played_move(c, from->get_move_x(), from->get_move_y());
+    if (m_size > 26)
+        return false;
+    auto point = [](int x, int y) -> QString {
+        if (x < 0)
+            return "[]";
+        return QString("[") + QChar('a' + x) + QChar('a' + y) + "]";
+    };
+    QString ab, aw;
+    for (int i = 0; i < b.size_x(); i++)
+        for (int j = 0; j < b.size_y(); j++)
+        {
+            stone_color c = maybe_flip(b.stone_at(i, j), flip);
+            if (c == black)
+                ab += point(i, j);
+            else if (c == white)
+                aw += point(i, j);
+        }
+    QString sgf = QString("(;GM[1]FF[4]SZ[%1]KM[%2]").arg(m_size).arg(km);
+    if (!ab.isEmpty())
+        sgf += "AB" + ab;
+    if (!aw.isEmpty())
+        sgf += "AW" + aw;
+    for (auto &m : moves)
+        sgf += (m.col == black ? ";B" : ";W") + point(m.x, m.y);
+    sgf += ")\n";
+
+    std::unique_ptr<QTemporaryFile> file(new QTemporaryFile(QDir::tempPath() + "/qgo-XXXXXX.sgf"));
+    if (!file->open() || file->write(sgf.toLatin1()) < 0 || !file->flush())
+        return false;
+    /* GTP arguments can't contain spaces.  */
+    QString name = file->fileName();
+    if (name.contains(' '))
+        return false;
+    file->close();
+    send_request("loadsgf " + name, &GTP_Process::loadsgf_done, &GTP_Process::loadsgf_failed);
+    m_sgf_files.push_back(std::move(file));
+    return true;
 }
 
-void GTP_Process::setup_board(game_state *st, double km, bool flip)
+void GTP_Process::loadsgf_done(const QString &)
 {
-    const go_board &b = st->get_board();
+    m_sgf_files.pop_front();
+}
 
-    /* Check for shortcuts.
-       @@@ Should handle flip as well, but need to do something about
-       position_equal_p.  */
-    if (m_last_move != nullptr && !flip)
-    {
-        game_state *st_parent = st->prev_move();
-        if (st->was_move_p() && st_parent->get_board().position_equal_p(m_last_move->get_board()))
-        {
-            dup_move(st, flip);
-            return;
-        }
-        game_state *our_parent = m_last_move->prev_move();
-        if (our_parent != nullptr && our_parent->get_board().position_equal_p(st->get_board()))
-        {
-            undo_move();
-            return;
-        }
-    }
+void GTP_Process::loadsgf_failed(const QString &s)
+{
+    m_sgf_files.pop_front();
+    default_err_receiver(s);
+}
 
-    /* Must clear this before doing played_move calls for the initial setup.  */
-    delete m_moves;
-    m_moves     = nullptr;
-    m_last_move = nullptr;
+/* Bring the engine to the position of ST, with colors swapped if FLIP.  Since
+   we know what the engine has, this is usually a few undo commands back to
+   where the two lines of play meet, and play commands from there.  If that
+   is more work than starting over, the position is set up from scratch,
+   with a single command if the engine supports set_position or loadsgf.  */
+void GTP_Process::setup_board(game_state *st, double km, bool flip)
+{
+    /* This gives better behavior if the GTP process dies or misbehaves.  */
+    if (stopped())
+        return;
 
-    std::vector<game_state *> moves;
-    while (st->was_move_p() && !st->root_node_p())
+    std::vector<sync_move> moves;
+    while (!st->root_node_p() && (st->was_move_p() || st->was_pass_p()))
     {
-        moves.push_back(st);
+        stone_color col = maybe_flip(st->get_move_color(), flip);
+        if (st->was_pass_p())
+            moves.push_back({col, -1, -1});
+        else
+            moves.push_back({col, st->get_move_x(), st->get_move_y()});
         st = st->prev_move();
     }
+    std::reverse(moves.begin(), moves.end());
     const go_board &startpos = st->get_board();
 
-    clear_board();
+    size_t n_stones = 0;
+    for (int i = 0; i < startpos.size_x(); i++)
+        for (int j = 0; j < startpos.size_y(); j++)
+            if (startpos.stone_at(i, j) != none)
+                n_stones++;
+
+    /* Count the commands each way would take.  Writing a file for loadsgf
+       is not free, so it only wins against longer sequences.  */
+    size_t common      = 0;
+    size_t incremental = SIZE_MAX;
+    if (m_sync_valid && (m_sync_flip == flip || n_stones == 0) && m_sync_start.position_equal_p(startpos))
+    {
+        size_t n = std::min(m_sync_moves.size(), moves.size());
+        while (common < n && m_sync_moves[common] == moves[common])
+            common++;
+        incremental = m_sync_moves.size() - common + moves.size() - common;
+    }
+    size_t from_scratch = (m_set_position ? 1 : 1 + n_stones) + moves.size();
+    size_t from_file    = m_loadsgf ? 4 : SIZE_MAX;
+
     komi(km);
 
-    for (int i = 0; i < b.size_x(); i++)
-        for (int j = 0; j < b.size_y(); j++)
+    if (incremental <= from_scratch && incremental <= from_file)
+    {
+        while (m_sync_moves.size() > common)
         {
-            /* This gives better behavior if the GTP process dies or misbehaves.  */
-            if (stopped())
-                return;
-            stone_color c = maybe_flip(startpos.stone_at(i, j), flip);
-            if (c != none)
-                played_move(c, i, j);
+            send_request("undo");
+            m_sync_moves.pop_back();
         }
+        for (size_t i = common; i < moves.size(); i++)
+        {
+            m_sync_moves.push_back(moves[i]);
+            send_play(moves[i]);
+        }
+        return;
+    }
 
-    /* Allocate this here so that m_last_move is nullptr during previous calls to
-       played_move and they don't try to track the position.  */
-    m_moves     = new game_state(startpos, maybe_flip(st->to_move(), flip));
-    m_last_move = m_moves;
+    if (from_file < from_scratch && send_loadsgf(startpos, flip, moves, km))
+    {
+        m_sync_start = startpos;
+        m_sync_flip  = flip;
+        m_sync_valid = true;
+        m_sync_moves = std::move(moves);
+        return;
+    }
 
-    while (!moves.empty())
+    if (m_set_position && n_stones > 0)
+    {
+        QString cmd = "set_position";
+        for (int i = 0; i < startpos.size_x(); i++)
+            for (int j = 0; j < startpos.size_y(); j++)
+            {
+                stone_color c = maybe_flip(startpos.stone_at(i, j), flip);
+                if (c == none)
+                    continue;
+                auto vertex = startpos.coords_name(i, j, false);
+                cmd += c == black ? " black " : " white ";
+                cmd += QString::fromStdString(vertex.first + vertex.second);
+            }
+        send_request(cmd);
+        m_sync_moves.clear();
+    }
+    else
     {
-        st = moves.back();
-        moves.pop_back();
-        dup_move(st, flip);
+        clear_board();
+        for (int i = 0; i < startpos.size_x(); i++)
+            for (int j = 0; j < startpos.size_y(); j++)
+            {
+                stone_color c = maybe_flip(startpos.stone_at(i, j), flip);
+                if (c != none)
+                    send_play({c, i, j});
+            }
+    }
+    m_sync_start = startpos;
+    m_sync_flip  = flip;
+    m_sync_valid = true;
+    for (auto &m : moves)
+    {
+        m_sync_moves.push_back(m);
+        send_play(m);
     }
 }
 
@@ -379,9 +658,11 @@ void GTP_Process::initiate_analysis_switch()
 // exit
 void GTP_Process::slot_finished(int exitcode, QProcess::ExitStatus status)
 {
-    m_stopped = true;
     qDebug() << req_cnt << " quit";
-    m_controller->gtp_exited(this);
+    if (status == QProcess::CrashExit)
+        report_crash(tr("Engine crashed"));
+    else
+        report_crash(tr("Engine exited with code %1").arg(exitcode));
 }
 
 /* QProcess communication has been a source of problems - so we don't use the
@@ -390,6 +671,10 @@ void GTP_Process::slot_finished(int exitcode, QProcess::ExitStatus status)
    receivers.  This way we can even queue up multiple commands at once.  */
 void GTP_Process::slot_receive_stdout()
 {
+    /* Callbacks may end up back here through waitForBytesWritten, so the loop
+       below must work from the member variables rather than cache them.  */
+    m_buffer.remove(0, m_buffer_pos);
+    m_buffer_pos = 0;
     m_buffer += readAllStandardOutput();
 
     if (m_stopped)
@@ -397,37 +682,56 @@ void GTP_Process::slot_receive_stdout()
         m_buffer.clear();
         return;
     }
+    m_last_activity = m_clock.nsecsElapsed();
 
     for (;;)
     {
-        /* Clear empty lines at the front of the buffer.  */
-        int last_lf = -1;
-        int pos     = 0;
-        while (pos < m_buffer.length() && m_buffer[pos].isSpace())
-        {
-            if (m_buffer[pos] == '\n')
-                last_lf = pos;
+        /* Skip empty lines and leading whitespace.  */
+        const char *data = m_buffer.constData();
+        int         len  = m_buffer.length();
+        int         pos  = m_buffer_pos;
+        while (pos < len && isspace((unsigned char)data[pos]))
             pos++;
-        }
-        if (last_lf >= 0)
-            m_buffer = m_buffer.mid(last_lf + 1);
+        m_buffer_pos = pos;
 
-        int idx = m_buffer.indexOf("\n");
+        int idx = m_buffer.indexOf('\n', pos);
         if (idx < 0)
             return;
+        int end = idx;
+        while (end > pos && isspace((unsigned char)data[end - 1]))
+            end--;
+        m_buffer_pos = idx + 1;
 
-        QString output = m_buffer.left(idx).trimmed();
-
-        append_text(output, Qt::red);
-
-        m_buffer = m_buffer.mid(idx + 1);
-        if (output.length() >= 10 && output.left(10) == "info move ")
+        std::string_view line(data + pos, end - pos);
+        if (line.substr(0, 10) == "info move ")
         {
-            m_controller->gtp_eval(output, m_analyze_kata);
+            /* Converting these to QString for the log window is not free, and
+               they arrive many times per second.  */
+            if (m_dlg.isVisible())
+                append_text(QString::fromUtf8(line.data(), line.size()), Qt::red);
+            qint64 now = m_clock.nsecsElapsed();
+            if (m_analyze_sent >= 0)
+            {
+                record_latency("first update", now - m_analyze_sent);
+                m_analyze_sent = -1;
+                update_stats();
+            }
+            m_n_updates++;
+            if (now - m_updates_since >= 1000000000)
+            {
+                m_update_rate   = m_n_updates * 1e9 / (now - m_updates_since);
+                m_n_updates     = 0;
+                m_updates_since = now;
+                update_stats();
+            }
+            m_controller->gtp_eval(line, m_analyze_kata);
             continue;
         }
 
-        if (m_receivers.isEmpty())
+        QString output = QString::fromUtf8(line.data(), line.size());
+        append_text(output, Qt::red);
+
+        if (m_requests.isEmpty())
             continue;
 
         bool err = output[0] != '=';
@@ -438,20 +742,30 @@ void GTP_Process::slot_receive_stdout()
             n_digits++;
         while (n_digits < len && output[n_digits].isSpace())
             n_digits++;
-        if (n_digits == 0)
-            err = true;
-        int                                   cmd_nr   = output.left(n_digits).toInt();
-        auto                                 &rcv_map  = err ? m_err_receivers : m_receivers;
-        QMap<int, t_receiver>::const_iterator map_iter = rcv_map.constFind(cmd_nr);
-        if (err || map_iter == rcv_map.constEnd())
+        int                                cmd_nr   = output.left(n_digits).toInt();
+        QMap<int, request>::const_iterator map_iter = m_requests.constFind(cmd_nr);
+        if (n_digits == 0 || map_iter == m_requests.constEnd())
         {
             quit();
             m_controller->gtp_failure(this, tr("Invalid response from GTP engine"));
             return;
         }
-        t_receiver rcv = *map_iter;
-        m_receivers.remove(cmd_nr);
-        m_err_receivers.remove(cmd_nr);
+        t_receiver rcv = err ? map_iter->err_rcv : map_iter->rcv;
+        if (map_iter->sent >= 0)
+            record_latency(map_iter->name, m_clock.nsecsElapsed() - map_iter->sent);
+        /* An analysis command keeps producing output until the engine reads
+           the next command, which is what the next response is for.  */
+        bool analysis = !err && (map_iter->name == "lz-analyze" || map_iter->name == "kata-analyze");
+        m_analysis_id = analysis ? cmd_nr : 0;
+        m_reply_id    = cmd_nr;
+        m_requests.remove(cmd_nr);
+        m_in_flight--;
+        if (!m_unsent.empty() && !m_flush_scheduled)
+        {
+            m_flush_scheduled = true;
+            QMetaObject::invokeMethod(this, &GTP_Process::flush_requests, Qt::QueuedConnection);
+        }
+        update_stats();
         output.remove(0, n_digits);
         if (rcv != nullptr)
             (this->*rcv)(output);
@@ -467,23 +781,99 @@ void GTP_Process::default_err_receiver(const QString &)
 void GTP_Process::send_request(const QString &s, t_receiver rcv, t_receiver err_rcv)
 {
     qDebug() << "send_request -> " << req_cnt << " " << s << "\n";
-    m_receivers[req_cnt]     = rcv;
-    m_err_receivers[req_cnt] = err_rcv;
+    m_requests[req_cnt] = request {rcv, err_rcv, s.section(' ', 0, 0)};
+    m_analyzing         = m_requests[req_cnt].name == "lz-analyze" || m_requests[req_cnt].name == "kata-analyze";
 #if 1
     append_text(s, Qt::blue);
 #endif
     QString req = QString::number(req_cnt) + " " + s + "\n";
-    write(req.toLatin1());
-    waitForBytesWritten();
+    m_unsent.emplace_back(req_cnt, req.toLatin1());
     req_cnt++;
+    if (!m_flush_scheduled)
+    {
+        m_flush_scheduled = true;
+        QMetaObject::invokeMethod(this, &GTP_Process::flush_requests, Qt::QueuedConnection);
+    }
+}
+
+/* Write as many queued commands as the pipeline has room for.  */
+void GTP_Process::flush_requests()
+{
+    m_flush_scheduled = false;
+    if (m_stopped || m_unsent.empty())
+        return;
+
+    QByteArray data;
+    qint64     now = m_clock.nsecsElapsed();
+    while (!m_unsent.empty() && m_in_flight < max_in_flight)
+    {
+        auto &front = m_unsent.front();
+        auto  it    = m_requests.find(front.first);
+        if (it != m_requests.end())
+        {
+            it->sent = now;
+            if (it->name == "lz-analyze" || it->name == "kata-analyze")
+                m_analyze_sent = now;
+        }
+        data += front.second;
+        m_unsent.pop_front();
+        m_in_flight++;
+    }
+    if (!data.isEmpty())
+    {
+        write(data);
+        m_last_activity = now;
+    }
+    update_stats();
 }
 
+void GTP_Process::record_latency(const QString &name, qint64 ns)
+{
+    latency &l = m_latency[name];
+    l.count++;
+    l.total += ns;
+    l.max = std::max(l.max, ns);
+}
+
+/* Show the state of the pipeline and the round trip times in the log
+   window, with details per command in the tooltip.  */
+void GTP_Process::update_stats()
+{
+    QString text = tr("In flight: %1/%2, queued: %3").arg(m_in_flight).arg(max_in_flight).arg(m_unsent.size());
+    auto    first = m_latency.find("first update");
+    if (first != m_latency.end())
+        text += tr(", first update: %1 ms").arg(first->second.total / first->second.count / 1e6, 0, 'f', 1);
+    if (m_update_rate > 0)
+        text += tr(", updates: %1/s").arg(m_update_rate, 0, 'f', 1);
+    m_dlg.statsLabel->setText(text);
+
+    QString details;
+    for (auto &it : m_latency)
+    {
+        const latency &l = it.second;
+        if (!details.isEmpty())
+            details += "\n";
+        details += tr("%1: %2 times, average %3 ms, max %4 ms")
+                       .arg(it.first)
+                       .arg(l.count)
+                       .arg(l.total / l.count / 1e6, 0, 'f', 2)
+                       .arg(l.max / 1e6, 0, 'f', 2);
+    }
+    m_dlg.statsLabel->setToolTip(details);
+}
+
+/* The quit command bypasses the queue: anything still waiting is dropped,
+   and the command must be written before the caller deletes us.  */
 void GTP_Process::internal_quit()
 {
     m_stopped = true;
+    m_watchdog.stop();
     disconnect(this, &QProcess::readyReadStandardOutput, nullptr, nullptr);
     disconnect(this, &QProcess::readyReadStandardError, nullptr, nullptr);
-    send_request("quit");
+    m_unsent.clear();
+    append_text("quit", Qt::blue);
+    write((QString::number(req_cnt++) + " quit\n").toLatin1());
+    waitForBytesWritten();
 }
 
 void GTP_Process::quit()
@@ -501,19 +891,26 @@ GTP_Process::~GTP_Process()
     disconnect(this, &QProcess::errorOccurred, nullptr, nullptr);
     void (QProcess::*fini)(int, QProcess::ExitStatus) = &QProcess::finished;
     disconnect(this, fini, nullptr, nullptr);
-    delete m_moves;
+}
+
+GTP_Eval_Controller::GTP_Eval_Controller(QWidget *p) : GTP_Controller(p)
+{
+    m_restart_timer.setSingleShot(true);
+    QObject::connect(&m_restart_timer, &QTimer::timeout, [this]() { restart_analyzer(); });
 }
 
 GTP_Eval_Controller::~GTP_Eval_Controller()
 {
     clear_eval_data();
-    delete m_analyzer;
+    drop_analyzer();
 }
 
 analyzer GTP_Eval_Controller::analyzer_state()
 {
+    if (m_service != nullptr)
+        return m_service->state(this);
     if (m_analyzer == nullptr)
-        return analyzer::disconnected;
+        return m_restart_timer.isActive() ? analyzer::starting : analyzer::disconnected;
     if (m_analyzer->stopped())
         return analyzer::disconnected;
     if (!m_analyzer->started())
@@ -528,32 +925,187 @@ void GTP_Eval_Controller::request_analysis(go_game_ptr gr, game_state *st, bool
     if (analyzer_state() != analyzer::running)
         return;
 
-    initiate_switch();
+    /* If we share the engine and it is not our turn, we only remember the
+       position, and show what the cache has for it.  */
+    if (m_analyzer != nullptr)
+        initiate_switch();
+    save_to_cache();
 
     const go_board &b       = st->get_board();
     stone_color     to_move = st->to_move();
+    forget_pvs();
     delete m_eval_state;
-    m_eval_state = new game_state(b, to_move);
-
-    m_analyzer->setup_board(st, QString::fromStdString(gr->komi()).toDouble(), flip);
-
-    if (flip)
-        to_move = flip_color(to_move);
+    m_eval_state      = new game_state(b, to_move);
+    m_eval_komi       = QString::fromStdString(gr->komi()).toDouble();
+    m_eval_have_score = false;
+    m_cached_visits   = 0;
+    m_root_visits     = 0;
+    m_request_game    = gr;
+    m_request_state   = st;
 
     m_last_request_flipped = flip;
-    m_analyzer->analyze(to_move, 100);
+    if (m_analyzer != nullptr)
+    {
+        m_analyzer->setup_board(st, m_eval_komi, flip);
+        m_analyzer->analyze(flip ? flip_color(to_move) : to_move, 100);
+        if (m_service != nullptr)
+            m_service->sent_analysis(this, m_analyzer->last_request_id());
+    }
+    load_from_cache();
+    if (m_service != nullptr && m_analyzer == nullptr)
+        m_service->client_changed(this);
 }
 
 void GTP_Eval_Controller::clear_eval_data()
 {
+    save_to_cache();
+    forget_pvs();
     delete m_eval_state;
-    m_eval_state = nullptr;
+    m_eval_state  = nullptr;
+    m_root_visits = 0;
+}
+
+/* Remember the analysis of m_eval_state before we move on to another
+   position.  */
+void GTP_Eval_Controller::save_to_cache()
+{
+    if (g_analysis_cache == nullptr || m_eval_state == nullptr || m_cached_visits > 0)
+        return;
+    eval root = m_eval_state->best_eval();
+    if (root.visits == 0)
+        return;
+    std::vector<analysis_pv> pvs(m_pvs.begin(), m_pvs.begin() + m_n_pvs);
+    g_analysis_cache->store(m_eval_state->get_board(), m_eval_state->to_move(), m_eval_komi, m_last_request_flipped, root, pvs, m_eval_have_score);
+}
+
+/* Show a stored result for the position we just asked the engine about, so
+   that the user does not have to wait for the engine to catch up to it.  */
+void GTP_Eval_Controller::load_from_cache()
+{
+    if (g_analysis_cache == nullptr)
+        return;
+    const go_board          &b          = m_eval_state->get_board();
+    stone_color              to_move    = m_eval_state->to_move();
+    an_id_t                  id         = m_last_request_flipped ? m_flipped_id_idx : m_id_idx;
+    int                      min_visits = analysis_cache::min_visits();
+    eval                     root;
+    std::vector<analysis_pv> pvs;
+    bool                     have_score;
+    if (!g_analysis_cache->lookup(b, to_move, m_eval_komi, id, m_last_request_flipped, min_visits, root, pvs, have_score) || pvs.empty())
+        return;
+
+    m_eval_state->update_eval(root);
+    if (m_pvs.size() < pvs.size())
+        m_pvs.resize(pvs.size());
+    m_n_pvs = pvs.size();
+    for (size_t i = 0; i < pvs.size(); i++)
+    {
+        live_pv &pv = m_pvs[i];
+        pv.moves    = pvs[i].moves;
+        pv.ev       = pvs[i].ev;
+        m_eval_state->set_mark(pv.moves[0].first, pv.moves[0].second, mark::letter, i);
+    }
+    m_eval_have_score = have_score;
+    m_cached_visits   = pvs[0].ev.visits;
+    m_root_visits     = 0;
+    for (auto &pv : pvs)
+        m_root_visits += pv.ev.visits;
+
+    const eval &best = pvs[0].ev;
+    m_primary_eval   = to_move == black ? best.wr_black : 1 - best.wr_black;
+    auto cname       = b.coords_name(pvs[0].moves[0].first, pvs[0].moves[0].second, false);
+    notice_analyzer_id(id, have_score);
+    eval_received(QString::fromStdString(cname.first + cname.second), best.visits, have_score);
+}
+
+/* Called when m_eval_state is about to be deleted, which takes all the
+   materialized nodes with it.  */
+void GTP_Eval_Controller::forget_pvs()
+{
+    for (auto &pv : m_pvs)
+    {
+        pv.node    = nullptr;
+        pv.n_nodes = 0;
+    }
+    m_n_pvs = 0;
+}
+
+/* Delete the nodes of PV beyond the first KEEP moves.  */
+void GTP_Eval_Controller::truncate_pv(live_pv &pv, size_t keep)
+{
+    if (pv.n_nodes <= keep)
+        return;
+    if (keep == 0)
+    {
+        delete pv.node;
+        pv.node    = nullptr;
+        pv.n_nodes = 0;
+        return;
+    }
+    game_state *last = pv.node;
+    for (size_t i = 1; i < keep; i++)
+        last = last->next_primary_move();
+    for (auto it : last->take_children())
+        delete it;
+    pv.n_nodes = keep;
+}
+
+/* Create the nodes for PV that do not exist yet, and return its first node.
+   Returns null if the engine gave us an invalid first move.  */
+game_state *GTP_Eval_Controller::materialize_pv(live_pv &pv)
+{
+    if (pv.n_nodes == pv.moves.size())
+        return pv.node;
+
+    game_state *cur = m_eval_state;
+    if (pv.node != nullptr)
+    {
+        cur = pv.node;
+        for (size_t i = 1; i < pv.n_nodes; i++)
+            cur = cur->next_primary_move();
+    }
+    while (pv.n_nodes < pv.moves.size())
+    {
+        auto       &m    = pv.moves[pv.n_nodes];
+        game_state *next = cur->add_child_move(m.first, m.second);
+        /* The program might have given us an invalid move.  Don't crash if it
+           did, just cut the variation short.  */
+        if (next == nullptr)
+        {
+            pv.moves.resize(pv.n_nodes);
+            break;
+        }
+        if (pv.n_nodes == 0)
+        {
+            next->update_eval(pv.ev);
+            /* Leave it to a higher level to add a title if it wants to place
+               these variations into the actual file.  */
+            next->set_figure(257, "");
+            pv.node = next;
+        }
+        cur = next;
+        pv.n_nodes++;
+    }
+    return pv.node;
+}
+
+int GTP_Eval_Controller::find_live_pv(int x, int y) const
+{
+    for (size_t i = 0; i < m_n_pvs; i++)
+    {
+        auto &moves = m_pvs[i].moves;
+        if (!moves.empty() && moves[0].first == x && moves[0].second == y)
+            return i;
+    }
+    return -1;
 }
 
 void GTP_Eval_Controller::initiate_switch()
 {
     m_switch_pending = true;
     m_analyzer->initiate_analysis_switch();
+    if (m_service != nullptr)
+        m_service->sent_switch(this, m_analyzer->last_request_id());
 }
 
 void GTP_Eval_Controller::gtp_switch_ready()
@@ -561,16 +1113,41 @@ void GTP_Eval_Controller::gtp_switch_ready()
     m_switch_pending = false;
 }
 
-void GTP_Eval_Controller::start_analyzer(const Engine &engine, int size, double komi, bool show_dialog)
+/* Give back the engine, or our place with the shared one.  */
+void GTP_Eval_Controller::drop_analyzer()
 {
-    if (m_analyzer != nullptr)
+    if (m_service != nullptr)
     {
-        m_analyzer->quit();
-        delete m_analyzer;
-        m_analyzer = nullptr;
+        m_service->leave(this);
+        m_service = nullptr;
     }
+    else if (m_analyzer != nullptr)
+        release_gtp(m_analyzer);
+    m_analyzer = nullptr;
+}
+
+void GTP_Eval_Controller::start_analyzer(const Engine &engine, int size, double komi, bool show_dialog)
+{
+    drop_analyzer();
+    m_restart_timer.stop();
+    m_watchdog.reset();
+    m_engine.reset(new Engine(engine));
+    m_analyzer_size = size;
+    m_analyzer_komi = komi;
+    m_analyzer      = lease_gtp(engine, size, komi, show_dialog);
+    m_analyzer->set_timeout(g_setting->readIntEntry("ANALYSIS_TIMEOUT"));
+    analyzer_state_changed();
+}
+
+void GTP_Eval_Controller::start_shared_analyzer(const Engine &engine, int size, double komi, QWidget *window)
+{
+    drop_analyzer();
+    m_restart_timer.stop();
+    m_engine.reset();
+    m_analyzer_size = size;
     m_analyzer_komi = komi;
-    m_analyzer      = create_gtp(engine, size, komi, show_dialog);
+    set_analyzer_id(engine, komi);
+    m_service = analysis_service::join(this, window, engine, size);
     analyzer_state_changed();
 }
 
@@ -579,17 +1156,78 @@ void GTP_Eval_Controller::stop_analyzer()
     clear_eval_data();
     m_pause_eval     = false;
     m_switch_pending = false;
-    if (m_analyzer != nullptr && !m_analyzer->stopped())
+    m_request_game   = nullptr;
+    m_request_state  = nullptr;
+    if (m_restart_timer.isActive())
+    {
+        m_restart_timer.stop();
+        analyzer_state_changed();
+    }
+    if (m_analyzer != nullptr || m_service != nullptr)
     {
-        m_analyzer->quit();
+        drop_analyzer();
         analyzer_state_changed();
     }
 }
 
+/* Virtual from GTP_Controller.  Analysis is expected to run unattended for
+   a long time, so an engine that runs out of memory or hangs is replaced
+   by a new one, unless it keeps failing.  */
+bool GTP_Eval_Controller::gtp_crashed(GTP_Process *p, const QString &cause)
+{
+    if (p != m_analyzer || m_engine == nullptr)
+        return false;
+    int delay = m_watchdog.crashed(cause);
+    if (delay < 0)
+        return false;
+    qDebug() << "restarting engine in " << delay << " ms after: " << cause;
+
+    /* Keeps what the engine found so far in the analysis cache.  */
+    clear_eval_data();
+    m_switch_pending = false;
+    /* We are called from one of its slots.  */
+    p->deleteLater();
+    m_analyzer = nullptr;
+    m_restart_timer.start(delay);
+    analyzer_restarting(cause);
+    analyzer_state_changed();
+    return true;
+}
+
+void GTP_Eval_Controller::restart_analyzer()
+{
+    m_watchdog.started();
+    m_analyzer = lease_gtp(*m_engine, m_analyzer_size, m_analyzer_komi, false);
+    m_analyzer->mark_replacement();
+    m_analyzer->set_timeout(g_setting->readIntEntry("ANALYSIS_TIMEOUT"));
+    analyzer_state_changed();
+}
+
+void GTP_Eval_Controller::gtp_restarted(GTP_Process *)
+{
+    analyzer_restarted();
+}
+
+/* Set the new engine up for the position we were analyzing, the same way as
+   for any new position.  */
+void GTP_Eval_Controller::analyzer_restarted()
+{
+    analyzer_state_changed();
+    if (m_request_state != nullptr && !m_pause_eval)
+        request_analysis(m_request_game, m_request_state, m_last_request_flipped);
+}
+
+void GTP_Eval_Controller::analyzer_lost()
+{
+    clear_eval_data();
+    analyzer_state_changed();
+}
+
 /* Return true iff the state changed.  */
 bool GTP_Eval_Controller::pause_analyzer(bool on, go_game_ptr gr, game_state *st)
 {
-    if (m_analyzer == nullptr || !m_analyzer->started() || m_analyzer->stopped())
+    analyzer state = analyzer_state();
+    if (state != analyzer::running && state != analyzer::paused)
         return false;
     if (m_pause_eval == on)
         return false;
@@ -597,7 +1235,10 @@ bool GTP_Eval_Controller::pause_analyzer(bool on, go_game_ptr gr, game_state *st
     if (on)
     {
         clear_eval_data();
-        m_analyzer->pause_analysis();
+        if (m_analyzer != nullptr)
+            m_analyzer->pause_analysis();
+        if (m_service != nullptr)
+            m_service->client_changed(this);
     }
     else
     {
@@ -607,128 +1248,139 @@ bool GTP_Eval_Controller::pause_analyzer(bool on, go_game_ptr gr, game_state *st
     return true;
 }
 
-void GTP_Eval_Controller::gtp_eval(const QString &s, bool kata_format)
+void GTP_Eval_Controller::gtp_eval(std::string_view s, bool kata_format)
 {
     if (m_pause_updates || m_pause_eval || m_switch_pending)
         return;
 
-    bool prune = g_setting->readBoolEntry("ANALYSIS_PRUNE");
+    if (m_cached_visits > 0)
+    {
+        gtp_info_parser first(s, kata_format);
+        gtp_info_move   mv;
+        if (!first.next(mv) || mv.visits < m_cached_visits)
+            return;
+        m_cached_visits = 0;
+    }
 
-    QStringList moves = s.split("info move ", Qt::SkipEmptyParts);
-    if (moves.isEmpty())
-        return;
+    bool prune = g_setting->readBoolEntry("ANALYSIS_PRUNE");
 
     stone_color to_move = m_eval_state->to_move();
 
     int an_maxmoves = g_setting->readIntEntry("ANALYSIS_MAXMOVES");
     int count       = 0;
     m_primary_eval  = 0.5;
-    QString primary_move;
-    int     primary_visits = 0;
+    std::string_view primary_move;
+    int              primary_visits = 0;
 
     bool flip = m_last_request_flipped;
 
-    analyzer_id id = m_id;
-    if (flip)
-        id.komi = -id.komi;
+    an_id_t id = flip ? m_flipped_id_idx : m_id_idx;
+
+    int szx = m_eval_state->get_board().size_x();
+    int szy = m_eval_state->get_board().size_y();
 
-    std::vector<game_state *> old_children = m_eval_state->take_children();
-    for (auto &old : old_children)
-        delete old;
+    /* Rather than building a tree of nodes for every variation on each update,
+       we store the moves, and compare them to what we had before.  Nodes that
+       were created for an earlier update are kept as long as their moves are
+       still a prefix of the new variation.  */
+    size_t n_old = m_n_pvs;
+    m_n_pvs      = 0;
 
-    bool found_score = false;
-    for (auto &e : moves)
+    bool            found_score = false;
+    int             root_visits = 0;
+    gtp_info_parser parser(s, kata_format);
+    gtp_info_move   mv;
+    while (parser.next(mv))
     {
-        QRegularExpression mvre("^(\\S+)\\s+");
-        auto               mv = mvre.match(e);
-        if (!mv.hasMatch())
+        root_visits += mv.visits;
+        /* An engine that is behind, or confused about the position, can
+           suggest a move on an occupied point or a suicide.  Leave it out
+           rather than put a mark on a stone.  */
+        int mx, my;
+        if (gtp_info_parser::parse_vertex(mv.move, szx, szy, mx, my) && !m_eval_state->valid_move_p(mx, my, to_move))
             continue;
-        QRegularExpression visre("\\s+visits\\s+(\\d+)\\s+");
-        auto               vism = visre.match(e);
-        if (!vism.hasMatch())
-            continue;
-        QRegularExpression wrre("\\s+winrate\\s+([^\\s]+)\\s+");
-        auto               wrm = wrre.match(e);
-        if (!wrm.hasMatch())
-            continue;
-        QRegularExpression pvre("\\s+pv\\s+(.*)$");
-        auto               pvm = pvre.match(e);
-        if (!pvm.hasMatch())
-            continue;
-        QRegularExpression scoremre("\\s+scoreMean\\s+([^\\s]+)\\s+");
-        auto               scoremm = scoremre.match(e);
-        QRegularExpression scoredre("\\s+scoreStdev\\s+([^\\s]+)\\s+");
-        auto               scoredm    = scoredre.match(e);
-        bool               have_score = scoremm.hasMatch() && scoredm.hasMatch();
-
-        QString move   = mv.captured(1);
-        int     visits = vism.captured(1).toInt();
-        double  wr     = kata_format ? wrm.captured(1).toFloat() : wrm.captured(1).toInt() / 10000.;
-        QString pv     = pvm.captured(1);
-        double  scorem = have_score ? scoremm.captured(1).toFloat() : 0;
-        double  scored = have_score ? scoredm.captured(1).toFloat() : 0;
-        if (have_score && to_move == white)
+
+        int    visits = mv.visits;
+        double wr     = mv.winrate;
+        double scorem = mv.score_mean;
+        double scored = mv.score_stddev;
+        if (mv.have_score && to_move == white)
             scorem = -scorem;
-        found_score |= have_score;
+        found_score |= mv.have_score;
 
         /* The winrate also does not need flipping, it is given for the side to
            move, and since we flip both the stones and the side to move, it comes
            out correct in both cases.  */
+        eval ev;
+        ev.visits       = visits;
+        ev.wr_black     = to_move == white ? 1 - wr : wr;
+        ev.score_mean   = scorem;
+        ev.score_stddev = scored;
+        ev.id           = id;
         if (count == 0)
         {
-            primary_move   = move;
+            primary_move   = mv.move;
             m_primary_eval = wr;
             primary_visits = visits;
-            m_eval_state->set_eval_data(visits, to_move == white ? 1 - wr : wr, scorem, scored, id);
+            m_eval_state->update_eval(ev);
         }
 #if 0
-		qDebug () << move << " wr " << wr << " visits " << visits << " PV: " << pv;
+		qDebug () << QString::fromUtf8 (mv.move.data (), mv.move.size ()) << " wr " << wr << " visits " << visits;
 #endif
-        QStringList pvmoves = pv.split(" ", Qt::SkipEmptyParts);
-        if (count < 52 && (!prune || pvmoves.length() > 1 || visits >= 2))
+        std::string_view pv_rest = mv.pv, pm;
+        std::string_view pv_second;
+        bool             long_pv = gtp_info_parser::next_token(pv_rest, pm) && gtp_info_parser::next_token(pv_rest, pv_second);
+        pv_rest                  = mv.pv;
+        int i, j;
+        if (count < 52 && (!prune || long_pv || visits >= 2) && gtp_info_parser::next_token(pv_rest, pm)
+            && gtp_info_parser::parse_vertex(pm, szx, szy, i, j))
         {
-            game_state *cur      = m_eval_state;
-            bool        pv_first = true;
-            for (auto &pm : pvmoves)
+            size_t k = m_n_pvs++;
+            if (k == m_pvs.size())
+                m_pvs.emplace_back();
+            for (size_t o = k; o < n_old; o++)
             {
-                QChar sx = pm[0];
-
-                int i = sx.toLatin1() - 'A';
-                if (i > 7)
-                    i--;
-                int szx = m_eval_state->get_board().size_x();
-                int szy = m_eval_state->get_board().size_y();
-                int j   = szy - pm.mid(1).toInt();
-                if (i >= 0 && i < szx && j >= 0 && j < szy)
+                auto &moves = m_pvs[o].moves;
+                if (!moves.empty() && moves[0].first == i && moves[0].second == j)
                 {
-                    game_state *next = cur->add_child_move(i, j);
-                    /* The program might have given us an invalid move.  Don't
-                       crash if it did.  */
-                    if (next == nullptr)
-                        break;
-                    if (pv_first)
-                    {
-                        cur->set_mark(i, j, mark::letter, count);
-                        next->set_eval_data(visits, to_move == white ? 1 - wr : wr, scorem, scored, id);
-                        /* Leave it to a higher level to add a title if it wants
-                           to place these variations into the actual file.  */
-                        next->set_figure(257, "");
-                    }
-                    cur = next;
-                }
-                else
-                    break;
-                if (cur == nullptr)
+                    std::swap(m_pvs[k], m_pvs[o]);
                     break;
-                pv_first = false;
+                }
             }
+            live_pv &pv   = m_pvs[k];
+            size_t   n    = 0;
+            size_t   same = 0;
+            do
+            {
+                auto m = std::make_pair(i, j);
+                if (n < pv.moves.size())
+                {
+                    if (same == n && pv.moves[n] == m)
+                        same++;
+                    pv.moves[n] = m;
+                }
+                else
+                    pv.moves.push_back(m);
+                n++;
+            } while (gtp_info_parser::next_token(pv_rest, pm) && gtp_info_parser::parse_vertex(pm, szx, szy, i, j));
+            pv.moves.resize(n);
+            truncate_pv(pv, same);
+            pv.ev = ev;
+            if (pv.node != nullptr)
+                pv.node->update_eval(ev);
+            m_eval_state->set_mark(pv.moves[0].first, pv.moves[0].second, mark::letter, count);
         }
         count++;
         if (an_maxmoves > 0 && count == an_maxmoves)
             break;
     }
+    for (size_t o = m_n_pvs; o < n_old; o++)
+        truncate_pv(m_pvs[o], 0);
+
+    m_eval_have_score = found_score;
+    m_root_visits     = root_visits;
     notice_analyzer_id(id, found_score);
 
-    if (!primary_move.isNull())
-        eval_received(primary_move, primary_visits, found_score);
+    if (count > 0)
+        eval_received(QString::fromLatin1(primary_move.data(), primary_move.size()), primary_visits, found_score);
 }
@@ -1,7 +1,18 @@
 #ifndef QGTP_H
 #define QGTP_H
 
+#include <deque>
+#include <map>
+#include <memory>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <QElapsedTimer>
 #include <QProcess>
+#include <QStringList>
+#include <QTemporaryFile>
+#include <QTimer>
 
 #include "goboard.h"
 #include "goeval.h"
@@ -13,6 +24,47 @@ class game_record;
 typedef std::shared_ptr<game_record> go_game_ptr;
 
 class GTP_Process;
+class analysis_service;
+
+/* The analyzer_id for evaluations produced by ENGINE.  KOMI is used unless the
+   engine is configured to always use a specific komi.  */
+extern analyzer_id engine_analyzer_id(const Engine &engine, double komi);
+
+/* Decides whether, and after what delay, an engine that crashed is started
+   again.  The delay doubles with every crash that follows soon after the
+   previous start, and after too many of those in a row we give up.  */
+class engine_watchdog
+{
+    static const int max_quick_crashes = 5;
+    /* Milliseconds an engine has to run before a crash no longer counts as
+       quick.  */
+    static const int stable_time = 5 * 60 * 1000;
+
+    QElapsedTimer m_since_start;
+    int           m_n_quick    = 0;
+    int           m_n_restarts = 0;
+    /* The most recent causes, oldest first.  */
+    QStringList m_causes;
+
+public:
+    void reset();
+    void started()
+    {
+        m_since_start.start();
+    }
+    /* Record a crash for CAUSE.  Returns the delay in milliseconds before the
+       engine should be started again, or -1 to give up.  */
+    int crashed(const QString &cause);
+
+    int n_restarts() const
+    {
+        return m_n_restarts;
+    }
+    const QStringList &causes() const
+    {
+        return m_causes;
+    }
+};
 
 class GTP_Controller
 {
@@ -21,9 +73,20 @@ class GTP_Controller
 
 protected:
     analyzer_id m_id;
+    /* Interned versions of m_id, and of m_id with the komi negated for analysis
+       of flipped positions.  */
+    an_id_t m_id_idx {};
+    an_id_t m_flipped_id_idx {};
 
     GTP_Controller(QWidget *p) : m_parent(p) {}
+    void         set_analyzer_id(const Engine &engine, double komi);
     GTP_Process *create_gtp(const Engine &engine, int size, double komi, bool show_dialog = true);
+    /* Like create_gtp, but the process may be one that is already running,
+       taken from the engine pool.  Either way, we are told through
+       gtp_startup_success once it is ready.  Hand it back with release_gtp
+       when done.  */
+    GTP_Process *lease_gtp(const Engine &engine, int size, double komi, bool show_dialog);
+    void         release_gtp(GTP_Process *);
 
 public:
     virtual void gtp_played_move(GTP_Process *p, int x, int y)     = 0;
@@ -34,8 +97,21 @@ public:
     virtual void gtp_setup_success(GTP_Process *p)                 = 0;
     virtual void gtp_exited(GTP_Process *p)                        = 0;
     virtual void gtp_failure(GTP_Process *p, const QString &)      = 0;
-    virtual void gtp_eval(const QString &, bool) {}
+    virtual void gtp_eval(std::string_view, bool) {}
     virtual void gtp_switch_ready() {}
+    /* The engine died, or stopped responding, and CAUSE says how.  Returns
+       true if the controller starts a new engine in its place, in which case
+       gtp_exited is not called.  */
+    virtual bool gtp_crashed(GTP_Process *, const QString &)
+    {
+        return false;
+    }
+    /* Called instead of gtp_startup_success for an engine that replaces one
+       that crashed.  */
+    virtual void gtp_restarted(GTP_Process *p)
+    {
+        gtp_startup_success(p);
+    }
 };
 
 enum class analyzer
@@ -48,13 +124,65 @@ enum class analyzer
 
 class GTP_Eval_Controller : public GTP_Controller
 {
+    friend class analysis_service;
+
     bool m_last_request_flipped {};
+    /* The komi of the game being analyzed, and whether the engine reported
+       scores for it.  Used to store the result in the analysis cache.  */
+    double m_eval_komi       = 0;
+    bool   m_eval_have_score = false;
+    /* Nonzero if the current analysis was loaded from the analysis cache.
+       Engine updates are ignored until they have at least this many visits
+       for their best move.  */
+    int m_cached_visits = 0;
+    /* The visits of all candidates in the last update, i.e. the size of the
+       engine's search for the current position.  */
+    int m_root_visits = 0;
+
+protected:
+    /* A variation reported by the analysis engine.  Most of these are replaced
+       by the next update before anyone looks at them, so we only keep the list
+       of moves, and create game_state nodes below m_eval_state on demand.  */
+    struct live_pv : analysis_pv
+    {
+        /* The materialized part of the variation: its first node, and the
+           number of moves that have nodes.  */
+        game_state *node    = nullptr;
+        size_t      n_nodes = 0;
+    };
+
+private:
+    /* Only the first m_n_pvs entries are current.  The others are kept so that
+       their storage can be reused by later updates.  */
+    std::vector<live_pv> m_pvs;
+    size_t               m_n_pvs = 0;
+
+    /* What start_analyzer was given, to start the engine again if it
+       crashes, and the last position we asked about, to continue with it.
+       The game is kept so that the position stays valid.  */
+    std::unique_ptr<Engine> m_engine;
+    int                     m_analyzer_size = 0;
+    go_game_ptr             m_request_game;
+    game_state             *m_request_state {};
+    QTimer                  m_restart_timer;
+    /* Set if we share an engine with other controllers.  m_analyzer is then
+       only set while it is our turn to use it.  */
+    analysis_service *m_service {};
+
+    void        truncate_pv(live_pv &, size_t);
+    game_state *materialize_pv(live_pv &);
+    void        forget_pvs();
+    void        save_to_cache();
+    void        load_from_cache();
+    void        restart_analyzer();
+    void        drop_analyzer();
 
 protected:
-    using GTP_Controller::GTP_Controller;
+    GTP_Eval_Controller(QWidget *p);
     ~GTP_Eval_Controller();
-    GTP_Process *m_analyzer {};
-    double       m_analyzer_komi = 0;
+    GTP_Process    *m_analyzer {};
+    double          m_analyzer_komi = 0;
+    engine_watchdog m_watchdog;
 
     bool m_pause_eval = false;
     /* Set if we are in the process of changing positions to analyze.  We send
@@ -72,8 +200,35 @@ protected:
 
     void clear_eval_data();
 
+    int root_visits() const
+    {
+        return m_root_visits;
+    }
+    size_t n_live_pvs() const
+    {
+        return m_n_pvs;
+    }
+    const live_pv &live_pv_at(size_t idx) const
+    {
+        return m_pvs[idx];
+    }
+    int         find_live_pv(int x, int y) const;
+    game_state *live_pv_node(size_t idx)
+    {
+        return materialize_pv(m_pvs[idx]);
+    }
+
     void start_analyzer(const Engine &engine, int size, double komi, bool show_dialog = true);
+    /* Like start_analyzer, but use the engine that all controllers analyzing
+       with ENGINE on this board size share.  WINDOW is used to find out
+       whether we are in the active window, which gets priority.  */
+    void start_shared_analyzer(const Engine &engine, int size, double komi, QWidget *window);
     void stop_analyzer();
+    /* The shared engine's service if start_shared_analyzer was used.  */
+    analysis_service *service()
+    {
+        return m_service;
+    }
     void pause_eval_updates(bool on)
     {
         m_pause_updates = on;
@@ -83,7 +238,15 @@ protected:
     void         request_analysis(go_game_ptr, game_state *, bool flip = false);
     virtual void eval_received(const QString &, int, bool) = 0;
     virtual void analyzer_state_changed() {}
-    virtual void notice_analyzer_id(const analyzer_id &, bool) {}
+    virtual void notice_analyzer_id(an_id_t, bool) {}
+    /* The engine crashed for CAUSE, and a new one is being started.  */
+    virtual void analyzer_restarting(const QString &) {}
+    /* The new engine is ready.  By default, the analysis that was interrupted
+       continues.  */
+    virtual void analyzer_restarted();
+    /* The shared engine is gone for good, and another client told the user
+       why.  By default, the analysis data is dropped.  */
+    virtual void analyzer_lost();
 
 public:
     analyzer analyzer_state();
@@ -103,16 +266,21 @@ public:
     virtual void gtp_report_score(GTP_Process *, const QString &) override
     { /* Should not happen.  */
     }
-    virtual void gtp_eval(const QString &, bool) override;
+    virtual void gtp_eval(std::string_view, bool) override;
     virtual void gtp_switch_ready() override;
+    virtual bool gtp_crashed(GTP_Process *, const QString &) override;
+    virtual void gtp_restarted(GTP_Process *) override;
 };
 
 class GTP_Process : public QProcess
 {
     Q_OBJECT
 
-    QString m_buffer;
-    QString m_stderr_buffer;
+    /* Raw output from the engine.  Lines before m_buffer_pos have already been
+       processed and are discarded the next time data arrives.  */
+    QByteArray m_buffer;
+    int        m_buffer_pos = 0;
+    QString    m_stderr_buffer;
 
     TextView        m_dlg;
     GTP_Controller *m_controller;
@@ -123,40 +291,126 @@ class GTP_Process : public QProcess
        ignored it.  */
     double m_komi;
 
-    /* A tree in which we keep track of what the move history, in sync with the
-     * GTP engine.  */
-    game_state *m_moves {};
-    game_state *m_last_move {};
+    /* What the engine's board looks like, so that the next position can be
+       reached with few commands.  The engine was last given m_sync_start (in
+       our colors, swapped if m_sync_flip) and has played m_sync_moves since,
+       in the colors sent to the engine.  If m_sync_valid is false, we don't
+       know and the next setup starts over.  */
+    struct sync_move
+    {
+        stone_color col;
+        /* -1 for a pass.  */
+        int x, y;
+
+        bool operator==(const sync_move &other) const
+        {
+            return col == other.col && x == other.x && y == other.y;
+        }
+    };
+    go_board               m_sync_start;
+    std::vector<sync_move> m_sync_moves;
+    bool                   m_sync_valid = true;
+    bool                   m_sync_flip  = false;
+    /* The color of the outstanding genmove request.  */
+    stone_color m_genmove_col = none;
+
+    /* Files given to loadsgf, deleted once the engine has answered.  */
+    std::deque<std::unique_ptr<QTemporaryFile>> m_sgf_files;
 
     bool m_started = false;
     bool m_stopped = false;
+    /* Set once the controller has been told that we died.  */
+    bool m_crash_reported = false;
+    /* Set if we replace an engine that crashed.  */
+    bool m_replacement = false;
+
+    /* An engine that owes us a response, or is analyzing, but has not
+       written anything for m_timeout seconds is considered hung.  Zero
+       disables the check.  */
+    int    m_timeout = 0;
+    QTimer m_watchdog;
+    qint64 m_last_activity = 0;
+    bool   m_analyzing     = false;
 
     bool m_analyze_lz   = false;
     bool m_analyze_kata = false;
+    bool m_set_position = false;
+    bool m_loadsgf      = false;
 
     typedef void (GTP_Process::*t_receiver)(const QString &);
-    QMap<int, t_receiver> m_receivers;
-    QMap<int, t_receiver> m_err_receivers;
+    struct request
+    {
+        t_receiver rcv;
+        t_receiver err_rcv;
+        /* The first word of the command, for the latency statistics.  */
+        QString name;
+        /* When the command was written to the engine, or -1 while it is
+           queued.  */
+        qint64 sent = -1;
+    };
+    /* Requests that have not been answered yet, by number.  */
+    QMap<int, request> m_requests;
+
+    /* Commands are not written as soon as they are issued.  They are queued,
+       and everything issued in one pass through the event loop goes out in a
+       single write, up to max_in_flight commands waiting for a response.  */
+    static const int                       max_in_flight = 16;
+    std::deque<std::pair<int, QByteArray>> m_unsent;
+    int                                    m_in_flight       = 0;
+    bool                                   m_flush_scheduled = false;
+
+    /* Round trip times by command name, in nanoseconds.  */
+    struct latency
+    {
+        int    count = 0;
+        qint64 total = 0;
+        qint64 max   = 0;
+    };
+    QElapsedTimer              m_clock;
+    std::map<QString, latency> m_latency;
+    /* When the last analyze command was written, until its first update
+       arrives; -1 otherwise.  */
+    qint64 m_analyze_sent = -1;
+    /* Analysis updates received since m_updates_since, and the rate measured
+       over the last full second.  */
+    int    m_n_updates     = 0;
+    qint64 m_updates_since = 0;
+    double m_update_rate   = 0;
+
+    /* The request whose response is being handled, and the analysis request
+       that "info move" lines currently belong to, or zero if the engine
+       is not analyzing.  */
+    int m_reply_id    = 0;
+    int m_analysis_id = 0;
 
     /* Number of the next request.  */
     int  req_cnt;
     void send_request(const QString &, t_receiver = nullptr, t_receiver = &GTP_Process::default_err_receiver);
-
-    void startup_part2(const QString &);
-    void startup_part3(const QString &);
-    void startup_part4(const QString &);
-    void startup_part5(const QString &);
-    void startup_part6(const QString &);
-    void startup_part7(const QString &);
+    void flush_requests();
+    void record_latency(const QString &, qint64);
+    void update_stats();
+
+    void startup_protocol(const QString &);
+    void startup_lz_analyze(const QString &);
+    void startup_kata_analyze(const QString &);
+    void startup_set_position(const QString &);
+    void startup_loadsgf(const QString &);
     void setup_success(const QString &);
     void receive_move(const QString &);
     void pause_callback(const QString &);
     void score_callback_1(const QString &);
     void score_callback_2(const QString &);
     void internal_quit();
+    void report_started();
+    void attach_done(const QString &);
     void default_err_receiver(const QString &);
-    void dup_move(game_state *, bool);
+    void send_play(const sync_move &);
+    bool send_loadsgf(const go_board &, bool, const std::vector<sync_move> &, double);
+    void loadsgf_done(const QString &);
+    void loadsgf_failed(const QString &);
     void append_text(const QString &, const QColor &col);
+    void report_crash(const QString &);
+    void check_alive();
 
 public slots:
     void slot_started();
@@ -178,10 +432,41 @@ public:
         return m_stopped;
     }
 
-    void clear_board()
+    void mark_replacement()
+    {
+        m_replacement = true;
+    }
+    void set_timeout(int seconds);
+
+    /* Used by the engine pool to pass a running engine from one controller
+       to the next.  */
+    void attach(GTP_Controller *, int size, double komi, bool show_dialog);
+    void detach(GTP_Controller *);
+    /* Whether the engine has started and has answered everything.  */
+    bool idle()
+    {
+        return m_started && !m_stopped && m_requests.isEmpty();
+    }
+    int board_size()
+    {
+        return m_size;
+    }
+    /* Used to route responses when several controllers take turns using the
+       engine.  */
+    int last_request_id()
+    {
+        return req_cnt - 1;
+    }
+    int reply_id()
     {
-        send_request("clear_board");
+        return m_reply_id;
     }
+    int analysis_id()
+    {
+        return m_analysis_id;
+    }
+
+    void clear_board();
     void setup_board(game_state *, double, bool);
     void setup_initial_position(game_state *);
     void request_move(stone_color col);
@@ -124,6 +124,13 @@ Setting::Setting()
     writeBoolEntry("ANALYSIS_PRUNE", 1);
     writeBoolEntry("ANALYSIS_CHILDREN", 1);
     writeBoolEntry("ANALYSIS_HIDEOTHER", 1);
+    writeIntEntry("ANALYSIS_CACHE_VISITS", 500);
+    writeIntEntry("ANALYSIS_TIMEOUT", 60);
+    writeIntEntry("ANALYSIS_PREFETCH", 0);
+    writeBoolEntry("ANALYSIS_SHARED", 1);
+    writeIntEntry("ENGINE_POOL_SIZE", 2);
+    writeIntEntry("ENGINE_POOL_MEMORY", 0);
+    writeBoolEntry("ENGINE_POOL_SPARE", 0);
 
     writeIntEntry("GAMETREE_SIZE", 30);
     writeBoolEntry("GAMETREE_DIAGHIDE", 1);
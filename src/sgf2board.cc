@@ -271,7 +271,7 @@ static bool add_eval_1(game_state *gs, sgf::node::property *vals, bool kata)
             retval = false;
             continue;
         }
-        gs->set_eval_data(visits, winrate, scorem, scored, id);
+        gs->set_eval_data(visits, winrate, scorem, scored, intern_analyzer_id(id));
     }
     return retval;
 }
@@ -920,14 +920,15 @@ void game_state::append_to_sgf(std::string &s) const
                 s += "[" + std::to_string(it.visits) + ":" + std::to_string(it.wr_black);
                 if (have_scores)
                     s += ":" + std::to_string(it.score_mean) + ":" + std::to_string(it.score_stddev);
-                if (it.id.komi_set)
+                const analyzer_id &id = it.analyzer();
+                if (id.komi_set)
                 {
-                    s += ":" + std::to_string(it.id.komi);
-                    if (it.id.engine.length() > 0)
-                        s += ":" + it.id.engine;
+                    s += ":" + std::to_string(id.komi);
+                    if (id.engine.length() > 0)
+                        s += ":" + id.engine;
                 }
-                else if (it.id.engine.length() > 0)
-                    s += "::" + it.id.engine;
+                else if (id.engine.length() > 0)
+                    s += "::" + id.engine;
                 s += "]";
                 linecount++;
             }
@@ -318,14 +318,13 @@ void SlideView::save_with_progress(std::vector<game_state *> &collection)
 
 void SlideView::save_all(bool only_comments)
 {
-    game_state                       *r = m_game->get_root();
-    std::vector<game_state *>         collection;
-    std::function<bool(game_state *)> fn = [this, only_comments, &collection](game_state *st) -> bool {
+    game_state               *r = m_game->get_root();
+    std::vector<game_state *> collection;
+    r->walk_tree([only_comments, &collection](game_state *st) -> bool {
         if (!only_comments || st->comment().length() > 0)
             collection.push_back(st);
         return true;
-    };
-    r->walk_tree(fn);
+    });
     save_with_progress(collection);
 }
 
@@ -23,12 +23,18 @@ FORMS	      = gui_dialog.ui \
 		svgview_gui.ui \
                 nthmove_gui.ui
 
-HEADERS		      = analyzedlg.h \
+HEADERS		      = analysisbench.h \
+		        analysiscache.h \
+		        analysisprefetch.h \
+		        analysisservice.h \
+		        analyzedlg.h \
 		        autodiagsdlg.h \
                         config.h \
                         clickableviews.h \
                         clockview.h \
                         dbdialog.h \
+                        enginematch.h \
+                        enginepool.h \
 			evalgraph.h \
                         figuredlg.h \
                         gamedialog.h \
@@ -49,7 +55,9 @@ HEADERS		      = analyzedlg.h \
 			defines.h \
 			goboard.h \
 			gogame.h \
+			gtpinfo.h \
 			helpviewer.h \
+			kataanalysis.h \
 			imagehandler.h \
 			komispinbox.h \
                         mainwindow.h \
@@ -76,11 +84,17 @@ HEADERS		      = analyzedlg.h \
     sevenzarchivehandler.h \
     archivehandlerfactory.h
 
-SOURCES		      = analyzedlg.cpp \
+SOURCES		      = analysisbench.cpp \
+			analysiscache.cpp \
+			analysisprefetch.cpp \
+			analysisservice.cpp \
+			analyzedlg.cpp \
 			autodiagsdlg.cpp \
 			clientwin.cpp \
                         clockview.cpp \
                         dbdialog.cpp \
+                        enginematch.cpp \
+                        enginepool.cpp \
 			evalgraph.cpp \
 			figuredlg.cpp \
 			gamedialog.cpp \
@@ -88,7 +102,9 @@ SOURCES		      = analyzedlg.cpp \
 			gametree.cpp \
                         goboard.cc \
                         gogame.cc \
+                        gtpinfo.cc \
 			igsconnection.cpp \
+			kataanalysis.cpp \
 			main.cpp \
 			misc.cpp \
 			msg_handler.cpp \
@@ -25,6 +25,10 @@ extern board_rect                                 find_crop(const game_state *gs
 
 extern void show_batch_analysis();
 
+/* True when running batch jobs from the command line, without windows.
+   Problems are then printed rather than shown in message boxes.  */
+extern bool g_headless;
+
 extern void help_about();
 extern void help_new_version();
 